@@ -3,7 +3,7 @@
 /*                                                                        */
 /* The Eight Bit Algorithmic Language                                     */
 /* For Apple IIe/c/gs (64K), Commodore 64, VIC-20 +32K RAM expansion      */
-/* (also builds for Linux as 32 bit executable (gcc -m32) only)           */
+/* (also builds for Linux, 32 or 64 bit)                                  */
 /*                                                                        */
 /* Compiles with cc65 v2.15 for VIC-20, C64, Apple II                     */
 /* and gcc 7.3 for Linux                                                  */
@@ -118,7 +118,66 @@ char *bytecodenames[] = {
     "PRSTR",
     "PRMSG",
     "KBDCH",
-    "KBDLN"
+    "KBDLN",
+    "JMPTAB",
+    "CONEW",
+    "COSTART",
+    "CODONE",
+    "RESUME",
+    "YIELD",
+    "NATIVE",
+    "LDAL",
+    "LDALI",
+    "LDRLI",
+    "STAL",
+    "STALI",
+    "STRLI",
+    "WIDY",
+    "ADDL",
+    "SUBL",
+    "MULL",
+    "DIVL",
+    "MODL",
+    "NEGL",
+    "GTL",
+    "GTEL",
+    "LTL",
+    "LTEL",
+    "EQLL",
+    "NEQLL",
+    "ANDL",
+    "ORL",
+    "NOTL",
+    "BANDL",
+    "BORL",
+    "BXORL",
+    "BNOTL",
+    "LSHL",
+    "RSHL",
+    "PRDECL",
+    "VEC",
+    "LDFW",
+    "LDFB",
+    "STFW",
+    "STFB",
+    "SNAP"
+};
+
+/*
+ * Names of the VEC_ operations of VM_VEC
+ */
+char *vecnames[] = {
+    "ADD",
+    "SUB",
+    "AND",
+    "OR",
+    "XOR",
+    "ADDS",
+    "SUM",
+    "MIN",
+    "MAX",
+    "CNT",
+    "FIND"
 };
 
 /*
@@ -147,6 +206,11 @@ unsigned char *memory = 0;
 UINT16 pc = RTPCSTART;          /* Program counter */
 UINT16 lastpc;
 
+#ifdef OBJFORMAT
+struct objhdr hdr;              /* Object file header */
+struct objsym *syms;            /* Symbol table, or NULL */
+#endif
+
 /*
  * Print a value as hex
  */
@@ -161,6 +225,9 @@ void _printhexbyte(unsigned char val) {
  */
 void disassemble_instruction()
 {
+    unsigned int n;
+    unsigned int i;
+
     printhex(pc);
     print(": ");
     _printhexbyte(memory[pc]);
@@ -178,6 +245,12 @@ void disassemble_instruction()
       case VM_JMPIMM:
       case VM_BRNCHIMM:
       case VM_JSRIMM:
+      case VM_COSTART:
+      case VM_NATIVE:
+      case VM_LDALIMM:
+      case VM_LDRLIMM:
+      case VM_STALIMM:
+      case VM_STRLIMM:
         _printhexbyte(memory[pc++]);
         printchar(' ');
         _printhexbyte(memory[pc++]);
@@ -189,6 +262,49 @@ void disassemble_instruction()
         printdec(memory[pc-2] + (memory[pc-1] << 8));
         print(")");
         break;
+      case VM_JMPTAB:
+        /* Count, then one line for each entry in the table */
+        n = memory[pc] + (memory[pc+1] << 8);
+        _printhexbyte(memory[pc++]);
+        printchar(' ');
+        _printhexbyte(memory[pc++]);
+        print("   ");
+        print(bytecodenames[memory[pc-3]]);
+        printchar(' ');
+        printdec(n);
+        for (i = 0; i < n; ++i) {
+#ifdef A2E
+            printchar('\r');
+#else
+            printchar('\n');
+#endif
+            printhex(pc);
+            print(":    ");
+            _printhexbyte(memory[pc++]);
+            printchar(' ');
+            _printhexbyte(memory[pc++]);
+            print("    ");
+            printdec(i);
+            print(": ");
+            printhex(memory[pc-2] + (memory[pc-1] << 8));
+        }
+        break;
+      case VM_VEC:
+        /* Operation, with .B or .W for the element size */
+        n = memory[pc] + (memory[pc+1] << 8);
+        _printhexbyte(memory[pc++]);
+        printchar(' ');
+        _printhexbyte(memory[pc++]);
+        print("   ");
+        print(bytecodenames[memory[pc-3]]);
+        printchar(' ');
+        if ((n & ~VEC_BYTE) < VEC_NUMOPS) {
+            print(vecnames[n & ~VEC_BYTE]);
+            print((n & VEC_BYTE) ? ".B" : ".W");
+        } else {
+            print("**ILLEGAL**");
+        }
+        break;
       case VM_PRMSG:
         print("...00   ");
         print(bytecodenames[memory[pc-1]]);
@@ -201,7 +317,7 @@ void disassemble_instruction()
         break;
       default:
         print("        ");
-        if (memory[pc-1] <= VM_KBDLN) {
+        if (memory[pc-1] <= VM_SNAP) {
             print(bytecodenames[memory[pc-1]]);
         } else {
             print("**ILLEGAL**");
@@ -219,7 +335,21 @@ void disassemble_instruction()
  */
 void disassemble()
 {
+#ifdef OBJFORMAT
+    char name[OBJSYMCHARS + 1];
+    unsigned int i;
+#endif
     while (pc < lastpc) {
+#ifdef OBJFORMAT
+        for (i = 0; syms && (i < hdr.nsyms); ++i) {
+            if (syms[i].addr == pc) {
+                strncpy(name, syms[i].name, OBJSYMCHARS);
+                name[OBJSYMCHARS] = '\0';
+                print(name);
+                print(":\n");
+            }
+        }
+#endif
         disassemble_instruction();
     }
 }
@@ -229,8 +359,12 @@ void disassemble()
  */
 void load()
 {
+#ifdef OBJFORMAT
+    unsigned char status;
+#else
     FILE *fp;
     char ch;
+#endif
     char *p = (char*)&memory[RTPCSTART];
 
     pc = RTPCSTART;
@@ -248,6 +382,35 @@ void load()
         print("Loading '");
         print(p);
         print("'\n");
+#ifdef OBJFORMAT
+        status = objload(p, memory, &hdr, &syms);
+    } while (status == OBJ_NOFILE);
+    if (status != OBJ_OK) {
+        print("Bad bytecode file\n");
+        exit(1);
+    }
+    print("Entry ");
+    printhex(hdr.entry);
+    print(", code ");
+    printhex(hdr.codeaddr);
+    print(" (");
+    printdec(hdr.codesz);
+    print(" bytes), data ");
+    printhex(hdr.dataaddr);
+    print(" (");
+    printdec(hdr.datasz);
+    print(" bytes)\nStack ");
+    printhex(hdr.stacktop);
+    print(" (");
+    printdec(hdr.stacksz);
+    print(" bytes for globals), ");
+    printdec(hdr.nrelocs);
+    print(" relocations, ");
+    printdec(hdr.nsyms);
+    print(" symbols\n");
+    lastpc = hdr.codeaddr + hdr.codesz;
+    pc = hdr.codeaddr;
+#else
         fp = fopen(p, "r");
     } while (!fp);
     while (!feof(fp)) {
@@ -261,6 +424,7 @@ void load()
     fclose(fp);
     lastpc = pc - 1;
     pc = RTPCSTART;
+#endif
 #ifdef A2E
     printchar(7);
 #endif
@@ -3,13 +3,14 @@
 /*                                                                        */
 /* The Eight Bit Algorithmic Language                                     */
 /* For Apple IIe/c/gs (64K), Commodore 64, VIC-20 +32K RAM expansion      */
-/* (also builds for Linux as 32 bit executable (gcc -m32) only)           */
+/* (also builds for Linux, 32 or 64 bit)                                  */
 /*                                                                        */
 /* Compiles with cc65 v2.15 for VIC-20, C64, Apple II                     */
 /* and gcc 7.3 for Linux                                                  */
 /*                                                                        */
-/* Note that this code assumes that sizeof(int) = sizeof(int*), which is  */
-/* true for 6502 (16 bits each) and i686 (32 bits each) - but not amd64   */
+/* Pointers are never stored in an int.  Internal pointers use intptr_t   */
+/* and addresses seen by EightBall programs are offsets into heap 1 on    */
+/* Linux (see ADDR() / PTR()), so the code works on amd64 as well.        */
 /*                                                                        */
 /* cc65: Define symbol VIC20 to build for Commodore VIC-20 + 32K.         */
 /*       Define symbol C64 to build for Commodore 64.                     */
@@ -43,6 +44,7 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <setjmp.h>
 #include <unistd.h>
 
@@ -59,6 +61,131 @@
 #define EXTMEMCODE  /* Enable/disable extended memory for object code */
 #endif
 
+/* Define EXPRCACHE to enable the interpreter's expression cache, which
+ * stores expressions in postfix form after they are first parsed.
+ * EXPRCACHESZ is the amount of memory (in bytes) used for the cache.
+ */
+#ifdef __GNUC__
+#define EXPRCACHE   /* Enable/disable expression cache */
+#endif
+
+/* Define TIERED to enable tiered execution (Linux only.)  A program which
+ * interprets more than TIERTHRESH lines in one run is compiled in memory
+ * the next time it is run, and executed on the embedded VM.
+ */
+#ifdef __GNUC__
+#define TIERED      /* Enable/disable tiered execution */
+#endif
+
+/* Define BLOCKINDEX to enable the interpreter's block structure index,
+ * which records where each if / else / while statement's body ends so
+ * that untaken bodies are skipped without parsing every line in them.
+ */
+#ifdef __GNUC__
+#define BLOCKINDEX  /* Enable/disable block structure index */
+#endif
+
+/* Define FRAMECACHE to enable the interpreter's subroutine frame cache,
+ * which records the location and parameter list of each sub the first
+ * time it is called, so later calls do not need to search for or parse
+ * the sub statement.
+ */
+#ifdef __GNUC__
+#define FRAMECACHE  /* Enable/disable subroutine frame cache */
+#endif
+
+/* Define CONTSTACK to have the interpreter run function calls within
+ * expressions on its own continuation stack rather than recursing in C.
+ * Requires FRAMECACHE.
+ */
+#ifdef __GNUC__
+#define CONTSTACK   /* Enable/disable continuation stack */
+#endif
+
+/* Define PROFILER to enable the prof statement, which counts executions
+ * and accumulates time for each line of the program while it is
+ * interpreted (Linux only.)
+ */
+#ifdef __GNUC__
+#define PROFILER    /* Enable/disable line profiler */
+#endif
+
+/* Define COROUTINE to enable the co.new, resume and yield statements in
+ * the interpreter (Linux only.)  The compiler always supports them.
+ * Requires CONTSTACK.
+ */
+#ifdef __GNUC__
+#define COROUTINE   /* Enable/disable interpreted coroutines */
+#endif
+
+/* Define OPTIMIZER to have the compiler optimize the bytecode it has
+ * generated before it is written out or run (Linux only.)  The level is
+ * chosen with the -O0, -O1 or -O2 command line option.  Default is -O1.
+ */
+#ifdef __GNUC__
+#define OPTIMIZER   /* Enable/disable bytecode optimizer */
+#endif
+
+/* Define LINKER to have linksubs() find subs using a hash table rather
+ * than searching the list of subs for every call, and to record a table
+ * of the locations in the code which hold code addresses (Linux only.)
+ * Requires OPTIMIZER.
+ */
+#ifdef __GNUC__
+#define LINKER      /* Enable/disable hashed linker */
+#endif
+
+/* Define INITDATA to have the compiler put the initial values of global
+ * arrays with constant initializers into the data section of the bytecode
+ * file, rather than generating code to store each element (Linux only.)
+ */
+#ifdef __GNUC__
+#define INITDATA    /* Enable/disable initialized data section */
+#endif
+
+/* Define TAILCALL to have the compiler compile 'return f(...)' as a jump
+ * to f which reuses the frame of the sub making the return, rather than a
+ * call followed by a return (Linux only.)  Off at -O0.  Requires OPTIMIZER.
+ */
+#ifdef __GNUC__
+#define TAILCALL    /* Enable/disable tail call elimination */
+#endif
+
+/* Define FARMEM to enable far arrays, which are kept in a separate far
+ * memory of FARMEMSZ bytes rather than in the 64K address space of the
+ * VM, and are indexed by longs (Linux only.)
+ */
+#ifdef __GNUC__
+#define FARMEM      /* Enable/disable far arrays */
+#endif
+
+/* Define COMPCACHE to keep compiled object files in a cache directory,
+ * keyed by a hash of the program text, optimization level and compiler
+ * build, so comp of an unchanged program skips compilation (Linux only.)
+ */
+#ifdef __GNUC__
+#define COMPCACHE   /* Enable/disable compile cache */
+#endif
+
+/* Define MODULES to add the module statement, which compiles the program
+ * into a module object file for the linker.  The globals of a module are
+ * static data, its top level code is an initialization routine, and calls
+ * to subs it does not define are left for the linker (Linux only.)
+ * Requires LINKER.
+ */
+#ifdef __GNUC__
+#define MODULES     /* Enable/disable separate compilation */
+#endif
+
+/* Define INCRCOMP to have the compiler keep the code it compiled for each
+ * sub, and reuse it when the sub is compiled again without its source
+ * lines, the sub statements or the globals it can see having changed,
+ * rather than compiling the sub again (Linux only.)  Requires LINKER.
+ */
+#ifdef __GNUC__
+#define INCRCOMP    /* Enable/disable incremental compilation */
+#endif
+
 /* Shortcut define CC65 makes code clearer */
 #if defined(VIC20) || defined(C64) || defined(A2E)
 #define CC65
@@ -91,6 +218,66 @@
 #include <stdio.h>              /* For FILE */
 #endif
 
+#ifdef PROFILER
+#include <time.h>               /* For clock_gettime() */
+#endif
+
+#ifdef COMPCACHE
+#include <sys/stat.h>           /* For mkdir() */
+#endif
+
+#ifdef EXPRCACHE
+#ifndef EXPRCACHESZ
+#ifdef CC65
+#define EXPRCACHESZ 512         /* Bytes of memory for expression cache */
+#else
+#define EXPRCACHESZ (1024*8)    /* Bytes of memory for expression cache */
+#endif
+#endif
+#ifdef CC65
+#define EXPRHASHSZ  16          /* Hash buckets - must be power of 2    */
+#else
+#define EXPRHASHSZ  128         /* Hash buckets - must be power of 2    */
+#endif
+#define EXPRRECSZ   32          /* Max RPN ops in one cached expression */
+#endif
+
+#ifdef TIERED
+#define TIERTHRESH  5000        /* Lines interpreted before compiling   */
+#endif
+
+#ifdef BLOCKINDEX
+#ifdef CC65
+#define BLOCKIDXSZ  64          /* Index entries - must be power of 2   */
+#else
+#define BLOCKIDXSZ  1024        /* Index entries - must be power of 2   */
+#endif
+#define BLOCKDEPTH  16          /* Max block nesting depth for indexing */
+#endif
+
+#ifdef FRAMECACHE
+#ifdef CC65
+#define FRAMECACHESZ 8          /* Number of subs in frame cache        */
+#else
+#define FRAMECACHESZ 64         /* Number of subs in frame cache        */
+#endif
+#define FRAMEHASHSZ  16         /* Hash buckets - must be power of 2    */
+#define FRAMEMAXARGS 8          /* Max params for sub to be cached      */
+#endif
+
+#ifdef PROFILER
+#define PROFTOP     10          /* Number of hottest lines reported     */
+#endif
+
+#ifdef OPTIMIZER
+#define OPTMAXITER  8           /* Max times round the pass pipeline    */
+#define OPTINLINESZ 16          /* Max bytes in body of sub to inline   */
+#endif
+
+#ifdef LINKER
+#define LINKHASHSZ  256         /* Hash buckets - must be power of 2    */
+#endif
+
 //#define TEST
 //#define DEBUG_READFILE
 
@@ -139,10 +326,15 @@ int _pow(int x, int y)
  */
 unsigned char P(void);
 unsigned char E(void);
+unsigned char Erest(void);
 unsigned char eval(unsigned char checkNoMore, int *val);
+void push_ctype(unsigned char islong);
 unsigned char parseint(int *);
 unsigned char parsehexint(int *);
 unsigned char getintvar(char *, int, int *, unsigned char *, unsigned char);
+#ifdef FARMEM
+unsigned char isfar(char *name);
+#endif
 unsigned char openfile(unsigned char);
 unsigned char readfile(void);
 unsigned char writefile(void);
@@ -154,11 +346,80 @@ unsigned char docall(void);
 unsigned char doreturn(int retvalue);
 void emit(enum bytecode code);
 void emit_imm(enum bytecode code, int word);
+void emit_word(int word);
 void emitprmsg(void);
-void linksubs(void);
+unsigned char linksubs(void);
+#ifdef TIERED
+unsigned char tierrun(void);
+#endif
 void copyfromaux(char *auxptr, unsigned char len);
+#ifdef EXPRCACHE
+void exprcache_flush(void);
+void exprcache_newgen(void);
+void exprcache_newvar(void);
+void exprcache_recop(unsigned char token);
+void exprcache_recconst(int val);
+void exprcache_recvar(char *name, unsigned char subscripted,
+                      unsigned char address);
+void exprcache_abort(void);
+unsigned char exprcache_lookup(unsigned char *off);
+void exprcache_end(unsigned char off);
+#endif
+#ifdef BLOCKINDEX
+void blockskip(char *startTxtPtr);
+#endif
+#ifdef FRAMECACHE
+void framecache_flush(void);
+#endif
+#ifdef CONTSTACK
+void contflush(void);
+unsigned char contoff(char *p);
+unsigned char contcall(unsigned char off);
+unsigned char contresumeexpr(void);
+void contleaf(unsigned char off, int *val);
+void contreset(void);
+#endif
+#ifdef PROFILER
+void profmark(unsigned char newline);
+void proffree(void);
+void profenable(unsigned char on);
+void profreport(void);
+#endif
+#ifdef OPTIMIZER
+void optimize(void);
+#endif
+#ifdef LINKER
+void linkrelocs(void);
+#endif
+#ifdef OBJFORMAT
+void writeobject(void);
+#endif
+#ifdef COMPCACHE
+unsigned char cacheget(void);
+void cacheput(unsigned char *buf, unsigned int len);
+#endif
+#ifdef MODULES
+unsigned char subextern(char *p);
+void modstart(void);
+void modreturn(void);
+unsigned char moddreloc(unsigned int addr);
+void writemodule(void);
+#endif
+#ifdef INITDATA
+void initdata_clear(void);
+#endif
+#ifdef INCRCOMP
+void incrstart(void);
+unsigned char incrsub(void);
+void incrsave(void);
+#endif
 
 #define emitldi(x) emit_imm(VM_LDIMM, x)
+#ifdef MODULES
+void emit_data(enum bytecode code, int word);
+#else
+#define emit_data(x, y) emit_imm(x, y)
+#endif
 
 /*
  ***************************************************************************
@@ -171,6 +432,128 @@ char compilingsub = 0;          /* 1 when compiling subroutine, 0 otherwise    *
 char onlyconstants = 0;         /* 0 is normal, 1 means only allow const exprs */
 char compiletimelookup = 0;     /* When set to 1, getintvar() will do lookup   */
                                 /* rather than code generation                 */
+char costart = 0;               /* 1 when docall() is starting a coroutine     */
+
+enum types {
+    TYPE_CONST,                 /* Stored as TYPE_WORD     */
+    TYPE_WORD,                  /* Word variable - 16 bits */
+    TYPE_BYTE,                  /* Byte variable - 8 bits  */
+    TYPE_LONG                   /* Long variable - 32 bits */
+};
+
+/*
+ * When compiling, eval() is told what the caller wants left on the VM's
+ * eval stack in evalwant, and sets exprlong if it left a long (two words.)
+ */
+#define EVAL_WORD 0             /* Truncate a long result to a word            */
+#define EVAL_ANY  1             /* Leave the result as it is                   */
+#define EVAL_LONG 2             /* Evaluate in 32 bits                         */
+
+unsigned char evalwant = EVAL_WORD;     /* Request for next eval()             */
+unsigned char exprlong;         /* 1 if last eval() left a long                */
+
+#ifdef TIERED
+#define TIER_COLD    0          /* Interpret the program                       */
+#define TIER_HOT     1          /* Compile and run on VM next time             */
+#define TIER_BLOCKED 2          /* Program may behave differently on VM        */
+
+unsigned char tierstate = TIER_COLD;    /* Tiered execution state               */
+unsigned int tierlines;         /* Lines interpreted during this run           */
+char tiering = 0;               /* 1 when compiling for embedded VM            */
+#endif
+
+#ifdef PROFILER
+/*
+ * Line profile entry.  Entries are indexed by line number (from zero, as
+ * counter.)  Calls to a sub are counted against the sub statement's line.
+ */
+struct profent {
+    unsigned int count;
+    unsigned long long ns;
+};
+
+unsigned char profon = 0;       /* 1 if profiling enabled                      */
+struct profent *profdata = NULL;        /* Profile, one entry per line  */
+unsigned int proflines;         /* Number of entries in profdata               */
+struct profent *proflast;       /* Entry being charged for time                */
+unsigned long long profstart;   /* Time when proflast was started              */
+
+/*
+ * Count a call to the sub declared on the line before counter, and start
+ * profiling the first line of the sub.
+ */
+#define profcall() \
+    if (profon && profdata && !compile && \
+        ((unsigned int) (counter - 1) < proflines)) { \
+        ++(profdata[counter - 1].count); \
+        profmark(1); \
+    }
+#endif
+
+#ifdef OPTIMIZER
+/*
+ * Optimizer intermediate representation.  The bytecode is held as an array
+ * of instructions.  The operand of a jump, branch or call is the index of
+ * the instruction it goes to (a label) rather than an address, so code can
+ * be deleted or rewritten without breaking control flow.
+ */
+#define IR_LABEL    0x01        /* Start of basic block                        */
+#define IR_ENTRY    0x02        /* Entry point of program or sub               */
+#define IR_DEAD     0x04        /* Instruction has been deleted                */
+#define IR_REACH    0x08        /* Instruction is reachable                    */
+#define IR_DROPPED  0x10        /* Entry of sub which is never called          */
+#define IR_INLINE   0x20        /* JSRIMM replaced by copy of body at irinl[imm] */
+
+#define IR_TABENT   0xff        /* op of jump table entry following VM_JMPTAB  */
+
+typedef struct irinsn {
+    unsigned char op;           /* VM opcode                                   */
+    unsigned char flags;        /* IR_xxx flags                                */
+    unsigned int imm;           /* 16 bit immediate operand, if any            */
+    unsigned int target;        /* Index of target, for JMPIMM/BRNCHIMM/JSRIMM */
+                                /* and jump table entries                      */
+    unsigned int src;           /* Offset of original encoding in irsrc        */
+    unsigned int addr;          /* Address once encoded                        */
+} irinsn_t;
+
+/*
+ * Optimizer pass.  run() returns 1 if it changed the IR.
+ */
+typedef struct optpass {
+    char *name;
+    unsigned char level;        /* Lowest optimization level to run pass       */
+    unsigned char (*run)(void);
+} optpass_t;
+
+unsigned char optlevel = 1;     /* Optimization level from -O option           */
+irinsn_t *ir;                   /* Instructions                                */
+unsigned int irlen;             /* Number of instructions in ir                */
+unsigned char *irsrc;           /* Copy of bytecode the IR was lifted from     */
+irinsn_t *irinl;                /* Copies of bodies of inlined subs            */
+unsigned int irinllen;          /* Number of instructions in irinl             */
+#endif
+
+#ifdef __GNUC__
+#define HEAP1SZ 1024*16
+unsigned char heap1[HEAP1SZ];   /* Variables, and code when compiling          */
+#endif
+
+/*
+ * Addresses used by EightBall programs (&var, array bodies passed by
+ * reference and so on) are held in an int, as are the array body pointers
+ * in the variable table.  On Linux these are offsets from the start of
+ * heap 1, where all variables live, so they fit in an int whatever the
+ * pointer size.  On the 8 bit targets they are simply the address.
+ *  ADDR(p) converts a pointer to an address.
+ *  PTR(a) converts an address to an unsigned char pointer.
+ */
+#ifdef __GNUC__
+#define ADDR(p) ((int) ((unsigned char *) (p) - heap1))
+#define PTR(a)  (heap1 + (a))
+#else
+#define ADDR(p) ((int) (p))
+#define PTR(a)  ((unsigned char *) (a))
+#endif
 
 #define FILENAMELEN 15
 
@@ -180,18 +563,63 @@ char filename[FILENAMELEN+1];   /* Name of bytecode file                       *
 char *txtPtr;                   /* Pointer to next character to read in lnbuf  */
 
 #define STACKSZ 16              /* Size of expression stacks   */
+#ifdef CONTSTACK
+/*
+ * Calls in expressions do not use the C stack, so this and the space for
+ * variables in heap 1 are what limit the depth of calls.  Each call takes
+ * three entries, so calls can be at most 1365 deep.
+ */
+#define RETSTACKSZ 4096         /* Size of return stack        */
+#else
 #define RETSTACKSZ 64           /* Size of return stack        */
+#endif
 
 int operand_stack[STACKSZ];     /* Operand stack - grows down  */
 unsigned char operator_stack[STACKSZ];  /* Operator stack - grows down */
-int return_stack[RETSTACKSZ];   /* Return stack - grows down   */
+intptr_t return_stack[RETSTACKSZ];      /* Return stack - grows down   */
+
+unsigned char ctypestack[STACKSZ];      /* Compiler: 1 for a long - grows up */
 
 unsigned char operatorSP;       /* Operator stack pointer      */
 unsigned char operandSP;        /* Operand stack pointer       */
+unsigned char ctypeSP;          /* Compiler type stack pointer */
+unsigned char longctx;          /* Compiler: widen each operand to a long */
+#ifdef CONTSTACK
+unsigned int returnSP;          /* Return stack pointer        */
+#else
 unsigned char returnSP;         /* Return stack pointer        */
+#endif
 
 jmp_buf jumpbuf;                /* For setjmp()/longjmp()      */
 
+#ifdef CONTSTACK
+/*
+ * Where a suspended statement unwinds to - one per active run() loop
+ */
+struct contctx {
+    jmp_buf jb;
+    unsigned char operandSP;    /* Expression stacks at start of run() */
+    unsigned char operatorSP;
+};
+
+struct contctx *contctx;        /* Innermost run() loop               */
+struct contrec *contactive;     /* Record for statement being replayed */
+struct contrec *contstack;      /* Suspended statements               */
+struct contrec *contfreelist;   /* Records available for reuse        */
+char *contstmt;                 /* Start of statement being executed  */
+unsigned char contok;           /* 1 if statement can be suspended    */
+unsigned char contresume;       /* 1 if resuming statement at txtPtr  */
+unsigned char contdepth;        /* Nesting of eval() in the statement */
+unsigned char contexproff;      /* Expression at contdepth 1: offset  */
+unsigned char contopndbase;     /*  and its expression stack bases    */
+unsigned char contoprbase;
+#endif
+
+#ifdef COROUTINE
+struct coobj *corunning;        /* Innermost running coroutine        */
+unsigned char coreturned;       /* 1 if return finished a coroutine   */
+#endif
+
 #ifndef CBM
 FILE *fd;                       /* File descriptor             */
 #endif
@@ -360,6 +788,9 @@ const char unaryops[] = "-+!~*^";
 #define ERR_STCONST 124         /* Const value reqd   */
 #define ERR_TOOLONG 125         /* Initializer too lng */
 #define ERR_LINK    126         /* Linkage error      */
+#define ERR_NOSWITCH 127        /* No SWITCH          */
+#define ERR_CORO    128         /* Coroutine error    */
+#define ERR_FAR     129         /* Far memory error   */
 
 char *errmsgs[] = {
     "no if",                    /* ERR_NOIF    */
@@ -387,7 +818,10 @@ char *errmsgs[] = {
     "not const",                /* ERR_CONST   */
     "const",                    /* ERR_STCONST */
     "too long",                 /* ERR_TOOLONG */
-    "link"                      /* ERR_LINK    */
+    "link",                     /* ERR_LINK    */
+    "no switch",                /* ERR_NOSWITCH */
+    "coroutine",                /* ERR_CORO    */
+    "far mem"                   /* ERR_FAR     */
 };
 
 /*
@@ -398,6 +832,12 @@ char *errmsgs[] = {
 #endif
 void error(unsigned char errcode)
 {
+#ifdef TIERED
+    /* Compilation for the embedded VM is silent */
+    if (tiering) {
+        return;
+    }
+#endif
     printchar('?');
     print(errmsgs[errcode - ERR_FIRST]);
 }
@@ -491,7 +931,17 @@ unsigned char pop_operator_stack()
 void push_operand_stack(int operand)
 {
     if (compile) {
+#ifdef __GNUC__
+        /* Constants too big for a word are longs */
+        if ((unsigned int) operand > 0xffff) {
+            emitldi(operand & 0xffff);
+            emitldi((unsigned int) operand >> 16);
+            push_ctype(1);
+            return;
+        }
+#endif
         emitldi(operand);
+        push_ctype(0);
         return;
     }
     operand_stack[operandSP] = operand;
@@ -518,6 +968,163 @@ int pop_operand_stack()
 
 #define top_operand_stack() operand_stack[operandSP + 1]
 
+/*
+ * Compiler type stack routines
+ * When compiling, the operand stack is the VM's eval stack.  The type stack
+ * records whether each operand on it is a word or a long (two words, high
+ * word on top) so that operators on longs can use the 32 bit instructions.
+ */
+
+/*
+ * Record the type of the operand just pushed: 0 for a word, 1 for a long.
+ * In long context (evaluating for a long variable) words are widened as
+ * soon as they are pushed.
+ */
+void push_ctype(unsigned char islong)
+{
+    if (longctx && !islong) {
+        emitldi(0);
+        islong = 1;
+    }
+    if (ctypeSP == STACKSZ) {
+        /* Warm start */
+        error(ERR_COMPLEX);
+        longjmp(jumpbuf, 1);
+    }
+    ctypestack[ctypeSP++] = islong;
+}
+
+unsigned char pop_ctype()
+{
+    return (ctypeSP ? ctypestack[--ctypeSP] : 0);
+}
+
+/*
+ * Compile operator token.  If either operand is a long, emits the 32 bit
+ * operation (widening the other operand if needed) and returns 1.  If the
+ * operands are words, returns 0 and apply_operator() emits the 16 bit
+ * operation.  Returns 2 on error.
+ */
+unsigned char longoperator(int token)
+{
+    unsigned char x = pop_ctype();
+    unsigned char y = 0;
+    unsigned char op;
+    unsigned char result = 1;
+
+    if (!ISUNARY(token)) {
+        y = pop_ctype();
+        if (token == TOK_POW) {
+            /* Result is pushed by push_operand_stack() */
+            if (x || y) {
+                error(ERR_TYPE);
+                return 2;
+            }
+            return 0;
+        }
+    }
+    if (!x && !y) {
+        /* Never widened here: in long context every operand is a long */
+        ctypestack[ctypeSP++] = 0;
+        return 0;
+    }
+    switch (token) {
+    case TOK_UNM:
+        op = VM_NEGL;
+        break;
+    case TOK_UNP:
+        push_ctype(1);
+        return 1;
+    case TOK_NOT:
+        op = VM_NOTL;
+        result = 0;
+        break;
+    case TOK_BITNOT:
+        op = VM_BITNOTL;
+        break;
+    case TOK_STAR:
+    case TOK_CARET:
+        /* Use the low word as the address */
+        emit(VM_DROP);
+        op = ((token == TOK_STAR) ? VM_LDAWORD : VM_LDABYTE);
+        result = 0;
+        break;
+    default:
+        if (!x) {
+            emitldi(0);
+        } else if (!y) {
+            emit(VM_WIDENY);
+        }
+        switch (token) {
+        case TOK_MUL:
+            op = VM_MULL;
+            break;
+        case TOK_DIV:
+            op = VM_DIVL;
+            break;
+        case TOK_MOD:
+            op = VM_MODL;
+            break;
+        case TOK_ADD:
+            op = VM_ADDL;
+            break;
+        case TOK_SUB:
+            op = VM_SUBL;
+            break;
+        case TOK_BITAND:
+            op = VM_BITANDL;
+            break;
+        case TOK_BITOR:
+            op = VM_BITORL;
+            break;
+        case TOK_BITXOR:
+            op = VM_BITXORL;
+            break;
+        case TOK_LSH:
+            op = VM_LSHL;
+            break;
+        case TOK_RSH:
+            op = VM_RSHL;
+            break;
+        default:
+            /* Comparisons and logical operators give a word */
+            result = 0;
+            switch (token) {
+            case TOK_GT:
+                op = VM_GTL;
+                break;
+            case TOK_GTE:
+                op = VM_GTEL;
+                break;
+            case TOK_LT:
+                op = VM_LTL;
+                break;
+            case TOK_LTE:
+                op = VM_LTEL;
+                break;
+            case TOK_EQL:
+                op = VM_EQLL;
+                break;
+            case TOK_NEQL:
+                op = VM_NEQLL;
+                break;
+            case TOK_AND:
+                op = VM_ANDL;
+                break;
+            case TOK_OR:
+                op = VM_ORL;
+                break;
+            default:
+                /* Should never happen */
+                EXIT(99);
+            }
+        }
+    }
+    emit(op);
+    push_ctype(result);
+    return 1;
+}
+
 /*
  ***************************************************************************
  * Parser proper ...
@@ -598,17 +1205,25 @@ unsigned char unary()
 }
 
 /*
- * Pop an operator from the operator stack, pop the operands from the
- * operand stack and apply the operator to the operands.
+ * Pop the operands from the operand stack and apply the operator token
+ * to the operands.
  * Returns 0 if successful, 1 on error
  */
-unsigned char pop_operator()
+unsigned char apply_operator(int token)
 {
     int operand2;
     int result;
-    int token = pop_operator_stack();
     int operand1 = pop_operand_stack();
 
+    if (compile) {
+        switch (longoperator(token)) {
+        case 1:
+            return 0;
+        case 2:
+            return 1;
+        }
+    }
+
     if (!ISUNARY(token)) {
 
         /*
@@ -802,28 +1417,53 @@ unsigned char pop_operator()
                 emit(VM_LDAWORD);
                 return 0;
             }
-            result = *((int *) operand1);
+            result = *((int *) PTR(operand1));
             break;
         case TOK_CARET:
             if (compile) {
                 emit(VM_LDABYTE);
                 return 0;
             }
-            result = *((unsigned char *) operand1);
+            result = *PTR(operand1);
             break;
         default:
             /* Should never happen */
             EXIT(99);
         }
     }
+#ifdef TIERED
+    /*
+     * The VM only has 16 bit unsigned arithmetic, so programs which use
+     * values outside 0..32767 (including pointers) are never compiled.
+     */
+    if (current && (((unsigned int) result > 0x7fff) ||
+                    ((unsigned int) operand1 > 0x7fff) ||
+                    (!ISUNARY(token) && ((unsigned int) operand2 > 0x7fff)))) {
+        tierstate = TIER_BLOCKED;
+    }
+#endif
     push_operand_stack(result);
     return 0;
 }
 
 /*
+ * Pop an operator from the operator stack, pop the operands from the
+ * operand stack and apply the operator to the operands.
  * Returns 0 if successful, 1 on error
  */
-unsigned char push_operator(int operator_token)
+unsigned char pop_operator()
+{
+    int token = pop_operator_stack();
+#ifdef EXPRCACHE
+    exprcache_recop(token);
+#endif
+    return apply_operator(token);
+}
+
+/*
+ * Returns 0 if successful, 1 on error
+ */
+unsigned char push_operator(int operator_token)
 {
     /* Handles operator precedence here */
     while (getprecedence(top_operator_stack()) >=
@@ -843,11 +1483,12 @@ unsigned char push_operator(int operator_token)
 #define FORFRAME_B  0xfffc      /* Magic number for FOR stack frame - byte var */
 #define FORFRAME_W  0xfffb      /* Magic number for FOR stack frame - word var */
 #define WHILEFRAME  0xfffa      /* Magic number for WHILE stack frame          */
+#define SWITCHFRAME 0xfff9      /* Magic number for SWITCH stack frame         */
 
 /*
- * Push line number (or other int) to return stack.
+ * Push line number (or other int or pointer) to return stack.
  */
-void push_return(int linenum)
+void push_return(intptr_t linenum)
 {
     return_stack[returnSP] = linenum;
     if (!returnSP) {
@@ -858,9 +1499,9 @@ void push_return(int linenum)
 }
 
 /*
- * Pop line number (or other int) from return stack.
+ * Pop line number (or other int or pointer) from return stack.
  */
-int pop_return()
+intptr_t pop_return()
 {
     if (returnSP == RETSTACKSZ - 1) {
         error(ERR_STACK);
@@ -903,11 +1544,19 @@ unsigned char expect(unsigned char token)
  */
 unsigned char E()
 {
-    int op;
-
     if (P()) {
         return 1;
     }
+    return Erest();
+}
+
+/*
+ * Handles the rest of an expression, after its first predicate
+ * Returns 0 on success, 1 on error
+ */
+unsigned char Erest()
+{
+    int op;
 
     while ((op = binary()) != ILLEGAL) {
         if (push_operator(op)) {
@@ -965,6 +1614,16 @@ unsigned char P()
 {
     struct lineofcode *oldcurrent;
     int oldcounter;
+#ifdef CONTSTACK
+    struct contrec *oldcont;
+    unsigned char oldcontok;
+    char *oldcontstmt;
+    unsigned char oldcontdepth;
+    unsigned char oldexproff;
+    unsigned char oldopndbase;
+    unsigned char oldoprbase;
+    unsigned char leafoff;
+#endif
     char key[VARNUMCHARS];
     int idx;
     char *writePtr;
@@ -981,6 +1640,11 @@ unsigned char P()
 
     if ((*txtPtr == '&') || (isalphach(*txtPtr))) {
 
+#ifdef CONTSTACK
+        if (current) {
+            leafoff = contoff(txtPtr);
+        }
+#endif
         addressmode = 0;
 
         /*
@@ -988,6 +1652,12 @@ unsigned char P()
          */
         if (*txtPtr == '&') {
             addressmode = 1;
+#ifdef TIERED
+            /* Addresses differ between interpreter and VM */
+            if (current) {
+                tierstate = TIER_BLOCKED;
+            }
+#endif
             ++txtPtr;
             if (!isalphach(*txtPtr)) {
                 error(ERR_VAR);
@@ -1015,6 +1685,12 @@ unsigned char P()
         idx = -1;
         if (*txtPtr == '[') {
             idx = 0;
+#ifdef FARMEM
+            /* Far arrays are indexed by a long */
+            if (compile && isfar(key)) {
+                evalwant = EVAL_LONG;
+            }
+#endif
             if (subscript(&idx) == 1) {
                 error(ERR_SUBSCR);
                 return 1;
@@ -1045,8 +1721,46 @@ unsigned char P()
 
                 pop_operator_stack();
 
+                /* Subs return a word */
+                push_ctype(0);
+
             } else {
 
+#ifdef EXPRCACHE
+                /* Function calls are not cacheable */
+                exprcache_abort();
+#endif
+
+#ifdef CONTSTACK
+                /*
+                 * Either suspends this statement and enters the sub
+                 * (does not return), or pushes the result of a call
+                 * made before the statement was last suspended.
+                 */
+                if (contok) {
+                    arg = contcall(leafoff);
+                    if (arg == 1) {
+                        return 1;
+                    }
+                    if (arg == 0) {
+                        goto skip_var;
+                    }
+                }
+
+                /*
+                 * Otherwise recurse.  Calls within the arguments or
+                 * the sub itself must not suspend this statement.
+                 */
+                oldcont = contactive;
+                oldcontok = contok;
+                oldcontstmt = contstmt;
+                oldcontdepth = contdepth;
+                oldexproff = contexproff;
+                oldopndbase = contopndbase;
+                oldoprbase = contoprbase;
+                contok = 0;
+#endif
+
                 push_operator_stack(SENTINEL);
 
                 oldcurrent = current;
@@ -1073,6 +1787,10 @@ unsigned char P()
                     return 1;
                 }
 
+#ifdef CONTSTACK
+                contactive = NULL;
+#endif
+
                 /*
                  * Run the function.  When the function returns it 
                  * is treated as immediate mode, so it comes back
@@ -1084,6 +1802,19 @@ unsigned char P()
                 current = oldcurrent;
                 counter = oldcounter;
 
+#ifdef CONTSTACK
+                contactive = oldcont;
+                contok = oldcontok;
+                contstmt = oldcontstmt;
+                contdepth = oldcontdepth;
+                contexproff = oldexproff;
+                contopndbase = oldopndbase;
+                contoprbase = oldoprbase;
+                if (contactive) {
+                    contleaf(leafoff, &retregister);
+                }
+#endif
+
 #ifdef EXTMEM
                 // Restore embuf, which is trashed by the call to run() above
                 copyfromaux(current->line, current->len);
@@ -1125,8 +1856,23 @@ unsigned char P()
             return 1;
         }
 
+        if (compile) {
+            /* Value of a long, or an address */
+            push_ctype(((type & 0x0f) == TYPE_LONG) && !addressmode &&
+                       (!(type & 0x10) || (idx != -1)));
+        }
+
         if (!compile) {
+#ifdef CONTSTACK
+            /* Value may have been changed by a call since first read */
+            if (contactive) {
+                contleaf(leafoff, &arg);
+            }
+#endif
             push_operand_stack(arg);
+#ifdef EXPRCACHE
+            exprcache_recvar(key, (idx != -1), addressmode);
+#endif
         }
 
       skip_var:
@@ -1141,6 +1887,14 @@ unsigned char P()
             return 1;
         }
         push_operand_stack(arg);
+#ifdef EXPRCACHE
+        exprcache_recconst(arg);
+#endif
+#ifdef TIERED
+        if (current && ((unsigned int) arg > 0x7fff)) {
+            tierstate = TIER_BLOCKED;
+        }
+#endif
         eatspace();
 
     } else if (*txtPtr == '$') {
@@ -1153,6 +1907,14 @@ unsigned char P()
             return 1;
         }
         push_operand_stack(arg);
+#ifdef EXPRCACHE
+        exprcache_recconst(arg);
+#endif
+#ifdef TIERED
+        if (current && ((unsigned int) arg > 0x7fff)) {
+            tierstate = TIER_BLOCKED;
+        }
+#endif
         eatspace();
 
     } else if (*txtPtr == '\'') {
@@ -1168,6 +1930,9 @@ unsigned char P()
         }
         ++txtPtr;               /* Eat the ' */
         push_operand_stack(arg);
+#ifdef EXPRCACHE
+        exprcache_recconst(arg);
+#endif
         eatspace();
 
     } else if (*txtPtr == '(') {
@@ -1209,12 +1974,16 @@ unsigned char P()
 /*
  * Evaluate expression at txtPtr
  * If checkNoMore is 1 then check there is no extra input to be consumed.
- * eval() is basically a wrapper around the expression parser routine E().
+ * evalexpr() is basically a wrapper around the expression parser routine E().
  * Result is returned via argument val.
  * Returns 0 if successful, 1 on error.
  */
-unsigned char eval(unsigned char checkNoMore, int *val)
+unsigned char evalexpr(unsigned char checkNoMore, int *val)
 {
+#ifdef EXPRCACHE
+    unsigned char cachestatus = 3;
+    unsigned char off;
+#endif
 
     eatspace();
 
@@ -1222,9 +1991,59 @@ unsigned char eval(unsigned char checkNoMore, int *val)
         error(ERR_EXPR);
         return 1;
     }
+#ifdef CONTSTACK
+    /*
+     * Note where an expression evaluated directly by a statement which can
+     * be suspended starts.  If it is the one which made the call the
+     * statement was suspended by, carry on from after the call.
+     */
+    if (contok && (contdepth == 1)) {
+        contexproff = contoff(txtPtr);
+        contopndbase = operandSP;
+        contoprbase = operatorSP;
+        switch (contresumeexpr()) {
+        case 0:
+            goto checkmore;
+        case 1:
+            return 1;
+        }
+    }
+#endif
+#ifdef EXPRCACHE
+    /*
+     * Only cache expressions in program lines (current is NULL in
+     * immediate mode.)
+     */
+#ifdef CONTSTACK
+    if (current && !compile && !onlyconstants && !contactive) {
+#else
+    if (current && !compile && !onlyconstants) {
+#endif
+        cachestatus = exprcache_lookup(&off);
+        if (cachestatus == 0) {
+            goto checkmore;
+        }
+        if (cachestatus == 1) {
+            return 1;
+        }
+    }
+#endif
     if (E()) {
+#ifdef EXPRCACHE
+        if (cachestatus == 2) {
+            exprcache_abort();
+        }
+#endif
         return 1;
     }
+#ifdef EXPRCACHE
+    if (cachestatus == 2) {
+        exprcache_end(off);
+    }
+#endif
+#if defined(EXPRCACHE) || defined(CONTSTACK)
+  checkmore:
+#endif
     if (checkNoMore == 1) {
         if (*txtPtr == ';') {
             goto doret;
@@ -1243,12 +2062,54 @@ unsigned char eval(unsigned char checkNoMore, int *val)
     return 0;
 }
 
+/*
+ * Evaluate expression at txtPtr, as evalexpr().
+ * When compiling, the result is left on the VM's eval stack as a word,
+ * unless evalwant was set to EVAL_ANY or EVAL_LONG before the call.  In
+ * that case exprlong is set if the result is a long.
+ */
+unsigned char eval(unsigned char checkNoMore, int *val)
+{
+    unsigned char want = evalwant;
+    unsigned char oldctx = longctx;
+    unsigned char oldSP = ctypeSP;
+    unsigned char ret;
+
+    evalwant = EVAL_WORD;
+    if (!compile) {
+#ifdef CONTSTACK
+        ++contdepth;
+        ret = evalexpr(checkNoMore, val);
+        --contdepth;
+        return ret;
+#else
+        return evalexpr(checkNoMore, val);
+#endif
+    }
+    longctx = (want == EVAL_LONG);
+    ret = evalexpr(checkNoMore, val);
+    if (!ret) {
+        exprlong = pop_ctype();
+        if (exprlong && (want == EVAL_WORD)) {
+            /* Drop the high word */
+            emit(VM_DROP);
+            exprlong = 0;
+        }
+    }
+    ctypeSP = oldSP;
+    longctx = oldctx;
+    return ret;
+}
+
 /*
  * Everything above this line is the expression parser.
  * Everything below is the rest of the language implementation.
  */
 
 unsigned char *heap1Ptr;        /* Arena 1: top-down stack */
+#ifdef COROUTINE
+unsigned char *heap1Lim;        /* Arena 1: limit, moved for coroutines */
+#endif
 unsigned char *heap2PtrTop;     /* Arena 2: top-down stack */
 unsigned char *heap2PtrBttm;    /* Arena 2: bottom-up heap */
 
@@ -1343,8 +2204,7 @@ unsigned char *auxmemPtrBttm;   /* Auxiliary memory: bottom up heap */
 
 #ifdef __GNUC__
 
-#define HEAP1SZ 1024*16
-unsigned char heap1[HEAP1SZ];
+/* heap1[] itself is declared with the globals, above */
 #define HEAP1TOP (heap1 + HEAP1SZ - 1)
 #define HEAP1LIM heap1
 
@@ -1359,7 +2219,11 @@ unsigned char heap1[HEAP1SZ];
 /*
  * Clears heap 1.  Must call this before using alloc1().
  */
+#ifdef COROUTINE
+#define CLEARHEAP1() heap1Ptr = HEAP1TOP; heap1Lim = HEAP1LIM
+#else
 #define CLEARHEAP1() heap1Ptr = HEAP1TOP
+#endif
 
 /*
  * Clears heap 2 top-down stack.  Must call this before using alloc2top().
@@ -1394,12 +2258,30 @@ unsigned char heap1[HEAP1SZ];
 #define CLEARRTCALLSTACK() rtSP = RTCALLSTACKTOP; rtFP = rtSP; rtPC = RTPCSTART; codeptr = CODESTART;
 #endif
 
+/*
+ * Round n up so that a block allocated on heap 1 straight after one of n
+ * bytes is aligned.
+ */
+#ifdef __GNUC__
+#define ALIGN1(n) (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+#else
+#define ALIGN1(n) (n)
+#endif
+
 /*
  * Allocate bytes on heap 1.
  */
 void *alloc1(unsigned int bytes)
 {
+#ifdef __GNUC__
+    /* Keep var_t records and the ints after them aligned */
+    bytes += (uintptr_t) (heap1Ptr - bytes) & (sizeof(void *) - 1);
+#endif
+#ifdef COROUTINE
+    if ((heap1Ptr - bytes) < heap1Lim) {
+#else
     if ((heap1Ptr - bytes) < HEAP1LIM) {
+#endif
         print("No mem (1)!\n");
         longjmp(jumpbuf, 1);
     }
@@ -1729,6 +2611,30 @@ void emit_imm(enum bytecode code, int word)
 #pragma code-name (pop)
 #endif
 
+/*
+ * Compiler: Emit 16 bit word with no opcode (entry in a jump table.)
+ * Stores using codeptr.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+void emit_word(int word)
+{
+    unsigned char *p = (unsigned char *) &word;
+
+#ifdef EXTMEMCODE
+    copybytetoaux(codeptr++, *p++);
+    copybytetoaux(codeptr++, *p);
+#else
+    *codeptr++ = *p++;
+    *codeptr++ = *p;
+#endif
+    rtPC += 2;
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
 /*
  * Compiler: Emit PRMSG and string argument.
  * String is in readbuf
@@ -1818,6 +2724,10 @@ void writebytecode()
     printchar('\n');
     openfile(1);
     print("...\n");
+#ifdef OBJFORMAT
+    writeobject();
+    end = p;
+#endif
     while (p < end) {
 #ifdef EXTMEMCODE
         copybytefromaux(p);
@@ -1863,6 +2773,40 @@ struct lineofcode *program = NULL;
  */
 unsigned char skipFlag;
 
+#ifdef BLOCKINDEX
+#define BLOCKIDX_NONE  0        /* Index has to be built before use     */
+#define BLOCKIDX_OK    1        /* Index is valid                       */
+#define BLOCKIDX_FULL  2        /* Program too big to index - not used  */
+
+unsigned char blockidxstate = BLOCKIDX_NONE;
+#endif
+
+/*
+ * Called whenever the program text is changed, to discard anything
+ * derived from it.
+ */
+void progedited()
+{
+#ifdef EXPRCACHE
+    exprcache_flush();
+#endif
+#ifdef BLOCKINDEX
+    blockidxstate = BLOCKIDX_NONE;
+#endif
+#ifdef FRAMECACHE
+    framecache_flush();
+#endif
+#ifdef CONTSTACK
+    contflush();
+#endif
+#ifdef PROFILER
+    proffree();
+#endif
+#ifdef TIERED
+    tierstate = TIER_COLD;
+#endif
+}
+
 /*
  * Append a line to the program
  * The new line will be appended after current
@@ -1886,6 +2830,7 @@ void appendline(char *line)
     loc->next = current->next;
     current->next = loc;
     current = loc;
+    progedited();
 }
 #ifdef A2E
 #pragma code-name (pop)
@@ -1911,6 +2856,7 @@ void insertfirstline(char *line)
 #endif
     loc->next = program;
     program = loc;
+    progedited();
 }
 #ifdef A2E
 #pragma code-name (pop)
@@ -1949,6 +2895,7 @@ void deleteline(int startline, int endline)
     if (endline < startline) {
         return;
     }
+    progedited();
     current = program;
     while (current && linesToDel) {
         if (counter == startline) {
@@ -1982,6 +2929,7 @@ void deleteline(int startline, int endline)
 #endif
 void changeline(char *line)
 {
+    progedited();
 #ifdef __GNUC__
     free(current->line);
 #endif
@@ -2026,6 +2974,7 @@ void new()
 #endif
     program = NULL;
     current = NULL;
+    progedited();
 }
 #ifdef A2E
 #pragma code-name (pop)
@@ -2040,7 +2989,8 @@ int calllevel;
  * type: encodes the type in the least significant 4 bits (bits 3:0) encode
  *       the data type (TYPE_WORD or TYPE_BYTE).  The next least significant
  *       bit (bit 4) is 0 for a scalar value and 1 for an array.  Bit 5 is
- *       0 for a normal variable and 1 for a constant.
+ *       0 for a normal variable and 1 for a constant.  Bit 6 is 1 for a
+ *       far array, whose body address is an offset in far memory.
  * next: pointer to next vartabent.
  */
 struct vartabent {
@@ -2055,6 +3005,18 @@ var_t *varsbegin;               /* First table entry */
 var_t *varsend;                 /* Last table entry  */
 var_t *varslocal;               /* Local stack frame */
 
+#ifdef EXPRCACHE
+/*
+ * Generation of the variable table as seen from the current scope.  Set
+ * to a new value by exprcache_newgen() when local variables are created,
+ * or a sub or coroutine is entered.  Each call frame records the caller's
+ * generation, which is restored when the sub returns, as the caller's
+ * variables are then just as they were.
+ */
+unsigned int varsgen;
+unsigned int varsgenlast;       /* Last generation handed out */
+#endif
+
 /*
  * Entry in the subroutine table.  This is used by the compiler only.
  * name: first SUBRNUMCHARS characters as key
@@ -2064,6 +3026,9 @@ struct subtabent {
     char name[SUBRNUMCHARS];
     unsigned int addr;
     struct subtabent *next;
+#ifdef LINKER
+    struct subtabent *hnext;    /* Next entry in linker hash chain */
+#endif
 };
 
 typedef struct subtabent sub_t;
@@ -2073,8 +3038,80 @@ sub_t *subsend;                 /* Entry points of compiled subroutines - last
 sub_t *callsbegin;              /* Subroutine calls - first */
 sub_t *callsend;                /* Subroutine calls - end */
 
+#ifdef LINKER
+sub_t *linkhash[LINKHASHSZ];    /* Hash table of subs, built by linksubs() */
+unsigned int *relocs = NULL;    /* Addresses of words holding code addrs   */
+unsigned int nrelocs;           /* Number of entries in relocs             */
+#endif
+
+#ifdef MODULES
+unsigned char modcomp = 0;      /* 1 if compiling a module                 */
+unsigned int moddatasz;         /* Bytes of static data in module          */
+unsigned int modlast;           /* Address of last static data allocated   */
+unsigned int modretpc;          /* rtPC just after the last return emitted */
+unsigned int *drelocs = NULL;   /* Addresses of words holding data addrs   */
+unsigned int ndrelocs;          /* Number of entries in drelocs            */
+unsigned int drelocsz;          /* Number of entries allocated in drelocs  */
+#endif
+
+#ifdef INITDATA
+/*
+ * Image of the initial values of global arrays, covering the target's call
+ * stack.  Only the part from datalo to datahi is written out.
+ */
+unsigned char *dataimg = NULL;
+unsigned int datalo;            /* Lowest address in data section          */
+unsigned int datahi;            /* Address after end of data section       */
+unsigned char datasafe;         /* 0 once a call has been compiled         */
+#endif
+
+#ifdef TAILCALL
+unsigned int tailpc;            /* rtPC after code for last call compiled  */
+unsigned int tailjsr;           /* rtPC of JSRIMM of last call compiled    */
+sub_t *tailcall;                /* Call table entry for last call compiled */
+unsigned char tailargbytes;     /* Argument bytes of last call compiled    */
+unsigned char subargbytes;      /* Argument bytes of sub being compiled    */
+unsigned char tailsafe;         /* 1 if sub being compiled may lose frame  */
+
+/*
+ * Tail returns compiled in the current sub.  Whether the sub's frame may be
+ * dropped is only known at endsub, so these are kept so they can be backed
+ * out if a local array or the address of a local turns up after them.
+ */
+#define MAXTAILRETS 8
+
+struct tailret {
+    unsigned int pc;            /* rtPC of start of tail return code       */
+    unsigned int end;           /* rtPC after end of tail return code      */
+    sub_t *call;                /* Call table entry for the sub called     */
+    unsigned char argbytes;     /* Argument bytes passed to the sub        */
+};
+
+struct tailret tailrets[MAXTAILRETS];
+unsigned char ntailrets;
+#endif
+
+#ifdef FARMEM
+/*
+ * Far memory.  The interpreter keeps far arrays in fardata, in the same
+ * layout as the VM (words little endian.)  farnext is the far address at
+ * which the next far array is allocated, by both interpreter and compiler.
+ */
+unsigned char *fardata = NULL;
+unsigned long farnext;
+#endif
+
 #define getptrtoscalarword(v) (int*)((char*)v + sizeof(var_t))
 #define getptrtoscalarbyte(v) (unsigned char*)((char*)v + sizeof(var_t))
+#define getptrtoframelink(v) (var_t**)((char*)v + sizeof(var_t))
+#define getptrtoframegen(v) (unsigned int*)((char*)v + sizeof(var_t) + 2 * sizeof(var_t*))
+
+/*
+ * Value the interpreter stores in a variable of the given type: words keep
+ * only the low 16 bits, sign extended so that negative words still compare
+ * and print as negative.  Longs are kept whole.
+ */
+#define storeval(type, value) (((type) == TYPE_WORD) ? (int) (short) (value) : (value))
 
 /*
  * Find integer variable
@@ -2113,6 +3150,19 @@ var_t *findintvar(char *name, unsigned char *local)
     return NULL;                /* Not found */
 }
 
+#ifdef FARMEM
+/*
+ * Returns 1 if name is a far array, 0 otherwise
+ */
+unsigned char isfar(char *name)
+{
+    unsigned char local = 0;
+    var_t *v = findintvar(name, &local);
+
+    return (v && (v->type & 0x40));
+}
+#endif
+
 /*
  * Clear all variables
  */
@@ -2123,14 +3173,17 @@ void clearvars()
     varsbegin = NULL;
     varsend = NULL;
     varslocal = NULL;
+#ifdef COROUTINE
+    corunning = NULL;
+#endif
+#ifdef FARMEM
+    farnext = 0;
+#endif
+#ifdef EXPRCACHE
+    exprcache_newgen();
+#endif
 }
 
-enum types {
-    TYPE_CONST,                 /* Stored as TYPE_WORD     */
-    TYPE_WORD,                  /* Word variable - 16 bits */
-    TYPE_BYTE                   /* Byte variable - 8 bits  */
-};
-
 /*
  * Print all variables as a table
  */
@@ -2153,11 +3206,12 @@ void printvars()
             printchar(']');
         }
         printchar(' ');
-        printchar(((v->type & 0x0f) == TYPE_WORD) ? 'w' : 'b');
-        printchar((v->type & 0x20) ? 'c' : ' ');
+        printchar(((v->type & 0x0f) == TYPE_WORD) ? 'w' :
+                  (((v->type & 0x0f) == TYPE_LONG) ? 'l' : 'b'));
+        printchar((v->type & 0x20) ? 'c' : ((v->type & 0x40) ? 'f' : ' '));
         printchar(' ');
         if ((v->type & 0x10) == 0) {
-            if (v->type == TYPE_WORD) {
+            if (v->type != TYPE_BYTE) {
                 printdec(*getptrtoscalarword(v));
             } else {
                 printdec(*getptrtoscalarbyte(v));
@@ -2176,6 +3230,12 @@ void printvars()
  */
 void civ_st_rel_word(unsigned int i)
 {
+#ifdef MODULES
+    if (modcomp && !compilingsub) {
+        emit_data(VM_STAWORDIMM, modlast + 2 * i);
+        return;
+    }
+#endif
     emitldi(rtSP - rtFP + 2 * i);
     emit(VM_STRWORD);
 }
@@ -2185,57 +3245,290 @@ void civ_st_rel_word(unsigned int i)
  */
 void civ_st_rel_byte(unsigned int i)
 {
+#ifdef MODULES
+    if (modcomp && !compilingsub) {
+        emit_data(VM_STABYTEIMM, modlast + i);
+        return;
+    }
+#endif
     emitldi(rtSP - rtFP + i);
     emit(VM_STRBYTE);
 }
 
+/* Factored out to save a few bytes
+ * Used by createintvar() only.
+ */
+void civ_st_rel_long(unsigned int i)
+{
+#ifdef MODULES
+    if (modcomp && !compilingsub) {
+        emit_data(VM_STALIMM, modlast + 4 * i);
+        return;
+    }
+#endif
+    emit_imm(VM_STRLIMM, rtSP - rtFP + 4 * i);
+}
+
 #define STRG_INIT 0
 #define LIST_INIT 1
+
+#ifdef MODULES
+
 /*
- * Create new integer variable (either word or byte, scalar or array)
- *
- * name is the variable name
- * type specifies if it is a word (TYPE_WORD) variable, a byte variable
- * (TYPE_BYTE), or a constant (TYPE_CONST).
- * isarray is 0 for scalar variable, 1 for array variable
- * sz is the size (for an array only)
- * value is the initializer (for a scalar only)  TODO: Can save a word of arguments here!!!!!
- * bodyptr is used when allocating arrays.  If bodyptr is null then the
- * function will allocate space for the array data block, following the
- * array header.  If, on the other hand, a non-null pointer is passed then
- * only the array header will be allocated and the pointer will be stored
- * as the pointer to the array data block.  This allows array pass-by-reference
- * semantics.
- * 
- * Return 0 on success, 1 if error.
- *
- * New variable is appended to table, which adds it to the innermost scope.
+ * Start compiling a module.  The top level code is compiled as the body
+ * of the module's initialization routine, which the linker calls.
  */
-unsigned char createintvar(char *name,
-                           enum types type,
-                           unsigned char isarray,
-                           int sz, int value, int bodyptr)
+void modstart()
 {
-    int i;
-    int val;
-    var_t *v;
-    unsigned char arrinitmode;  /* STRG_INIT means string initializer, LIST_INIT means list initializer */
-    unsigned char local = 1;
-    unsigned char isconst = 0;
+    moddatasz = 0;
+    ndrelocs = 0;
+#ifdef INITDATA
+    datasafe = 0;               /* Globals are not on the call stack */
+#endif
+    emit(VM_SPTOFP);
+    modretpc = 0;
+}
 
-    v = findintvar(name, &local);       /* local = 1, so only search local scope */
+/*
+ * Return from the initialization routine of a module.
+ */
+void modreturn()
+{
+    emitldi(0);
+    emit(VM_FPTOSP);
+    emit(VM_RTS);
+    modretpc = rtPC;
+}
 
-    if (v) {
-        error(ERR_REDEF);
-        return 1;
-    }
+/*
+ * Allocate bytes of static data for a global in a module.
+ * Returns the address it is built for.
+ */
+unsigned int modstatic(unsigned int bytes)
+{
+    modlast = MODDATAADDR + moddatasz;
+    moddatasz += bytes;
+    return modlast;
+}
 
-    if (sz < 1) {
-        error(ERR_DIM);
-        return 1;
+/*
+ * Emit instruction with an immediate operand which is the address of a
+ * global.  In a module this is static data, so the word is added to the
+ * data relocation table.
+ */
+void emit_data(enum bytecode code, int word)
+{
+    emit_imm(code, word);
+    if (modcomp) {
+        moddreloc(rtPC - 2);
     }
+}
 
-    if (type == TYPE_CONST) {
+/*
+ * Add addr, which holds the address of static data, to the data
+ * relocation table.
+ * Returns 0 on success, 1 if out of memory.
+ */
+unsigned char moddreloc(unsigned int addr)
+{
+    unsigned int *p;
+
+    if (ndrelocs == drelocsz) {
+        p = realloc(drelocs, (drelocsz + 64) * sizeof(unsigned int));
+        if (!p) {
+            error(ERR_COMPLEX);
+            return 1;
+        }
+        drelocs = p;
+        drelocsz += 64;
+    }
+    drelocs[ndrelocs++] = addr;
+    return 0;
+}
+
+#endif
+
+#ifdef INITDATA
+
+/*
+ * Empty the data section.  Call this when compilation starts.
+ */
+void initdata_clear()
+{
+    datalo = 0xffff;
+    datahi = 0;
+    datasafe = 1;
+}
+
+/*
+ * Put the initializer at txtPtr for the global array at target address
+ * bodyptr into the data section, if possible.  On success txtPtr is left
+ * in the same place as code generation for the initializer would leave
+ * it.  sz is the number of elements in the array.
+ * The array's memory is reserved by the program when it runs, so this is
+ * only possible until the first call is compiled, because the call stack
+ * below the array is in use after that.
+ * Arrays initialized to all zeros are left to the code which pushes them,
+ * which is shorter than their data.
+ * Returns 1 if the initializer was placed in the data section, 0 if code
+ * must be generated for it, 2 on error.
+ */
+unsigned char initdata(enum types type, int sz, unsigned char arrinitmode,
+                       int bodyptr)
+{
+    char *p;
+    unsigned char *q;
+    unsigned int bytes = ((type == TYPE_LONG) ? 4 * sz : ((type == TYPE_WORD) ? 2 * sz : sz));
+    char *start = txtPtr;
+    int val;
+    int i;
+    unsigned char nonzero = 0;
+    unsigned char oldcompile = compile;
+
+    if (!datasafe) {
+        return 0;
+    }
+    if (arrinitmode == LIST_INIT) {
+        /* Only constants - no variables or calls */
+#ifdef CBM
+        for (p = txtPtr; *p && (*p != ']'); ++p) {
+#else
+        for (p = txtPtr; *p && (*p != '}'); ++p) {
+#endif
+            if ((*p == '\'') && *(p + 1) && (*(p + 2) == '\'')) {
+                p += 2;
+            } else if (*p == '$') {
+                while (isdigitch(*(p + 1)) ||
+                       ((*(p + 1) >= 'a') && (*(p + 1) <= 'f')) ||
+                       ((*(p + 1) >= 'A') && (*(p + 1) <= 'F'))) {
+                    ++p;
+                }
+            } else if (isalphach(*p)) {
+                return 0;
+            }
+        }
+    }
+    if (!dataimg) {
+        dataimg = malloc(RTCALLSTACKTOP - RTCALLSTACKLIM + 1);
+        if (!dataimg) {
+            return 0;
+        }
+    }
+
+    /* Zero fill, as when the array is pushed onto the call stack */
+    q = dataimg + bodyptr - RTCALLSTACKLIM;
+    memset(q, 0, bytes);
+    if (arrinitmode == STRG_INIT) {
+        --sz;                   /* Leave space for final null */
+    }
+
+    for (i = 0; i < sz; ++i) {
+        if (arrinitmode == STRG_INIT) {
+            if (*txtPtr == '"') {
+                break;
+            }
+            val = *txtPtr++;
+        } else {
+#ifdef CBM
+            if (*txtPtr == ']')
+#else
+            if (*txtPtr == '}')
+#endif
+            {
+                break;
+            }
+            onlyconstants = 1;
+            compile = 0;
+            if (eval(0, &val)) {
+                onlyconstants = 0;
+                compile = oldcompile;
+                return 2;
+            }
+            onlyconstants = 0;
+            compile = oldcompile;
+            eatspace();
+            if (*txtPtr == ',') {
+                ++txtPtr;
+            }
+            eatspace();
+        }
+        if (type == TYPE_LONG) {
+            q[4 * i] = val & 0xff;
+            q[4 * i + 1] = (val >> 8) & 0xff;
+            q[4 * i + 2] = (val >> 16) & 0xff;
+            q[4 * i + 3] = (val >> 24) & 0xff;
+        } else if (type == TYPE_WORD) {
+            q[2 * i] = val & 0xff;
+            q[2 * i + 1] = (val >> 8) & 0xff;
+        } else {
+            q[i] = val;
+        }
+        nonzero |= (val != 0);
+    }
+    if (!nonzero) {
+        txtPtr = start;
+        return 0;
+    }
+
+    if ((unsigned int) bodyptr < datalo) {
+        datalo = bodyptr;
+    }
+    if (bodyptr + bytes > datahi) {
+        datahi = bodyptr + bytes;
+    }
+    return 1;
+}
+
+#endif
+/*
+ * Create new integer variable (either word or byte, scalar or array)
+ *
+ * name is the variable name
+ * type specifies if it is a word (TYPE_WORD) variable, a byte variable
+ * (TYPE_BYTE), a long variable (TYPE_LONG) or a constant (TYPE_CONST).
+ * The interpreter stores longs exactly like words.
+ * isarray is 0 for scalar variable, 1 for array variable
+ * sz is the size (for an array only)
+ * value is the initializer (for a scalar only)  TODO: Can save a word of arguments here!!!!!
+ * bodyptr is used when allocating arrays.  If bodyptr is null then the
+ * function will allocate space for the array data block, following the
+ * array header.  If, on the other hand, a non-null pointer is passed then
+ * only the array header will be allocated and the pointer will be stored
+ * as the pointer to the array data block.  This allows array pass-by-reference
+ * semantics.
+ * 
+ * Return 0 on success, 1 if error.
+ *
+ * New variable is appended to table, which adds it to the innermost scope.
+ */
+unsigned char createintvar(char *name,
+                           enum types type,
+                           unsigned char isarray,
+                           int sz, int value, int bodyptr)
+{
+    int i;
+    int val;
+    var_t *v;
+    unsigned char arrinitmode;  /* STRG_INIT means string initializer, LIST_INIT means list initializer */
+    unsigned char local = 1;
+    unsigned char isconst = 0;
+#ifdef INITDATA
+    unsigned char indata;
+#endif
+
+    v = findintvar(name, &local);       /* local = 1, so only search local scope */
+
+    if (v) {
+        error(ERR_REDEF);
+        return 1;
+    }
+
+    if (sz < 1) {
+        error(ERR_DIM);
+        return 1;
+    }
+
+    if (type == TYPE_CONST) {
         isconst = 1;
         type = TYPE_WORD;
     }
@@ -2256,6 +3549,18 @@ unsigned char createintvar(char *name,
             if (isconst) {
                 /* Store value of const.  No code generation. */
                 *getptrtoscalarword(v) = value;
+#ifdef MODULES
+            } else if (modcomp && !compilingsub) {
+                /* Static data, value is on the eval stack */
+                *getptrtoscalarword(v) = modstatic((type == TYPE_LONG) ? 4 : ((type == TYPE_WORD) ? 2 : 1));
+                emit_data((type == TYPE_LONG) ? VM_STALIMM :
+                          ((type == TYPE_WORD) ? VM_STAWORDIMM : VM_STABYTEIMM), *getptrtoscalarword(v));
+#endif
+            } else if (type == TYPE_LONG) {
+                /* Value is on the eval stack, high word on top */
+                *getptrtoscalarword(v) = (compilingsub ? (rt_push_callstack(4) - rtFP) : (rt_push_callstack(4) + 1));
+                emit(VM_PSHWORD);
+                emit(VM_PSHWORD);
             } else if (type == TYPE_WORD) {
                 /* Relative if compiling sub, absolute otherwise */
                 *getptrtoscalarword(v) = (compilingsub ? (rt_push_callstack(2) - rtFP) : (rt_push_callstack(2) + 1));
@@ -2266,9 +3571,12 @@ unsigned char createintvar(char *name,
                 emit(VM_PSHBYTE);
             }
         } else {
-            if (type == TYPE_WORD) {
+            if (isconst) {
                 v = alloc1(sizeof(var_t) + sizeof(int));
                 *getptrtoscalarword(v) = value;
+            } else if (type != TYPE_BYTE) {
+                v = alloc1(sizeof(var_t) + sizeof(int));
+                *getptrtoscalarword(v) = storeval(type, value);
             } else {
                 v = alloc1(sizeof(var_t) + sizeof(unsigned char));
                 *getptrtoscalarbyte(v) = value;
@@ -2313,7 +3621,22 @@ unsigned char createintvar(char *name,
             if (compile) {
 
                 v = alloc1(sizeof(var_t) + 2 * sizeof(int));
-                if (type == TYPE_WORD) {
+#ifdef TAILCALL
+                if (compilingsub) {
+                    /* Pointers into the frame are made to arrays */
+                    tailsafe = 0;
+                }
+#endif
+#ifdef MODULES
+                if (modcomp && !compilingsub) {
+                    /* Static data, which is already zero filled */
+                    bodyptr = modstatic((type == TYPE_LONG) ? 4 * sz : ((type == TYPE_WORD) ? 2 * sz : sz));
+                } else
+#endif
+                if (type == TYPE_LONG) {
+                    /* Relative if compiling sub, absolute otherwise */
+                    bodyptr = (compilingsub ? (rt_push_callstack(sz * 4) - rtFP) : (rt_push_callstack(sz * 4) + 1));
+                } else if (type == TYPE_WORD) {
                     /* Relative if compiling sub, absolute otherwise */
                     bodyptr = (compilingsub ? (rt_push_callstack(sz * 2) - rtFP) : (rt_push_callstack(sz * 2) + 1));
                 } else {
@@ -2321,19 +3644,36 @@ unsigned char createintvar(char *name,
                     bodyptr = (compilingsub ? (rt_push_callstack(sz) - rtFP) : (rt_push_callstack(sz) + 1));
                 }
 
+#ifdef INITDATA
+                indata = (compilingsub ? 0 : initdata(type, sz, arrinitmode, bodyptr));
+                if (indata == 2) {
+                    return 1;
+                }
+                if (indata) {
+                    /* Just reserve the space, the data is already there */
+                    emitldi(-((type == TYPE_LONG) ? 4 * sz : ((type == TYPE_WORD) ? 2 * sz : sz)));
+                    emit(VM_DISCARD);
+                } else {
+#endif
                 /*
                  * The following generates code to allocate the array
                  * TODO: This is not very efficient. Need a VM instruction to allocate a block.
                  */
-                emitldi(sz);
+#ifdef MODULES
+                if (!modcomp || compilingsub) {
+#endif
+                emitldi((type == TYPE_LONG) ? 2 * sz : sz);
                 emit(VM_DEC);
                 emit(VM_DUP);
                 emitldi(0);     /* Value to fill with */
-                emit((type == TYPE_WORD) ? VM_PSHWORD : VM_PSHBYTE);
+                emit((type == TYPE_BYTE) ? VM_PSHBYTE : VM_PSHWORD);
                 emitldi(0);
                 emit(VM_NEQL);
                 emit_imm(VM_BRNCHIMM, rtPC - 10);
                 emit(VM_DROP);
+#ifdef MODULES
+                }
+#endif
 
                 /*
                  * Initialize array
@@ -2346,7 +3686,12 @@ unsigned char createintvar(char *name,
                 for (i = 0; i < sz; ++i) {
                     if (arrinitmode == STRG_INIT) {
                         emitldi((*txtPtr == '"') ? 0 : *txtPtr);
-                        ((type == TYPE_WORD) ? civ_st_rel_word(i) : civ_st_rel_byte(i));
+                        if (type == TYPE_LONG) {
+                            emitldi(0);
+                            civ_st_rel_long(i);
+                        } else {
+                            ((type == TYPE_WORD) ? civ_st_rel_word(i) : civ_st_rel_byte(i));
+                        }
                         if (*txtPtr == '"') {
                             break;
                         }
@@ -2360,10 +3705,17 @@ unsigned char createintvar(char *name,
                         {
                             break;
                         }
+                        if (type == TYPE_LONG) {
+                            evalwant = EVAL_LONG;
+                        }
                         if (eval(0, &val)) {
                             return 1;
                         }
-                        ((type == TYPE_WORD) ? civ_st_rel_word(i) : civ_st_rel_byte(i));
+                        if (type == TYPE_LONG) {
+                            civ_st_rel_long(i);
+                        } else {
+                            ((type == TYPE_WORD) ? civ_st_rel_word(i) : civ_st_rel_byte(i));
+                        }
                         eatspace();
                         if (*txtPtr == ',') {
                             ++txtPtr;
@@ -2371,13 +3723,19 @@ unsigned char createintvar(char *name,
                         eatspace();
                     }
                 }
+#ifdef INITDATA
+                }
+                if (indata && (arrinitmode == STRG_INIT)) {
+                    --sz;       /* Balance the hack below */
+                }
+#endif
             } else {
-                if (type == TYPE_WORD) {
+                if (type != TYPE_BYTE) {
                     v = alloc1(sizeof(var_t) + (sz + 2) * sizeof(int));
                 } else {
                     v = alloc1(sizeof(var_t) + 2 * sizeof(int) + sz * sizeof(unsigned char));
                 }
-                bodyptr = (int) ((unsigned char *) v + sizeof(var_t) + 2 * sizeof(int));
+                bodyptr = ADDR((unsigned char *) v + sizeof(var_t) + 2 * sizeof(int));
 
                 /*
                  * Initialize array
@@ -2414,10 +3772,10 @@ unsigned char createintvar(char *name,
                             eatspace();
                         }
                     }
-                    if (type == TYPE_WORD) {
-                        *((int *) bodyptr + i) = val;
+                    if (type != TYPE_BYTE) {
+                        *((int *) PTR(bodyptr) + i) = storeval(type, val);
                     } else {
-                        *((unsigned char *) bodyptr + i) = val;
+                        *(PTR(bodyptr) + i) = val;
                     }
                 }
             }
@@ -2445,7 +3803,7 @@ unsigned char createintvar(char *name,
         }
 
         /* Store pointer to payload */
-        *(int *) ((unsigned char *) v + sizeof(var_t)) = (int) bodyptr;
+        *(int *) ((unsigned char *) v + sizeof(var_t)) = bodyptr;
 
         /* Store size */
         *(int *) ((unsigned char *) v + sizeof(var_t) + sizeof(int)) = sz;
@@ -2455,6 +3813,10 @@ unsigned char createintvar(char *name,
     v->type = (isconst << 5) | (isarray << 4) | type;
     v->next = NULL;
 
+#ifdef EXPRCACHE
+    exprcache_newvar();
+#endif
+
     if (varsend) {
         varsend->next = v;
     }
@@ -2473,12 +3835,24 @@ unsigned char createintvar(char *name,
  */
 void vars_markcallframe()
 {
+    var_t *prevframe = NULL;
+
     ++calllevel;
-    varslocal = alloc1(sizeof(var_t) + sizeof(int));
+    if (varslocal && (varslocal->name[0] == '-')) {
+        prevframe = varslocal;
+    }
+#ifdef EXPRCACHE
+    varslocal = alloc1(sizeof(var_t) + 2 * sizeof(var_t *) + sizeof(unsigned int));
+    *(getptrtoframegen(varslocal)) = varsgen;   /* Caller's generation */
+    exprcache_newgen();
+#else
+    varslocal = alloc1(sizeof(var_t) + 2 * sizeof(var_t *));
+#endif
     strncpy(varslocal->name, "----", VARNUMCHARS);
     varslocal->type = TYPE_WORD;
     varslocal->next = NULL;
-    *(getptrtoscalarword(varslocal)) = (int) varsend;   /* Store pointer to previous in value */
+    *(getptrtoframelink(varslocal)) = varsend;  /* Store pointer to previous in value */
+    *(getptrtoframelink(varslocal) + 1) = prevframe;    /* And previous frame */
     if (varsend) {
         varsend->next = varslocal;
     }
@@ -2493,14 +3867,17 @@ void vars_markcallframe()
  */
 void vars_deletecallframe()
 {
-    var_t *newend = (void *) *(getptrtoscalarword(varslocal));  /* Recover pointer */
+    var_t *newend = *(getptrtoframelink(varslocal));    /* Recover pointer */
     var_t *v = varslocal;
 
+#ifdef EXPRCACHE
+    varsgen = *(getptrtoframegen(v));
+#endif
     /* Free the local variables */
     if (!newend) {
         CLEARHEAP1();
     } else {
-        free1((int) newend - (int) varsend);
+        free1((unsigned char *) newend - (unsigned char *) varsend);
     }
 
     if (newend) {
@@ -2512,14 +3889,7 @@ void vars_deletecallframe()
     --calllevel;
 
     /* Set varslocal to previous stack frame or NULL if none */
-    varslocal = NULL;
-    v = varsbegin;
-    while (v) {
-        if (v->name[0] == '-') {
-            varslocal = v;
-        }
-        v = v->next;
-    }
+    varslocal = *(getptrtoframelink(v) + 1);
 }
 
 /* Factored out to save a few bytes
@@ -2543,7 +3913,8 @@ void siv_st_rel(unsigned char type)
  */
 void siv_st_abs_imm(unsigned int addr, unsigned char type)
 {
-    emit_imm(((type & 0x0f) == TYPE_WORD) ? VM_STAWORDIMM : VM_STABYTEIMM, addr);
+    emit_data(((type & 0x0f) == TYPE_LONG) ? VM_STALIMM :
+             (((type & 0x0f) == TYPE_WORD) ? VM_STAWORDIMM : VM_STABYTEIMM), addr);
 }
 
 /* Factored out to save a few bytes
@@ -2551,7 +3922,8 @@ void siv_st_abs_imm(unsigned int addr, unsigned char type)
  */
 void siv_st_rel_imm(unsigned int addr, unsigned char type)
 {
-    emit_imm(((type & 0x0f) == TYPE_WORD) ? VM_STRWORDIMM : VM_STRBYTEIMM, addr);
+    emit_imm(((type & 0x0f) == TYPE_LONG) ? VM_STRLIMM :
+             (((type & 0x0f) == TYPE_WORD) ? VM_STRWORDIMM : VM_STRBYTEIMM), addr);
 }
 
 /*
@@ -2568,7 +3940,7 @@ unsigned char setintvar(char *name, int idx, int value)
 {
     unsigned char isarray;
     unsigned char type;
-    void *bodyptr;
+    int bodyaddr;
     unsigned char local = 0;
 
     var_t *ptr = findintvar(name, &local);
@@ -2609,8 +3981,8 @@ unsigned char setintvar(char *name, int idx, int value)
                 siv_st_abs_imm(*getptrtoscalarword(ptr), type);
             }
         } else {
-            if (type == TYPE_WORD) {
-                *getptrtoscalarword(ptr) = value;
+            if (type != TYPE_BYTE) {
+                *getptrtoscalarword(ptr) = storeval(type, value);
             } else {
                 *getptrtoscalarbyte(ptr) = value;
             }
@@ -2624,16 +3996,44 @@ unsigned char setintvar(char *name, int idx, int value)
             error(ERR_SUBSCR);
             return 1;
         }
-        bodyptr = (void *) *(int *) ((unsigned char *) ptr + sizeof(var_t));
+        bodyaddr = *(int *) ((unsigned char *) ptr + sizeof(var_t));
 
-        if (compile) {
+#ifdef FARMEM
+        if (ptr->type & 0x40) {
+            if (compile) {
+                /* Far address was computed by assignorcreate(), below the value */
+                emit((type == TYPE_WORD) ? VM_STFW : VM_STFB);
+                return 0;
+            }
+            if ((idx < 0) || (idx >= *(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)))) {
+                error(ERR_SUBSCR);
+                return 1;
+            }
+            if (type == TYPE_WORD) {
+                fardata[bodyaddr + idx * 2] = value & 0xff;
+                fardata[bodyaddr + idx * 2 + 1] = (value >> 8) & 0xff;
+            } else {
+                fardata[bodyaddr + idx] = value;
+            }
+            return 0;
+        }
+#endif
+
+        if (compile && (type == TYPE_LONG)) {
+            /* Address was computed by assignorcreate(), below the value */
+            emit(VM_STAL);
+        } else if (compile) {
             /* *** Index is on the stack (X) */
             emit(VM_SWAP);
             if (type == TYPE_WORD) {
                 emitldi(1);
                 emit(VM_LSH);
             }
-            emitldi((int) ((int *) bodyptr));
+            if (local && compilingsub) {
+                emitldi(bodyaddr);
+            } else {
+                emit_data(VM_LDIMM, bodyaddr);
+            }
             /*
              * If the array size field is -1, this means the bodyptr is a
              * pointer to a pointer to the body (rather than pointer to
@@ -2657,10 +4057,10 @@ unsigned char setintvar(char *name, int idx, int value)
                 error(ERR_SUBSCR);
                 return 1;
             }
-            if (type == TYPE_WORD) {
-                *((int *) bodyptr + idx) = value;
+            if (type != TYPE_BYTE) {
+                *((int *) PTR(bodyaddr) + idx) = storeval(type, value);
             } else {
-                *((unsigned char *) bodyptr + idx) = value;
+                *(PTR(bodyaddr) + idx) = value;
             }
         }
     }
@@ -2673,7 +4073,8 @@ unsigned char setintvar(char *name, int idx, int value)
  */
 void giv_ld_abs(unsigned char type)
 {
-    (((type & 0x0f) == TYPE_WORD) ? emit(VM_LDAWORD) : emit(VM_LDABYTE));
+    (((type & 0x0f) == TYPE_LONG) ? emit(VM_LDAL) :
+     (((type & 0x0f) == TYPE_WORD) ? emit(VM_LDAWORD) : emit(VM_LDABYTE)));
 }
 
 /* Factored out to save a few bytes
@@ -2681,6 +4082,11 @@ void giv_ld_abs(unsigned char type)
  */
 void giv_ld_rel(unsigned char type)
 {
+    if ((type & 0x0f) == TYPE_LONG) {
+        emit(VM_RTOA);
+        emit(VM_LDAL);
+        return;
+    }
     (((type & 0x0f) == TYPE_WORD) ? emit(VM_LDRWORD) : emit(VM_LDRBYTE));
 }
 
@@ -2689,7 +4095,8 @@ void giv_ld_rel(unsigned char type)
  */
 void giv_ld_abs_imm(unsigned int addr, unsigned char type)
 {
-    emit_imm(((type & 0x0f) == TYPE_WORD) ? VM_LDAWORDIMM : VM_LDABYTEIMM, addr);
+    emit_data(((type & 0x0f) == TYPE_LONG) ? VM_LDALIMM :
+             (((type & 0x0f) == TYPE_WORD) ? VM_LDAWORDIMM : VM_LDABYTEIMM), addr);
 }
 
 /* Factored out to save a few bytes
@@ -2697,7 +4104,100 @@ void giv_ld_abs_imm(unsigned int addr, unsigned char type)
  */
 void giv_ld_rel_imm(unsigned int addr, unsigned char type)
 {
-    emit_imm(((type & 0x0f) == TYPE_WORD) ? VM_LDRWORDIMM : VM_LDRBYTEIMM, addr);
+    emit_imm(((type & 0x0f) == TYPE_LONG) ? VM_LDRLIMM :
+             (((type & 0x0f) == TYPE_WORD) ? VM_LDRWORDIMM : VM_LDRBYTEIMM), addr);
+}
+
+/*
+ * Fetch value of integer variable which has already been looked up.
+ * This is used by the interpreter only.
+ * ptr points to the variable table entry
+ * idx is the index into an array. -1 means subscript not given.
+ * Returns the value (or the address) in val.
+ * address if set to 1 then address is returned, not value
+ * Return 0 if successful, 1 on error
+ */
+unsigned char getvarval(var_t *ptr,
+                        int idx, int *val, unsigned char address)
+{
+    unsigned char type = ptr->type;
+    int bodyaddr;
+
+    if (!(type & 0x10)) {
+        /*
+         * Scalars
+         */
+        if (idx != -1) {
+            /* Means [..] subscript was provided */
+            error(ERR_SUBSCR);
+            return 1;
+        }
+        if ((type & 0x0f) != TYPE_BYTE) {
+            if (address) {
+                *val = ADDR(getptrtoscalarword(ptr));
+            } else {
+                *val = *getptrtoscalarword(ptr);
+            }
+        } else {
+            if (address) {
+                *val = ADDR(getptrtoscalarbyte(ptr));
+            } else {
+                *val = *getptrtoscalarbyte(ptr);
+            }
+        }
+    } else {
+        /*
+         * Arrays
+         * Note the special cases, for an array A:
+         * 1) &A is the same as &A[0]
+         * 2) A is the same as &A[0]
+         * This second case is needed to make the eval() work propertly
+         * for array pass-by-reference.
+         */
+        if (idx == -1) {
+            /* Means [..] subscript was never provided */
+            address = 1;
+            idx = 0;
+        }
+        bodyaddr = *(int *) ((unsigned char *) ptr + sizeof(var_t));
+
+        if ((idx < 0) || (idx >= *(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)))) {
+            error(ERR_SUBSCR);
+            return 1;
+        }
+
+#ifdef FARMEM
+        if (type & 0x40) {
+            /* Far arrays have no address in the 64K address space */
+            if (address) {
+                error(ERR_TYPE);
+                return 1;
+            }
+            if ((type & 0x0f) != TYPE_BYTE) {
+                *val = fardata[bodyaddr + idx * 2] | (fardata[bodyaddr + idx * 2 + 1] << 8);
+            } else {
+                *val = fardata[bodyaddr + idx];
+            }
+            return 0;
+        }
+#endif
+
+        if ((type & 0x0f) != TYPE_BYTE) {
+            if (address) {
+                *val = bodyaddr + idx * sizeof(int);
+            } else {
+                *val = *((int *) PTR(bodyaddr) + idx);
+            }
+        } else {
+            if (address) {
+                *val = bodyaddr + idx;
+            } else {
+                *val = *(PTR(bodyaddr) + idx);
+            }
+        }
+    }
+
+    return 0;
 }
 
 /*
@@ -2705,7 +4205,7 @@ void giv_ld_rel_imm(unsigned int addr, unsigned char type)
  * name is the variable name
  * idx is the index into an array. -1 means subscript not given.
  * Returns the value (or the address) in val.
- * Return the type TYPE_BYTE or TYPE_WORD in type.
+ * Return the type TYPE_BYTE, TYPE_WORD or TYPE_LONG in type.
  * address if set to 1 then address is returned, not value
  * Return 0 if successful, 1 on error
  *
@@ -2718,7 +4218,7 @@ unsigned char getintvar(char *name,
                         unsigned char *type, unsigned char address)
 {
     unsigned char isarray;
-    void *bodyptr;
+    int bodyaddr;
     unsigned char local = 0;
 
     var_t *ptr = findintvar(name, &local);
@@ -2740,6 +4240,10 @@ unsigned char getintvar(char *name,
         return 0;
     }
 
+    if (!compile) {
+        return getvarval(ptr, idx, val, address);
+    }
+
     if (!isarray) {
         /*
          * Scalars
@@ -2749,120 +4253,419 @@ unsigned char getintvar(char *name,
             error(ERR_SUBSCR);
             return 1;
         }
-        if (compile) {
-            /*
-             * When we are at the top level scope (global scope), all
-             * variables are globals and we use ABSOLUTE addressing.
-             * When we are at function scope, globals still use
-             * ABSOLUTE addressing, but locals are addressed RELATIVE
-             * to the frame pointer.
-             */
-            if (address) {
-                emitldi(*getptrtoscalarword(ptr));
-                if (local && compilingsub) {
-                    emit(VM_RTOA);
-                }
+        /*
+         * When we are at the top level scope (global scope), all
+         * variables are globals and we use ABSOLUTE addressing.
+         * When we are at function scope, globals still use
+         * ABSOLUTE addressing, but locals are addressed RELATIVE
+         * to the frame pointer.
+         */
+        if (address) {
+            if (local && compilingsub) {
+#ifdef TAILCALL
+                /* Pointer into the frame */
+                tailsafe = 0;
+#endif
+                emitldi(*getptrtoscalarword(ptr));
+                emit(VM_RTOA);
             } else {
-                if (local && compilingsub) {
-                    giv_ld_rel_imm(*getptrtoscalarword(ptr), *type);
-                } else {
-                    giv_ld_abs_imm(*getptrtoscalarword(ptr), *type);
-                }
+                emit_data(VM_LDIMM, *getptrtoscalarword(ptr));
             }
         } else {
-            if ((*type & 0x0f) == TYPE_WORD) {
-                if (address) {
-                    *val = (int) getptrtoscalarword(ptr);
-                } else {
-                    *val = *getptrtoscalarword(ptr);
-                }
+            if (local && compilingsub) {
+                giv_ld_rel_imm(*getptrtoscalarword(ptr), *type);
             } else {
-                if (address) {
-                    *val = (int) getptrtoscalarbyte(ptr);
-                } else {
-                    *val = *getptrtoscalarbyte(ptr);
-                }
+                giv_ld_abs_imm(*getptrtoscalarword(ptr), *type);
             }
         }
     } else {
         /*
-         * Arrays
-         * Note the special cases, for an array A:
-         * 1) &A is the same as &A[0]
-         * 2) A is the same as &A[0]
-         * This second case is needed to make the eval() work propertly
-         * for array pass-by-reference.
+         * Arrays - see getvarval() for the special cases
          */
-        if (idx == -1) {
-            /* Means [..] subscript was never provided */
-            address = 1;
-            idx = 0;
-            if (compile) {
-                emitldi(0);
-            }
-        }
-        bodyptr =
-            (void *) *(int *) ((unsigned char *) ptr + sizeof(var_t));
-
-        if (compile) {
-            /* *** Index is on the stack (X) *** */
-            if ((*type & 0x0f) == TYPE_WORD) {
-                emitldi(1);
-                emit(VM_LSH);
-            }
-            emitldi((int) ((int *) bodyptr));
+#ifdef FARMEM
+        if (*type & 0x40) {
             /*
-             * If the array size field is -1, this means the bodyptr is a
-             * pointer to a pointer to the body (rather than pointer to
-             * the body), so it needs to be dereferenced one more time.
+             * Far arrays.  Long index is on the stack (LX).  Leave the far
+             * address if address is set, otherwise load the element.
              */
-            if (*(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)) == -1) {
-                emit(VM_LDRWORD);
+            if (idx == -1) {
+                error(ERR_TYPE);
+                return 1;
             }
-            emit(VM_ADD);
+            if ((*type & 0x0f) == TYPE_WORD) {
+                emit(VM_DUP2);
+                emit(VM_ADDL);
+            }
+            bodyaddr = *(int *) ((unsigned char *) ptr + sizeof(var_t));
+            emitldi(bodyaddr & 0xffff);
+            emitldi((unsigned int) bodyaddr >> 16);
+            emit(VM_ADDL);
             if (!address) {
-                if (local && compilingsub) {
-                    if (*(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)) == -1) {
-                        giv_ld_abs(*type);
-                    } else {
-                        giv_ld_rel(*type);
-                    }
-                } else {
+                emit(((*type & 0x0f) == TYPE_WORD) ? VM_LDFW : VM_LDFB);
+            }
+            return 0;
+        }
+#endif
+        if (idx == -1) {
+            /* Means [..] subscript was never provided */
+            address = 1;
+            emitldi(0);
+        }
+        bodyaddr = *(int *) ((unsigned char *) ptr + sizeof(var_t));
+
+        /* *** Index is on the stack (X) *** */
+        if ((*type & 0x0f) == TYPE_LONG) {
+            emitldi(2);
+            emit(VM_LSH);
+        } else if ((*type & 0x0f) == TYPE_WORD) {
+            emitldi(1);
+            emit(VM_LSH);
+        }
+        if (local && compilingsub) {
+            emitldi(bodyaddr);
+        } else {
+            emit_data(VM_LDIMM, bodyaddr);
+        }
+        /*
+         * If the array size field is -1, this means the bodyptr is a
+         * pointer to a pointer to the body (rather than pointer to
+         * the body), so it needs to be dereferenced one more time.
+         */
+        if (*(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)) == -1) {
+            emit(VM_LDRWORD);
+        }
+        emit(VM_ADD);
+        if (!address) {
+            if (local && compilingsub) {
+                if (*(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)) == -1) {
                     giv_ld_abs(*type);
+                } else {
+                    giv_ld_rel(*type);
                 }
             } else {
-                if (local && compilingsub) {
-                    if (*(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)) != -1) {
-                        /* Convert to absolute address */
-                        emit(VM_RTOA);
-                    }
-                }
+                giv_ld_abs(*type);
             }
         } else {
-            if ((idx < 0) || (idx >= *(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)))) {
-                error(ERR_SUBSCR);
-                return 1;
+            if (local && compilingsub) {
+                if (*(int *) ((unsigned char *) ptr + sizeof(var_t) + sizeof(int)) != -1) {
+                    /* Convert to absolute address */
+                    emit(VM_RTOA);
+                }
             }
+        }
+    }
 
-            if ((*type & 0x0f) == TYPE_WORD) {
-                if (address) {
-                    *val = (int) ((int *) bodyptr + idx);
-                } else {
-                    *val = *((int *) bodyptr + idx);
-                }
-            } else {
-                if (address) {
-                    *val = (int) ((unsigned char *) bodyptr + idx);
-                } else {
-                    *val = *((unsigned char *) bodyptr + idx);
+    return 0;
+}
+
+#ifdef EXPRCACHE
+
+/*************************************************************************/
+/* EXPRESSION CACHE                                                      */
+/*************************************************************************/
+
+/*
+ * The first time the interpreter evaluates an expression in a program
+ * line, the sequence of operations performed by the shunting-yard parser
+ * is recorded in postfix (RPN) form, with variable references resolved to
+ * their variable table entries.  Subsequent evaluations of the same
+ * expression replay the RPN code and skip the parser entirely.
+ *
+ * Entries are keyed on the line and the offset of the expression within
+ * the line.  The whole cache is flushed whenever the program is edited.
+ * Entries record the generation of the variable table seen from the scope
+ * they were recorded in (varsgen), and are re-recorded if that has changed,
+ * for example because a local has been created since, or the expression is
+ * in a sub which has since returned and been called again.  Calls made
+ * from a scope leave its entries current.  Expressions containing function
+ * calls are not cached (a negative entry with no ops is stored instead).
+ */
+
+/*
+ * RPN opcodes.  Anything else is an operator token.
+ */
+#define RPN_CONST   1           /* Push constant                   */
+#define RPN_VAR     2           /* Push scalar variable            */
+#define RPN_VARADDR 3           /* Push address of scalar variable */
+#define RPN_ELEM    4           /* Pop index, push array element   */
+#define RPN_ELEMADDR 5          /* Pop index, push element address */
+
+struct rpnop {
+    unsigned char op;
+    union {
+        int val;
+        var_t *var;
+    } u;
+};
+
+struct exprent {
+    struct lineofcode *line;    /* Line containing the expression     */
+    unsigned char offset;       /* Offset of expression within line   */
+    unsigned char endoffset;    /* Offset of text following the expr  */
+    unsigned char nops;         /* Number of RPN ops, 0 if uncacheable */
+    unsigned char cap;          /* Space allocated for RPN ops         */
+    unsigned int gen;           /* varsgen when recorded               */
+    struct exprent *next;       /* Next entry in hash chain            */
+};
+
+void *exprcache[EXPRCACHESZ / sizeof(void *)];  /* Memory for cache */
+unsigned char *exprcacheptr;    /* Next free byte in cache          */
+struct exprent *exprhash[EXPRHASHSZ];   /* Hash chains              */
+
+struct rpnop exprrec[EXPRRECSZ];        /* Recording buffer         */
+struct rpnop *exprrecptr = NULL;        /* NULL when not recording  */
+
+#define exprhashidx(line, off) ((((uintptr_t) line >> 2) ^ off) & (EXPRHASHSZ - 1))
+
+/*
+ * Offset of txtPtr within the text of current line
+ */
+#ifdef EXTMEM
+#define exproffset() (txtPtr - embuf)
+#else
+#define exproffset() (txtPtr - current->line)
+#endif
+
+/*
+ * Start a new generation of the variable table.  This makes the cached
+ * variable references of expressions evaluated in the current scope stale.
+ */
+void exprcache_newgen()
+{
+    if (!++varsgenlast) {
+        /* Wrapped around - old entries could look current */
+        exprcache_flush();
+    }
+    varsgen = varsgenlast;
+}
+
+/*
+ * Called when a variable has been created.  A new global can not change
+ * what any name already looked up refers to, but a new local may hide a
+ * global of the same name.
+ */
+void exprcache_newvar()
+{
+    if (varslocal && (varslocal->name[0] == '-')) {
+        exprcache_newgen();
+    }
+}
+
+/*
+ * Discard all cached expressions.
+ */
+void exprcache_flush()
+{
+    unsigned char i;
+
+    for (i = 0; i < EXPRHASHSZ; ++i) {
+        exprhash[i] = NULL;
+    }
+    exprcacheptr = (unsigned char *) exprcache;
+    exprrecptr = NULL;
+}
+
+/*
+ * Find the cache entry for the expression at offset off of current line.
+ * Returns NULL if not found.
+ */
+struct exprent *exprcache_find(unsigned char off)
+{
+    struct exprent *e = exprhash[exprhashidx(current, off)];
+
+    while (e) {
+        if ((e->line == current) && (e->offset == off)) {
+            return e;
+        }
+        e = e->next;
+    }
+    return NULL;
+}
+
+/*
+ * Append an op to the recording buffer.
+ * If the recording buffer overflows then the recording is abandoned.
+ */
+void exprcache_rec(unsigned char op, int val)
+{
+    if (!exprrecptr) {
+        return;
+    }
+    if (exprrecptr == exprrec + EXPRRECSZ) {
+        exprrecptr = NULL;
+        return;
+    }
+    exprrecptr->op = op;
+    exprrecptr->u.val = val;
+    ++exprrecptr;
+}
+
+/*
+ * Record an operator token.
+ */
+void exprcache_recop(unsigned char token)
+{
+    exprcache_rec(token, 0);
+}
+
+/*
+ * Record an integer constant.
+ */
+void exprcache_recconst(int val)
+{
+    exprcache_rec(RPN_CONST, val);
+}
+
+/*
+ * Record a variable reference.  Called after getintvar() has succeeded
+ * (so the lookup is known to be good).
+ * If subscripted is 1 then the index is on the operand stack.
+ */
+void exprcache_recvar(char *name, unsigned char subscripted,
+                      unsigned char address)
+{
+    unsigned char local = 0;
+    var_t *v;
+
+    if (!exprrecptr) {
+        return;
+    }
+    v = findintvar(name, &local);
+    if (v->type & 0x10) {
+        if (!subscripted) {
+            /* A is the same as &A[0] */
+            exprcache_recconst(0);
+            address = 1;
+        }
+        exprcache_rec(address ? RPN_ELEMADDR : RPN_ELEM, 0);
+    } else {
+        exprcache_rec(address ? RPN_VARADDR : RPN_VAR, 0);
+    }
+    if (exprrecptr) {
+        (exprrecptr - 1)->u.var = v;
+    }
+}
+
+/*
+ * Abandon the current recording (eg: function call found)
+ */
+void exprcache_abort()
+{
+    exprrecptr = NULL;
+}
+
+/*
+ * Look up the expression at txtPtr.  The offset of the expression within
+ * current line is returned in off.
+ * Returns:
+ *   0: Cache hit. Value has been pushed to operand stack and txtPtr
+ *      advanced past the expression.
+ *   1: Error evaluating cached expression.
+ *   2: Cache miss.  Recording has been started.
+ *   3: Expression can not be cached.  Evaluate as normal.
+ */
+unsigned char exprcache_lookup(unsigned char *off)
+{
+    struct exprent *e;
+    struct rpnop *op;
+    struct rpnop *end;
+    int idx;
+    int val;
+
+    if (exprrecptr) {
+        /* Already recording an enclosing expression */
+        return 3;
+    }
+    *off = exproffset();
+    e = exprcache_find(*off);
+    if (e) {
+        if (!e->nops) {
+            return 3;
+        }
+        if (e->gen == varsgen) {
+            op = (struct rpnop *) (e + 1);
+            end = op + e->nops;
+            for (; op < end; ++op) {
+                switch (op->op) {
+                case RPN_CONST:
+                    push_operand_stack(op->u.val);
+                    break;
+                case RPN_VAR:
+                case RPN_VARADDR:
+                    if (getvarval(op->u.var, -1, &val, op->op - RPN_VAR)) {
+                        return 1;
+                    }
+                    push_operand_stack(val);
+                    break;
+                case RPN_ELEM:
+                case RPN_ELEMADDR:
+                    idx = pop_operand_stack();
+                    if (getvarval(op->u.var, idx, &val, op->op - RPN_ELEM)) {
+                        return 1;
+                    }
+                    push_operand_stack(val);
+                    break;
+                default:
+                    if (apply_operator(op->op)) {
+                        return 1;
+                    }
                 }
             }
+            txtPtr += e->endoffset - *off;
+            return 0;
         }
     }
+    exprrecptr = exprrec;
+    return 2;
+}
 
-    return 0;
+/*
+ * Finish the recording started by exprcache_lookup() for the expression
+ * at offset off in current line, and store it in the cache.  If the
+ * recording was abandoned a negative entry is stored.
+ */
+void exprcache_end(unsigned char off)
+{
+    struct exprent *e = exprcache_find(off);
+    struct exprent **pp;
+    unsigned char nops = 0;
+    unsigned int bytes;
+
+    if (exprrecptr) {
+        nops = exprrecptr - exprrec;
+        exprrecptr = NULL;
+    }
+    if (!e || (e->cap < nops)) {
+        if (e) {
+            /* Unlink stale entry which is too small */
+            pp = &exprhash[exprhashidx(current, off)];
+            while (*pp != e) {
+                pp = &((*pp)->next);
+            }
+            *pp = e->next;
+        }
+        bytes = sizeof(struct exprent) + nops * sizeof(struct rpnop);
+        if (exprcacheptr + bytes > (unsigned char *) exprcache + sizeof(exprcache)) {
+            exprcache_flush();
+            if (bytes > sizeof(exprcache)) {
+                return;
+            }
+        }
+        e = (struct exprent *) exprcacheptr;
+        exprcacheptr += bytes;
+        e->line = current;
+        e->offset = off;
+        e->cap = nops;
+        e->next = exprhash[exprhashidx(current, off)];
+        exprhash[exprhashidx(current, off)] = e;
+    }
+    e->endoffset = exproffset();
+    e->nops = nops;
+    e->gen = varsgen;
+    memcpy(e + 1, exprrec, nops * sizeof(struct rpnop));
 }
 
+#endif
 
 /*
  * Handy defines for return codes
@@ -2877,7 +4680,7 @@ unsigned char getintvar(char *name,
 /*
  * Handles if statement.
  */
-void doif(unsigned char arg)
+void doif(int arg)
 {
 
     /*
@@ -3007,59 +4810,333 @@ unsigned char doendif()
 }
 
 /*************************************************************************/
-/* FOR LOOPS                                                             */
+/* SWITCH / CASE                                                         */
 /*************************************************************************/
 
 /*
- * Routine handles five cases, each of which looks like variable assignment.
- * Doing these all together here makes code easier to maintain and smaller.
+ * Status values in the SWITCH stack frame when interpreting
  */
-#define WORD_MODE  0
-#define BYTE_MODE  1
-#define CONST_MODE 2
-#define LET_MODE   3
-#define FOR_MODE   4
+#define SW_SKIP     0           /* skipFlag was already set                  */
+#define SW_SEARCH   1           /* Looking for the matching case             */
+#define SW_RUN      2           /* Running the matching case                 */
+#define SW_DONE     3           /* Matching case done, skipping the rest     */
+#define SW_DEFAULT  4           /* Bit set once default has been seen        */
+
+#define SWITCHDENSE 3           /* Min cases to compile as a jump table      */
+#define SWITCHLIN   3           /* Max cases to compare one after another    */
 
 /*
- * Handles four cases, according to value of mode:
- *  - WORD_MODE  - declaration of word variable 
- *  - BYTE_MODE  - declaration of byte variable 
- *  - CONST_MODE - declaration of constant
- *  - LET_MODE   - assignment to existing variable
- *  - FOR_MODE   - entry to for loop
- *
- * Handles parsing the following text (mode == WORD_MODE/BYTE_MODE) either:
- *     "var = expr"
- * or, "var[expr1] = expr2"
- * or (mode == CONST_MODE), just:
- *     "var = expr"
- * or (mode == FOR_MODE):
- *     "var = expr2 : expr3"
- * or, "var[expr1] = expr2 : expr3"
- *
- * Returns RET_SUCCESS if no error, RET_ERROR if error
+ * Compiler: record of a case (or default) in a switch statement.
+ * Allocated on the top-down stack in arena 2, like the sub table.
+ */
+struct casetabent {
+    int val;                    /* Case value                                */
+    unsigned int addr;          /* Address of code for the case              */
+    unsigned int endjmp;        /* Operand of jump to end of switch          */
+    unsigned char isdefault;    /* 1 for default                             */
+    struct casetabent *next;
+};
+
+typedef struct casetabent case_t;
+
+/*
+ * Handles switch statement.
  */
-unsigned char assignorcreate(unsigned char mode)
+void doswitch(int arg)
 {
-    int j;
-    int k;
-    unsigned char type;
-    char name[VARNUMCHARS];
-    int i = 0;
-    unsigned char isarray = 0;
-    unsigned char local = 0;
-    unsigned char oldcompile = compile;
+    /*
+     * Place the following on the return stack when interpreting:
+     *   - Magic value SWITCHFRAME
+     *   - Status value, SW_xxx
+     *   - Value of switch expression
+     *
+     * When compiling:
+     *   - Magic value SWITCHFRAME
+     *   - Address of the operand of the jump to the dispatch code, which
+     *     is generated at endswitch once all the cases are known
+     *   - List of cases compiled so far, most recent first
+     *
+     * Compiled code for each case starts by dropping the value of the
+     * switch expression, which the dispatch code leaves on the eval stack.
+     */
+    push_return(SWITCHFRAME);
 
-    if (!txtPtr || !isalphach(*txtPtr)) {
-        error(ERR_VAR);
-        return RET_ERROR;
-    }
-    while (*txtPtr && (isalphach(*txtPtr) || isdigitch(*txtPtr))) {
-        if (i < VARNUMCHARS) {
-            name[i++] = *txtPtr;
-        }
-        ++txtPtr;
-    }
+    if (compile) {
+        /* **** Value of SWITCH expression is on the eval stack **** */
+        push_return(rtPC + 1);
+        emit_imm(VM_JMPIMM, 0xffff);  /* To be filled in later */
+        push_return(0);
+    } else {
+        if (skipFlag) {
+            push_return(SW_SKIP);
+        } else {
+            skipFlag = 1;
+            push_return(SW_SEARCH);
+        }
+        push_return(arg);
+    }
+}
+
+/*
+ * Handles case statement, or default statement if isdefault is 1.
+ * arg is the case value.
+ * Returns RET_SUCCESS if no error, RET_ERROR if error
+ */
+unsigned char docase(int arg, unsigned char isdefault)
+{
+    case_t *c;
+    int status;
+
+    if (return_stack[returnSP + 3] != SWITCHFRAME) {
+        error(ERR_NOSWITCH);
+        return RET_ERROR;
+    }
+
+    if (compile) {
+        c = (case_t *) return_stack[returnSP + 1];
+        if (c) {
+            /* Default must be the last case */
+            if (c->isdefault) {
+                error(ERR_VALUE);
+                return RET_ERROR;
+            }
+            /* Jump from end of the previous case to end of switch */
+            c->endjmp = rtPC + 1;
+            emit_imm(VM_JMPIMM, 0xffff);      /* To be filled in later */
+        }
+        c = alloc2top(sizeof(case_t));
+        c->val = arg;
+        c->addr = rtPC;
+        c->endjmp = 0;
+        c->isdefault = isdefault;
+        c->next = (case_t *) return_stack[returnSP + 1];
+        return_stack[returnSP + 1] = (intptr_t) c;
+        emit(VM_DROP);          /* Switch value */
+    } else {
+        status = return_stack[returnSP + 2];
+        if (status == SW_SKIP) {
+            return RET_SUCCESS;
+        }
+        if (status & SW_DEFAULT) {
+            error(ERR_VALUE);
+            return RET_ERROR;
+        }
+        if (isdefault) {
+            status |= SW_DEFAULT;
+        }
+        switch (status & ~SW_DEFAULT) {
+        case SW_SEARCH:
+            if (isdefault ||
+                ((arg & 0xffff) == (return_stack[returnSP + 1] & 0xffff))) {
+                skipFlag = 0;
+                status = (status & SW_DEFAULT) | SW_RUN;
+            }
+            break;
+        case SW_RUN:
+            skipFlag = 1;
+            status = (status & SW_DEFAULT) | SW_DONE;
+            break;
+        }
+        return_stack[returnSP + 2] = status;
+    }
+    return RET_SUCCESS;
+}
+
+/*
+ * Compiler: emit code to find the case in the sorted array of n cases
+ * starting at cases, for the value on the eval stack, and jump to it.  If
+ * there is none, jump to deflt.  Dense cases use a jump table, sparse ones
+ * a binary search.  The value is left on the eval stack.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+void emitdispatch(case_t **cases, unsigned int n, unsigned int deflt)
+{
+    unsigned int lo;
+    unsigned int span;
+    unsigned int i;
+    unsigned int fixup;
+
+    if (!n) {
+        emit_imm(VM_JMPIMM, deflt);
+        return;
+    }
+
+    lo = cases[0]->val & 0xffff;
+    span = (cases[n - 1]->val & 0xffff) - lo;   /* One less than size */
+
+    if ((n >= SWITCHDENSE) && (span < 2 * n)) {
+        if (lo) {
+            emitldi(lo);
+            emit(VM_SUB);
+        }
+        emit_imm(VM_JMPTAB, span + 1);
+        for (i = 0; i < n; ++i) {
+            while (lo < (cases[i]->val & 0xffff)) {
+                emit_word(deflt);
+                ++lo;
+            }
+            emit_word(cases[i]->addr);
+            ++lo;
+        }
+        emit_imm(VM_JMPIMM, deflt);
+        return;
+    }
+
+    if (n <= SWITCHLIN) {
+        for (i = 0; i < n; ++i) {
+            emit(VM_DUP);
+            emitldi(cases[i]->val);
+            emit(VM_EQL);
+            emit_imm(VM_BRNCHIMM, cases[i]->addr);
+        }
+        emit_imm(VM_JMPIMM, deflt);
+        return;
+    }
+
+    /* Upper half falls through, lower half is branched to */
+    i = n / 2;
+    emit(VM_DUP);
+    emitldi(cases[i]->val);
+    emit(VM_LT);
+    fixup = rtPC + 1;
+    emit_imm(VM_BRNCHIMM, 0xffff);    /* To be filled in later */
+    emitdispatch(cases + i, n - i, deflt);
+    emit_fixup(fixup, rtPC);
+    emitdispatch(cases, i, deflt);
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Handles endswitch statement.
+ * Returns RET_SUCCESS if no error, RET_ERROR if error
+ */
+unsigned char doendswitch()
+{
+    case_t *c;
+    case_t **cases;
+    unsigned int n = 0;
+    unsigned int i;
+    unsigned int j;
+    unsigned int deflt;
+
+    if (return_stack[returnSP + 3] != SWITCHFRAME) {
+        error(ERR_NOSWITCH);
+        return RET_ERROR;
+    }
+
+    if (compile) {
+        c = (case_t *) return_stack[returnSP + 1];
+
+        /* If there is no default, add one which does nothing */
+        if (!c || !c->isdefault) {
+            if (docase(0, 1)) {
+                return RET_ERROR;
+            }
+            c = (case_t *) return_stack[returnSP + 1];
+        }
+        deflt = c->addr;
+        c->endjmp = rtPC + 1;
+        emit_imm(VM_JMPIMM, 0xffff);  /* To be filled in later */
+
+        /* Dispatch code goes here */
+        emit_fixup(return_stack[returnSP + 2], rtPC);
+
+        /* Sort the cases by value, as the VM compares them (unsigned) */
+        for (c = c->next; c; c = c->next) {
+            ++n;
+        }
+        cases = alloc2top(n * sizeof(case_t *) + 1);
+        c = ((case_t *) return_stack[returnSP + 1])->next;
+        for (i = 0; c; c = c->next, ++i) {
+            for (j = i; j && ((cases[j - 1]->val & 0xffff) >=
+                              (c->val & 0xffff)); --j) {
+                if ((cases[j - 1]->val & 0xffff) == (c->val & 0xffff)) {
+                    error(ERR_VALUE);
+                    return RET_ERROR;
+                }
+                cases[j] = cases[j - 1];
+            }
+            cases[j] = c;
+        }
+
+        emitdispatch(cases, n, deflt);
+
+        for (c = (case_t *) return_stack[returnSP + 1]; c; c = c->next) {
+            emit_fixup(c->endjmp, rtPC);
+        }
+    } else {
+        if (return_stack[returnSP + 2] != SW_SKIP) {
+            skipFlag = 0;
+        }
+    }
+
+    pop_return();
+    pop_return();
+    pop_return();
+    return RET_SUCCESS;
+}
+
+/*************************************************************************/
+/* FOR LOOPS                                                             */
+/*************************************************************************/
+
+/*
+ * Routine handles five cases, each of which looks like variable assignment.
+ * Doing these all together here makes code easier to maintain and smaller.
+ */
+#define WORD_MODE  0
+#define BYTE_MODE  1
+#define CONST_MODE 2
+#define LET_MODE   3
+#define FOR_MODE   4
+#define LONG_MODE  5
+
+/*
+ * Handles six cases, according to value of mode:
+ *  - WORD_MODE  - declaration of word variable 
+ *  - BYTE_MODE  - declaration of byte variable 
+ *  - CONST_MODE - declaration of constant
+ *  - LET_MODE   - assignment to existing variable
+ *  - FOR_MODE   - entry to for loop
+ *  - LONG_MODE  - declaration of long variable
+ *
+ * Handles parsing the following text (mode == WORD_MODE/BYTE_MODE/LONG_MODE) either:
+ *     "var = expr"
+ * or, "var[expr1] = expr2"
+ * or (mode == CONST_MODE), just:
+ *     "var = expr"
+ * or (mode == FOR_MODE):
+ *     "var = expr2 : expr3"
+ * or, "var[expr1] = expr2 : expr3"
+ *
+ * Returns RET_SUCCESS if no error, RET_ERROR if error
+ */
+unsigned char assignorcreate(unsigned char mode)
+{
+    int j;
+    int k;
+    unsigned char type;
+    char name[VARNUMCHARS];
+    int i = 0;
+    unsigned char isarray = 0;
+    unsigned char local = 0;
+    unsigned char oldcompile = compile;
+    var_t *v;
+
+    if (!txtPtr || !isalphach(*txtPtr)) {
+        error(ERR_VAR);
+        return RET_ERROR;
+    }
+    while (*txtPtr && (isalphach(*txtPtr) || isdigitch(*txtPtr))) {
+        if (i < VARNUMCHARS) {
+            name[i++] = *txtPtr;
+        }
+        ++txtPtr;
+    }
     if (i < VARNUMCHARS) {
         name[i] = '\0';
     }
@@ -3070,6 +5147,7 @@ unsigned char assignorcreate(unsigned char mode)
         switch (mode) {
         case WORD_MODE:
         case BYTE_MODE:
+        case LONG_MODE:
             onlyconstants = 1;  /* Only parse constants - no variables  */
             compile = 0;        /* Use subscript() to eval, not codegen */
             if (subscript(&i) == 1) {
@@ -3081,6 +5159,12 @@ unsigned char assignorcreate(unsigned char mode)
             compile = oldcompile;
             break;
         default:
+#ifdef FARMEM
+            /* Far arrays are indexed by a long */
+            if (compile && isfar(name)) {
+                evalwant = EVAL_LONG;
+            }
+#endif
             if (subscript(&i) == 1) {
                 return RET_ERROR;
             }
@@ -3099,6 +5183,29 @@ unsigned char assignorcreate(unsigned char mode)
         compile = 0;            /* Eval, not codegen */
     }
 
+    /*
+     * Longs are evaluated in 32 bits.  For an element of a long array the
+     * address is computed now, below the value, as it is two words.
+     */
+    if (compile) {
+        if ((mode == LONG_MODE) && !isarray) {
+            evalwant = EVAL_LONG;
+#ifdef FARMEM
+        } else if ((mode == LET_MODE) && isarray && isfar(name)) {
+            /* Far address is computed now, below the value */
+            if (getintvar(name, i, &j, &type, 1)) {
+                return RET_ERROR;
+            }
+#endif
+        } else if ((mode == LET_MODE) && (v = findintvar(name, &local)) &&
+                   ((v->type & 0x0f) == TYPE_LONG)) {
+            if (isarray && getintvar(name, i, &j, &type, 1)) {
+                return RET_ERROR;
+            }
+            evalwant = EVAL_LONG;
+        }
+    }
+
     /*
      * If it is LET or FOR, evaluate the single argument.
      * If it is declaration, only evaluate single argument for scalars.
@@ -3117,11 +5224,14 @@ unsigned char assignorcreate(unsigned char mode)
     case WORD_MODE:
     case BYTE_MODE:
     case CONST_MODE:
+    case LONG_MODE:
         if (i == 0) {
             ++i;
         }
         if (createintvar(name,
-                         ((mode == CONST_MODE) ? TYPE_CONST : ((mode == WORD_MODE) ? TYPE_WORD : TYPE_BYTE)),
+                         ((mode == CONST_MODE) ? TYPE_CONST :
+                          ((mode == WORD_MODE) ? TYPE_WORD :
+                           ((mode == LONG_MODE) ? TYPE_LONG : TYPE_BYTE))),
                          isarray, i, j, 0)) {
             return RET_ERROR;
         }
@@ -3181,6 +5291,12 @@ unsigned char assignorcreate(unsigned char mode)
         return RET_ERROR;
     }
 
+    /* Loop variable must be a word or a byte, and not in far memory */
+    if (((type & 0x0f) == TYPE_LONG) || (type & 0x40)) {
+        error(ERR_TYPE);
+        return RET_ERROR;
+    }
+
     push_return(((type & 0x0f) == TYPE_WORD) ? FORFRAME_W : FORFRAME_B);
 
     if (compile) {
@@ -3196,7 +5312,7 @@ unsigned char assignorcreate(unsigned char mode)
         push_return(0);         /* Dummy */
     } else {
         push_return(counter);
-        push_return((int) txtPtr);
+        push_return((intptr_t) txtPtr);
         push_return(k);
         push_return(j);
     }
@@ -3204,92 +5320,307 @@ unsigned char assignorcreate(unsigned char mode)
     return RET_SUCCESS;
 }
 
+#ifdef FARMEM
+
 /*
- * Go back to the start of a loop or return after end of subroutine.
- * (Used for FOR and WHILE loops and for subroutine CALL/RETURN).
- * - linenum is the line number of the start of the loop or the call
- *   statement, or -1 in immediate mode.
- * - oldTxtPtr is the stashed text pointer, which is expected to point
- *   to the code immediately after the opening loop statement.
- * This is used by the interpreter only.
- */
-void backtotop(int linenum, char *oldTxtPtr)
+ * Create far array name of sz elements of type TYPE_WORD or TYPE_BYTE,
+ * and parse its initializer, which is a list or a string as for other
+ * arrays.  Elements without an initializer are 0.  Far arrays are globals
+ * declared at the top level.  Their bodies are allocated in far memory from
+ * farnext upwards, and the body address in the variable table is the far
+ * address.  When compiling, code is generated to store each initializer at
+ * its far address.
+ * Returns 0 on success, 1 if error.
+ */
+unsigned char createfarvar(char *name, unsigned char type, int sz)
 {
+    unsigned char arrinitmode;
+    unsigned char local = 1;
+    unsigned char esz = ((type == TYPE_WORD) ? 2 : 1);
+    unsigned long addr;
+    int i;
+    int val;
+    var_t *v;
 
-    if (linenum == -1) {
-        /* Return to immediate mode */
-        counter = -1;
-        current = NULL;
-    } else {
-        /*
-         * If not immediate mode, then reload the line containing
-         * the opening statement of the loop, or the call statement
-         */
-        findline(linenum + 1);
-        --counter;              /* Findline uses 1-based linenums */
-        if (!current) {
-            /* Should never get here! */
-            EXIT(99);
-        }
-    }
-
-#ifdef EXTMEM
-    copyfromaux(current->line, current->len);
+    /* In a sub, varslocal is the marker at the start of its frame */
+    if (compilingsub || (varslocal && (varslocal->name[0] == '-'))
+#ifdef MODULES
+        || modcomp
 #endif
+        ) {
+        error(ERR_FAR);
+        return 1;
+    }
 
-    /* This should also work with extended memory */
-    txtPtr = oldTxtPtr;
-}
-
-/*
- * Handle iterating or exiting the FOR loop.
- * Expects to find pointer to loop variable, loop limit
- * and line counter on the return stack.
- * Returns RET_SUCCESS on success, RET_ERROR on error
- */
-unsigned char doendfor()
-{
-    int val;
-    unsigned char type = 0xff;
+    if (findintvar(name, &local)) {
+        error(ERR_REDEF);
+        return 1;
+    }
 
-    if (return_stack[returnSP + 5] == FORFRAME_W) {
-        type = TYPE_WORD;
-        if (!compile) {
-            val = *(int *) (return_stack[returnSP + 1]);
-        }
-    } else if (return_stack[returnSP + 5] == FORFRAME_B) {
-        type = TYPE_BYTE;
-        if (!compile) {
-            val = *(unsigned char *) (return_stack[returnSP + 1]);
-        }
+    if (sz < 1) {
+        error(ERR_DIM);
+        return 1;
     }
-    if (type == 0xff) {
-        error(ERR_NOFOR);
-        return RET_ERROR;
+
+    if (farnext + (unsigned long) sz * esz > FARMEMSZ) {
+        error(ERR_FAR);
+        return 1;
     }
 
-    if (compile) {
-        /* **** Loop limit is on the call stack **** */
-        emit(VM_POPWORD);
-        emit(VM_DUP);
-        emit(VM_PSHWORD);
+    if (*txtPtr == '"') {
+        arrinitmode = STRG_INIT;
+    } else if (*txtPtr == '{') {
+        arrinitmode = LIST_INIT;
+    } else {
+        error(ERR_EXPECT);
+        printchar('{');
+        return 1;
+    }
+    ++txtPtr;
 
-        //emitldi(return_stack[returnSP + 2]); /* Pointer to loop variable */
-        if (return_stack[returnSP + 4]) {    /* Rel or abs */
-            /* Pointer to loop var */
-            emit_imm((type == TYPE_WORD) ? VM_LDRWORDIMM : VM_LDRBYTEIMM, return_stack[returnSP + 2]);
-        } else {
-            /* Pointer to loop var */
-            emit_imm((type == TYPE_WORD) ? VM_LDAWORDIMM : VM_LDABYTEIMM, return_stack[returnSP + 2]);
+    if (!compile) {
+        if (!fardata) {
+            fardata = calloc(FARMEMSZ, 1);
+            if (!fardata) {
+                error(ERR_FAR);
+                return 1;
+            }
         }
+        memset(fardata + farnext, 0, sz * esz);
+#ifdef TIERED
+        /* Far memory is not copied to or from the embedded VM */
+        tierstate = TIER_BLOCKED;
+#endif
+    }
+    addr = farnext;
 
-        /* Increment and store loop variable */
+    if (arrinitmode == STRG_INIT) {
+        --sz;                   /* Leave space for final null */
+    }
+    for (i = 0; i < sz; ++i, addr += esz) {
+        if (arrinitmode == STRG_INIT) {
+            if (*txtPtr == '"') {
+                break;
+            }
+            if (compile) {
+                emitldi(addr & 0xffff);
+                emitldi(addr >> 16);
+            }
+            val = *txtPtr;
+            ++txtPtr;
+            if (compile) {
+                emitldi(val);
+            }
+        } else {
+            if (*txtPtr == '}') {
+                break;
+            }
+            if (compile) {
+                emitldi(addr & 0xffff);
+                emitldi(addr >> 16);
+            }
+            if (eval(0, &val)) {
+                return 1;
+            }
+            eatspace();
+            if (*txtPtr == ',') {
+                ++txtPtr;
+            }
+            eatspace();
+        }
+        if (compile) {
+            emit((type == TYPE_WORD) ? VM_STFW : VM_STFB);
+        } else {
+            fardata[addr] = val & 0xff;
+            if (type == TYPE_WORD) {
+                fardata[addr + 1] = (val >> 8) & 0xff;
+            }
+        }
+    }
+    if (arrinitmode == STRG_INIT) {
+        ++sz;
+    }
+    if (*txtPtr == ((arrinitmode == STRG_INIT) ? '"' : '}')) {
+        ++txtPtr;
+    } else {
+        error(ERR_TOOLONG);
+        return 1;
+    }
+
+    v = alloc1(sizeof(var_t) + 2 * sizeof(int));
+    *(int *) ((unsigned char *) v + sizeof(var_t)) = farnext;
+    *(int *) ((unsigned char *) v + sizeof(var_t) + sizeof(int)) = sz;
+    farnext += (unsigned long) sz * esz;
+
+    strncpy(v->name, name, VARNUMCHARS);
+    v->type = 0x40 | 0x10 | type;
+    v->next = NULL;
+
+#ifdef EXPRCACHE
+    exprcache_newvar();
+#endif
+
+    if (varsend) {
+        varsend->next = v;
+    }
+    varsend = v;
+    if (!varsbegin) {
+        varsbegin = v;
+        varslocal = v;
+    }
+    return 0;
+}
+
+/*
+ * Handles far array declaration, parsing either:
+ *     "word var[sz] = initializer"
+ * or, "byte var[sz] = initializer"
+ * The size must be a constant, and may be more than 64K.
+ * Returns RET_SUCCESS if no error, RET_ERROR if error
+ */
+unsigned char dofar()
+{
+    char name[VARNUMCHARS];
+    unsigned char type;
+    unsigned char oldcompile = compile;
+    int i = 0;
+
+    if (!strncmp(txtPtr, "word", 4)) {
+        type = TYPE_WORD;
+    } else if (!strncmp(txtPtr, "byte", 4)) {
+        type = TYPE_BYTE;
+    } else {
+        error(ERR_TYPE);
+        return RET_ERROR;
+    }
+    txtPtr += 4;
+    eatspace();
+
+    if (!isalphach(*txtPtr)) {
+        error(ERR_VAR);
+        return RET_ERROR;
+    }
+    while (*txtPtr && (isalphach(*txtPtr) || isdigitch(*txtPtr))) {
+        if (i < VARNUMCHARS) {
+            name[i++] = *txtPtr;
+        }
+        ++txtPtr;
+    }
+    if (i < VARNUMCHARS) {
+        name[i] = '\0';
+    }
+
+    i = 0;
+    onlyconstants = 1;          /* Only parse constants - no variables  */
+    compile = 0;                /* Use subscript() to eval, not codegen */
+    if (subscript(&i) == 1) {
+        onlyconstants = 0;
+        compile = oldcompile;
+        return RET_ERROR;
+    }
+    onlyconstants = 0;
+    compile = oldcompile;
+
+    eatspace();
+    if (expect('=')) {
+        return RET_ERROR;
+    }
+    eatspace();
+
+    if (createfarvar(name, type, i)) {
+        return RET_ERROR;
+    }
+    return RET_SUCCESS;
+}
+
+#endif
+
+/*
+ * Go back to the start of a loop or return after end of subroutine.
+ * (Used for FOR and WHILE loops and for subroutine CALL/RETURN).
+ * - linenum is the line number of the start of the loop or the call
+ *   statement, or -1 in immediate mode.
+ * - oldTxtPtr is the stashed text pointer, which is expected to point
+ *   to the code immediately after the opening loop statement.
+ * This is used by the interpreter only.
+ */
+void backtotop(int linenum, char *oldTxtPtr)
+{
+
+    if (linenum == -1) {
+        /* Return to immediate mode */
+        counter = -1;
+        current = NULL;
+    } else {
+        /*
+         * If not immediate mode, then reload the line containing
+         * the opening statement of the loop, or the call statement
+         */
+        findline(linenum + 1);
+        --counter;              /* Findline uses 1-based linenums */
+        if (!current) {
+            /* Should never get here! */
+            EXIT(99);
+        }
+    }
+
+#ifdef EXTMEM
+    copyfromaux(current->line, current->len);
+#endif
+
+    /* This should also work with extended memory */
+    txtPtr = oldTxtPtr;
+}
+
+/*
+ * Handle iterating or exiting the FOR loop.
+ * Expects to find pointer to loop variable, loop limit
+ * and line counter on the return stack.
+ * Returns RET_SUCCESS on success, RET_ERROR on error
+ */
+unsigned char doendfor()
+{
+    int val;
+    unsigned char type = 0xff;
+
+    if (return_stack[returnSP + 5] == FORFRAME_W) {
+        type = TYPE_WORD;
+        if (!compile) {
+            val = *(int *) PTR(return_stack[returnSP + 1]);
+        }
+    } else if (return_stack[returnSP + 5] == FORFRAME_B) {
+        type = TYPE_BYTE;
+        if (!compile) {
+            val = *PTR(return_stack[returnSP + 1]);
+        }
+    }
+    if (type == 0xff) {
+        error(ERR_NOFOR);
+        return RET_ERROR;
+    }
+
+    if (compile) {
+        /* **** Loop limit is on the call stack **** */
+        emit(VM_POPWORD);
+        emit(VM_DUP);
+        emit(VM_PSHWORD);
+
+        //emitldi(return_stack[returnSP + 2]); /* Pointer to loop variable */
+        if (return_stack[returnSP + 4]) {    /* Rel or abs */
+            /* Pointer to loop var */
+            emit_imm((type == TYPE_WORD) ? VM_LDRWORDIMM : VM_LDRBYTEIMM, return_stack[returnSP + 2]);
+        } else {
+            /* Pointer to loop var */
+            emit_data((type == TYPE_WORD) ? VM_LDAWORDIMM : VM_LDABYTEIMM, return_stack[returnSP + 2]);
+        }
+
+        /* Increment and store loop variable */
         emit(VM_INC);
         emit(VM_DUP);
         if (return_stack[returnSP + 4]) {
             emit_imm((type == TYPE_WORD) ? VM_STRWORDIMM : VM_STRBYTEIMM, return_stack[returnSP + 2]);
         } else {
-            emit_imm((type == TYPE_WORD) ? VM_STAWORDIMM : VM_STABYTEIMM, return_stack[returnSP + 2]);
+            emit_data((type == TYPE_WORD) ? VM_STAWORDIMM : VM_STABYTEIMM, return_stack[returnSP + 2]);
         }
 
         /* Compare with loop limit already on eval stack */
@@ -3312,9 +5643,9 @@ unsigned char doendfor()
          * to line after FOR
          */
         if (type == TYPE_WORD) {
-            ++(*(int *) (return_stack[returnSP + 1]));
+            ++(*(int *) PTR(return_stack[returnSP + 1]));
         } else {
-            ++(*(unsigned char *) (return_stack[returnSP + 1]));
+            ++(*PTR(return_stack[returnSP + 1]));
         }
 
         backtotop(return_stack[returnSP + 4], (char *) return_stack[returnSP + 3]);
@@ -3341,7 +5672,7 @@ unsigned char doendfor()
  * startTxtPtr should point to the text of the WHILE statement itself.
  * arg is the evaluated value of the argument to the WHILE.
  */
-void dowhile(char *startTxtPtr, unsigned char arg)
+void dowhile(char *startTxtPtr, int arg)
 {
 
     /*
@@ -3382,7 +5713,7 @@ void dowhile(char *startTxtPtr, unsigned char arg)
             }
         }
         push_return(counter);
-        push_return((int) startTxtPtr);
+        push_return((intptr_t) startTxtPtr);
     }
 }
 
@@ -3489,6 +5820,82 @@ unsigned char compareUntil(char *s1, char *s2, char term)
     return 1;
 }
 
+#ifdef TAILCALL
+
+/*
+ * Compile 'return f(...)', where the code for the call to f has just been
+ * emitted and passes as many bytes of arguments as the current sub takes.
+ * The JSRIMM and the discarding of the arguments are replaced by code to
+ * copy the new arguments from the top of the call stack over our own,
+ * drop our frame and jump to f.  f then returns straight to our caller,
+ * which discards the arguments as usual.
+ */
+void tailreturn()
+{
+    unsigned char off;
+
+    codeptr -= rtPC - tailjsr;
+    rtPC = tailjsr;
+    tailrets[ntailrets].pc = rtPC;
+    tailrets[ntailrets].call = tailcall;
+    tailrets[ntailrets].argbytes = tailargbytes;
+
+    /* Last argument pushed is at the lowest address */
+    for (off = 0; off + 1 < tailargbytes; off += 2) {
+        emit(VM_POPWORD);
+        emit_imm(VM_STRWORDIMM, 4 + off);
+    }
+    if (off < tailargbytes) {
+        emit(VM_POPBYTE);
+        emit_imm(VM_STRBYTEIMM, 4 + off);
+    }
+    emit(VM_FPTOSP);
+    emit_imm(VM_JMPIMM, 0xffff);
+
+    /* linksubs() fills in the jump address */
+    tailcall->addr = rtPC - 2;
+    tailpc = 0;
+    tailrets[ntailrets++].end = rtPC;
+}
+
+/*
+ * Called at the end of a sub.  If the sub turned out to make pointers into
+ * its own frame, each tail return compiled in it is replaced by a jump to
+ * code placed here, which makes an ordinary call and return instead.
+ * The rest of the tail return code is filled with RTS, which is never run.
+ */
+void tailbackout()
+{
+    struct tailret *t;
+    unsigned int pc;
+    unsigned char i;
+
+    for (i = 0; !tailsafe && (i < ntailrets); ++i) {
+        t = &tailrets[i];
+        pc = rtPC;
+        codeptr -= rtPC - t->pc;
+        rtPC = t->pc;
+        emit_imm(VM_JMPIMM, pc);
+        while (rtPC < t->end) {
+            emit(VM_RTS);
+        }
+        codeptr += pc - rtPC;
+        rtPC = pc;
+
+        emit_imm(VM_JSRIMM, 0xffff);
+        t->call->addr = rtPC - 2;
+        if (t->argbytes) {
+            emitldi(t->argbytes);
+            emit(VM_DISCARD);
+        }
+        emit(VM_FPTOSP);
+        emit(VM_RTS);
+    }
+    ntailrets = 0;
+}
+
+#endif
+
 /*
  * Handle subroutine declaration.
  * This is really only used by the compiler.
@@ -3501,14 +5908,52 @@ unsigned char dosubr()
     unsigned char arraymode;
     var_t *v;
     sub_t *s;
+#ifdef INCRCOMP
+    unsigned char reuse;
+#endif
+
+#ifdef MODULES
+    if (compile && subextern(txtPtr)) {
+        /* Declaration of a sub in another module, which has no body */
+        while (*txtPtr) {
+            ++txtPtr;
+        }
+        return RET_SUCCESS;
+    }
+#endif
 
     if (compile) {
 
+#ifdef TAILCALL
+        if (compilingsub) {
+            /* The previous sub had no endsub */
+            tailbackout();
+        }
+#endif
+
+#ifdef MODULES
+        if (modcomp && (rtPC != modretpc)) {
+            /* Module initialization ends where the first sub starts */
+            modreturn();
+        }
+#endif
+
+#ifdef INCRCOMP
+        /* Not if the previous sub had no endsub */
+        reuse = !compilingsub;
+#endif
+
         compilingsub = 1;
 
-        print("\n[");
-        print(readbuf);
-        print("]");
+#ifdef TIERED
+        if (!tiering) {
+#endif
+            print("\n[");
+            print(readbuf);
+            print("]");
+#ifdef TIERED
+        }
+#endif
 
         /*
          * Create entry in subroutine table
@@ -3528,6 +5973,14 @@ unsigned char dosubr()
             subsbegin = s;
         }
 
+#ifdef INCRCOMP
+        if (reuse && !incrsub()) {
+            /* Code from the last compile was reused */
+            compilingsub = 0;
+            return RET_SUCCESS;
+        }
+#endif
+
         vars_markcallframe();
 
         /* Update frame pointer */
@@ -3538,6 +5991,13 @@ unsigned char dosubr()
             return RET_ERROR;
         }
 
+#ifdef TAILCALL
+        tailpc = 0;
+        subargbytes = 0;
+        tailsafe = 1;
+        ntailrets = 0;
+#endif
+
         for (;;) {
             eatspace();
             if (*txtPtr == ')') {
@@ -3547,6 +6007,8 @@ unsigned char dosubr()
                 type = TYPE_WORD;
             } else if (!strncmp(txtPtr, "byte ", 5)) {
                 type = TYPE_BYTE;
+            } else if (!strncmp(txtPtr, "long ", 5)) {
+                type = TYPE_LONG;
             } else {
                 error(ERR_ARG);
                 return RET_ERROR;
@@ -3594,6 +6056,9 @@ unsigned char dosubr()
                     if (arraymode || (type == TYPE_WORD)) {
                         *(int *) ((unsigned char *) v + sizeof(var_t)) +=
                             2;
+                    } else if (type == TYPE_LONG) {
+                        *(int *) ((unsigned char *) v + sizeof(var_t)) +=
+                            4;
                     } else {
                         *(int *) ((unsigned char *) v + sizeof(var_t)) +=
                             1;
@@ -3602,6 +6067,10 @@ unsigned char dosubr()
                 v = v->next;
             }
 
+#ifdef TAILCALL
+            subargbytes += ((arraymode || (type == TYPE_WORD)) ? 2 : ((type == TYPE_LONG) ? 4 : 1));
+#endif
+
             if (arraymode) {
                 v = alloc1(sizeof(var_t) + 2 * sizeof(int));
             } else {
@@ -3648,6 +6117,16 @@ unsigned char dosubr()
             return RET_ERROR;
         }
 
+        /* Skip 'native n', which docall() looks for */
+        eatspace();
+        if (!strncmp(txtPtr, "native", 6)) {
+            txtPtr += 6;
+            eatspace();
+            while (isdigitch(*txtPtr)) {
+                ++txtPtr;
+            }
+        }
+
     } else {
         /* Error if we just run into this line! */
         error(ERR_RUNSUB);
@@ -3668,48 +6147,103 @@ unsigned char doendsubr()
         emitldi(0);
     }
     doreturn(0);
+#ifdef TAILCALL
+    if (compile) {
+        tailbackout();
+    }
+#endif
+#ifdef MODULES
+    if (compile) {
+        modretpc = rtPC;
+    }
+#endif
+#ifdef INCRCOMP
+    if (compile) {
+        incrsave();
+    }
+#endif
     return RET_SUCCESS;
 }
 
+#ifdef FRAMECACHE
+
 /*
- * Perform call instruction
- * Expects sub name to call in readbuf
- * Return RET_SUCCESS if successful, RET_ERROR on error
+ * Subroutine frame cache.
+ * The first time the interpreter calls a sub, the line containing the sub
+ * statement is found and the formal parameter list is parsed into a frame
+ * layout: the name and type of each parameter.  Later calls look the sub
+ * up by name, evaluate the arguments, then bind them to the new frame in
+ * a single allocation, without re-reading the sub statement.  The cache is
+ * flushed whenever the program is edited.
+ */
+struct frameparam {
+    char name[VARNUMCHARS];
+    unsigned char type;         /* TYPE_WORD, TYPE_BYTE or TYPE_LONG    */
+    unsigned char arraymode;    /* 1 if array passed by reference       */
+};
+
+struct frameent {
+    char name[SUBRNUMCHARS];    /* Name of sub as called                */
+    struct lineofcode *line;    /* Line containing sub statement        */
+    int linenum;                /* Line number of sub statement         */
+    unsigned int framesz;       /* Bytes for parameters' var_t records  */
+    unsigned char nparams;      /* Number of parameters                 */
+    struct frameparam params[FRAMEMAXARGS];
+    struct frameent *next;      /* Next entry in hash chain             */
+};
+
+struct frameent framecache[FRAMECACHESZ];
+struct frameent *framehash[FRAMEHASHSZ];
+unsigned char framecount;
+
+/*
+ * Size of the var_t record for a parameter
  */
-unsigned char docall()
+#define frameparamsz(p) ALIGN1(sizeof(var_t) + \
+                         ((p)->arraymode ? 2 * sizeof(int) : \
+                          (((p)->type != TYPE_BYTE) ? sizeof(int) : sizeof(unsigned char))))
+
+/*
+ * Discard all cached frame layouts.
+ */
+void framecache_flush()
 {
-    unsigned char type;
-    char *p;
-    int arg;
-    char name[VARNUMCHARS];
-    char name2[VARNUMCHARS];
-    unsigned char j;
-    unsigned char arraymode;
-    var_t *oldvarslocal;
-    var_t *newvarslocal;
-    var_t *array;
-    sub_t *s;
-    unsigned char argbytes = 0;
-    struct lineofcode *l = program;
-    int origcounter = counter;
-    unsigned char local = 0;
+    unsigned char i;
 
-    /*
-     * Do this before evaluating arguments, which overwrites readbuf
-     */
-    if (compile) {
-        /*
-         * Allocate this on the top-down stack in arena 2.  This grows down
-         * towards the source code, which is growing up from the bottom of
-         * arena 2.
-         */
-        s = alloc2top(sizeof(sub_t));
-        strncpy(s->name, readbuf, SUBRNUMCHARS);
+    for (i = 0; i < FRAMEHASHSZ; ++i) {
+        framehash[i] = NULL;
     }
+    framecount = 0;
+}
 
-    if (!compile) {
-        counter = -1;
+/*
+ * Hash sub name
+ */
+unsigned char framehashidx(char *name)
+{
+    unsigned char h = 0;
+
+    while (*name) {
+        h += *name++;
     }
+    return h & (FRAMEHASHSZ - 1);
+}
+
+/*
+ * Find the sub named in readbuf and parse its formal parameters into a
+ * new cache entry.
+ * Returns RET_SUCCESS with *fe set on success, RET_ERROR on error, or 2 if
+ * the sub has too many parameters to be cached.
+ */
+unsigned char framecache_add(struct frameent **fe)
+{
+    struct frameent *f;
+    struct frameparam *fp;
+    struct lineofcode *l = program;
+    int linenum = 0;
+    unsigned char j;
+    char *p;
+
     while (l) {
 #ifdef EXTMEM
         copyfromaux2(l->line, l->len);
@@ -3717,1609 +6251,5719 @@ unsigned char docall()
 #else
         p = l->line;
 #endif
-        if (!compile) {
-            ++counter;
+        while (*p == ' ') {
+            ++p;
+        }
+        if (!strncmp(p, "sub ", 4)) {
+            p += 4;
+            while (*p == ' ') {
+                ++p;
+            }
+            if (!compareUntil(p, readbuf, '(')) {
+                goto found;
+            }
         }
+        l = l->next;
+        ++linenum;
+    }
+    error(ERR_NOSUB);
+    return RET_ERROR;
 
-        skipFlag = 0;
+  found:
+    if (framecount == FRAMECACHESZ) {
+        framecache_flush();
+    }
+    f = &(framecache[framecount]);
+    strncpy(f->name, readbuf, SUBRNUMCHARS);
+    f->line = l;
+    f->linenum = linenum;
+    f->framesz = 0;
+    f->nparams = 0;
+
+    /* Eat the subroutine name */
+    while (*p && (*p != '(')) {
+        ++p;
+    }
+    if (!(*p)) {
+        error(ERR_EXPECT);
+        printchar('(');
+        return RET_ERROR;
+    }
+    ++p;
+#ifdef MODULES
+    if (subextern(p)) {
+        return 2;               /* docall() reports it */
+    }
+#endif
 
-        while (p && (*p == ' ')) {
+    for (;;) {
+        while (*p == ' ') {
             ++p;
         }
-        if (!strncmp(p, "sub ", 4)) {
-            p += 4;
-            while (p && (*p == ' ')) {
+        if (*p == ')') {
+            break;
+        }
+        if (f->nparams == FRAMEMAXARGS) {
+            return 2;
+        }
+        fp = &(f->params[f->nparams]);
+        if (!strncmp(p, "word ", 5)) {
+            fp->type = TYPE_WORD;
+        } else if (!strncmp(p, "byte ", 5)) {
+            fp->type = TYPE_BYTE;
+        } else if (!strncmp(p, "long ", 5)) {
+            fp->type = TYPE_LONG;
+        } else {
+            error(ERR_ARG);
+            return RET_ERROR;
+        }
+        p += 5;
+        while (*p == ' ') {
+            ++p;
+        }
+        for (j = 0; j < VARNUMCHARS; ++j) {
+            fp->name[j] = 0;
+        }
+        j = 0;
+        while (isalphach(*p) || isdigitch(*p)) {
+            if (j < VARNUMCHARS) {
+                fp->name[j] = *p;
+            }
+            ++j;
+            ++p;
+        }
+        fp->arraymode = 0;
+        if (*p == '[') {
+            ++p;
+            if (*p == ']') {
                 ++p;
+                fp->arraymode = 1;
+            } else {
+                error(ERR_ARG);
+                return RET_ERROR;
             }
+        }
+        /* Duplicate parameter names */
+        for (j = 0; j < f->nparams; ++j) {
+            if (!strncmp(fp->name, f->params[j].name, VARNUMCHARS)) {
+                error(ERR_REDEF);
+                return RET_ERROR;
+            }
+        }
+        f->framesz += frameparamsz(fp);
+        ++(f->nparams);
+        while (*p == ' ') {
+            ++p;
+        }
+        if (*p == ',') {
+            ++p;
+        }
+    }
 
-            if (!compareUntil(p, readbuf, '(')) {
+    ++framecount;
+    j = framehashidx(readbuf);
+    f->next = framehash[j];
+    framehash[j] = f;
+    *fe = f;
+    return RET_SUCCESS;
+}
 
-                /*
-                 * Here we are parsing two lines at a time:
-                 * The call (at *txtPtr as usual) and the
-                 * sub being called (at *p).
-                 */
+/*
+ * Interpreter side of docall() using the frame cache.
+ * Expects sub name to call in readbuf.
+ * retline is the line number recorded in the CALLFRAME.
+ * Returns RET_SUCCESS if successful, RET_ERROR on error, or 2 if the
+ * sub can not be cached, in which case nothing has been consumed.
+ */
+unsigned char framecall(int retline)
+{
+    struct frameent *f;
+    struct frameent fr;
+    struct frameparam *fp;
+    int args[FRAMEMAXARGS];
+    char name[VARNUMCHARS];
+    var_t *array;
+    var_t *v;
+    unsigned char *rec;
+    unsigned char i;
+    unsigned char j;
+    unsigned char local;
 
-                /* Eat the subroutine name at *p */
-                while (p && (*p != '(')) {
-                    ++p;
-                }
-                if (!p) {
-                    error(ERR_EXPECT);
-                    printchar('(');
-                    return RET_ERROR;
-                }
-                ++p;            /* Eat the '(' */
+    if (strlen(readbuf) > SUBRNUMCHARS) {
+        return 2;
+    }
+    f = framehash[framehashidx(readbuf)];
+    while (f && strncmp(f->name, readbuf, SUBRNUMCHARS)) {
+        f = f->next;
+    }
+    if (!f) {
+        i = framecache_add(&f);
+        if (i) {
+            return i;
+        }
+    }
 
-                /*
-                 * Set up txtPtr to start passing the argument
-                 * list of the call
-                 */
-                eatspace();
-                if (expect('(')) {
-                    counter = origcounter;
-                    return RET_ERROR;
+    /*
+     * Work on a copy, since calls made while evaluating the arguments
+     * may cause the cache to be flushed.
+     */
+    fr = *f;
+
+    skipFlag = 0;
+
+    eatspace();
+    if (expect('(')) {
+        return RET_ERROR;
+    }
+
+    /*
+     * Evaluate the arguments in the caller's frame.  For arrays, find
+     * the array header so it can be copied (pass by reference.)
+     */
+    for (i = 0; i < fr.nparams; ++i) {
+        fp = &(fr.params[i]);
+        if (!(*txtPtr) || (*txtPtr == ')')) {
+            error(ERR_ARG);
+            return RET_ERROR;
+        }
+        if (!fp->arraymode) {
+            if (eval(0, &(args[i]))) {
+                error(ERR_ARG);
+                return RET_ERROR;
+            }
+        } else {
+            for (j = 0; j < VARNUMCHARS; ++j) {
+                name[j] = 0;
+            }
+            j = 0;
+            while (isalphach(*txtPtr) || isdigitch(*txtPtr)) {
+                if (j < VARNUMCHARS) {
+                    name[j] = *txtPtr;
                 }
+                ++txtPtr;
+                ++j;
+            }
+            local = 0;
+            array = findintvar(name, &local);
+            if (!array) {
+                error(ERR_VAR);
+                return RET_ERROR;
+            }
+            if (((array->type & 0x0f) != fp->type) || !(array->type & 0xf0)) {
+                error(ERR_TYPE);
+                return RET_ERROR;
+            }
+            args[i] = ADDR(array);
+        }
+        eatspace();
+        if (*txtPtr == ',') {
+            ++txtPtr;
+        }
+        eatspace();
+    }
 
-                if (!compile) {
-                    /*
-                     * Will need this later for looking up
-                     * things in the 'old' frame
-                     */
-                    oldvarslocal = varslocal;
+    eatspace();
+    if (expect(')')) {
+        return RET_ERROR;
+    }
 
-                    /*
-                     * For CALL, stack frame is:
-                     *  - CALLFRAME magic number
-                     *  - line number of CALL
-                     *  - Pointer to just after the call statement
-                     *    (set further down in the code)
-                     */
-                    push_return(CALLFRAME);
-                    push_return(origcounter);
+    /*
+     * For CALL, stack frame is:
+     *  - CALLFRAME magic number
+     *  - line number of CALL
+     *  - Pointer to just after the call statement
+     */
+    push_return(CALLFRAME);
+    push_return(retline);
+    push_return((intptr_t) txtPtr);
 
-                    vars_markcallframe();
+    vars_markcallframe();
 
-                    newvarslocal = varslocal;
+    /*
+     * Bind the arguments.  The parameters' var_t records are allocated
+     * as one block, with the first parameter at the top, as though each
+     * had been allocated in turn by createintvar().
+     */
+    if (fr.nparams) {
+        rec = (unsigned char *) alloc1(fr.framesz) + fr.framesz;
+        for (i = 0; i < fr.nparams; ++i) {
+            fp = &(fr.params[i]);
+            rec -= frameparamsz(fp);
+            v = (var_t *) rec;
+            memcpy(v->name, fp->name, VARNUMCHARS);
+            v->next = NULL;
+            if (fp->arraymode) {
+                array = (var_t *) PTR(args[i]);
+                v->type = (array->type & 0xf0) | fp->type;
+                *getptrtoscalarword(v) = *getptrtoscalarword(array);
+                *(getptrtoscalarword(v) + 1) = *(getptrtoscalarword(array) + 1);
+            } else {
+                v->type = fp->type;
+                if (fp->type != TYPE_BYTE) {
+                    *getptrtoscalarword(v) = storeval(fp->type, args[i]);
+                } else {
+                    *getptrtoscalarbyte(v) = args[i];
                 }
+            }
+            varsend->next = v;
+            varsend = v;
+        }
+    }
 
-                /*
-                 * Iterate through the formal parameter
-                 * list of the sub (at *p).
-                 *
-                 * For word and byte scalar parameters, we
-                 * instantiate a local of the appropriate
-                 * type, evaluate the corresponding expression
-                 * in the call and store the result in this
-                 * new local.
-                 *
-                 * For arrays we copy the header, leaving
-                 * the pointer to the original global data
-                 * intact.  Effectively, this gives arrays
-                 * pass by reference semantics (similar to C).
-                 * This trick works when passing literal
-                 * arrays only.
-                 */
-                for (;;) {
-                    while (p && (*p == ' ')) {
-                        ++p;
-                    }
-                    if (!p) {
-                        error(ERR_ARG);
-                        return RET_ERROR;
-                    }
-                    if (*p == ')') {
-                        break;
-                    }
-                    if (!strncmp(p, "word ", 5)) {
-                        type = TYPE_WORD;
-                    } else if (!strncmp(p, "byte ", 5)) {
-                        type = TYPE_BYTE;
-                    } else {
-                        error(ERR_ARG);
-                        return RET_ERROR;
-                    }
-                    p += 5;
-                    while (p && (*p == ' ')) {
-                        ++p;
-                    }
-                    if (!p) {
-                        error(ERR_ARG);
-                        return RET_ERROR;
-                    }
-                    for (j = 0; j < VARNUMCHARS; ++j) {
-                        name[j] = 0;
-                    }
-                    j = 0;
-                    while (p && (isalphach(*p) || isdigitch(*p))) {
-                        if (j < VARNUMCHARS) {
-                            name[j] = *p;
-                        }
-                        ++j;
-                        ++p;
-                    }
-                    /*
-                     * If argument is followed by '[]'
-                     * then switch to pass array by ref
-                     * mode.
-                     */
-                    arraymode = 0;
-                    if (p && (*p == '[')) {
-                        ++p;
-                        if (p && (*p == ']')) {
-                            ++p;
-                            arraymode = 1;
-                        } else {
-                            error(ERR_ARG);
-                            return RET_ERROR;
-                        }
-                    }
-
-                    /*
-                     * Now we go back to looking at the 
-                     * call arguments
-                     */
-
-                    /* If end of line, error */
-                    if (!(*txtPtr)) {
-                        counter = origcounter;
-                        error(ERR_ARG);
-                        return RET_ERROR;
-                    }
-                    if (*txtPtr == ')') {
-                        counter = origcounter;
-                        error(ERR_ARG);
-                        return RET_ERROR;
-                    }
-                    if (!arraymode) {
-                        /*
-                         * Pass scalar value
-                         */
-                        if (!compile) {
-                            /* Back to old frame for lookup */
-                            varslocal = oldvarslocal;
-                        }
-                        if (eval(0, &arg)) {
-                            /* No expression found */
-                            counter = origcounter;
-                            error(ERR_ARG);
-                            return RET_ERROR;
-                        }
+    /*
+     * Set up parser to start executing first line of subroutine
+     */
+    current = fr.line->next;
+    counter = fr.linenum + 1;
+#ifdef PROFILER
+    profcall();
+#endif
 #ifdef EXTMEM
-                        // Recover embuf2, which has been trashed by eval() above
-                        copyfromaux2(l->line, l->len);
+    copyfromaux(current->line, current->len);
+    txtPtr = embuf;
+#else
+    txtPtr = current->line;
+#endif
+    return RET_SUCCESS;
+}
 #endif
-                        if (compile) {
-                            if (type == TYPE_WORD) {
-                                emit(VM_PSHWORD);
-                                argbytes += 2;
-                            } else {
-                                emit(VM_PSHBYTE);
-                                ++argbytes;
-                            }
-                        } else {
-                            /* Back to new frame to create var */
-                            varslocal = newvarslocal;
-                            createintvar(name, type, 0, 1, arg, 0);
-                        }
-                    } else {
-                        /*
-                         * Array pass-by-reference
-                         */
-                        if (!compile) {
-                            for (j = 0; j < VARNUMCHARS; ++j) {
-                                name2[j] = 0;
-                            }
-                            j = 0;
-                            while (txtPtr && (isalphach(*txtPtr) || isdigitch(*txtPtr))) {
-                                if (j < VARNUMCHARS) {
-                                    name2[j] = *txtPtr;
-                                }
-                                ++txtPtr;
-                                ++j;
-                            }
-                            /* Back to old frame for lookup */
-                            varslocal = oldvarslocal;
-                            array = findintvar(name2, &local);
-                            if (!array) {
-                                counter = origcounter;
-                                error(ERR_VAR);
-                                return RET_ERROR;
-                            }
-                            /* j holds number of dimensions */
-                            j = (array->type & 0xf0) >> 4;
-                            if (((array->type & 0x0f) != type) || (j == 0)) {
-                                counter = origcounter;
-                                error(ERR_TYPE);
-                                return RET_ERROR;
-                            }
-                            /* Back to new frame to create var */
-                            varslocal = newvarslocal;
-                            createintvar(name,
-                                         type,
-                                         j,
-                                         *(getptrtoscalarword(array) + 1),
-                                         0, *getptrtoscalarword(array));
-
-                        } else {
-                            if (eval(0, &arg)) {
-                                /* No expression found */
-                                counter = origcounter;
-                                error(ERR_ARG);
-                                return RET_ERROR;
-                            }
-                            emit(VM_PSHWORD);
-                            argbytes += 2;
-                        }
-                    }
-                    eatspace();
-                    if (*txtPtr == ',') {
-                        ++txtPtr;
-                    }
-                    eatspace();
-
-                    while (p && (*p == ' ')) {
-                        ++p;
-                    }
-
-                    if (!p) {
-                        error(ERR_ARG);
-                        return RET_ERROR;
-                    }
 
-                    if (*p == ',') {
-                        ++p;    /* Eat the comma */
-                    }
-                }
+#ifdef CONTSTACK
 
-                eatspace();
-                if (expect(')')) {
-                    counter = origcounter;
-                    return RET_ERROR;
-                }
+/*
+ * Continuation stack.
+ * A function call within an expression does not run the sub in a nested
+ * interpreter loop.  Instead the statement containing the call is
+ * suspended: its record is pushed onto the continuation stack, the C stack
+ * is unwound to run() with longjmp(), and the sub is entered as though by
+ * a call statement, with CONTLINE as the return line.  When the sub
+ * returns, the statement is replayed from the start.  Operand values read
+ * from variables and the results of calls already made are recorded in
+ * the statement's record, keyed by their offset within the line, and are
+ * reused on replay, so each is read or called only once.  The expression
+ * which made the call is not parsed again: if it was evaluated directly by
+ * the statement, the expression stacks at the call and the position after
+ * it are saved, and evalexpr() carries on from there (contresumeexpr().)
+ * Calls within array subscripts or the arguments of other calls replay
+ * the whole expression.
+ *
+ * No C stack is used by a call, so the depth of calls is limited by the
+ * return stack (see RETSTACKSZ) and by the space for variables in heap 1.
+ * In practice heap 1 runs out first: on 64 bit Linux each call of a sub
+ * with one word parameter takes 64 bytes of it, so such calls can only be
+ * nested about 250 deep.  8b-scripts/calls.8b checks this.
+ *
+ * Only statements which have no side effects until all of their
+ * expressions have been evaluated can be suspended (see parseline().)
+ * Function calls elsewhere recurse as before.
+ */
 
-                if (compile) {
+#define CONTLINE    -3          /* CALLFRAME line number: resume statement */
+#define CONTKNOWNSZ 64          /* Statements known to make calls - power of 2 */
 
-                    emit_imm(VM_JSRIMM, 0xffff);
+struct contval {
+    unsigned char offset;       /* Offset of operand within the line   */
+    int val;                    /* Value                               */
+};
 
-                    /*
-                     * Create entry in call table
-                     */
-                    s->addr = rtPC - 2;
-                    s->next = NULL;
+struct contrec {
+    struct lineofcode *line;    /* Line containing the statement       */
+    int counter;                /* Line number of the statement        */
+    unsigned char stmtoff;      /* Offset of statement within the line */
+    unsigned char calloff;      /* Offset of call that suspended it    */
+    unsigned char nvals;        /* Number of recorded values           */
+    unsigned char capvals;      /* Space allocated for values          */
+    struct contval *vals;       /* Recorded values                     */
+    struct contrec *next;       /* Next record on stack or free list   */
+    unsigned char resumable;    /* 1 if fields below are set           */
+    unsigned char exproff;      /* Offset of expression making call    */
+    unsigned char resoff;       /* Offset of text following the call   */
+    unsigned char nopnds;       /* Its expression stacks at the call   */
+    unsigned char noprs;
+    int opnds[STACKSZ];
+    unsigned char oprs[STACKSZ];
+};
 
-                    if (callsend) {
-                        callsend->next = s;
-                    }
-                    callsend = s;
-                    if (!callsbegin) {
-                        callsbegin = s;
-                    }
+/*
+ * Statements which have been found to contain function calls.  These
+ * record their operands from the outset, rather than being restarted
+ * when the first call is found.
+ */
+struct contknownent {
+    struct lineofcode *line;
+    unsigned char stmtoff;
+} contknown[CONTKNOWNSZ];
 
-                    /* Caller must drop the arguments
-                     * pushed to call stack above */
-                    if (argbytes) {
-                        emitldi(argbytes);
-                        emit(VM_DISCARD);
-                    }
-                } else {
-                    /* Stash pointer to just after the call stmt */
-                    push_return((int) txtPtr);
+#define contknownidx(line, off) ((((uintptr_t) line >> 2) ^ off) & (CONTKNOWNSZ - 1))
 
-                    /*
-                     * Set up parser to start executing first
-                     * line of subroutine
-                     */
-                    current = l->next;
-                    ++counter;
+/*
+ * Offset of p within the text of current line
+ */
+unsigned char contoff(char *p)
+{
 #ifdef EXTMEM
-                    copyfromaux(current->line, current->len);
-                    txtPtr = embuf;
+    return p - embuf;
 #else
-                    txtPtr = current->line;
+    return p - current->line;
 #endif
-                }
-                return RET_SUCCESS;
-            }
-        }
-        l = l->next;
-    }
-    counter = origcounter;
-    error(ERR_NOSUB);
-    return RET_ERROR;
 }
 
 /*
- * Handle return from subroutine.
- * Parameter retvalue is the value to be returned to the caller.
- * Returns RET_SUCCESS on success, RET_ERROR on error
+ * Start recording operands for the statement at contstmt.
  */
-unsigned char doreturn(int retvalue)
+void contnew()
 {
-    if (compile) {
-
-        /*
-         * Return value is already on evaluation stack
-         */
-
-        /* Update stack pointer to drop local variables */
-        emit(VM_FPTOSP);
-
-        /* And done! */
-        emit(VM_RTS);
+    struct contrec *c;
 
+    if (contfreelist) {
+        c = contfreelist;
+        contfreelist = c->next;
     } else {
+        c = alloc2top(sizeof(struct contrec));
+        c->capvals = 0;
+        c->vals = NULL;
+    }
+    c->line = current;
+    c->counter = counter;
+    c->stmtoff = contoff(contstmt);
+    c->nvals = 0;
+    c->resumable = 0;
+    contactive = c;
+}
 
-        /*
-         * Search the stack to find the first CALLFRAME.  This allows us
-         * to unwind any inner stackframes (for example where we return
-         * from within a FOR loop or IF statement.)
-         */
-
-        int p = returnSP + 1;
-
-        while (p <= RETSTACKSZ - 1) {
-            if (return_stack[p] == CALLFRAME) {
-                /*
-                 * Unwind the stack.
-                 */
-                returnSP = p;
-                goto found;
-            }
-            ++p;
-        }
-
-        error(ERR_STACK);
-        return RET_ERROR;
-
-      found:
-        /* Stash the return value */
-        retregister = retvalue;
-
-        vars_deletecallframe();
+/*
+ * Called by parseline() for a statement which can be suspended.  If the
+ * statement is known to contain function calls and is not already being
+ * replayed, start recording.
+ */
+void contbegin()
+{
+    unsigned char off = contoff(contstmt);
+    struct contknownent *k = &(contknown[contknownidx(current, off)]);
 
-        backtotop(return_stack[p - 1], (char *) return_stack[p - 2]);
+    contok = 1;
+    if (!contactive && (k->line == current) && (k->stmtoff == off)) {
+        contnew();
     }
-    return RET_SUCCESS;
 }
 
-/*************************************************************************/
+/*
+ * Forget which statements contain function calls.
+ */
+void contflush()
+{
+    memset(contknown, 0, sizeof(contknown));
+}
 
 /*
- * Parse a decimal integer constant.
- * The text to parse is pointed to by txtPtr.
- * The result is placed in val.
- * If successful returns 0, otherwise 1.
+ * Release the record for the statement being replayed, if any.
  */
-unsigned char parseint(int *val)
+void contfree()
 {
-    *val = 0;
-    if (!(*txtPtr)) {
-        return 1;
+    if (contactive) {
+        contactive->next = contfreelist;
+        contfreelist = contactive;
+        contactive = NULL;
     }
-    if (!isdigitch(*txtPtr)) {
-        return 1;
-    }
-    do {
-        *val *= 10;
-        *val += *txtPtr - '0';
-        ++txtPtr;
-    } while (isdigitch(*txtPtr));
-    return 0;
 }
 
 /*
- * Return value of hex char
+ * Release all records.
  */
-unsigned char hexchar2val(char c)
+void contreset()
 {
-    if (c >= 'a' && c <= 'f') {
-        return c - 'a' + 10;
+    struct contrec *c;
+
+    contfree();
+    while (contstack) {
+        c = contstack->next;
+        contstack->next = contfreelist;
+        contfreelist = contstack;
+        contstack = c;
     }
-    return c - '0';
+    contctx = NULL;
+    contok = 0;
+    contresume = 0;
+    contdepth = 0;
 }
 
 /*
- * Parse a hexadecimal integer constant.
- * The text to parse is pointed to by txtPtr.
- * The result is placed in val.
- * If successful returns 0, otherwise 1.
+ * Find value recorded at offset off for the statement being replayed.
+ * Returns NULL if not found.
  */
-unsigned char parsehexint(int *val)
+struct contval *contfind(unsigned char off)
 {
-    *val = 0;
-    if (!(isdigitch(*txtPtr) || ((*txtPtr >= 'a') && (*txtPtr <= 'f')))) {
-        return 1;
+    struct contval *v = contactive->vals;
+    unsigned char i;
+
+    for (i = 0; i < contactive->nvals; ++i, ++v) {
+        if (v->offset == off) {
+            return v;
+        }
     }
-    do {
-        *val *= 16;
-        *val += hexchar2val(*txtPtr);
-        ++txtPtr;
-    } while (isdigitch(*txtPtr) || ((*txtPtr >= 'a') && (*txtPtr <= 'f')));
-    return 0;
+    return NULL;
 }
 
 /*
- * Statement tokens - must be in order with no gaps in sequence
- */
-#define TOK_COMM     150        /* (comment) must be lowest-numbered token */
-#define TOK_PRDEC    151        /* pr.dec        */
-#define TOK_PRDEC_S  152        /* pr.dec.s      */
-#define TOK_PRHEX    153        /* pr.hex        */
-#define TOK_PRMSG    154        /* pr.msg        */
-#define TOK_PRNL     155        /* pr.nl         */
-#define TOK_PRSTR    156        /* pr.str        */
-#define TOK_PRCH     157        /* pr.ch         */
-#define TOK_KBDCH    158        /* kbd.ch        */
-#define TOK_KBDLN    159        /* kbd.ln        */
-#define TOK_QUIT     160        /* quit          */
-#define TOK_CLEAR    161        /* clear         */
-#define TOK_VARS     162        /* vars          */
-#define TOK_WORD     163        /* word          */
-#define TOK_BYTE     164        /* byte          */
-#define TOK_CONST    165        /* byte          */
-#define TOK_RUN      166        /* run           */
-#define TOK_COMPILE  167        /* comp          */
-#define TOK_NEW      168        /* new           */
-#define TOK_SUBR     169        /* sub           */
-#define TOK_ENDSUBR  170        /* endsub        */
-#define TOK_IF       171        /* if            */
-#define TOK_ELSE     172        /* else          */
-#define TOK_ENDIF    173        /* endif         */
-#define TOK_FREE     174        /* free          */
-#define TOK_CALL     175        /* call sub      */
-#define TOK_RET      176        /* return        */
-#define TOK_FOR      177        /* for           */
-#define TOK_ENDFOR   178        /* endfor        */
-#define TOK_WHILE    179        /* while         */
-#define TOK_ENDW     180        /* endwhile      */
-#define TOK_END      181        /* end           */
-#define TOK_MODE     182        /* mode          */
-
-/*
- * All the following tokens do not require trailing whitespace
- * Careful - the ordering matters!
+ * Look up operand at offset off in the record of the statement being
+ * replayed.  If found, the recorded value is returned in val.  Otherwise
+ * the value in val is recorded.
  */
-#define TOK_POKEWORD 183        /* poke word (*) */
-#define TOK_POKEBYTE 184        /* poke byte (^) */
+void contleaf(unsigned char off, int *val)
+{
+    struct contval *v = contfind(off);
 
-/* Line editor commands */
-#define TOK_LOAD    185         /* Editor: load        */
-#define TOK_SAVE    186         /* Editor: save        */
-#define TOK_LIST    187         /* Editor: list        */
-#define TOK_CHANGE  188         /* Editor: modify line */
-#define TOK_APP     189         /* Editor: append line */
-#define TOK_INS     190         /* Editor: insert line */
-#define TOK_DEL     191         /* Editor: delete line */
+    if (v) {
+        *val = v->val;
+        return;
+    }
+    if (contactive->nvals == contactive->capvals) {
+        contactive->capvals = (contactive->capvals ? 2 * contactive->capvals : 8);
+        v = realloc(contactive->vals, contactive->capvals * sizeof(struct contval));
+        if (!v) {
+            print("No mem (2)!\n");
+            longjmp(jumpbuf, 1);
+        }
+        contactive->vals = v;
+    }
+    v = &(contactive->vals[(contactive->nvals)++]);
+    v->offset = off;
+    v->val = *val;
+}
 
 /*
- * Used for the stmnttabent type field.  Code in parseline() uses this
- * value to determine how to handle parameters for the statement.
- *
- *  FULLLINE: full-line statement where the entire line 'belongs' to the
- *            statement (comments, sub and lbl are like this.)
- *  NOARGS: no arguments permitted.
- *  ONEARG: one expression is expected and evaluated.  No further arguments
- *          permitted.
- *  TWOARGS: two expressions are expected, separated by a comma
- *  INITIALARG: one expression is evaluated.  Any subsequent arguments may be
- *              evaluated by custom code for each statement.
- *  ONESTRARG: a string constant in quotes is expected
- *  INITIALNAMEARG: a single name is evaluated.  Any subsequent arguments may
- *                  be evaluated by custom code for each statement.  The name
- *                  must start with alpha character and has no spaces.
- *  CUSTOM: the statement has its own custom code to handle parameters
+ * Handle a call in an expression in a statement which can be suspended.
+ * off is the offset of the sub name within the line.
+ * If the call was made before the statement was last suspended, pushes
+ * the result and returns 0.  Returns 1 on error, or 2 if the call should
+ * be made by recursing in the usual way.  Otherwise does not return.
  */
-enum stmnttype {
-    FULLLINE,
-    NOARGS,
-    ONEARG,
-    TWOARGS,
-    INITIALARG,
-    ONESTRARG,
-    INITIALNAMEARG,
-    CUSTOM
-};
+unsigned char contcall(unsigned char off)
+{
+    struct contknownent *k;
+    struct contval *v;
+    struct contrec *c;
+    char *p;
+    unsigned char depth = 0;
+    unsigned char ret;
+    unsigned char i;
 
-/*
- * Represents an entry in the statement table
- */
-struct stmnttabent {
-    char *name;
-    unsigned char token;
-    enum stmnttype type;
-};
+    if (!contactive) {
+        /*
+         * First call in this statement.  The call may change variables
+         * already read, so restart the statement, recording operands.
+         */
+        contnew();
+        k = &(contknown[contknownidx(current, contactive->stmtoff)]);
+        k->line = current;
+        k->stmtoff = contactive->stmtoff;
+        contresume = 1;
+        txtPtr = contstmt;
+        longjmp(contctx->jb, 1);
+    }
 
-/*
- * Number of statements - must be updated to match the table
- */
-#define NUMSTMNTS 42
+    v = contfind(off);
+    if (v) {
+        /* Already called - skip the argument list and use the result */
+        eatspace();
+        do {
+            if ((*txtPtr == '\'') && *(txtPtr + 1) && (*(txtPtr + 2) == '\'')) {
+                txtPtr += 2;
+            } else if (*txtPtr == '(') {
+                ++depth;
+            } else if (*txtPtr == ')') {
+                --depth;
+            }
+            ++txtPtr;
+        } while (depth && *txtPtr);
+        push_operand_stack(v->val);
+        return 0;
+    }
 
-/*
- * Statement table
- * Must be in order of sequentially increasing token value, so that
- * stmnttabent[t - TOK_COMM] is the line matching token t
- *
- * Also note that if a one name is a prefix of another, the longer one
- * must be first (so println goes before print).
- */
-struct stmnttabent stmnttab[] = {
+    /*
+     * If the call is in an expression evaluated directly by the statement,
+     * save the part of the expression stacks belonging to the expression,
+     * so that it can carry on from after the call when the sub returns.
+     */
+    c = contactive;
+    c->resumable = (contdepth == 1);
+    if (c->resumable) {
+        c->exproff = contexproff;
+        c->nopnds = contopndbase - operandSP;
+        c->noprs = contoprbase - operatorSP;
+        for (i = 0; i < c->nopnds; ++i) {
+            c->opnds[i] = operand_stack[contopndbase - i];
+        }
+        for (i = 0; i < c->noprs; ++i) {
+            c->oprs[i] = operator_stack[contoprbase - i];
+        }
+    }
 
-    /* Statements */
-    {"\'", TOK_COMM, FULLLINE},         /* 1 */
-    {"pr.dec", TOK_PRDEC, ONEARG},      /* 2 */
-    {"pr.dec.s", TOK_PRDEC_S, ONEARG},  /* 3 */
-    {"pr.hex", TOK_PRHEX, ONEARG},      /* 4 */
-    {"pr.msg", TOK_PRMSG, ONESTRARG},   /* 5 */
-    {"pr.nl", TOK_PRNL, NOARGS},        /* 6 */
-    {"pr.str", TOK_PRSTR, ONEARG},      /* 7 */
-    {"pr.ch", TOK_PRCH, ONEARG},        /* 8 */
-    {"kbd.ch", TOK_KBDCH, ONEARG},      /* 9 */
-    {"kbd.ln", TOK_KBDLN, TWOARGS},     /* 10 */
-    {"quit", TOK_QUIT, NOARGS},         /* 11 */
-    {"clear", TOK_CLEAR, NOARGS},       /* 12 */
-    {"vars", TOK_VARS, NOARGS},         /* 13 */
-    {"word", TOK_WORD, CUSTOM},         /* 14 */
-    {"byte", TOK_BYTE, CUSTOM},         /* 15 */
-    {"const", TOK_CONST, CUSTOM},       /* 16 */
-    {"run", TOK_RUN, NOARGS},           /* 17 */
-    {"comp", TOK_COMPILE, ONESTRARG},   /* 18 */
-    {"new", TOK_NEW, NOARGS},           /* 19 */
-    {"sub", TOK_SUBR, INITIALNAMEARG},  /* 20 */
-    {"endsub", TOK_ENDSUBR, NOARGS},    /* 21 */
-    {"if", TOK_IF, ONEARG},             /* 22 */
-    {"else", TOK_ELSE, NOARGS},         /* 23 */
-    {"endif", TOK_ENDIF, NOARGS},       /* 24 */
-    {"free", TOK_FREE, NOARGS},         /* 25 */
-    {"call", TOK_CALL, INITIALNAMEARG}, /* 26 */
-    {"return", TOK_RET, ONEARG},        /* 27 */
-    {"for", TOK_FOR, CUSTOM},           /* 28 */
-    {"endfor", TOK_ENDFOR, NOARGS},     /* 29 */
-    {"while", TOK_WHILE, ONEARG},       /* 30 */
-    {"endwhile", TOK_ENDW, NOARGS},     /* 31 */
-    {"end", TOK_END, NOARGS},           /* 32 */
-    {"mode", TOK_MODE, ONEARG},         /* 33 */
-    {"*", TOK_POKEWORD, INITIALARG},    /* 34 */
-    {"^", TOK_POKEBYTE, INITIALARG},    /* 35 */
+    /* Arguments are evaluated as subexpressions */
+    push_operator_stack(SENTINEL);
+    p = txtPtr;
+    c->resoff = contoff(p);
+    ret = framecall(CONTLINE);
+    if (ret) {
+        pop_operator_stack();
+        return ret;
+    }
 
-    /* Editor commands */
-    {":r", TOK_LOAD, ONESTRARG},        /* 36 */
-    {":w", TOK_SAVE, ONESTRARG},        /* 37 */
-    {":l", TOK_LIST, CUSTOM},           /* 38 */
-    {":c", TOK_CHANGE, INITIALARG},     /* 39 */
-    {":a", TOK_APP, ONEARG},            /* 40 */
-    {":i", TOK_INS, ONEARG},            /* 41 */
-    {":d", TOK_DEL, INITIALARG}         /* 42 - set NUMSTMNTS to this value */
-};
+    /* Return stack has the position after the call, now in the sub */
+    c->resoff += (char *) return_stack[returnSP + 1] - p;
+
+    /* Suspend the statement and continue in the sub */
+    contactive->calloff = off;
+    contactive->next = contstack;
+    contstack = contactive;
+    contactive = NULL;
+    longjmp(contctx->jb, 1);
+    return 0;                   /* Not reached */
+}
 
 /*
- * Attempt to find statement keyword
- * Returns the token or ILLEGAL
- *
- * Uses table stmnttab, returning the token corresponding to the first
- * matching name.  Also checks for either a space or end of line following
- * the keyword, or will not declare a match.
- */
-unsigned char matchstatement()
+ * Called by evalexpr() for an expression at contexproff.  If this is the
+ * expression which made the call the statement being replayed was
+ * suspended by, then rather than parse it again, restores the expression
+ * stacks as they were at the call, pushes its result and carries on
+ * parsing after it.
+ * Returns 0 on success, 1 on error, or 2 if the expression should be
+ * parsed in the usual way.
+ */
+unsigned char contresumeexpr()
 {
+    struct contrec *c = contactive;
     unsigned char i;
-    unsigned char len;
-    char c;
-    struct stmnttabent *s;
+    unsigned char nparens = 0;
 
-    for (i = 0; i < NUMSTMNTS; ++i) {
-        s = &(stmnttab[i]);
-        len = strlen(s->name);
-        if (!strncmp(txtPtr, s->name, len)) {
-            /*
-             * Do not check for whitespace for tokens >= TOK_POKEWORD
-             * Also do not check for whitespace for tokens <= TOK_COMM.
-             */
-            if ((s->token >= TOK_POKEWORD) || (s->token <= TOK_COMM)) {
-                return s->token;
-            }
-            c = *(txtPtr + len);
-            if ((c == 0) || (c == ' ') || (c == ';')) {
-                return s->token;
-            }
+    if (!c || !c->resumable || (c->exproff != contexproff)) {
+        return 2;
+    }
+    c->resumable = 0;
+    for (i = 0; i < c->nopnds; ++i) {
+        push_operand_stack(c->opnds[i]);
+    }
+    for (i = 0; i < c->noprs; ++i) {
+        push_operator_stack(c->oprs[i]);
+        if (c->oprs[i] == SENTINEL) {
+            ++nparens;
         }
     }
-    return ILLEGAL;
+    push_operand_stack(contfind(c->calloff)->val);
+#ifdef EXTMEM
+    txtPtr = embuf + c->resoff;
+#else
+    txtPtr = current->line + c->resoff;
+#endif
+    eatspace();
+
+    /*
+     * Finish the innermost subexpression, then each enclosing one in
+     * turn, as E() and the '(' case of P() would have done.
+     */
+    if (Erest()) {
+        return 1;
+    }
+    while (nparens--) {
+        if (expect(')')) {
+            return 1;
+        }
+        pop_operator_stack();
+        if (Erest()) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
 /*
- * Used to check no arguments are passed to statements that do not take them
- * Returns 0 if end of line or semicolon next, 1 otherwise.
+ * Return from a sub entered by contcall(), with return value val.
+ * Resumes the suspended statement.
+ * Returns RET_SUCCESS on success, RET_ERROR on error.
  */
-unsigned char checkNoMoreArgs()
+unsigned char contreturn(int val)
 {
-    eatspace();
-    if (*txtPtr && (*txtPtr != ';')) {
-        error(ERR_EXTRA);
-        printchar(' ');
-        print(txtPtr);
-        return 1;
+    if (!contstack) {
+        error(ERR_STACK);
+        return RET_ERROR;
     }
-    return 0;
-}
+    contactive = contstack;
+    contstack = contstack->next;
+    contleaf(contactive->calloff, &val);
 
-#ifdef A2E
-#pragma code-name (push, "LC")
-#endif
-void showfreespace() {
-    print("free:\n");
-#ifdef CC65
+    current = contactive->line;
+    counter = contactive->counter;
 #ifdef EXTMEM
-    print("Blk1: ");
-    printdec(getfreespace1());
-    print(" / ");
-    printdec(gettotalspace1());
-#ifdef EXTMEMCODE
-    print(" vars\n");
+    copyfromaux(current->line, current->len);
+    txtPtr = embuf + contactive->stmtoff;
 #else
-    print(" bytecode,vars\n");
+    txtPtr = current->line + contactive->stmtoff;
 #endif
-    print("Blk2: ");
-    printdec(getfreespace2());
-    print(" / ");
-    printdec(gettotalspace2());
-    print(" lists,linkage\n");
-    print("Aux:  ");
-    printdec(getfreeauxmem());
-    print(" / ");
-    printdec(gettotalauxmem());
-#ifdef EXTMEMCODE
-    print(" source,bytecode");
-#else
-    print(" source");
-#endif
-#else
-    print("Blk1: ");
-    printdec(getfreespace1());
-    print(" / ");
-    printdec(gettotalspace1());
-    print(" bytecode,vars\n");
-    print("Blk2: ");
-    printdec(getfreespace2());
-    print(" / ");
-    printdec(gettotalspace2());
-    print(" source,linkage");
+    contresume = 1;
+    return RET_SUCCESS;
+}
 #endif
-#else
-    printdec(getfreespace1());
-    print(" / ");
-    printdec(gettotalspace1());
-    print(" bytecode,vars\n");
-    print("unlimited source,linkage");
+
+#define COSTACKMIN  32          /* Least room for stack in coroutine object */
+
+#ifdef COROUTINE
+
+/*
+ * Coroutines.
+ * co.new sets up a word array as a coroutine object.  The object starts
+ * with struct coobj, so that element 0 is the status as in compiled code.
+ * The variables of the subs run by the coroutine live in the rest of the
+ * array: while it runs heap1Ptr and heap1Lim point into the array, and a
+ * placeholder variable at the top of it is linked after the resumer's
+ * variables.  The part of the return stack belonging to the coroutine is
+ * copied into the object when it yields, after the header, and pushed back
+ * when it is resumed.  The sub is entered with COLINE as the return line,
+ * so that returning from it ends the coroutine.
+ *
+ * Calls within expressions either recurse in C or are suspended on the
+ * continuation stack, so a coroutine can not yield from a sub called
+ * within an expression.
+ */
+
+#define COLINE      -4          /* CALLFRAME line number: end coroutine */
+#define COMAGIC     0x434f      /* Set once object has been set up      */
+
+struct coobj {
+    int status;                 /* CO_xxx, from eightballvm.h          */
+    int magic;                  /* COMAGIC                             */
+    int counter;                /* Where the coroutine continues       */
+    char *txt;
+    unsigned char *heap;        /* Its heap1Ptr, varsend and varslocal */
+    var_t *vend;
+    var_t *vlocal;
+    var_t *base;                /* Placeholder at top of its variables */
+    unsigned int nret;          /* Number of return stack entries      */
+    int rcounter;               /* Where the resumer continues         */
+    char *rtxt;
+    int raddr;                  /* Address to store value yielded at   */
+    unsigned char *rheap;       /* Resumer's heap1Ptr and heap1Lim     */
+    unsigned char *rlim;
+    var_t *rvend;               /* Resumer's varsend and varslocal     */
+    var_t *rvlocal;
+    unsigned int rsp;           /* Resumer's returnSP                  */
+    struct coobj *prev;         /* Coroutine which was running         */
+    intptr_t ret[];             /* Saved return stack entries          */
+};
+
+/*
+ * Start running coroutine co, saving the state of the resumer, which
+ * continues at txtPtr.  raddr is where the value yielded is stored.
+ */
+void coenter(struct coobj *co, int raddr)
+{
+    co->rcounter = counter;
+    co->rtxt = txtPtr;
+    co->raddr = raddr;
+    co->rheap = heap1Ptr;
+    co->rlim = heap1Lim;
+    co->rvend = varsend;
+    co->rvlocal = varslocal;
+    co->rsp = returnSP;
+    co->prev = corunning;
+    co->status = CO_RUNNING;
+    corunning = co;
+    heap1Lim = (unsigned char *) co->ret;
+#ifdef EXPRCACHE
+    exprcache_newgen();
 #endif
 }
-#ifdef A2E
-#pragma code-name (pop)
+
+/*
+ * Save the state of running coroutine co, which continues at txtPtr.
+ * Returns RET_SUCCESS on success, RET_ERROR on error.
+ */
+unsigned char cosuspend(struct coobj *co)
+{
+    unsigned int n = co->rsp - returnSP;
+    unsigned int i;
+
+    /* Calls which must return to where they were made */
+    for (i = returnSP + 2; i <= co->rsp; ++i) {
+        if ((return_stack[i] == CALLFRAME) &&
+            ((return_stack[i - 1] == -2) || (return_stack[i - 1] == CONTLINE))) {
+            error(ERR_CORO);
+            return RET_ERROR;
+        }
+    }
+    if ((unsigned char *) (co->ret + n) > heap1Ptr) {
+        error(ERR_CORO);
+        return RET_ERROR;
+    }
+    memcpy(co->ret, &(return_stack[returnSP + 1]), n * sizeof(intptr_t));
+    co->nret = n;
+    co->counter = counter;
+    co->txt = txtPtr;
+    co->heap = heap1Ptr;
+    co->vend = varsend;
+    co->vlocal = varslocal;
+    co->status = CO_SUSPENDED;
+    return RET_SUCCESS;
+}
+
+/*
+ * Restore the state of the resumer of running coroutine co, apart from
+ * where it continues.
+ */
+void corestore(struct coobj *co)
+{
+    returnSP = co->rsp;
+    heap1Ptr = co->rheap;
+    heap1Lim = co->rlim;
+    co->rvend->next = NULL;
+    varsend = co->rvend;
+    varslocal = co->rvlocal;
+    corunning = co->prev;
+#ifdef EXPRCACHE
+    exprcache_newgen();
 #endif
+}
 
-/* Parse a line from the input buffer
- * Handles statements
- * Starts reading from location of txtPtr
- * Returns:
- *   0: Keep executing
- *   1: Normal stop
- *   2: Error stop
- *   3: User stop / escape
+/*
+ * Go back to the resumer of running coroutine co.
  */
-unsigned char parseline()
+void coexit(struct coobj *co)
 {
-    int token;
-    int arg;
-    int arg2;
-    char *p;
-    char *startTxtPtr;
-    struct stmnttabent *s;
+    corestore(co);
+    skipFlag = 0;
+    backtotop(co->rcounter, co->rtxt);
+}
 
-    for (;;) {
+/*
+ * Abandon all running coroutines, after an error or end.
+ */
+void coreset()
+{
+    while (corunning) {
+        corunning->status = CO_DONE;
+        corestore(corunning);
+    }
+}
 
-        /* See if user requested stop */
-        if (checkInterrupted()) {
-            return 3;
-        }
+/*
+ * Set up the word array of n elements at addr as a coroutine object
+ * which will call the sub named in readbuf, with the arguments at txtPtr.
+ * Returns RET_SUCCESS on success, RET_ERROR on error.
+ */
+unsigned char conew(int addr, int n)
+{
+    struct coobj *co = (struct coobj *) PTR(addr);
 
-        eatspace();
+    if ((n * sizeof(int) < sizeof(struct coobj) + COSTACKMIN) ||
+        ((co->magic == COMAGIC) && (co->status == CO_RUNNING))) {
+        error(ERR_CORO);
+        return RET_ERROR;
+    }
+    co->magic = 0;
+    coenter(co, 0);
+
+    /* Evaluate the arguments and enter the sub, in the new object */
+    heap1Ptr = (unsigned char *) co + n * sizeof(int);
+    co->base = alloc1(sizeof(var_t) + sizeof(int));
+    memcpy(co->base->name, "----", VARNUMCHARS);
+    co->base->type = TYPE_WORD;
+    co->base->next = NULL;
+    varsend->next = co->base;
+    varsend = co->base;
+    if (docall()) {
+        co->status = CO_DONE;
+        corestore(co);
+        return RET_ERROR;
+    }
+    return_stack[co->rsp - 1] = COLINE;
 
-        while (*txtPtr == ';') {
-            ++txtPtr;
-            if (!(*txtPtr)) {
-                return 0;
-            }
-            eatspace();
-        }
+    /* Suspend it, ready to run the first line of the sub */
+    co->rtxt = (char *) return_stack[co->rsp - 2];
+    if (cosuspend(co)) {
+        co->status = CO_DONE;
+        corestore(co);
+        return RET_ERROR;
+    }
+    co->magic = COMAGIC;
+    coexit(co);
+    return RET_SUCCESS;
+}
 
-        if (!(*txtPtr)) {
-            return 0;
-        }
+/*
+ * Resume the coroutine object at addr.  When it yields, the value is
+ * stored at raddr and the resumer continues at txtPtr.
+ * Returns RET_SUCCESS on success, RET_ERROR on error.
+ */
+unsigned char coresume(int addr, int raddr)
+{
+    struct coobj *co = (struct coobj *) PTR(addr);
 
-        startTxtPtr = txtPtr;
+    if ((co->magic != COMAGIC) || (co->status != CO_SUSPENDED)) {
+        error(ERR_CORO);
+        return RET_ERROR;
+    }
+    if (co->nret >= returnSP) {
+        error(ERR_STACK);
+        return RET_ERROR;
+    }
+    coenter(co, raddr);
+    varsend->next = co->base;
+    heap1Ptr = co->heap;
+    varsend = co->vend;
+    varslocal = co->vlocal;
+    returnSP -= co->nret;
+    memcpy(&(return_stack[returnSP + 1]), co->ret, co->nret * sizeof(intptr_t));
+    skipFlag = 0;
+    backtotop(co->counter, co->txt);
+    return RET_SUCCESS;
+}
 
-        token = matchstatement();
+/*
+ * Yield value val from the running coroutine.
+ * Returns RET_SUCCESS on success, RET_ERROR on error.
+ */
+unsigned char coyield(int val)
+{
+    struct coobj *co = corunning;
 
-        /*
-         * If skipFlag is set, then only process those tokens that
-         * manipulate skipFlag:
-         *   'if / else / endif'
-         *   'while / endw'
-         * Skip all others.
-         */
-        if (skipFlag) {
-            if ((token != TOK_IF) &&
-                (token != TOK_ELSE) &&
-                (token != TOK_ENDIF) &&
-                (token != TOK_WHILE) && (token != TOK_ENDW)) {
+    if (!co) {
+        error(ERR_CORO);
+        return RET_ERROR;
+    }
+    contfree();
+    if (cosuspend(co)) {
+        return RET_ERROR;
+    }
+    coexit(co);
+    *(int *) PTR(co->raddr) = val;
+    return RET_SUCCESS;
+}
 
-                /*
-                 * Eat the statement up to semicolon or the
-                 * end.
-                 */
-                while (*txtPtr && (*txtPtr != ';')) {
-                    ++txtPtr;
-                }
-                continue;
-            }
-        }
+/*
+ * Return from the sub run by the running coroutine, which is then done.
+ * val is the last value it yields.
+ * Returns RET_SUCCESS on success, RET_ERROR on error.
+ */
+unsigned char coreturn(int val)
+{
+    struct coobj *co = corunning;
 
-        if (token == ILLEGAL) {
+    if (!co) {
+        error(ERR_STACK);
+        return RET_ERROR;
+    }
+    co->status = CO_DONE;
+    coexit(co);
+    *(int *) PTR(co->raddr) = val;
+    coreturned = 1;
+    return RET_SUCCESS;
+}
+#endif
 
-#ifdef CBM
-            /*
-             * If the first character is a digit then treat
-             * this as an editor 'change line' command.  This
-             * allows the VIC-20/C64 screen editor to work the
-             * same way as in BASIC.
-             */
+/*
+ * Handle co.new statement, which sets up a word array as a coroutine
+ * object to run a sub:
+ *   co.new g, sub(args)
+ * Returns RET_SUCCESS on success, RET_ERROR on error.
+ */
+unsigned char doconew()
+{
+    var_t *v;
+    char *p = txtPtr;
+    char *q = readbuf;
+    int addr;
+    int n;
+    unsigned char local = 0;
 
-            if (isdigitch(*txtPtr)) {
+    while (isalphach(*txtPtr) || isdigitch(*txtPtr)) {
+        *(q++) = *(txtPtr++);
+    }
+    *q = '\0';
+    v = findintvar(readbuf, &local);
+    if (!v) {
+        error(ERR_VAR);
+        return RET_ERROR;
+    }
+    if (((v->type & 0xf0) != 0x10) || ((v->type & 0x0f) != TYPE_WORD)) {
+        error(ERR_TYPE);
+        return RET_ERROR;
+    }
+    /* Size is not known for an array passed by reference */
+    n = *(getptrtoscalarword(v) + 1);
+    if ((n == -1) || (compile && (2 * n < CO_HDRSZ + COSTACKMIN))) {
+        error(ERR_CORO);
+        return RET_ERROR;
+    }
 
-                token = TOK_CHANGE;
-                s = &(stmnttab[token - TOK_COMM]);
+    /* Address of the array */
+    txtPtr = p;
+    if (eval(0, &addr)) {
+        return RET_ERROR;
+    }
+    eatspace();
+    if (expect(',')) {
+        return RET_ERROR;
+    }
+    eatspace();
+    q = readbuf;
+    while (isalphach(*txtPtr) || isdigitch(*txtPtr)) {
+        *(q++) = *(txtPtr++);
+    }
+    *q = '\0';
+    if (!(*readbuf)) {
+        error(ERR_ARG);
+        return RET_ERROR;
+    }
 
-            } else {
-#endif
-                /*
-                 * Variable assignment winds up here
-                 */
-                if (assignorcreate(LET_MODE)) {
-                    return 2;   /* Error */
-                }
-                continue;
-#ifdef CBM
-            }
+    if (compile) {
+        emitldi(2 * n);
+        emit(VM_CONEW);
+        costart = 1;
+        n = docall();
+        costart = 0;
+        return n;
+    }
+#ifdef COROUTINE
+    return conew(addr, n);
+#else
+    error(ERR_CORO);
+    return RET_ERROR;
 #endif
+}
 
-        } else {
+/*
+ * Argument list of each vector statement, in order of VEC_ operation.
+ * 'a' is the name of an array, 'e' any expression.
+ */
+char *vecargs[] = {
+    "aaae", "aaae", "aaae", "aaae", "aaae", "aaee",
+    "eae", "eae", "eae", "eaee", "eaee"
+};
 
-            s = &(stmnttab[token - TOK_COMM]);
+/* Element j of array p in dovec(), unsigned as in the VM */
+#define vecget(p, j) ((type == TYPE_BYTE) ? ((unsigned char *) (p))[j] : (unsigned short) ((int *) (p))[j])
 
-            /* Eat the keyword */
-            txtPtr += strlen(s->name);
+/*
+ * Handle the vector statements, which work on whole word or byte arrays:
+ *   vec.add d, a, b, n     d[i] = a[i] + b[i] for i from 0 to n-1
+ *   vec.sub, vec.and, vec.or and vec.xor likewise
+ *   vec.adds d, a, k, n    d[i] = a[i] + k
+ *   vec.sum &r, a, n       r = sum of the a[i]
+ *   vec.min &r, a, n       r = smallest a[i] (0 if n is 0)
+ *   vec.max &r, a, n       r = largest a[i] (0 if n is 0)
+ *   vec.cnt &r, a, k, n    r = number of a[i] equal to k
+ *   vec.find &r, a, k, n   r = first i where a[i] equals k, or $ffff
+ * The arrays must all be word arrays or all byte arrays.  Compiled code
+ * uses VM_VEC, which does the whole loop in one instruction.
+ * op is the VEC_ operation.
+ * Returns RET_SUCCESS on success, RET_ERROR on error.
+ */
+
+unsigned char dovec(unsigned char op)
+{
+    char *kind = vecargs[op];
+    unsigned char nargs = strlen(kind);
+    unsigned char type = 0;
+    unsigned char local = 0;
+    unsigned char i;
+    int args[4];
+    char *p;
+    char *q;
+    var_t *v;
+    int j;
+    int r;
+    int k;
+    int val;
 
+    for (i = 0; i < nargs; ++i) {
+        if (i > 0) {
+            eatspace();
+            if (expect(',')) {
+                return RET_ERROR;
+            }
             eatspace();
         }
-
-        /*
-         * If we are compiling it is good to keep a copy of the
-         * VM program counter just before we begin argument 
-         * handling.  This is useful for re-evaluating WHILE loop
-         * guards, for example!
-         */
-        rtPCBeforeEval = rtPC;
-
-        /*
-         * Generic parameter handling based on statement type.
-         */
-        switch (s->type) {
-
-        case NOARGS:
-            /* Check end of input */
-            arg = checkNoMoreArgs();
-            if (arg) {
-                return 2;
+        p = txtPtr;
+        if (kind[i] == 'a') {
+            q = readbuf;
+            while (isalphach(*txtPtr) || isdigitch(*txtPtr)) {
+                *(q++) = *(txtPtr++);
+            }
+            *q = '\0';
+            v = findintvar(readbuf, &local);
+            if (!v) {
+                error(ERR_VAR);
+                return RET_ERROR;
             }
-            break;
-        case ONEARG:
-            /* Evaluate one arg and check end of input */
-            if (eval(1, &arg)) {
-                return 2;
+            if (!(v->type & 0x10) || ((v->type & 0x0f) == TYPE_LONG) ||
+                (type && ((v->type & 0x0f) != type))) {
+                error(ERR_TYPE);
+                return RET_ERROR;
             }
-            break;
-        case TWOARGS:
-            /* Evaluate one arg don't check end of input */
-            if (eval(0, &arg)) {
-                return 2;
+            type = v->type & 0x0f;
+            q = txtPtr;
+            txtPtr = p;
+        }
+        if (eval((i == nargs - 1), &args[i])) {
+            return RET_ERROR;
+        }
+        /* An array argument must be just the name */
+        if (kind[i] == 'a') {
+            while (*q == ' ') {
+                ++q;
             }
             eatspace();
-            if (expect(',')) {
-                return 2;
-            }
-            /* Evaluate second arg, don't check end of input */
-            if (eval(0, &arg2)) {
-                return 2;
+            if (txtPtr != q) {
+                error(ERR_TYPE);
+                return RET_ERROR;
             }
+        }
+    }
+
+    if (compile) {
+        emit_imm(VM_VEC, op | ((type == TYPE_BYTE) ? VEC_BYTE : 0));
+        if (op >= VEC_SUM) {
+            /* Result is above the address to store it at */
+            emit(VM_SWAP);
+            emit(VM_STAWORD);
+        }
+        return RET_SUCCESS;
+    }
+
+    /*
+     * As in the VM, word elements are taken as unsigned 16 bit values and
+     * the results wrap at 16 bits.
+     */
+    r = (op == VEC_FIND) ? 0xffff : 0;
+    k = args[2] & 0xffff;
+    /* The source array, and the second one for the elementwise operations */
+    p = (char *) PTR(args[1]);
+    q = (char *) PTR(args[2]);
+    for (j = 0; j < args[nargs - 1]; ++j) {
+        val = vecget(p, j);
+        switch (op) {
+        case VEC_ADD:
+            val += vecget(q, j);
             break;
-        case INITIALARG:
-            /* Evaluate one arg, don't check end of input */
-            if (eval(0, &arg)) {
-                return 2;
-            }
+        case VEC_SUB:
+            val -= vecget(q, j);
             break;
-        case ONESTRARG:
-            /* Parse quoted string, place it in readbuf */
-            if (!(*txtPtr == '"')) {
-                return 2;
-            }
-            ++txtPtr;
-            p = readbuf;
-            while (*txtPtr && (*txtPtr != '"')) {
-                *(p++) = *(txtPtr++);
-            }
-            *p = '\0';
-            if (*txtPtr == '"') {
-                ++txtPtr;
-            } else {
-                error(ERR_STR);
-                return 2;
-            }
-            arg = checkNoMoreArgs();
-            if (arg) {
-                return 2;
-            }
+        case VEC_AND:
+            val &= vecget(q, j);
             break;
-        case INITIALNAMEARG:
-            /* Evaluate name, place in readbuf */
-            /* Don't check end of input */
-            if (!isalpha(*txtPtr)) {
-                return 2;
-            }
-            p = readbuf;
-            while (*txtPtr && (isalphach(*txtPtr) || isdigitch(*txtPtr))) {
-                *(p++) = *(txtPtr++);
-            }
-            *p = '\0';
+        case VEC_OR:
+            val |= vecget(q, j);
             break;
-        case FULLLINE:
-            /* Eat the line */
-            while (*txtPtr) {
-                ++txtPtr;
-            }
+        case VEC_XOR:
+            val ^= vecget(q, j);
             break;
-#ifdef __GNUC__
-        case CUSTOM:
+        case VEC_ADDS:
+            val += k;
             break;
+        case VEC_SUM:
+            r += val;
+            continue;
+        case VEC_MIN:
+            if ((j == 0) || (val < r)) {
+                r = val;
+            }
+            continue;
+        case VEC_MAX:
+            if ((j == 0) || (val > r)) {
+                r = val;
+            }
+            continue;
+        case VEC_CNT:
+            if (val == k) {
+                ++r;
+            }
+            continue;
+        case VEC_FIND:
+            if ((r == 0xffff) && (val == k)) {
+                r = j;
+            }
+            continue;
+        }
+        if (type == TYPE_BYTE) {
+            ((unsigned char *) PTR(args[0]))[j] = val;
+        } else {
+            ((int *) PTR(args[0]))[j] = storeval(TYPE_WORD, val);
+        }
+    }
+    if (op >= VEC_SUM) {
+        *(int *) PTR(args[0]) = storeval(TYPE_WORD, r);
+    }
+    return RET_SUCCESS;
+}
+
+/*
+ * Number of arguments each native takes, indexed by native number.
+ */
+const unsigned char nativenargs[] = NATNARGS;
+
+/*
+ * Native subs are declared 'sub name(params) native n' and compile to
+ * VM_NATIVE n, which calls host function n with the arguments left on the
+ * eval stack.  The body is only run by the interpreter.
+ * p points into the parameter list of the sub header.
+ * Returns n, or -1 if the sub is not native.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
 #endif
+int subnative(char *p)
+{
+    int n = 0;
+
+    while (*p && (*p != ')')) {
+        ++p;
+    }
+    if (!(*p)) {
+        return -1;
+    }
+    ++p;
+    while (*p == ' ') {
+        ++p;
+    }
+    if (strncmp(p, "native", 6)) {
+        return -1;
+    }
+    p += 6;
+    while (*p == ' ') {
+        ++p;
+    }
+    if (!isdigitch(*p)) {
+        return -1;
+    }
+    while (isdigitch(*p)) {
+        n = n * 10 + *(p++) - '0';
+    }
+    return n;
+}
+
+/*
+ * Count the parameters of a sub.
+ * p points into the parameter list of the sub header.
+ */
+unsigned char subnparams(char *p)
+{
+    unsigned char n = 0;
+
+    while (*p == ' ') {
+        ++p;
+    }
+    if (*p && (*p != ')')) {
+        n = 1;
+    }
+    while (*p && (*p != ')')) {
+        if (*(p++) == ',') {
+            ++n;
         }
+    }
+    return n;
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+#ifdef MODULES
+
+/*
+ * Subs in other modules are declared 'sub name(params) extern', with no
+ * body.  The linker fills in the address of the sub in each call.
+ * p points into the parameter list of the sub header.
+ * Returns 1 if the sub is extern, 0 otherwise.
+ */
+unsigned char subextern(char *p)
+{
+    while (*p && (*p != ')')) {
+        ++p;
+    }
+    if (!(*p)) {
+        return 0;
+    }
+    ++p;
+    while (*p == ' ') {
+        ++p;
+    }
+    return !strncmp(p, "extern", 6);
+}
+
+#endif
+
+/*
+ * Perform call instruction
+ * Expects sub name to call in readbuf
+ * Return RET_SUCCESS if successful, RET_ERROR on error
+ */
+unsigned char docall()
+{
+    unsigned char type;
+    char *p;
+    int arg;
+    char name[VARNUMCHARS];
+    char name2[VARNUMCHARS];
+    unsigned char j;
+    unsigned char arraymode;
+    var_t *oldvarslocal;
+    var_t *newvarslocal;
+    var_t *array;
+    sub_t *s;
+    unsigned char argbytes = 0;
+    struct lineofcode *l = program;
+    int origcounter = counter;
+    unsigned char local = 0;
+    int native = -1;
 
+    /*
+     * Do this before evaluating arguments, which overwrites readbuf
+     */
+    if (compile) {
         /*
-         * Code for individual statements.
+         * Allocate this on the top-down stack in arena 2.  This grows down
+         * towards the source code, which is growing up from the bottom of
+         * arena 2.
          */
-        switch (token) {
-        case TOK_COMM:
-            break;
-        case TOK_QUIT:
-#ifdef C64
-            /* Restore normal NMI vector on C64 */
-            POKE(808, 237);
-#elif defined(VIC20)
-            /* Restore normal NMI vector on VIC20 */
-            POKE(808, 112);
+        s = alloc2top(sizeof(sub_t));
+        strncpy(s->name, readbuf, SUBRNUMCHARS);
+    }
+
+#ifdef FRAMECACHE
+    if (!compile) {
+        j = framecall(counter);
+        if (j != 2) {
+            return j;
+        }
+    }
 #endif
 
-            print("Bye!\n");
-            EXIT(0);
-        case TOK_PRDEC:
-            if (compile) {
-                emit(VM_PRDEC);
-            } else {
-                printdec(arg);
-            }
-            break;
-        case TOK_PRDEC_S:
-            if (compile) {
-                emit(VM_DUP);   /* Preserve arg on the stack */
-                emitldi(0x8000);
-                emit(VM_BITAND);
-                emit(VM_NOT);
-                emit_imm(VM_BRNCHIMM, rtPC + 9);      /* Jump over printing of '-' */
-                emitldi('-');
-                emit(VM_PRCH);
-                emit(VM_NEG);
-                emit(VM_PRDEC);
-            }
-            if (arg < 0) {
-                printchar('-');
-                arg = -arg;
-            }
-            printdec(arg);
-            break;
-        case TOK_PRHEX:
-            if (compile) {
-                emit(VM_PRHEX);
-            } else {
-                printhex(arg);
-            }
-            break;
-        case TOK_PRMSG:
-            if (compile) {
-                emitprmsg();
-            } else {
-                print(readbuf);
-            }
-            break;
-        case TOK_PRNL:
-            if (compile) {
-#ifdef CBM
-                emitldi(13);
+    if (!compile) {
+        counter = -1;
+    }
+    while (l) {
+#ifdef EXTMEM
+        copyfromaux2(l->line, l->len);
+        p = embuf2;
 #else
-                emitldi(10);
+        p = l->line;
 #endif
-                emit(VM_PRCH);
-            } else {
-                printchar('\n');
-            }
-            break;
-        case TOK_PRSTR:
-            if (compile) {
-                emit(VM_PRSTR);
-            } else {
-                print((char *) arg);
-            }
-            break;
-        case TOK_PRCH:
-            if (compile) {
-                emit(VM_PRCH);
-            } else {
-                printchar(arg);
+        if (!compile) {
+            ++counter;
+        }
+
+        skipFlag = 0;
+
+        while (p && (*p == ' ')) {
+            ++p;
+        }
+        if (!strncmp(p, "sub ", 4)) {
+            p += 4;
+            while (p && (*p == ' ')) {
+                ++p;
             }
+
+            if (!compareUntil(p, readbuf, '(')) {
+
+                /*
+                 * Here we are parsing two lines at a time:
+                 * The call (at *txtPtr as usual) and the
+                 * sub being called (at *p).
+                 */
+
+                /* Eat the subroutine name at *p */
+                while (p && (*p != '(')) {
+                    ++p;
+                }
+                if (!p) {
+                    error(ERR_EXPECT);
+                    printchar('(');
+                    return RET_ERROR;
+                }
+                ++p;            /* Eat the '(' */
+
+                if (compile) {
+                    native = subnative(p);
+                    if ((native != -1) &&
+                        ((native >= NUMNATIVES) ||
+                         (subnparams(p) != nativenargs[native]))) {
+                        /* Declaration does not match the VM's native */
+                        counter = origcounter;
+                        error(ERR_ARG);
+                        return RET_ERROR;
+                    }
+                }
+#ifdef MODULES
+                if (!compile && subextern(p)) {
+                    /* Only the linker can find it */
+                    counter = origcounter;
+                    error(ERR_LINK);
+                    return RET_ERROR;
+                }
+#endif
+
+                /*
+                 * Set up txtPtr to start passing the argument
+                 * list of the call
+                 */
+                eatspace();
+                if (expect('(')) {
+                    counter = origcounter;
+                    return RET_ERROR;
+                }
+
+                if (!compile) {
+                    /*
+                     * Will need this later for looking up
+                     * things in the 'old' frame
+                     */
+                    oldvarslocal = varslocal;
+
+                    /*
+                     * For CALL, stack frame is:
+                     *  - CALLFRAME magic number
+                     *  - line number of CALL
+                     *  - Pointer to just after the call statement
+                     *    (set further down in the code)
+                     */
+                    push_return(CALLFRAME);
+                    push_return(origcounter);
+
+                    vars_markcallframe();
+
+                    newvarslocal = varslocal;
+                }
+
+                /*
+                 * Iterate through the formal parameter
+                 * list of the sub (at *p).
+                 *
+                 * For word and byte scalar parameters, we
+                 * instantiate a local of the appropriate
+                 * type, evaluate the corresponding expression
+                 * in the call and store the result in this
+                 * new local.
+                 *
+                 * For arrays we copy the header, leaving
+                 * the pointer to the original global data
+                 * intact.  Effectively, this gives arrays
+                 * pass by reference semantics (similar to C).
+                 * This trick works when passing literal
+                 * arrays only.
+                 */
+                for (;;) {
+                    while (p && (*p == ' ')) {
+                        ++p;
+                    }
+                    if (!p) {
+                        error(ERR_ARG);
+                        return RET_ERROR;
+                    }
+                    if (*p == ')') {
+                        break;
+                    }
+                    if (!strncmp(p, "word ", 5)) {
+                        type = TYPE_WORD;
+                    } else if (!strncmp(p, "byte ", 5)) {
+                        type = TYPE_BYTE;
+                    } else if (!strncmp(p, "long ", 5)) {
+                        type = TYPE_LONG;
+                    } else {
+                        error(ERR_ARG);
+                        return RET_ERROR;
+                    }
+                    p += 5;
+                    while (p && (*p == ' ')) {
+                        ++p;
+                    }
+                    if (!p) {
+                        error(ERR_ARG);
+                        return RET_ERROR;
+                    }
+                    for (j = 0; j < VARNUMCHARS; ++j) {
+                        name[j] = 0;
+                    }
+                    j = 0;
+                    while (p && (isalphach(*p) || isdigitch(*p))) {
+                        if (j < VARNUMCHARS) {
+                            name[j] = *p;
+                        }
+                        ++j;
+                        ++p;
+                    }
+                    /*
+                     * If argument is followed by '[]'
+                     * then switch to pass array by ref
+                     * mode.
+                     */
+                    arraymode = 0;
+                    if (p && (*p == '[')) {
+                        ++p;
+                        if (p && (*p == ']')) {
+                            ++p;
+                            arraymode = 1;
+                        } else {
+                            error(ERR_ARG);
+                            return RET_ERROR;
+                        }
+                    }
+
+                    /*
+                     * Now we go back to looking at the 
+                     * call arguments
+                     */
+
+                    /* If end of line, error */
+                    if (!(*txtPtr)) {
+                        counter = origcounter;
+                        error(ERR_ARG);
+                        return RET_ERROR;
+                    }
+                    if (*txtPtr == ')') {
+                        counter = origcounter;
+                        error(ERR_ARG);
+                        return RET_ERROR;
+                    }
+                    if (!arraymode) {
+                        /*
+                         * Pass scalar value
+                         */
+                        if (!compile) {
+                            /* Back to old frame for lookup */
+                            varslocal = oldvarslocal;
+                        } else if (type == TYPE_LONG) {
+                            /* Native subs take words */
+                            if (native != -1) {
+                                counter = origcounter;
+                                error(ERR_TYPE);
+                                return RET_ERROR;
+                            }
+                            evalwant = EVAL_LONG;
+                        }
+                        if (eval(0, &arg)) {
+                            /* No expression found */
+                            counter = origcounter;
+                            error(ERR_ARG);
+                            return RET_ERROR;
+                        }
+#ifdef EXTMEM
+                        // Recover embuf2, which has been trashed by eval() above
+                        copyfromaux2(l->line, l->len);
+#endif
+                        if (compile) {
+                            if (native != -1) {
+                                /* Left on eval stack */
+                            } else if (type == TYPE_LONG) {
+                                /* High word first, so low word is first in memory */
+                                emit(VM_PSHWORD);
+                                emit(VM_PSHWORD);
+                                argbytes += 4;
+                            } else if (type == TYPE_WORD) {
+                                emit(VM_PSHWORD);
+                                argbytes += 2;
+                            } else {
+                                emit(VM_PSHBYTE);
+                                ++argbytes;
+                            }
+                        } else {
+                            /* Back to new frame to create var */
+                            varslocal = newvarslocal;
+                            createintvar(name, type, 0, 1, arg, 0);
+                        }
+                    } else {
+                        /*
+                         * Array pass-by-reference
+                         */
+                        if (!compile) {
+                            for (j = 0; j < VARNUMCHARS; ++j) {
+                                name2[j] = 0;
+                            }
+                            j = 0;
+                            while (txtPtr && (isalphach(*txtPtr) || isdigitch(*txtPtr))) {
+                                if (j < VARNUMCHARS) {
+                                    name2[j] = *txtPtr;
+                                }
+                                ++txtPtr;
+                                ++j;
+                            }
+                            /* Back to old frame for lookup */
+                            varslocal = oldvarslocal;
+                            array = findintvar(name2, &local);
+                            if (!array) {
+                                counter = origcounter;
+                                error(ERR_VAR);
+                                return RET_ERROR;
+                            }
+                            /* j holds number of dimensions */
+                            j = (array->type & 0xf0) >> 4;
+                            if (((array->type & 0x0f) != type) || (j == 0)) {
+                                counter = origcounter;
+                                error(ERR_TYPE);
+                                return RET_ERROR;
+                            }
+                            /* Back to new frame to create var */
+                            varslocal = newvarslocal;
+                            createintvar(name,
+                                         type,
+                                         j,
+                                         *(getptrtoscalarword(array) + 1),
+                                         0, *getptrtoscalarword(array));
+
+                        } else {
+                            if (eval(0, &arg)) {
+                                /* No expression found */
+                                counter = origcounter;
+                                error(ERR_ARG);
+                                return RET_ERROR;
+                            }
+                            if (native == -1) {
+                                emit(VM_PSHWORD);
+                                argbytes += 2;
+                            }
+                        }
+                    }
+                    eatspace();
+                    if (*txtPtr == ',') {
+                        ++txtPtr;
+                    }
+                    eatspace();
+
+                    while (p && (*p == ' ')) {
+                        ++p;
+                    }
+
+                    if (!p) {
+                        error(ERR_ARG);
+                        return RET_ERROR;
+                    }
+
+                    if (*p == ',') {
+                        ++p;    /* Eat the comma */
+                    }
+                }
+
+                eatspace();
+                if (expect(')')) {
+                    counter = origcounter;
+                    return RET_ERROR;
+                }
+
+                if (compile && (native != -1)) {
+                    if (costart) {
+                        error(ERR_CORO);
+                        return RET_ERROR;
+                    }
+                    emit_imm(VM_NATIVE, native);
+#ifdef INITDATA
+                    datasafe = 0;
+#endif
+                    return RET_SUCCESS;
+                }
+
+                if (compile) {
+
+                    emit_imm(costart ? VM_COSTART : VM_JSRIMM, 0xffff);
+#ifdef INITDATA
+                    datasafe = 0;
+#endif
+
+                    /*
+                     * Create entry in call table
+                     */
+                    s->addr = rtPC - 2;
+                    s->next = NULL;
+
+                    if (callsend) {
+                        callsend->next = s;
+                    }
+                    callsend = s;
+                    if (!callsbegin) {
+                        callsbegin = s;
+                    }
+
+                    if (costart) {
+                        /* Where the sub returns to when it is done */
+                        emit(VM_CODONE);
+                        return RET_SUCCESS;
+                    }
+
+                    /* Caller must drop the arguments
+                     * pushed to call stack above */
+                    if (argbytes) {
+                        emitldi(argbytes);
+                        emit(VM_DISCARD);
+                    }
+#ifdef TAILCALL
+                    tailjsr = s->addr - 1;
+                    tailcall = s;
+                    tailargbytes = argbytes;
+                    tailpc = rtPC;
+#endif
+                } else {
+                    /* Stash pointer to just after the call stmt */
+                    push_return((intptr_t) txtPtr);
+
+                    /*
+                     * Set up parser to start executing first
+                     * line of subroutine
+                     */
+                    current = l->next;
+                    ++counter;
+#ifdef PROFILER
+                    profcall();
+#endif
+#ifdef EXTMEM
+                    copyfromaux(current->line, current->len);
+                    txtPtr = embuf;
+#else
+                    txtPtr = current->line;
+#endif
+                }
+                return RET_SUCCESS;
+            }
+        }
+        l = l->next;
+    }
+    counter = origcounter;
+    error(ERR_NOSUB);
+    return RET_ERROR;
+}
+
+/*
+ * Handle return from subroutine.
+ * Parameter retvalue is the value to be returned to the caller.
+ * Returns RET_SUCCESS on success, RET_ERROR on error
+ */
+unsigned char doreturn(int retvalue)
+{
+    if (compile) {
+
+        /*
+         * Return value is already on evaluation stack
+         */
+
+#ifdef TAILCALL
+        /* Nothing but the call to compile after the return expression? */
+        if (compilingsub && tailsafe && optlevel && (tailpc == rtPC) &&
+            (tailargbytes == subargbytes) && (ntailrets < MAXTAILRETS)) {
+            tailreturn();
+            return RET_SUCCESS;
+        }
+#endif
+
+        /* Update stack pointer to drop local variables */
+        emit(VM_FPTOSP);
+
+        /* And done! */
+        emit(VM_RTS);
+
+    } else {
+
+        /*
+         * Search the stack to find the first CALLFRAME.  This allows us
+         * to unwind any inner stackframes (for example where we return
+         * from within a FOR loop or IF statement.)
+         */
+
+        int p = returnSP + 1;
+
+        while (p <= RETSTACKSZ - 1) {
+            if (return_stack[p] == CALLFRAME) {
+                /*
+                 * Unwind the stack.
+                 */
+                returnSP = p;
+                goto found;
+            }
+            ++p;
+        }
+
+        error(ERR_STACK);
+        return RET_ERROR;
+
+      found:
+        /* Stash the return value.  Subs return a word. */
+        retvalue = (short) retvalue;
+        retregister = retvalue;
+
+        vars_deletecallframe();
+
+#ifdef CONTSTACK
+        /* The statement making the return is finished with */
+        contfree();
+        if (return_stack[p - 1] == CONTLINE) {
+            return contreturn(retvalue);
+        }
+#endif
+#ifdef COROUTINE
+        if (return_stack[p - 1] == COLINE) {
+            return coreturn(retvalue);
+        }
+#endif
+
+        backtotop(return_stack[p - 1], (char *) return_stack[p - 2]);
+    }
+    return RET_SUCCESS;
+}
+
+/*************************************************************************/
+
+/*
+ * Parse a decimal integer constant.
+ * The text to parse is pointed to by txtPtr.
+ * The result is placed in val.
+ * If successful returns 0, otherwise 1.
+ */
+unsigned char parseint(int *val)
+{
+    *val = 0;
+    if (!(*txtPtr)) {
+        return 1;
+    }
+    if (!isdigitch(*txtPtr)) {
+        return 1;
+    }
+    do {
+        *val *= 10;
+        *val += *txtPtr - '0';
+        ++txtPtr;
+    } while (isdigitch(*txtPtr));
+    return 0;
+}
+
+/*
+ * Return value of hex char
+ */
+unsigned char hexchar2val(char c)
+{
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return c - '0';
+}
+
+/*
+ * Parse a hexadecimal integer constant.
+ * The text to parse is pointed to by txtPtr.
+ * The result is placed in val.
+ * If successful returns 0, otherwise 1.
+ */
+unsigned char parsehexint(int *val)
+{
+    *val = 0;
+    if (!(isdigitch(*txtPtr) || ((*txtPtr >= 'a') && (*txtPtr <= 'f')))) {
+        return 1;
+    }
+    do {
+        *val *= 16;
+        *val += hexchar2val(*txtPtr);
+        ++txtPtr;
+    } while (isdigitch(*txtPtr) || ((*txtPtr >= 'a') && (*txtPtr <= 'f')));
+    return 0;
+}
+
+/*
+ * Statement tokens - must be in order with no gaps in sequence
+ */
+#define TOK_COMM     150        /* (comment) must be lowest-numbered token */
+#define TOK_PRDEC    151        /* pr.dec        */
+#define TOK_PRDEC_S  152        /* pr.dec.s      */
+#define TOK_PRHEX    153        /* pr.hex        */
+#define TOK_PRMSG    154        /* pr.msg        */
+#define TOK_PRNL     155        /* pr.nl         */
+#define TOK_PRSTR    156        /* pr.str        */
+#define TOK_PRCH     157        /* pr.ch         */
+#define TOK_KBDCH    158        /* kbd.ch        */
+#define TOK_KBDLN    159        /* kbd.ln        */
+#define TOK_QUIT     160        /* quit          */
+#define TOK_CLEAR    161        /* clear         */
+#define TOK_VARS     162        /* vars          */
+#define TOK_WORD     163        /* word          */
+#define TOK_BYTE     164        /* byte          */
+#define TOK_CONST    165        /* byte          */
+#define TOK_RUN      166        /* run           */
+#define TOK_COMPILE  167        /* comp          */
+#define TOK_NEW      168        /* new           */
+#define TOK_SUBR     169        /* sub           */
+#define TOK_ENDSUBR  170        /* endsub        */
+#define TOK_IF       171        /* if            */
+#define TOK_ELSE     172        /* else          */
+#define TOK_ENDIF    173        /* endif         */
+#define TOK_FREE     174        /* free          */
+#define TOK_CALL     175        /* call sub      */
+#define TOK_RET      176        /* return        */
+#define TOK_FOR      177        /* for           */
+#define TOK_ENDFOR   178        /* endfor        */
+#define TOK_WHILE    179        /* while         */
+#define TOK_ENDW     180        /* endwhile      */
+#define TOK_END      181        /* end           */
+#define TOK_SWITCH   182        /* switch        */
+#define TOK_CASE     183        /* case          */
+#define TOK_DEFAULT  184        /* default       */
+#define TOK_ENDSW    185        /* endswitch     */
+#define TOK_CONEW    186        /* co.new        */
+#define TOK_RESUME   187        /* resume        */
+#define TOK_YIELD    188        /* yield         */
+#define TOK_LONG     189        /* long          */
+#define TOK_VADD     190        /* vec.add       */
+#define TOK_VSUB     191        /* vec.sub       */
+#define TOK_VAND     192        /* vec.and       */
+#define TOK_VOR      193        /* vec.or        */
+#define TOK_VXOR     194        /* vec.xor       */
+#define TOK_VADDS    195        /* vec.adds      */
+#define TOK_VSUM     196        /* vec.sum       */
+#define TOK_VMIN     197        /* vec.min       */
+#define TOK_VMAX     198        /* vec.max       */
+#define TOK_VCNT     199        /* vec.cnt       */
+#define TOK_VFIND    200        /* vec.find      */
+#define TOK_FAR      201        /* far           */
+#define TOK_SNAP     202        /* snap          */
+#define TOK_MODULE   203        /* module        */
+#define TOK_MODE     204        /* mode          */
+#define TOK_PROF     205        /* prof          */
+
+/*
+ * All the following tokens do not require trailing whitespace
+ * Careful - the ordering matters!
+ */
+#define TOK_POKEWORD 206        /* poke word (*) */
+#define TOK_POKEBYTE 207        /* poke byte (^) */
+
+/* Line editor commands */
+#define TOK_LOAD    208         /* Editor: load        */
+#define TOK_SAVE    209         /* Editor: save        */
+#define TOK_LIST    210         /* Editor: list        */
+#define TOK_CHANGE  211         /* Editor: modify line */
+#define TOK_APP     212         /* Editor: append line */
+#define TOK_INS     213         /* Editor: insert line */
+#define TOK_DEL     214         /* Editor: delete line */
+
+/*
+ * Used for the stmnttabent type field.  Code in parseline() uses this
+ * value to determine how to handle parameters for the statement.
+ *
+ *  FULLLINE: full-line statement where the entire line 'belongs' to the
+ *            statement (comments, sub and lbl are like this.)
+ *  NOARGS: no arguments permitted.
+ *  ONEARG: one expression is expected and evaluated.  No further arguments
+ *          permitted.
+ *  TWOARGS: two expressions are expected, separated by a comma
+ *  INITIALARG: one expression is evaluated.  Any subsequent arguments may be
+ *              evaluated by custom code for each statement.
+ *  ONESTRARG: a string constant in quotes is expected
+ *  INITIALNAMEARG: a single name is evaluated.  Any subsequent arguments may
+ *                  be evaluated by custom code for each statement.  The name
+ *                  must start with alpha character and has no spaces.
+ *  CUSTOM: the statement has its own custom code to handle parameters
+ */
+enum stmnttype {
+    FULLLINE,
+    NOARGS,
+    ONEARG,
+    TWOARGS,
+    INITIALARG,
+    ONESTRARG,
+    INITIALNAMEARG,
+    CUSTOM
+};
+
+/*
+ * Represents an entry in the statement table
+ */
+struct stmnttabent {
+    char *name;
+    unsigned char token;
+    enum stmnttype type;
+};
+
+/*
+ * Number of statements - must be updated to match the table
+ */
+#define NUMSTMNTS 65
+
+/*
+ * Statement table
+ * Must be in order of sequentially increasing token value, so that
+ * stmnttabent[t - TOK_COMM] is the line matching token t
+ *
+ * Also note that if a one name is a prefix of another, the longer one
+ * must be first (so println goes before print).
+ */
+struct stmnttabent stmnttab[] = {
+
+    /* Statements */
+    {"\'", TOK_COMM, FULLLINE},         /* 1 */
+    {"pr.dec", TOK_PRDEC, ONEARG},      /* 2 */
+    {"pr.dec.s", TOK_PRDEC_S, ONEARG},  /* 3 */
+    {"pr.hex", TOK_PRHEX, ONEARG},      /* 4 */
+    {"pr.msg", TOK_PRMSG, ONESTRARG},   /* 5 */
+    {"pr.nl", TOK_PRNL, NOARGS},        /* 6 */
+    {"pr.str", TOK_PRSTR, ONEARG},      /* 7 */
+    {"pr.ch", TOK_PRCH, ONEARG},        /* 8 */
+    {"kbd.ch", TOK_KBDCH, ONEARG},      /* 9 */
+    {"kbd.ln", TOK_KBDLN, TWOARGS},     /* 10 */
+    {"quit", TOK_QUIT, NOARGS},         /* 11 */
+    {"clear", TOK_CLEAR, NOARGS},       /* 12 */
+    {"vars", TOK_VARS, NOARGS},         /* 13 */
+    {"word", TOK_WORD, CUSTOM},         /* 14 */
+    {"byte", TOK_BYTE, CUSTOM},         /* 15 */
+    {"const", TOK_CONST, CUSTOM},       /* 16 */
+    {"run", TOK_RUN, NOARGS},           /* 17 */
+    {"comp", TOK_COMPILE, ONESTRARG},   /* 18 */
+    {"new", TOK_NEW, NOARGS},           /* 19 */
+    {"sub", TOK_SUBR, INITIALNAMEARG},  /* 20 */
+    {"endsub", TOK_ENDSUBR, NOARGS},    /* 21 */
+    {"if", TOK_IF, ONEARG},             /* 22 */
+    {"else", TOK_ELSE, NOARGS},         /* 23 */
+    {"endif", TOK_ENDIF, NOARGS},       /* 24 */
+    {"free", TOK_FREE, NOARGS},         /* 25 */
+    {"call", TOK_CALL, INITIALNAMEARG}, /* 26 */
+    {"return", TOK_RET, ONEARG},        /* 27 */
+    {"for", TOK_FOR, CUSTOM},           /* 28 */
+    {"endfor", TOK_ENDFOR, NOARGS},     /* 29 */
+    {"while", TOK_WHILE, ONEARG},       /* 30 */
+    {"endwhile", TOK_ENDW, NOARGS},     /* 31 */
+    {"end", TOK_END, NOARGS},           /* 32 */
+    {"switch", TOK_SWITCH, ONEARG},     /* 33 */
+    {"case", TOK_CASE, CUSTOM},         /* 34 */
+    {"default", TOK_DEFAULT, NOARGS},   /* 35 */
+    {"endswitch", TOK_ENDSW, NOARGS},   /* 36 */
+    {"co.new", TOK_CONEW, CUSTOM},      /* 37 */
+    {"resume", TOK_RESUME, TWOARGS},    /* 38 */
+    {"yield", TOK_YIELD, ONEARG},       /* 39 */
+    {"long", TOK_LONG, CUSTOM},         /* 40 */
+    {"vec.add", TOK_VADD, CUSTOM},      /* 41 */
+    {"vec.sub", TOK_VSUB, CUSTOM},      /* 42 */
+    {"vec.and", TOK_VAND, CUSTOM},      /* 43 */
+    {"vec.or", TOK_VOR, CUSTOM},        /* 44 */
+    {"vec.xor", TOK_VXOR, CUSTOM},      /* 45 */
+    {"vec.adds", TOK_VADDS, CUSTOM},    /* 46 */
+    {"vec.sum", TOK_VSUM, CUSTOM},      /* 47 */
+    {"vec.min", TOK_VMIN, CUSTOM},      /* 48 */
+    {"vec.max", TOK_VMAX, CUSTOM},      /* 49 */
+    {"vec.cnt", TOK_VCNT, CUSTOM},      /* 50 */
+    {"vec.find", TOK_VFIND, CUSTOM},    /* 51 */
+    {"far", TOK_FAR, CUSTOM},           /* 52 */
+    {"snap", TOK_SNAP, NOARGS},         /* 53 */
+    {"module", TOK_MODULE, ONESTRARG},  /* 54 */
+    {"mode", TOK_MODE, ONEARG},         /* 55 */
+    {"prof", TOK_PROF, CUSTOM},         /* 56 */
+    {"*", TOK_POKEWORD, INITIALARG},    /* 57 */
+    {"^", TOK_POKEBYTE, INITIALARG},    /* 58 */
+
+    /* Editor commands */
+    {":r", TOK_LOAD, ONESTRARG},        /* 59 */
+    {":w", TOK_SAVE, ONESTRARG},        /* 60 */
+    {":l", TOK_LIST, CUSTOM},           /* 61 */
+    {":c", TOK_CHANGE, INITIALARG},     /* 62 */
+    {":a", TOK_APP, ONEARG},            /* 63 */
+    {":i", TOK_INS, ONEARG},            /* 64 */
+    {":d", TOK_DEL, INITIALARG}         /* 65 - set NUMSTMNTS to this value */
+};
+
+/*
+ * Attempt to find statement keyword
+ * Returns the token or ILLEGAL
+ *
+ * Uses table stmnttab, returning the token corresponding to the first
+ * matching name.  Also checks for either a space or end of line following
+ * the keyword, or will not declare a match.
+ */
+unsigned char matchstatement()
+{
+    unsigned char i;
+    unsigned char len;
+    char c;
+    struct stmnttabent *s;
+
+    for (i = 0; i < NUMSTMNTS; ++i) {
+        s = &(stmnttab[i]);
+        len = strlen(s->name);
+        if (!strncmp(txtPtr, s->name, len)) {
+            /*
+             * Do not check for whitespace for tokens >= TOK_POKEWORD
+             * Also do not check for whitespace for tokens <= TOK_COMM.
+             */
+            if ((s->token >= TOK_POKEWORD) || (s->token <= TOK_COMM)) {
+                return s->token;
+            }
+            c = *(txtPtr + len);
+            if ((c == 0) || (c == ' ') || (c == ';')) {
+                return s->token;
+            }
+        }
+    }
+    return ILLEGAL;
+}
+
+#ifdef BLOCKINDEX
+
+/*
+ * Block structure index.
+ * For each if, else, while, switch and case statement in the program, the
+ * index records the position of the matching else, endif, endwhile, or next
+ * case, default or endswitch.  When one of these
+ * statements sets skipFlag, parseline() moves straight to the terminator,
+ * instead of reading each line of the body with skipFlag set.  The index
+ * is built on first use after the program is edited.
+ */
+struct blockent {
+    struct lineofcode *line;    /* Line of opening statement            */
+    struct lineofcode *target;  /* Line of matching terminator          */
+    int lines;                  /* Number of lines from line to target  */
+    unsigned char offset;       /* Offset of opening statement in line  */
+    unsigned char targetoff;    /* Offset of terminator in target line  */
+};
+
+struct blockent blockidx[BLOCKIDXSZ];
+unsigned int blockidxcount;
+
+/*
+ * Opening statement awaiting its terminator, while building the index
+ */
+struct blockopen {
+    struct lineofcode *line;    /* Line of opening statement            */
+    int linenum;                /* Line number of opening statement     */
+    unsigned char offset;       /* Offset of opening statement in line  */
+    unsigned char token;        /* TOK_IF, TOK_WHILE or TOK_SWITCH      */
+};
+
+#define blockhashidx(line, off) ((((uintptr_t) line >> 2) ^ off) & (BLOCKIDXSZ - 1))
+
+/*
+ * Add index entry for opening statement o, which is terminated by the
+ * statement at offset off in line l, line number linenum.
+ * Returns 0 on success, 1 if the index is full.
+ */
+unsigned char blockidx_add(struct blockopen *o, struct lineofcode *l,
+                           int linenum, unsigned char off)
+{
+    unsigned int i = blockhashidx(o->line, o->offset);
+
+    /* Keep some free entries so probing stays short */
+    if (blockidxcount >= BLOCKIDXSZ - BLOCKIDXSZ / 4) {
+        return 1;
+    }
+    while (blockidx[i].line) {
+        i = (i + 1) & (BLOCKIDXSZ - 1);
+    }
+    blockidx[i].line = o->line;
+    blockidx[i].target = l;
+    blockidx[i].lines = linenum - o->linenum;
+    blockidx[i].offset = o->offset;
+    blockidx[i].targetoff = off;
+    ++blockidxcount;
+    return 0;
+}
+
+/*
+ * Returns the opening statement matching terminator token t.
+ */
+unsigned char blockopener(unsigned char t)
+{
+    switch (t) {
+    case TOK_ENDW:
+        return TOK_WHILE;
+    case TOK_CASE:
+    case TOK_DEFAULT:
+    case TOK_ENDSW:
+        return TOK_SWITCH;
+    }
+    return TOK_IF;
+}
+
+/*
+ * Build the block structure index for the whole program.
+ * Statements are matched up exactly as parseline() does when skipFlag is
+ * set, so jumping to the terminator has the same effect as skipping.
+ * Leaves blockidxstate set to BLOCKIDX_OK or BLOCKIDX_FULL.
+ */
+void blockidx_build()
+{
+    struct blockopen stack[BLOCKDEPTH];
+    struct lineofcode *l = program;
+    char *oldTxtPtr = txtPtr;
+    char *base;
+    int linenum = 0;
+    unsigned char sp = 0;
+    unsigned char off;
+    unsigned char token;
+
+    memset(blockidx, 0, sizeof(blockidx));
+    blockidxcount = 0;
+    blockidxstate = BLOCKIDX_FULL;
+
+    while (l) {
+#ifdef EXTMEM
+        copyfromaux(l->line, l->len);
+        base = embuf;
+#else
+        base = l->line;
+#endif
+        txtPtr = base;
+
+        for (;;) {
+            eatspace();
+            while (*txtPtr == ';') {
+                ++txtPtr;
+                eatspace();
+            }
+            if (!(*txtPtr)) {
+                break;
+            }
+            off = txtPtr - base;
+            token = matchstatement();
+
+            switch (token) {
+            case TOK_IF:
+            case TOK_WHILE:
+            case TOK_SWITCH:
+                if (sp == BLOCKDEPTH) {
+                    goto done;
+                }
+                stack[sp].line = l;
+                stack[sp].linenum = linenum;
+                stack[sp].offset = off;
+                stack[sp].token = token;
+                ++sp;
+                break;
+            case TOK_ELSE:
+            case TOK_ENDIF:
+            case TOK_ENDW:
+            case TOK_CASE:
+            case TOK_DEFAULT:
+            case TOK_ENDSW:
+                if (sp && (stack[sp - 1].token == blockopener(token))) {
+                    if (blockidx_add(&(stack[sp - 1]), l, linenum, off)) {
+                        goto done;
+                    }
+                    if ((token == TOK_ELSE) || (token == TOK_CASE) ||
+                        (token == TOK_DEFAULT)) {
+                        /*
+                         * Else body runs to the next else or endif, and
+                         * case body to the next case, default or endswitch
+                         */
+                        stack[sp - 1].line = l;
+                        stack[sp - 1].linenum = linenum;
+                        stack[sp - 1].offset = off;
+                    } else {
+                        --sp;
+                    }
+                } else {
+                    /*
+                     * Mismatched - the open statements are left out of
+                     * the index, so skipping them reports the error.
+                     */
+                    sp = 0;
+                }
+                break;
+            }
+
+            /*
+             * Eat the statement up to semicolon or the end.  Conditions
+             * may contain character literals such as ';'.
+             */
+            while (*txtPtr && (*txtPtr != ';')) {
+                if (((token == TOK_IF) || (token == TOK_WHILE) ||
+                     (token == TOK_SWITCH) || (token == TOK_CASE)) &&
+                    (*txtPtr == '\'') && *(txtPtr + 1) &&
+                    (*(txtPtr + 2) == '\'')) {
+                    txtPtr += 2;
+                }
+                ++txtPtr;
+            }
+        }
+
+        l = l->next;
+        ++linenum;
+    }
+
+    blockidxstate = BLOCKIDX_OK;
+
+  done:
+#ifdef EXTMEM
+    if (current) {
+        copyfromaux(current->line, current->len);
+    }
+#endif
+    txtPtr = oldTxtPtr;
+}
+
+/*
+ * Called by parseline() when the if, else or while statement at
+ * startTxtPtr in the current line has just set skipFlag.  If the index
+ * has an entry for the statement, move current and txtPtr to the matching
+ * terminator, which then runs as usual.
+ */
+void blockskip(char *startTxtPtr)
+{
+    struct blockent *b;
+    unsigned int i;
+    unsigned char off;
+
+    if (blockidxstate == BLOCKIDX_NONE) {
+        blockidx_build();
+    }
+    if (blockidxstate != BLOCKIDX_OK) {
+        return;
+    }
+
+#ifdef EXTMEM
+    off = startTxtPtr - embuf;
+#else
+    off = startTxtPtr - current->line;
+#endif
+
+    i = blockhashidx(current, off);
+    while ((b = &(blockidx[i]))->line) {
+        if ((b->line == current) && (b->offset == off)) {
+            current = b->target;
+            counter += b->lines;
+#ifdef EXTMEM
+            copyfromaux(current->line, current->len);
+            txtPtr = embuf + b->targetoff;
+#else
+            txtPtr = current->line + b->targetoff;
+#endif
+#ifdef PROFILER
+            /* The terminator is not reached through the run() loop */
+            if (profon) {
+                profmark(1);
+            }
+#endif
+            return;
+        }
+        i = (i + 1) & (BLOCKIDXSZ - 1);
+    }
+}
+#endif
+
+/*
+ * Used to check no arguments are passed to statements that do not take them
+ * Returns 0 if end of line or semicolon next, 1 otherwise.
+ */
+unsigned char checkNoMoreArgs()
+{
+    eatspace();
+    if (*txtPtr && (*txtPtr != ';')) {
+        error(ERR_EXTRA);
+        printchar(' ');
+        print(txtPtr);
+        return 1;
+    }
+    return 0;
+}
+
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+void showfreespace() {
+    print("free:\n");
+#ifdef CC65
+#ifdef EXTMEM
+    print("Blk1: ");
+    printdec(getfreespace1());
+    print(" / ");
+    printdec(gettotalspace1());
+#ifdef EXTMEMCODE
+    print(" vars\n");
+#else
+    print(" bytecode,vars\n");
+#endif
+    print("Blk2: ");
+    printdec(getfreespace2());
+    print(" / ");
+    printdec(gettotalspace2());
+    print(" lists,linkage\n");
+    print("Aux:  ");
+    printdec(getfreeauxmem());
+    print(" / ");
+    printdec(gettotalauxmem());
+#ifdef EXTMEMCODE
+    print(" source,bytecode");
+#else
+    print(" source");
+#endif
+#else
+    print("Blk1: ");
+    printdec(getfreespace1());
+    print(" / ");
+    printdec(gettotalspace1());
+    print(" bytecode,vars\n");
+    print("Blk2: ");
+    printdec(getfreespace2());
+    print(" / ");
+    printdec(gettotalspace2());
+    print(" source,linkage");
+#endif
+#else
+    printdec(getfreespace1());
+    print(" / ");
+    printdec(gettotalspace1());
+    print(" bytecode,vars\n");
+    print("unlimited source,linkage");
+#endif
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/* Parse a line from the input buffer
+ * Handles statements
+ * Starts reading from location of txtPtr
+ * Returns:
+ *   0: Keep executing
+ *   1: Normal stop
+ *   2: Error stop
+ *   3: User stop / escape
+ */
+unsigned char parseline()
+{
+    int token;
+    int arg;
+    int arg2;
+    char oldcompile;
+    char *p;
+    char *startTxtPtr;
+    struct stmnttabent *s;
+
+    for (;;) {
+
+        /* See if user requested stop */
+        if (checkInterrupted()) {
+            return 3;
+        }
+
+        eatspace();
+
+        while (*txtPtr == ';') {
+            ++txtPtr;
+            if (!(*txtPtr)) {
+                return 0;
+            }
+            eatspace();
+        }
+
+        if (!(*txtPtr)) {
+            return 0;
+        }
+
+        startTxtPtr = txtPtr;
+
+#ifdef CONTSTACK
+        /*
+         * Unless this is the statement being resumed, the statement
+         * which was being replayed has finished.
+         */
+        contstmt = startTxtPtr;
+        if (contresume) {
+            contresume = 0;
+        } else {
+            contfree();
+        }
+        contok = 0;
+        contdepth = 0;
+#endif
+
+        token = matchstatement();
+
+        /*
+         * If skipFlag is set, then only process those tokens that
+         * manipulate skipFlag:
+         *   'if / else / endif'
+         *   'while / endw'
+         *   'switch / case / default / endswitch'
+         * Skip all others.
+         */
+        if (skipFlag) {
+            if ((token != TOK_IF) &&
+                (token != TOK_ELSE) &&
+                (token != TOK_ENDIF) &&
+                (token != TOK_WHILE) && (token != TOK_ENDW) &&
+                ((token < TOK_SWITCH) || (token > TOK_ENDSW))) {
+
+                /*
+                 * Eat the statement up to semicolon or the
+                 * end.
+                 */
+                while (*txtPtr && (*txtPtr != ';')) {
+                    ++txtPtr;
+                }
+                continue;
+            }
+        }
+
+        if (token == ILLEGAL) {
+
+#ifdef CBM
+            /*
+             * If the first character is a digit then treat
+             * this as an editor 'change line' command.  This
+             * allows the VIC-20/C64 screen editor to work the
+             * same way as in BASIC.
+             */
+
+            if (isdigitch(*txtPtr)) {
+
+                token = TOK_CHANGE;
+                s = &(stmnttab[token - TOK_COMM]);
+
+            } else {
+#endif
+                /*
+                 * Variable assignment winds up here
+                 */
+#ifdef CONTSTACK
+                if (current && !compile) {
+                    contbegin();
+                }
+#endif
+                if (assignorcreate(LET_MODE)) {
+                    return 2;   /* Error */
+                }
+                continue;
+#ifdef CBM
+            }
+#endif
+
+        } else {
+
+            s = &(stmnttab[token - TOK_COMM]);
+
+            /* Eat the keyword */
+            txtPtr += strlen(s->name);
+
+            eatspace();
+
+#ifdef CONTSTACK
+            /*
+             * Statements whose arguments are all evaluated before they
+             * do anything can be suspended by function calls.
+             */
+            if (current && !compile && !skipFlag) {
+                if ((s->type == ONEARG) || (s->type == TWOARGS)) {
+                    contbegin();
+                } else if ((token == TOK_WORD) || (token == TOK_BYTE) ||
+                           (token == TOK_LONG)) {
+                    /* Scalar declarations only */
+                    p = txtPtr;
+                    while (isalphach(*p) || isdigitch(*p)) {
+                        ++p;
+                    }
+                    if (*p != '[') {
+                        contbegin();
+                    }
+                }
+            }
+#endif
+        }
+
+#ifdef TIERED
+        /*
+         * Programs which use interactive commands, or which poke memory,
+         * are never compiled for the embedded VM.
+         */
+        if (current && !compile &&
+            (((token >= TOK_QUIT) && (token <= TOK_VARS)) ||
+             ((token >= TOK_RUN) && (token <= TOK_NEW)) ||
+             (token == TOK_FREE) || (token >= TOK_MODE))) {
+            tierstate = TIER_BLOCKED;
+        }
+#endif
+
+        /*
+         * If we are compiling it is good to keep a copy of the
+         * VM program counter just before we begin argument 
+         * handling.  This is useful for re-evaluating WHILE loop
+         * guards, for example!
+         */
+        rtPCBeforeEval = rtPC;
+
+        /*
+         * Generic parameter handling based on statement type.
+         */
+        switch (s->type) {
+
+        case NOARGS:
+            /* Check end of input */
+            arg = checkNoMoreArgs();
+            if (arg) {
+                return 2;
+            }
+            break;
+        case ONEARG:
+            /* These statements handle longs themselves */
+            if ((token == TOK_PRDEC) || (token == TOK_PRDEC_S) ||
+                (token == TOK_IF) || (token == TOK_WHILE)) {
+                evalwant = EVAL_ANY;
+            }
+            /* Evaluate one arg and check end of input */
+            if (eval(1, &arg)) {
+                return 2;
+            }
+            /* A long condition is true if any bit is set */
+            if (compile && exprlong &&
+                ((token == TOK_IF) || (token == TOK_WHILE))) {
+                emit(VM_NOTL);
+                emit(VM_NOT);
+            }
+            break;
+        case TWOARGS:
+            /* Evaluate one arg don't check end of input */
+            if (eval(0, &arg)) {
+                return 2;
+            }
+            eatspace();
+            if (expect(',')) {
+                return 2;
+            }
+            /* Evaluate second arg, don't check end of input */
+            if (eval(0, &arg2)) {
+                return 2;
+            }
+            break;
+        case INITIALARG:
+            /* Evaluate one arg, don't check end of input */
+            if (eval(0, &arg)) {
+                return 2;
+            }
+            break;
+        case ONESTRARG:
+            /* Parse quoted string, place it in readbuf */
+            if (!(*txtPtr == '"')) {
+                return 2;
+            }
+            ++txtPtr;
+            p = readbuf;
+            while (*txtPtr && (*txtPtr != '"')) {
+                *(p++) = *(txtPtr++);
+            }
+            *p = '\0';
+            if (*txtPtr == '"') {
+                ++txtPtr;
+            } else {
+                error(ERR_STR);
+                return 2;
+            }
+            arg = checkNoMoreArgs();
+            if (arg) {
+                return 2;
+            }
+            break;
+        case INITIALNAMEARG:
+            /* Evaluate name, place in readbuf */
+            /* Don't check end of input */
+            if (!isalpha(*txtPtr)) {
+                return 2;
+            }
+            p = readbuf;
+            while (*txtPtr && (isalphach(*txtPtr) || isdigitch(*txtPtr))) {
+                *(p++) = *(txtPtr++);
+            }
+            *p = '\0';
+            break;
+        case FULLLINE:
+            /* Eat the line */
+            while (*txtPtr) {
+                ++txtPtr;
+            }
+            break;
+#ifdef __GNUC__
+        case CUSTOM:
+            break;
+#endif
+        }
+
+        /*
+         * Code for individual statements.
+         */
+        switch (token) {
+        case TOK_COMM:
+            break;
+        case TOK_QUIT:
+#ifdef C64
+            /* Restore normal NMI vector on C64 */
+            POKE(808, 237);
+#elif defined(VIC20)
+            /* Restore normal NMI vector on VIC20 */
+            POKE(808, 112);
+#endif
+
+            print("Bye!\n");
+            EXIT(0);
+        case TOK_PRDEC:
+            if (compile) {
+                emit(exprlong ? VM_PRDECL : VM_PRDEC);
+            } else if ((arg < 0) && (arg >= -32768)) {
+                /*
+                 * Words are held sign extended.  The interpreter does not
+                 * know whether a value is a long, so print one which fits
+                 * in a word as the VM prints a word.
+                 */
+                printdec(arg & 0xffff);
+            } else {
+                printdecl((unsigned int) arg);
+            }
+            break;
+        case TOK_PRDEC_S:
+            if (compile) {
+                /* Sign bit is in X for a word or a long */
+                emit(VM_DUP);   /* Preserve arg on the stack */
+                emitldi(0x8000);
+                emit(VM_BITAND);
+                emit(VM_NOT);
+                emit_imm(VM_BRNCHIMM, rtPC + 8);      /* Jump over printing of '-' */
+                emitldi('-');
+                emit(VM_PRCH);
+                emit(exprlong ? VM_NEGL : VM_NEG);
+                emit(exprlong ? VM_PRDECL : VM_PRDEC);
+            } else {
+                if (arg < 0) {
+                    printchar('-');
+                    arg = -arg;
+                }
+                printdecl((unsigned int) arg);
+            }
+            break;
+        case TOK_PRHEX:
+            if (compile) {
+                emit(VM_PRHEX);
+            } else {
+                printhex(arg);
+            }
+            break;
+        case TOK_PRMSG:
+            if (compile) {
+                emitprmsg();
+            } else {
+                print(readbuf);
+            }
+            break;
+        case TOK_PRNL:
+            if (compile) {
+#ifdef CBM
+                emitldi(13);
+#else
+                emitldi(10);
+#endif
+                emit(VM_PRCH);
+            } else {
+                printchar('\n');
+            }
+            break;
+        case TOK_PRSTR:
+            if (compile) {
+                emit(VM_PRSTR);
+            } else {
+                print((char *) PTR(arg));
+            }
+            break;
+        case TOK_PRCH:
+            if (compile) {
+                emit(VM_PRCH);
+            } else {
+                printchar(arg);
+            }
+            break;
+        case TOK_KBDCH:
+            if (compile) {
+                /* Address should be on the eval stack already */
+                emit(VM_KBDCH);
+                /* Now the keycode is pushed to the eval stack also */
+                emit(VM_SWAP);
+                emit(VM_STABYTE);
+            } else {
+#ifdef A2E
+                /* Loop until we get a keypress */
+                while (!(arg2 = getkey()));
+                *(char *) PTR(arg) = arg2;
+#elif defined(CBM)
+                /* Loop until we get a keypress */
+                while (!(*(char *) PTR(arg) = cbm_k_getin()));
+#else
+                print("kbd.ch unimplemented on Linux\n");
+#endif
+            }
+            break;
+        case TOK_KBDLN:
+            if (compile) {
+                /* Address and length should both be on the eval stack */
+                emit(VM_KBDLN);
+            } else {
+                getln((char *) PTR(arg), arg2);
+            }
+            break;
+        case TOK_CLEAR:
+            clearvars();
+            break;
+        case TOK_VARS:
+            printvars();
+            break;
+        case TOK_WORD:
+            if (assignorcreate(WORD_MODE)) {
+                return 2;
+            }
+            break;
+        case TOK_BYTE:
+            if (assignorcreate(BYTE_MODE)) {
+                return 2;
+            }
+            break;
+        case TOK_LONG:
+            if (assignorcreate(LONG_MODE)) {
+                return 2;
+            }
+            break;
+        case TOK_FAR:
+#ifdef FARMEM
+            if (dofar()) {
+                return 2;
+            }
+#else
+            error(ERR_FAR);
+            return 2;
+#endif
+            break;
+        case TOK_SNAP:
+            /* Only the VM takes snapshots */
+            if (compile) {
+                emit(VM_SNAP);
+            }
+            break;
+        case TOK_VADD:
+        case TOK_VSUB:
+        case TOK_VAND:
+        case TOK_VOR:
+        case TOK_VXOR:
+        case TOK_VADDS:
+        case TOK_VSUM:
+        case TOK_VMIN:
+        case TOK_VMAX:
+        case TOK_VCNT:
+        case TOK_VFIND:
+            if (dovec(token - TOK_VADD)) {
+                return 2;
+            }
+            break;
+        case TOK_CONST:
+            if (assignorcreate(CONST_MODE)) {
+                return 2;
+            }
+            break;
+        case TOK_RUN:
+#ifdef TIERED
+            if ((tierstate == TIER_HOT) && !tierrun()) {
+                break;
+            }
+            tierlines = 0;
+#endif
+            run(0);             /* Start from beginning */
+#ifdef TIERED
+            if ((tierstate == TIER_COLD) && (tierlines > TIERTHRESH)) {
+                tierstate = TIER_HOT;
+            }
+#endif
+            break;
+#ifdef MODULES
+        case TOK_MODULE:
+            modcomp = 1;
+            /* Fall through, past the #endif */
+            __attribute__ ((fallthrough));
+#endif
+        case TOK_COMPILE:
+            strncpy(filename, readbuf, FILENAMELEN);
+            filename[FILENAMELEN] = 0; /* Just in case not terminated */
+#ifdef COMPCACHE
+            if (!cacheget()) {
+                break;
+            }
+#endif
+            compile = 1;
+            subsbegin = subsend = NULL;
+            callsbegin = callsend = NULL;
+            CLEARRTCALLSTACK();
+#ifdef INITDATA
+            initdata_clear();
+#endif
+#ifdef MODULES
+            if (modcomp) {
+                modstart();
+            }
+#endif
+#ifdef INCRCOMP
+            incrstart();
+#endif
+            run(0);
+            if (compile) {
+#ifdef MODULES
+                if (modcomp) {
+                    modreturn();
+                } else
+#endif
+                emit(VM_END);
+#ifdef OPTIMIZER
+                if (!linksubs()) {
+#ifdef MODULES
+                    /* Module code is left as compiled, for the linker */
+                    if (!modcomp)
+#endif
+                    optimize();
+#ifdef LINKER
+                    linkrelocs();
+#endif
+                }
+#else
+                linksubs();
+#endif
+                writebytecode();
+                compile = 0;
+            }
+#ifdef MODULES
+            modcomp = 0;
+#endif
+#ifndef __GNUC__
+            CLEARHEAP2TOP();    /* Clear the linkage table */
+#endif
+            break;
+        case TOK_NEW:
+            new();
+            break;
+        case TOK_SUBR:
+            if (dosubr()) {
+                return 2;
+            }
+            break;
+        case TOK_ENDSUBR:
+            if (doendsubr()) {
+                return 2;
+            }
+            break;
+        case TOK_CALL:
+            if (docall()) {
+                return 2;
+            }
+            if (compile) {
+                /* Drop the return value */
+                emit(VM_DROP);
+            } else {
+                /* If we were called from immediate mode ... */
+                /* Switch to run mode and continue */
+                if (return_stack[returnSP + 2] == -1) {
+                    run(1);
+                }
+            }
+            break;
+        case TOK_RET:
+            if (doreturn(arg)) {
+                /* Error */
+                return 2;
+            }
+
+#ifdef COROUTINE
+            /* Back in whatever resumed the coroutine */
+            if (coreturned) {
+                coreturned = 0;
+                break;
+            }
+#endif
+
+#ifdef CONTSTACK
+            /* Resuming the statement which called the function */
+            if (contresume) {
+                break;
+            }
+#endif
+
+            /*
+             * If this was a function invocation, just
+             * return and let P() continue with its job!
+             */
+            if (return_stack[returnSP + 2] == -2) {
+                return 1;
+            }
+
+            break;
+        case TOK_IF:
+            doif(arg);
+#ifdef BLOCKINDEX
+            /* Condition false - jump to else / endif */
+            if (!compile && current && (return_stack[returnSP + 2] == 1)) {
+                blockskip(startTxtPtr);
+            }
+#endif
+            break;
+        case TOK_ELSE:
+            if (doelse()) {
+                return 2;
+            }
+#ifdef BLOCKINDEX
+            /* Condition was true - jump to endif */
+            if (!compile && current && skipFlag &&
+                (return_stack[returnSP + 2] == 2)) {
+                blockskip(startTxtPtr);
+            }
+#endif
+            break;
+        case TOK_ENDIF:
+            if (doendif()) {
+                return 2;
+            }
+            break;
+        case TOK_FOR:
+            if (assignorcreate(FOR_MODE)) {
+                return 2;
+            }
+            break;
+        case TOK_ENDFOR:
+            if (doendfor()) {
+                return 2;
+            }
+            break;
+        case TOK_WHILE:
+            dowhile(startTxtPtr, arg);
+#ifdef BLOCKINDEX
+            /* Condition false - jump to endwhile */
+            if (!compile && current && (return_stack[returnSP + 3] == 1)) {
+                blockskip(startTxtPtr);
+            }
+#endif
+            break;
+        case TOK_ENDW:
+            if (doendwhile()) {
+                return 2;
+            }
+            break;
+        case TOK_SWITCH:
+            doswitch(arg);
+#ifdef BLOCKINDEX
+            /* Jump to first case */
+            if (!compile && current &&
+                (return_stack[returnSP + 2] == SW_SEARCH)) {
+                blockskip(startTxtPtr);
+            }
+#endif
+            break;
+        case TOK_CASE:
+            /* Case value must be constant, and is not compiled */
+            onlyconstants = 1;
+            oldcompile = compile;
+            compile = 0;
+            if (eval(1, &arg)) {
+                onlyconstants = 0;
+                compile = oldcompile;
+                return 2;
+            }
+            onlyconstants = 0;
+            compile = oldcompile;
+            /* Fall through */
+        case TOK_DEFAULT:
+            if (docase(arg, (token == TOK_DEFAULT))) {
+                return 2;
+            }
+#ifdef BLOCKINDEX
+            /* Not the matching case - jump to the next one */
+            if (!compile && current && skipFlag &&
+                (return_stack[returnSP + 2] != SW_SKIP)) {
+                blockskip(startTxtPtr);
+            }
+#endif
+            break;
+        case TOK_ENDSW:
+            if (doendswitch()) {
+                return 2;
+            }
+            break;
+        case TOK_CONEW:
+            if (doconew()) {
+                return 2;
+            }
+            break;
+        case TOK_RESUME:
+            if (compile) {
+                /* Addresses of object and variable are on the eval stack */
+                emit(VM_SWAP);
+                emit(VM_RESUME);
+                /* Now the value yielded is pushed to the eval stack also */
+                emit(VM_SWAP);
+                emit(VM_STAWORD);
+                break;
+            }
+#ifdef COROUTINE
+            if (coresume(arg, arg2)) {
+                return 2;
+            }
+            /* If we were called from immediate mode ... */
+            /* Switch to run mode and continue */
+            if (corunning->rcounter == -1) {
+                run(2);
+            }
+            break;
+#else
+            error(ERR_CORO);
+            return 2;
+#endif
+        case TOK_YIELD:
+            if (compile) {
+                emit(VM_YIELD);
+                break;
+            }
+#ifdef COROUTINE
+            if (coyield(arg)) {
+                return 2;
+            }
+            break;
+#else
+            error(ERR_CORO);
+            return 2;
+#endif
+        case TOK_END:
+#ifdef MODULES
+            if (compile && modcomp && !compilingsub) {
+                /* Back to the linker's startup code */
+                modreturn();
+                break;
+            }
+#endif
+            if (compile) {
+                emit(VM_END);
+            } else {
+                return 1;       /* Normal stop */
+            }
+            break;
+        case TOK_MODE:
+#ifdef A2E
+            if (arg == 40) {
+                videomode(VIDEOMODE_40COL);
+            } else if (arg == 80) {
+                videomode(VIDEOMODE_80COL);
+            } else {
+                error(ERR_VALUE);
+                return 2;
+            }
+#endif
+            break;
+        case TOK_FREE:
+            showfreespace();
+            break;
+        case TOK_PROF:
+#ifdef PROFILER
+            if (!compile) {
+                if (!(*txtPtr) || (*txtPtr == ';')) {
+                    profreport();       /* No args */
+                    break;
+                }
+                if (eval(1, &arg)) {
+                    return 2;
+                }
+                profenable(arg != 0);
+                break;
+            }
+#endif
+            /* Not supported, or compiling - ignore */
+            while (*txtPtr && (*txtPtr != ';')) {
+                ++txtPtr;
+            }
+            break;
+        case TOK_POKEWORD:
+            eatspace();
+            if (expect('=')) {
+                return 2;
+            }
+            if (eval(1, &arg2)) {
+                return 2;
+            }
+            if (compile) {
+                emit(VM_SWAP);
+                emit(VM_STAWORD);
+                return 0;
+            }
+            *(int *) PTR(arg) = arg2;
+            break;
+        case TOK_POKEBYTE:
+            eatspace();
+            if (expect('=')) {
+                return 2;
+            }
+            if (eval(1, &arg2)) {
+                return 2;
+            }
+            if (compile) {
+                emit(VM_SWAP);
+                emit(VM_STABYTE);
+                return 0;
+            }
+            *PTR(arg) = arg2;
+            break;
+        case TOK_APP:
+            findline(arg);
+            if (!current) {
+                error(ERR_LINE);
+                break;
+            }
+            editmode = 1;
+            break;
+        case TOK_INS:
+            if (arg <= 1) {
+                editmode = 2;   /* Special mode for insert
+                                   first line */
+            } else {
+                findline(arg - 1);
+                if (!current) {
+                    error(ERR_LINE);
+                    break;
+                }
+                editmode = 1;
+            }
+            break;
+        case TOK_DEL:
+            eatspace();
+            if (!(*txtPtr)) {
+                deleteline(arg, arg);   /* One arg */
+                break;
+            }
+            if (expect(',')) {
+                return 2;
+            }
+            if (eval(1, &arg2)) {
+                return 2;
+            }
+            deleteline(arg, arg2);      /* Two args */
+            break;
+        case TOK_CHANGE:
+            eatspace();
+            if (expect(':')) {
+                return 2;
+            }
+            findline(arg);
+            if (!current) {
+                error(ERR_LINE);
+                break;
+            }
+            changeline(txtPtr);
+            /* Don't execute the changed code yet! */
+            return 0;
+            break;
+        case TOK_LIST:
+            if (!(*txtPtr)) {
+                list(1, 32767); /* No args */
+                break;
+            }
+            if (eval(0, &arg)) {
+                return 2;
+            }
+            eatspace();
+            if (!(*txtPtr)) {
+                list(arg, 32767);       /* One arg */
+                break;
+            }
+            if (expect(',')) {
+                return 2;
+            }
+            if (eval(1, &arg2)) {
+                return 2;
+            }
+            list(arg, arg2);    /* Two args */
+            break;
+        case TOK_LOAD:
+            if (readfile()) {
+                return 2;       /* Error */
+            }
+            /* Because readfile() trashes lnbuf ... */
+            return 0;
             break;
-        case TOK_KBDCH:
-            if (compile) {
-                /* Address should be on the eval stack already */
-                emit(VM_KBDCH);
-                /* Now the keycode is pushed to the eval stack also */
-                emit(VM_SWAP);
-                emit(VM_STABYTE);
+        case TOK_SAVE:
+            if (writefile()) {
+                return 2;       /* Error */
+            }
+            break;
+        default:
+            /* Should never get here */
+            EXIT(99);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Expects filename in readbuf.
+ * If writemode = 0 then it opens file for reading, otherwise for writing.
+ * Returns 0 if OK, 1 if error.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+unsigned char openfile(unsigned char writemode)
+{
+    char *readPtr = readbuf;
+
+    if (writemode) {
+        print("Writing ");
+    } else {
+        print("Reading ");
+    }
+    print(readPtr);
+    printchar(':');
+    while (*readPtr) {
+        ++readPtr;
+    }
+#ifdef CBM
+    /* Commodore only, append ',s' for SEQ file */
+    *(readPtr++) = ',';
+    *(readPtr++) = 's';
+#endif
+    *readPtr = '\0';
+
+    readPtr = readbuf;
+
+#ifdef CBM
+    /* Commodore */
+    if (cbm_open(1, 8, (writemode ? CBM_WRITE : CBM_READ), readPtr)) {
+        error(ERR_FILE);
+        return 1;
+    }
+#else
+
+#ifdef A2E
+    _filetype = 4;              /* Text file */
+#endif
+
+    /* POSIX */
+    fd = fopen(readPtr, (writemode ? "w" : "r"));
+    if (fd == NULL) {
+        error(ERR_FILE);
+        return 1;
+    }
+#endif
+
+    return 0;
+
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Load program from file.
+ * Expects filename in readbuf.
+ * Returns 0 if OK, 1 if error.
+ * NOTE: Trashes lnbuf !!
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+unsigned char readfile()
+{
+    unsigned char i;
+    unsigned char j;
+    unsigned int bytes;
+    unsigned char foundEOL;
+    unsigned char bytesInBuf = 0;
+    char *readPtr = readbuf;
+    int donereading = 0;
+    int count = 0;
+
+    if (openfile(0)) {
+        return 1;
+    }
+
+    clearvars();
+    new();
+
+    readPtr = readbuf;
+    do {
+        if (!donereading) {
+#ifdef DEBUG_READFILE
+            print("About to read ");
+            printdec(255 - bytesInBuf);
+            print(" bytes\n");
+#endif
+
+#ifdef CBM
+            /* Commodore */
+            bytes = cbm_read(1, readPtr, 255 - bytesInBuf);
+#else
+            /* POSIX */
+            bytes = fread(readPtr, 1, 255 - bytesInBuf, fd);
+
+#endif
+            if (bytes == -1U) {
+                error(ERR_FILE);
+#ifdef CBM
+                /* Commodore */
+                cbm_close(1);
+#else
+                /* POSIX */
+                fclose(fd);
+#endif
+                return 1;
+            }
+            if (!bytes) {
+                donereading = 1;
+            }
+
+            readPtr += bytes;
+            bytesInBuf += bytes;
+
+#ifdef DEBUG_READFILE
+            print("Read ");
+            printdec(bytes);
+            print(" bytes\nBuf[");
+            for (i = 0; i < bytesInBuf; ++i) {
+                printchar(readbuf[i]);
+            }
+            print("]\n");
+#endif
+        }
+
+        foundEOL = 0;
+        for (i = 0; i < bytesInBuf; ++i) {
+            if (readbuf[i] == 10 || readbuf[i] == 13) {
+                strncpy(lnbuf, readbuf, i);
+                lnbuf[i] = 0;
+                for (j = i + 1; j < bytesInBuf; ++j) {
+                    readbuf[j - i - 1] = readbuf[j];
+                }
+                readPtr = readbuf + bytesInBuf - i - 1;
+                bytesInBuf -= (i + 1);
+                foundEOL = 1;
+                break;
+            }
+        }
+
+        if (foundEOL == 1) {
+            if (!count) {
+                insertfirstline(lnbuf);
+                findline(1);
             } else {
+                appendline(lnbuf);
+            }
+            ++count;
+        } else {
+            if (bytesInBuf == 255) {
+                error(ERR_FILE);
+#ifdef CBM
+                /* Commodore */
+                cbm_close(1);
+#else
+                /* Apple II and POSIX */
+                fclose(fd);
+#endif
+                return 1;
+            }
+            /* Handle last line with missing CRLF */
+            if (donereading == 1 && bytesInBuf) {
+                readbuf[bytesInBuf] = '\0';
+                appendline(readbuf);
+                ++count;
+                break;
+            }
+        }
+
+    } while (bytes || bytesInBuf);
+
+#ifdef CBM
+    /* Commodore */
+    cbm_close(1);
+#else
+    /* Apple II and POSIX */
+    fclose(fd);
+#endif
+
+    printdec(count);
+    print(" lines\n");
+    return 0;
+}
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+/*
+ * Save program to file.
+ * Expects filename in readbuf.
+ * Returns 0 if OK, 1 if error.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+unsigned char writefile()
+{
+    unsigned int bytes;
+    unsigned int index;
+
+    if (openfile(1)) {
+        return 1;
+    }
+
+    current = program;
+    while (current) {
+        index = 0;
+
+#ifdef EXTMEM
+        copyfromaux(current->line, current->len);
+        for (index = 0; index < strlen(embuf); ++index) {
+#else
+        for (index = 0; index < strlen(current->line); ++index) {
+#endif
+
+#ifdef CBM
+            /* Commodore */
+            bytes = cbm_write(1, current->line + index, 1);
+
+#elif defined(EXTMEM)
+            /* Apple II, using extended memory driver */
+            bytes = fwrite(embuf + index, 1, 1, fd);
+#else
+            /* POSIX and Apple II without extended memory */
+            bytes = fwrite(current->line + index, 1, 1, fd);
+#endif
+            if (!bytes) {
+                goto error;
+            }
+        }
+#ifdef CBM
+        /* Commodore */
+        bytes += cbm_write(1, "\n", 1);
+#elif defined(A2E)
+        /* Apple II */
+        bytes += fwrite("\r", 1, 1, fd);
+#else
+        /* POSIX */
+        bytes += fwrite("\n", 1, 1, fd);
+#endif
+        if (!bytes) {
+            goto error;
+        }
+        current = current->next;
+    }
+
+#ifdef CBM
+    /* Commodore */
+    cbm_close(1);
+#else
+    /* POSIX */
+    fclose(fd);
+#endif
+    print("OK\n");
+    return 0;
+
+  error:
+#ifdef CBM
+    /* Commodore */
+    cbm_close(1);
+#else
+    /* POSIX */
+    fclose(fd);
+#endif
+    error(ERR_FILE);
+    return 1;
+}
 #ifdef A2E
-                /* Loop until we get a keypress */
-                while (!(arg2 = getkey()));
-                *(char *) arg = arg2;
-#elif defined(CBM)
-                /* Loop until we get a keypress */
-                while (!(*(char *) arg = cbm_k_getin()));
+#pragma code-name (pop)
+#endif
+
+#ifdef PROFILER
+
+/*
+ * Line profiler.  When enabled, run() counts the number of times each
+ * line is started and charges the time until the next line is started
+ * to it.
+ */
+
+/*
+ * Monotonic time in nanoseconds
+ */
+unsigned long long proftime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Discard profile
+ */
+void proffree()
+{
+    free(profdata);
+    profdata = NULL;
+    proflast = NULL;
+}
+
+/*
+ * Allocate an empty profile for the program
+ */
+void profalloc()
+{
+    struct lineofcode *l = program;
+
+    proffree();
+    proflines = 0;
+    while (l) {
+        ++proflines;
+        l = l->next;
+    }
+    profdata = calloc(proflines + 1, sizeof(struct profent));
+    if (!profdata) {
+        print("No mem (3)!\n");
+        longjmp(jumpbuf, 1);
+    }
+}
+
+/*
+ * prof statement with an argument - enable or disable profiling.
+ * Enabling discards any previous profile.
+ */
+void profenable(unsigned char on)
+{
+    profon = on;
+    if (on) {
+        proffree();
+        if (current) {
+            /* Within a running program */
+            profalloc();
+            profmark(0);
+        }
+    } else {
+        profmark(0);
+        proflast = NULL;
+    }
+}
+
+/*
+ * Charge the time since the last call to the line being profiled, then
+ * start profiling the line at counter.  Counts an execution of the line
+ * if newline is 1 (rather than resuming a statement part way through.)
+ */
+void profmark(unsigned char newline)
+{
+    unsigned long long now = proftime();
+
+    if (proflast) {
+        proflast->ns += now - profstart;
+    }
+    profstart = now;
+    proflast = NULL;
+    if (profon && profdata && current && !compile &&
+        ((unsigned int) counter < proflines)) {
+        proflast = &(profdata[counter]);
+        if (newline) {
+            ++(proflast->count);
+        }
+    }
+}
+
+/*
+ * Print val right aligned in a column of width 10.  (printdec() only
+ * handles five digits.)
+ */
+void profcol(unsigned long long val)
+{
+    char buf[11];
+    unsigned char i = 10;
+
+    buf[10] = 0;
+    do {
+        buf[--i] = '0' + val % 10;
+        val /= 10;
+    } while (val && i);
+    while (i) {
+        buf[--i] = ' ';
+    }
+    print(buf);
+}
+
+/*
+ * Print the sub name declared on line l, or main if l is NULL
+ */
+void profsubname(struct lineofcode *l)
+{
+    char *p;
+
+    if (!l) {
+        print(" (main)");
+        return;
+    }
+    p = l->line;
+    while (*p == ' ') {
+        ++p;
+    }
+    p += 3;                     /* Skip "sub" */
+    printchar(' ');
+    while (*p == ' ') {
+        ++p;
+    }
+    while (*p && (*p != '(') && (*p != ' ')) {
+        printchar(*p++);
+    }
+}
+
+/*
+ * Print the totals for a sub (or the main program if sub is NULL)
+ */
+void profsubtotal(struct lineofcode *sub, unsigned int calls,
+                  unsigned long long lines, unsigned long long ns)
+{
+    profcol(calls);
+    profcol(lines);
+    profcol(ns / 1000);
+    profsubname(sub);
+    printchar('\n');
+}
+
+/*
+ * prof statement with no argument - report the hottest lines, with their
+ * text, then the totals for each sub.  Times are in microseconds.
+ */
+void profreport()
+{
+    struct lineofcode *l;
+    struct lineofcode *sub = NULL;
+    struct profent *e;
+    unsigned int top[PROFTOP];
+    unsigned int ntop = 0;
+    unsigned int i;
+    unsigned int j;
+    unsigned int calls = 0;
+    unsigned long long lines = 0;
+    unsigned long long ns = 0;
+    unsigned long long mainlines = 0;
+    unsigned long long mainns = 0;
+    unsigned char token;
+    char *oldtxtPtr = txtPtr;
+
+    if (!profdata) {
+        print("No profile\n");
+        return;
+    }
+    profmark(0);
+
+    /* Keep the indices of the hottest lines, in descending order */
+    for (i = 0; i < proflines; ++i) {
+        e = &(profdata[i]);
+        if (!e->count) {
+            continue;
+        }
+        for (j = ntop; j > 0; --j) {
+            if (profdata[top[j - 1]].ns >= e->ns) {
+                break;
+            }
+            if (j < PROFTOP) {
+                top[j] = top[j - 1];
+            }
+        }
+        if (j < PROFTOP) {
+            top[j] = i;
+            if (ntop < PROFTOP) {
+                ++ntop;
+            }
+        }
+    }
+
+    print("      line     count      usec\n");
+    for (j = 0; j < ntop; ++j) {
+        l = program;
+        for (i = 0; l && (i < top[j]); ++i) {
+            l = l->next;
+        }
+        if (!l) {
+            continue;
+        }
+        profcol(top[j] + 1);
+        profcol(profdata[top[j]].count);
+        profcol(profdata[top[j]].ns / 1000);
+        printchar(' ');
+        print(l->line);
+        printchar('\n');
+    }
+
+    print("\n     calls     lines      usec sub\n");
+    l = program;
+    for (i = 0; l && (i < proflines); ++i, l = l->next) {
+        e = &(profdata[i]);
+        txtPtr = l->line;
+        eatspace();
+        token = matchstatement();
+        if (token == TOK_SUBR) {
+            sub = l;
+            calls = e->count;
+            lines = 0;
+            ns = 0;
+        } else if (token == TOK_ENDSUBR) {
+            if (sub) {
+                profsubtotal(sub, calls, lines, ns);
+            }
+            sub = NULL;
+        } else if (sub) {
+            lines += e->count;
+            ns += e->ns;
+        } else {
+            mainlines += e->count;
+            mainns += e->ns;
+        }
+    }
+    txtPtr = oldtxtPtr;
+    profsubtotal(NULL, 1, mainlines, mainns);
+}
+
+#endif
+
+void run(unsigned char cont)
+{
+    int status = 0;
+#ifdef PROFILER
+    /* When continuing, docall() has already counted the first line */
+    unsigned char profskip = cont;
+#endif
+#ifdef CONTSTACK
+    struct contctx ctx;
+    struct contctx *oldctx = contctx;
+#endif
+
+    calllevel = 0;
+    skipFlag = 0;
+    if (cont == 0) {
+        counter = 0;
+        clearvars();
+        returnSP = RETSTACKSZ - 1;
+        current = program;
+#ifdef CONTSTACK
+        contreset();
+#endif
+#ifdef PROFILER
+        if (profon && !compile) {
+            profalloc();
+        }
+#endif
+    }
+#ifdef CONTSTACK
+    /*
+     * A suspended statement comes back here, with current and txtPtr
+     * set up to continue in the sub which was called, or to restart
+     * the statement.
+     */
+    contctx = &ctx;
+    ctx.operandSP = operandSP;
+    ctx.operatorSP = operatorSP;
+    if (setjmp(ctx.jb)) {
+        status = 0;
+        operandSP = ctx.operandSP;
+        operatorSP = ctx.operatorSP;
+        contdepth = 0;
+#ifdef EXPRCACHE
+        exprcache_abort();
+#endif
+#ifdef PROFILER
+        if (profon) {
+            profmark(0);
+        }
+#endif
+        goto resume;
+    }
+#ifdef COROUTINE
+    /* Resuming a coroutine, part way through the current line */
+    if (cont == 2) {
+        goto resume;
+    }
+#endif
+#endif
+    while (current && !status) {
+#ifdef TIERED
+        if (tierlines <= TIERTHRESH) {
+            ++tierlines;
+        }
+        if (compile && !tiering) {
 #else
-                print("kbd.ch unimplemented on Linux\n");
+        if (compile) {
+#endif
+            printchar('.');
+        }
+#ifdef EXTMEM
+        copyfromaux(current->line, current->len);
+        txtPtr = embuf;
+#else
+        txtPtr = current->line;
+#endif
+#ifdef PROFILER
+        if (profskip) {
+            profskip = 0;
+        } else if (profon) {
+            profmark(1);
+        }
+#endif
+#ifdef CONTSTACK
+      resume:
+#endif
+        status = parseline();
+        /* parseline() can set current to NULL when return is to
+         * immediate mode */
+        if (!current) {
+            break;
+        }
+        current = current->next;
+        ++counter;
+    }
+#ifdef CONTSTACK
+    contctx = oldctx;
+#endif
+#ifdef PROFILER
+    if (profon) {
+        profmark(0);
+    }
+#endif
+#ifdef TIERED
+    if (status > 1) {
+        /* Only compile programs which ran cleanly */
+        tierstate = TIER_BLOCKED;
+        if (tiering) {
+            /* Fail silently, caller will interpret instead */
+            returnSP = (RETSTACKSZ - 1);
+            skipFlag = 0;
+            compile = 0;
+            return;
+        }
+    }
+#endif
+#ifdef COROUTINE
+    if ((status > 1) || !cont) {
+        coreset();
+    }
+#endif
+    switch (status) {
+    case 2:
+        print(" err at ");
+        printdec(counter);
+        printchar('\n');
+        returnSP = (RETSTACKSZ - 1);
+        skipFlag = 0;
+        compile = 0;
+        break;
+    case 3:
+        print("\nBrk at ");
+        printdec(counter);
+        printchar('\n');
+        returnSP = (RETSTACKSZ - 1);
+        skipFlag = 0;
+        compile = 0;
+        break;
+    }
+}
+
+/*
+ * Perform linkage.
+ * The subroutine definitions are in the list that starts with subsbegin.
+ * The subroutine calls are in the list that starts with callsbegin.
+ * Returns 0 on success, 1 on error.
+ */
+#ifdef A2E
+#pragma code-name (push, "LC")
+#endif
+#ifdef LINKER
+
+/*
+ * Hash sub name, which is not terminated if it is SUBRNUMCHARS long.
+ */
+unsigned int linkhashidx(char *name)
+{
+    unsigned int h = 0;
+    unsigned char i;
+
+    for (i = 0; (i < SUBRNUMCHARS) && name[i]; ++i) {
+        h = h * 31 + (unsigned char) name[i];
+    }
+    return h & (LINKHASHSZ - 1);
+}
+
+/*
+ * Find sub by name in the linker hash table.
+ * Returns NULL if not found.
+ */
+sub_t *linkfind(char *name)
+{
+    sub_t *sub = linkhash[linkhashidx(name)];
+
+    while (sub && strncmp(sub->name, name, SUBRNUMCHARS)) {
+        sub = sub->hnext;
+    }
+    return sub;
+}
+
+unsigned char linksubs()
+{
+    sub_t *call;
+    sub_t *sub;
+    unsigned int h;
+    unsigned char *ptr;
+
+    for (h = 0; h < LINKHASHSZ; ++h) {
+        linkhash[h] = NULL;
+    }
+
+    /* If a sub is defined twice, calls go to the first one, as before */
+    for (sub = subsbegin; sub; sub = sub->next) {
+        if (!linkfind(sub->name)) {
+            h = linkhashidx(sub->name);
+            sub->hnext = linkhash[h];
+            linkhash[h] = sub;
+        }
+    }
+
+    for (call = callsbegin; call; call = call->next) {
+        sub = linkfind(call->name);
+#ifdef MODULES
+        if (!sub && modcomp) {
+            /* Imported from another module */
+            continue;
+        }
 #endif
+        if (!sub) {
+            error(ERR_LINK);
+            return 1;
+        }
+        ptr = CODESTART + call->addr - RTPCSTART;
+        ptr[0] = sub->addr & 0xff;
+        ptr[1] = (sub->addr >> 8) & 0xff;
+    }
+    return 0;
+}
+
+#else
+
+unsigned char linksubs()
+{
+    sub_t *call;
+    sub_t *sub;
+    call = callsbegin;
+    while (call) {
+        sub = subsbegin;
+
+        while (strncmp(sub->name, call->name, SUBRNUMCHARS)) {
+            sub = sub->next;
+            if (!sub) {
+                error(ERR_LINK);
+                return 1;
             }
-            break;
-        case TOK_KBDLN:
-            if (compile) {
-                /* Address and length should both be on the eval stack */
-                emit(VM_KBDLN);
-            } else {
-                getln((char *) arg, arg2);
-            }
-            break;
-        case TOK_CLEAR:
-            clearvars();
-            break;
-        case TOK_VARS:
-            printvars();
-            break;
-        case TOK_WORD:
-            if (assignorcreate(WORD_MODE)) {
-                return 2;
-            }
-            break;
-        case TOK_BYTE:
-            if (assignorcreate(BYTE_MODE)) {
-                return 2;
-            }
-            break;
-        case TOK_CONST:
-            if (assignorcreate(CONST_MODE)) {
-                return 2;
-            }
-            break;
-        case TOK_RUN:
-            run(0);             /* Start from beginning */
-            break;
-        case TOK_COMPILE:
-            strncpy(filename, readbuf, FILENAMELEN);
-            filename[FILENAMELEN] = 0; /* Just in case not terminated */
-            compile = 1;
-            subsbegin = subsend = NULL;
-            callsbegin = callsend = NULL;
-            CLEARRTCALLSTACK();
-            run(0);
-            if (compile) {
-                emit(VM_END);
-                linksubs();
-                writebytecode();
-                compile = 0;
-            }
-#ifndef __GNUC__
-            CLEARHEAP2TOP();    /* Clear the linkage table */
+        }
+        emit_fixup(call->addr, sub->addr);
+        call = call->next;
+    }
+    return 0;
+}
+
 #endif
+#ifdef A2E
+#pragma code-name (pop)
+#endif
+
+#ifdef OPTIMIZER
+
+/*
+ * Optimizer.  After linking, the bytecode is lifted into the IR and the
+ * passes in optpasses[] are run over it until none of them changes
+ * anything (or OPTMAXITER times.)  The IR is then encoded back into
+ * bytecode at CODESTART.  Only inlining makes code longer, and it checks
+ * the code still fits.
+ */
+
+#define isjump(op) (((op) == VM_JMPIMM) || ((op) == VM_BRNCHIMM) || \
+                    ((op) == VM_JSRIMM) || ((op) == VM_COSTART) || \
+                    ((op) == IR_TABENT))
+
+/*
+ * Returns 1 if op is followed by a 16 bit immediate operand.
+ */
+unsigned char irhasimm(unsigned char op)
+{
+    switch (op) {
+    case VM_LDIMM:
+    case VM_LDAWORDIMM:
+    case VM_LDABYTEIMM:
+    case VM_STAWORDIMM:
+    case VM_STABYTEIMM:
+    case VM_LDRWORDIMM:
+    case VM_LDRBYTEIMM:
+    case VM_STRWORDIMM:
+    case VM_STRBYTEIMM:
+    case VM_JMPIMM:
+    case VM_BRNCHIMM:
+    case VM_JSRIMM:
+    case VM_JMPTAB:
+    case VM_COSTART:
+    case VM_NATIVE:
+    case VM_LDALIMM:
+    case VM_LDRLIMM:
+    case VM_STALIMM:
+    case VM_STRLIMM:
+    case VM_VEC:
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the length in bytes of the encoding of instruction *p.
+ */
+unsigned int irinsnsize(irinsn_t *p)
+{
+    if (p->op == VM_PRMSG) {
+        return strlen((char *) irsrc + p->src + 1) + 2;
+    }
+    if (p->op == IR_TABENT) {
+        return 2;
+    }
+    return (irhasimm(p->op) ? 3 : 1);
+}
+
+/*
+ * Returns the length in bytes of the encoding of instruction i.  For an
+ * inlined call this is the length of the copy of the body of the sub.
+ */
+unsigned int irsize(unsigned int i)
+{
+    unsigned int j;
+    unsigned int n = 0;
+
+    if (ir[i].flags & IR_INLINE) {
+        for (j = ir[i].imm; irinl[j].op != VM_RTS; ++j) {
+            n += irinsnsize(&irinl[j]);
+        }
+        return n;
+    }
+    return irinsnsize(&ir[i]);
+}
+
+/*
+ * Find the instruction whose original encoding starts at VM address addr.
+ * Returns its index, or irlen if there is none.
+ */
+unsigned int irfind(unsigned int addr)
+{
+    unsigned int lo = 0;
+    unsigned int hi = irlen;
+    unsigned int mid;
+
+    addr -= RTPCSTART;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (ir[mid].src < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (((lo < irlen) && (ir[lo].src == addr)) ? lo : irlen);
+}
+
+/*
+ * Returns the index of the first instruction at or after i which has not
+ * been deleted, or irlen if there is none.  A jump to a deleted
+ * instruction goes here.
+ */
+unsigned int irnext(unsigned int i)
+{
+    while ((i < irlen) && (ir[i].flags & IR_DEAD)) {
+        ++i;
+    }
+    return i;
+}
+
+/*
+ * Returns the index of the instruction after i in the same basic block,
+ * or irlen if i is the last instruction in its block.
+ */
+unsigned int irstep(unsigned int i)
+{
+    switch (ir[i].op) {
+    case VM_END:
+    case VM_JMPIMM:
+    case VM_BRNCHIMM:
+    case VM_JSRIMM:
+    case VM_RTS:
+    case VM_JMPTAB:
+    case IR_TABENT:
+    case VM_CONEW:
+    case VM_COSTART:
+    case VM_CODONE:
+    case VM_RESUME:
+    case VM_YIELD:
+        return irlen;
+    }
+    while (++i < irlen) {
+        if (ir[i].flags & IR_LABEL) {
             break;
-        case TOK_NEW:
-            new();
-            break;
-        case TOK_SUBR:
-            if (dosubr()) {
-                return 2;
-            }
-            break;
-        case TOK_ENDSUBR:
-            if (doendsubr()) {
-                return 2;
-            }
-            break;
-        case TOK_CALL:
-            if (docall()) {
-                return 2;
-            }
-            if (compile) {
-                /* Drop the return value */
-                emit(VM_DROP);
-            } else {
-                /* If we were called from immediate mode ... */
-                /* Switch to run mode and continue */
-                if (return_stack[returnSP + 2] == -1) {
-                    run(1);
-                }
-            }
-            break;
-        case TOK_RET:
-            if (doreturn(arg)) {
-                /* Error */
-                return 2;
-            }
+        }
+        if (!(ir[i].flags & IR_DEAD)) {
+            return i;
+        }
+    }
+    return irlen;
+}
 
-            /*
-             * If this was a function invocation, just
-             * return and let P() continue with its job!
-             */
-            if (return_stack[returnSP + 2] == -2) {
+/*
+ * Free the IR.
+ */
+void irfree()
+{
+    free(ir);
+    free(irsrc);
+    free(irinl);
+    ir = NULL;
+    irsrc = NULL;
+    irinl = NULL;
+    irlen = 0;
+    irinllen = 0;
+}
+
+/*
+ * Lift the code between CODESTART and codeptr into the IR.  Each entry in
+ * the table following a JMPTAB becomes an IR_TABENT instruction.
+ * Returns 0 on success, 1 if the code can not be optimized (it uses
+ * computed jumps, or a jump target is not an instruction.)
+ */
+unsigned char irlift()
+{
+    unsigned int len = codeptr - CODESTART;
+    unsigned int pos = 0;
+    unsigned int tabents = 0;
+    unsigned int i;
+    sub_t *s;
+
+    irlen = 0;
+    irsrc = malloc(len + 1);
+    ir = malloc((len + 1) * sizeof(irinsn_t)); /* At most one per byte */
+    if (!irsrc || !ir) {
+        return 1;
+    }
+    memcpy(irsrc, CODESTART, len);
+    irsrc[len] = 0;
+
+    while (pos < len) {
+        ir[irlen].flags = 0;
+        ir[irlen].src = pos;
+        if (tabents) {
+            ir[irlen].op = IR_TABENT;
+            ir[irlen].imm = irsrc[pos] | (irsrc[pos + 1] << 8);
+            --tabents;
+            pos += irsize(irlen++);
+            continue;
+        }
+        ir[irlen].op = irsrc[pos];
+        ir[irlen].imm = 0;
+        if ((ir[irlen].op > VM_SNAP) || (ir[irlen].op == VM_JMP) ||
+            (ir[irlen].op == VM_BRNCH) || (ir[irlen].op == VM_JSR)) {
+            return 1;
+        }
+        if (irhasimm(ir[irlen].op)) {
+            ir[irlen].imm = irsrc[pos + 1] | (irsrc[pos + 2] << 8);
+        }
+        if (ir[irlen].op == VM_JMPTAB) {
+            tabents = ir[irlen].imm;
+        }
+        pos += irsize(irlen++);
+    }
+    if (!irlen || (pos != len) || tabents) {
+        return 1;
+    }
+
+    for (i = 0; i < irlen; ++i) {
+        if (isjump(ir[i].op)) {
+            ir[i].target = irfind(ir[i].imm);
+            if (ir[i].target == irlen) {
                 return 1;
             }
+        }
+    }
+    ir[0].flags = IR_ENTRY;
+    for (s = subsbegin; s; s = s->next) {
+        i = irfind(s->addr);
+        if (i == irlen) {
+            return 1;
+        }
+        ir[i].flags = IR_ENTRY;
+    }
+    return 0;
+}
 
-            break;
-        case TOK_IF:
-            doif(arg);
-            break;
-        case TOK_ELSE:
-            if (doelse()) {
-                return 2;
-            }
-            break;
-        case TOK_ENDIF:
-            if (doendif()) {
-                return 2;
-            }
-            break;
-        case TOK_FOR:
-            if (assignorcreate(FOR_MODE)) {
-                return 2;
-            }
-            break;
-        case TOK_ENDFOR:
-            if (doendfor()) {
-                return 2;
-            }
-            break;
-        case TOK_WHILE:
-            dowhile(startTxtPtr, arg);
-            break;
-        case TOK_ENDW:
-            if (doendwhile()) {
-                return 2;
-            }
-            break;
-        case TOK_END:
-            if (compile) {
-                emit(VM_END);
-            } else {
-                return 1;       /* Normal stop */
+/*
+ * Work out where the basic blocks start.  Must be called before each
+ * pass, since deleting an instruction moves any label on it forward.
+ */
+void irlabels()
+{
+    unsigned int i;
+    unsigned int j;
+
+    for (i = 0; i < irlen; ++i) {
+        ir[i].flags &= ~IR_LABEL;
+    }
+    for (i = 0; i < irlen; ++i) {
+        if (ir[i].flags & IR_DEAD) {
+            if (ir[i].flags & IR_ENTRY) {
+                ir[i].flags &= ~IR_ENTRY;
+                j = irnext(i);
+                if (j < irlen) {
+                    ir[j].flags |= IR_ENTRY;
+                }
             }
-            break;
-        case TOK_MODE:
-#ifdef A2E
-            if (arg == 40) {
-                videomode(VIDEOMODE_40COL);
-            } else if (arg == 80) {
-                videomode(VIDEOMODE_80COL);
+            continue;
+        }
+        if (ir[i].flags & IR_ENTRY) {
+            ir[i].flags |= IR_LABEL;
+        }
+        if (isjump(ir[i].op)) {
+            ir[i].target = irnext(ir[i].target);
+            if (ir[i].target < irlen) {
+                ir[ir[i].target].flags |= IR_LABEL;
+            }
+            if ((ir[i].op == VM_JSRIMM) || (ir[i].op == VM_COSTART)) {
+                /* Return address */
+                j = irnext(i + 1);
+                if (j < irlen) {
+                    ir[j].flags |= IR_LABEL;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Pass: jump threading.
+ * A jump or branch to a JMPIMM goes straight to its destination, a jump
+ * to RTS or END becomes that instruction and a jump or branch to the
+ * following instruction is removed.
+ */
+unsigned char optjumps()
+{
+    unsigned int i;
+    unsigned int t;
+    unsigned int n;
+    unsigned char changed = 0;
+
+    for (i = 0; i < irlen; ++i) {
+        if ((ir[i].flags & IR_DEAD) ||
+            ((ir[i].op != VM_JMPIMM) && (ir[i].op != VM_BRNCHIMM))) {
+            continue;
+        }
+        t = ir[i].target;
+        for (n = 0; (t < irlen) && (ir[t].op == VM_JMPIMM) && (n < irlen); ++n) {
+            t = irnext(ir[t].target);
+        }
+        if (t >= irlen) {
+            continue;
+        }
+        if (t != ir[i].target) {
+            ir[i].target = t;
+            changed = 1;
+        }
+        if (t == irnext(i + 1)) {
+            if (ir[i].op == VM_JMPIMM) {
+                ir[i].flags |= IR_DEAD;
             } else {
-                error(ERR_VALUE);
-                return 2;
+                ir[i].op = VM_DROP; /* Still need to pop the condition */
             }
-#endif
+            changed = 1;
+        } else if ((ir[i].op == VM_JMPIMM) &&
+                   ((ir[t].op == VM_RTS) || (ir[t].op == VM_END))) {
+            ir[i].op = ir[t].op;
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+/*
+ * Add instruction i to the worklist if it has not been reached before.
+ */
+void irreach(unsigned int i, unsigned int *work, unsigned int *n)
+{
+    i = irnext(i);
+    if ((i < irlen) && !(ir[i].flags & IR_REACH)) {
+        ir[i].flags |= IR_REACH;
+        work[(*n)++] = i;
+    }
+}
+
+/*
+ * Pass: unreachable code removal.
+ * Deletes code which can not be reached from the start of the program,
+ * such as code after return or end.  Subs are only reached through a
+ * call from reachable code, so subs which are never called are dropped.
+ */
+unsigned char optunreachable()
+{
+    unsigned int *work;
+    unsigned int n = 0;
+    unsigned int i;
+    unsigned char changed = 0;
+
+    work = malloc(irlen * sizeof(unsigned int));
+    if (!work) {
+        return 0;
+    }
+    for (i = 0; i < irlen; ++i) {
+        ir[i].flags &= ~IR_REACH;
+    }
+    irreach(0, work, &n);
+    while (n) {
+        i = work[--n];
+        switch (ir[i].op) {
+        case VM_END:
+        case VM_RTS:
             break;
-        case TOK_FREE:
-            showfreespace();
+        case VM_JMPIMM:
+            irreach(ir[i].target, work, &n);
             break;
-        case TOK_POKEWORD:
-            eatspace();
-            if (expect('=')) {
-                return 2;
-            }
-            if (eval(1, &arg2)) {
-                return 2;
-            }
-            if (compile) {
-                emit(VM_SWAP);
-                emit(VM_STAWORD);
-                return 0;
+        case VM_JSRIMM:
+            if (ir[i].flags & IR_INLINE) {
+                irreach(i + 1, work, &n);
+                break;
             }
-            *(int *) arg = arg2;
+            /* Fall through */
+        case IR_TABENT:
+            /* Reaches the next entry, or the code after the table */
+        case VM_COSTART:
+            /* Reaches the sub, and the CODONE which it returns to */
+        case VM_BRNCHIMM:
+            irreach(ir[i].target, work, &n);
+            irreach(i + 1, work, &n);
             break;
-        case TOK_POKEBYTE:
-            eatspace();
-            if (expect('=')) {
-                return 2;
+        default:
+            irreach(i + 1, work, &n);
+        }
+    }
+    for (i = 0; i < irlen; ++i) {
+        if (!(ir[i].flags & (IR_DEAD | IR_REACH))) {
+            if (ir[i].flags & IR_ENTRY) {
+                ir[i].flags &= ~IR_ENTRY;
+                ir[i].flags |= IR_DROPPED;
+            }
+            ir[i].flags |= IR_DEAD;
+            changed = 1;
+        }
+    }
+    free(work);
+    return changed;
+}
+
+/*
+ * Pass: dead code elimination.
+ * Deletes values which are pushed and then dropped, pairs of SWAPs and
+ * double NOTs before a branch, and resolves branches on constants.
+ */
+unsigned char optdeadcode()
+{
+    unsigned int i;
+    unsigned int j;
+    unsigned int k;
+    unsigned char changed = 0;
+
+    for (i = 0; i < irlen; ++i) {
+        if ((ir[i].flags & IR_DEAD) || ((j = irstep(i)) == irlen)) {
+            continue;
+        }
+        switch (ir[i].op) {
+        case VM_LDIMM:
+            if (ir[j].op == VM_BRNCHIMM) {
+                if (ir[i].imm) {
+                    ir[i].op = VM_JMPIMM;
+                    ir[i].target = ir[j].target;
+                } else {
+                    ir[i].flags |= IR_DEAD;
+                }
+                ir[j].flags |= IR_DEAD;
+                changed = 1;
+                break;
             }
-            if (eval(1, &arg2)) {
-                return 2;
+            /* Fall through */
+        case VM_LDAWORDIMM:
+        case VM_LDABYTEIMM:
+        case VM_LDRWORDIMM:
+        case VM_LDRBYTEIMM:
+        case VM_DUP:
+        case VM_OVER:
+            if (ir[j].op == VM_DROP) {
+                ir[i].flags |= IR_DEAD;
+                ir[j].flags |= IR_DEAD;
+                changed = 1;
             }
-            if (compile) {
-                emit(VM_SWAP);
-                emit(VM_STABYTE);
-                return 0;
+            break;
+        case VM_SWAP:
+            if (ir[j].op == VM_SWAP) {
+                ir[i].flags |= IR_DEAD;
+                ir[j].flags |= IR_DEAD;
+                changed = 1;
             }
-            *(unsigned char *) arg = arg2;
             break;
-        case TOK_APP:
-            findline(arg);
-            if (!current) {
-                error(ERR_LINE);
-                break;
+        case VM_NOT:
+            if ((ir[j].op == VM_NOT) && ((k = irstep(j)) < irlen) &&
+                (ir[k].op == VM_BRNCHIMM)) {
+                ir[i].flags |= IR_DEAD;
+                ir[j].flags |= IR_DEAD;
+                changed = 1;
             }
-            editmode = 1;
             break;
-        case TOK_INS:
-            if (arg <= 1) {
-                editmode = 2;   /* Special mode for insert
-                                   first line */
-            } else {
-                findline(arg - 1);
-                if (!current) {
-                    error(ERR_LINE);
+        }
+    }
+    return changed;
+}
+
+/*
+ * Pass: peephole optimizations.
+ * Folds arithmetic on constants, turns constant addresses into immediate
+ * mode loads and stores and merges NOT into the preceding comparison.
+ */
+unsigned char optpeephole()
+{
+    unsigned int i;
+    unsigned int j;
+    unsigned int k;
+    unsigned int a;
+    unsigned int b;
+    unsigned char changed = 0;
+
+    for (i = 0; i < irlen; ++i) {
+        if ((ir[i].flags & IR_DEAD) || ((j = irstep(i)) == irlen)) {
+            continue;
+        }
+        switch (ir[i].op) {
+        case VM_GT:
+        case VM_GTE:
+        case VM_LT:
+        case VM_LTE:
+        case VM_EQL:
+        case VM_NEQL:
+            if (ir[j].op == VM_NOT) {
+                switch (ir[i].op) {
+                case VM_GT:
+                    ir[i].op = VM_LTE;
+                    break;
+                case VM_GTE:
+                    ir[i].op = VM_LT;
+                    break;
+                case VM_LT:
+                    ir[i].op = VM_GTE;
+                    break;
+                case VM_LTE:
+                    ir[i].op = VM_GT;
+                    break;
+                case VM_EQL:
+                    ir[i].op = VM_NEQL;
+                    break;
+                case VM_NEQL:
+                    ir[i].op = VM_EQL;
                     break;
                 }
-                editmode = 1;
+                ir[j].flags |= IR_DEAD;
+                changed = 1;
             }
             break;
-        case TOK_DEL:
-            eatspace();
-            if (!(*txtPtr)) {
-                deleteline(arg, arg);   /* One arg */
+        case VM_LDIMM:
+            a = ir[i].imm;
+            if ((ir[j].op == VM_LDIMM) && ((k = irstep(j)) < irlen)) {
+                b = ir[j].imm;
+                switch (ir[k].op) {
+                case VM_ADD:
+                    a += b;
+                    break;
+                case VM_SUB:
+                    a -= b;
+                    break;
+                case VM_MUL:
+                    a *= b;
+                    break;
+                case VM_BITAND:
+                    a &= b;
+                    break;
+                case VM_BITOR:
+                    a |= b;
+                    break;
+                case VM_BITXOR:
+                    a ^= b;
+                    break;
+                default:
+                    continue;
+                }
+                ir[i].imm = a & 0xffff;
+                ir[j].flags |= IR_DEAD;
+                ir[k].flags |= IR_DEAD;
+                changed = 1;
                 break;
             }
-            if (expect(',')) {
-                return 2;
+            if ((a == 0) && ((k = irstep(j)) < irlen) &&
+                ((ir[k].op == VM_ADD) || (ir[k].op == VM_BITOR)) &&
+                ((ir[j].op == VM_LDAWORDIMM) || (ir[j].op == VM_LDABYTEIMM) ||
+                 (ir[j].op == VM_LDRWORDIMM) || (ir[j].op == VM_LDRBYTEIMM))) {
+                /* 0 + x */
+                ir[i].flags |= IR_DEAD;
+                ir[k].flags |= IR_DEAD;
+                changed = 1;
+                break;
             }
-            if (eval(1, &arg2)) {
-                return 2;
+            switch (ir[j].op) {
+            case VM_LDAWORD:
+                ir[i].op = VM_LDAWORDIMM;
+                break;
+            case VM_LDABYTE:
+                ir[i].op = VM_LDABYTEIMM;
+                break;
+            case VM_LDAL:
+                ir[i].op = VM_LDALIMM;
+                break;
+            case VM_STAWORD:
+                ir[i].op = VM_STAWORDIMM;
+                break;
+            case VM_STABYTE:
+                ir[i].op = VM_STABYTEIMM;
+                break;
+            case VM_LDRWORD:
+                ir[i].op = VM_LDRWORDIMM;
+                break;
+            case VM_LDRBYTE:
+                ir[i].op = VM_LDRBYTEIMM;
+                break;
+            case VM_STRWORD:
+                ir[i].op = VM_STRWORDIMM;
+                break;
+            case VM_STRBYTE:
+                ir[i].op = VM_STRBYTEIMM;
+                break;
+            case VM_ADD:
+            case VM_SUB:
+                if (a == 0) {
+                    ir[i].flags |= IR_DEAD;
+                } else if (a == 1) {
+                    ir[i].op = ((ir[j].op == VM_ADD) ? VM_INC : VM_DEC);
+                } else {
+                    continue;
+                }
+                break;
+            default:
+                continue;
             }
-            deleteline(arg, arg2);      /* Two args */
+            ir[j].flags |= IR_DEAD;
+            changed = 1;
             break;
-        case TOK_CHANGE:
-            eatspace();
-            if (expect(':')) {
-                return 2;
+        }
+    }
+    return changed;
+}
+
+/*
+ * Copy the body of the sub whose entry is instruction t to the end of
+ * irinl, so it can be inlined, unless it has been copied already.  The
+ * sub must be a small leaf: straight line code from SPTOFP to FPTOSP, RTS
+ * which calls nothing and only accesses its frame with the immediate mode
+ * relative loads and stores.  The copy keeps the SPTOFP and FPTOSP, but
+ * there is no return address in the frame, so the offsets of arguments are
+ * two less.  The instruction after the copy is an RTS.
+ * Sets *k to the index of the copy.  Returns 0 on success, 1 if the sub
+ * can not be inlined.
+ */
+unsigned char irinlbody(unsigned int t, unsigned int *k)
+{
+    unsigned int j;
+    unsigned int n = 0;
+    unsigned int size = 0;
+    unsigned int last = t;
+    irinsn_t *p;
+
+    for (*k = 0; *k < irinllen; ++*k) {
+        if ((irinl[*k].op == VM_SPTOFP) && (irinl[*k].target == t)) {
+            return 0;
+        }
+    }
+    if ((t >= irlen) || (ir[t].op != VM_SPTOFP)) {
+        return 1;
+    }
+    for (j = t; ir[j].op != VM_RTS; j = irnext(j + 1)) {
+        switch (ir[j].op) {
+        case VM_LDRWORDIMM:
+        case VM_LDRBYTEIMM:
+        case VM_STRWORDIMM:
+        case VM_STRBYTEIMM:
+        case VM_LDRLIMM:
+        case VM_STRLIMM:
+            /* Return address or saved frame pointer */
+            if (ir[j].imm < 4) {
+                return 1;
             }
-            findline(arg);
-            if (!current) {
-                error(ERR_LINE);
-                break;
+            break;
+        case VM_SPTOFP:
+            if (j != t) {
+                return 1;
             }
-            changeline(txtPtr);
-            /* Don't execute the changed code yet! */
-            return 0;
             break;
-        case TOK_LIST:
-            if (!(*txtPtr)) {
-                list(1, 32767); /* No args */
-                break;
+        case VM_FPTOSP:
+            if (ir[irnext(j + 1)].op != VM_RTS) {
+                return 1;
             }
-            if (eval(0, &arg)) {
-                return 2;
+            break;
+        case VM_END:
+        case VM_JMPIMM:
+        case VM_BRNCHIMM:
+        case VM_JSRIMM:
+        case VM_JMPTAB:
+        case VM_CONEW:
+        case VM_COSTART:
+        case VM_CODONE:
+        case VM_RESUME:
+        case VM_YIELD:
+        case VM_LDRWORD:
+        case VM_LDRBYTE:
+        case VM_STRWORD:
+        case VM_STRBYTE:
+        case VM_ATOR:
+        case VM_RTOA:
+            return 1;
+        }
+        size += irsize(j);
+        ++n;
+        last = j;
+        if ((size > OPTINLINESZ) || (irnext(j + 1) == irlen)) {
+            return 1;
+        }
+    }
+    if (ir[last].op != VM_FPTOSP) {
+        return 1;
+    }
+
+    p = realloc(irinl, (irinllen + n + 1) * sizeof(irinsn_t));
+    if (!p) {
+        return 1;
+    }
+    irinl = p;
+    p = irinl + irinllen;
+    for (j = t; ir[j].op != VM_RTS; j = irnext(j + 1)) {
+        *p = ir[j];
+        if ((p->op == VM_LDRWORDIMM) || (p->op == VM_LDRBYTEIMM) ||
+            (p->op == VM_STRWORDIMM) || (p->op == VM_STRBYTEIMM) ||
+            (p->op == VM_LDRLIMM) || (p->op == VM_STRLIMM)) {
+            if (p->imm < 0x8000) {
+                p->imm -= 2;
             }
-            eatspace();
-            if (!(*txtPtr)) {
-                list(arg, 32767);       /* One arg */
-                break;
+        }
+        ++p;
+    }
+    p->op = VM_RTS;
+    irinl[irinllen].target = t;
+    irinl[irinllen].imm = 0;    /* Number of calls inlined */
+    *k = irinllen;
+    irinllen += n + 1;
+    return 0;
+}
+
+/*
+ * Pass: inlining.
+ * Calls to small leaf subs are replaced by a copy of the body of the sub,
+ * saving the JSRIMM and RTS.  If every call to a sub is inlined, the sub
+ * is then dropped as unreachable.  Only inlines while the code still fits
+ * below the variables in heap 1.
+ */
+unsigned char optinline()
+{
+    unsigned int i;
+    unsigned int k;
+    unsigned int size = 0;
+    unsigned char changed = 0;
+
+    for (i = 0; i < irlen; ++i) {
+        if (!(ir[i].flags & IR_DEAD)) {
+            size += irsize(i);
+        }
+    }
+    for (i = 0; i < irlen; ++i) {
+        if ((ir[i].flags & (IR_DEAD | IR_INLINE)) ||
+            (ir[i].op != VM_JSRIMM) || irinlbody(ir[i].target, &k)) {
+            continue;
+        }
+        size -= irsize(i);
+        ir[i].flags |= IR_INLINE;
+        ir[i].imm = k;
+        size += irsize(i);
+        if (CODESTART + size > heap1Ptr) {
+            size -= irsize(i);
+            ir[i].flags &= ~IR_INLINE;
+            size += irsize(i);
+            continue;
+        }
+        ++irinl[k].imm;
+        changed = 1;
+    }
+    return changed;
+}
+
+/*
+ * Print the subs which have been inlined.  Call before irencode().
+ */
+void irinlreport()
+{
+    char name[SUBRNUMCHARS + 1];
+    unsigned int k;
+    sub_t *s;
+
+    for (s = subsbegin; s; s = s->next) {
+        for (k = 0; k < irinllen; ++k) {
+            if ((irinl[k].op == VM_SPTOFP) && irinl[k].imm &&
+                (irinl[k].target == irfind(s->addr))) {
+                strncpy(name, s->name, SUBRNUMCHARS);
+                name[SUBRNUMCHARS] = '\0';
+                print("Inlined ");
+                print(name);
+                print(" at ");
+                printdec(irinl[k].imm);
+                print(" calls\n");
             }
-            if (expect(',')) {
-                return 2;
+        }
+    }
+}
+
+/*
+ * Write the encoding of instruction *insn at p, with operand v.
+ * Returns the address after it.
+ */
+unsigned char *irput(unsigned char *p, irinsn_t *insn, unsigned int v)
+{
+    if (insn->op == IR_TABENT) {
+        *p++ = v & 0xff;
+        *p++ = (v >> 8) & 0xff;
+        return p;
+    }
+    *p++ = insn->op;
+    if (irhasimm(insn->op)) {
+        *p++ = v & 0xff;
+        *p++ = (v >> 8) & 0xff;
+    } else if (insn->op == VM_PRMSG) {
+        strcpy((char *) p, (char *) irsrc + insn->src + 1);
+        p += irinsnsize(insn) - 1;
+    }
+    return p;
+}
+
+/*
+ * Encode the IR back into bytecode at CODESTART, and update the addresses
+ * in the sub and call tables to match.  The address of a sub which has
+ * been dropped is set to zero.
+ * Returns the number of subs dropped.
+ */
+unsigned int irencode()
+{
+    unsigned int dropped = 0;
+    unsigned char *p = CODESTART;
+    unsigned int addr = RTPCSTART;
+    unsigned int i;
+    unsigned int j;
+    sub_t *s;
+
+    for (i = 0; i < irlen; ++i) {
+        if (!(ir[i].flags & IR_DEAD)) {
+            ir[i].addr = addr;
+            addr += irsize(i);
+        }
+    }
+    for (i = 0; i < irlen; ++i) {
+        if (ir[i].flags & IR_DEAD) {
+            continue;
+        }
+        if (ir[i].flags & IR_INLINE) {
+            for (j = ir[i].imm; irinl[j].op != VM_RTS; ++j) {
+                p = irput(p, &irinl[j], irinl[j].imm);
             }
-            if (eval(1, &arg2)) {
-                return 2;
+        } else if (isjump(ir[i].op)) {
+            p = irput(p, &ir[i], ir[irnext(ir[i].target)].addr);
+        } else {
+            p = irput(p, &ir[i], ir[i].imm);
+        }
+    }
+    for (s = subsbegin; s; s = s->next) {
+        i = irfind(s->addr);
+        if (ir[i].flags & IR_DROPPED) {
+            s->addr = 0;
+            ++dropped;
+        } else if ((i = irnext(i)) < irlen) {
+            s->addr = ir[i].addr;
+        }
+    }
+    for (s = callsbegin; s; s = s->next) {
+        i = irfind(s->addr - 1);
+        if ((i < irlen) && !(ir[i].flags & IR_DEAD)) {
+            s->addr = ir[i].addr + 1;
+        }
+    }
+    codeptr = p;
+    rtPC = addr;
+    return dropped;
+}
+
+/*
+ * Pass pipeline, in the order the passes are run.
+ */
+optpass_t optpasses[] = {
+    {"peephole", 2, optpeephole},
+    {"deadcode", 2, optdeadcode},
+    {"jumps", 1, optjumps},
+    {"inline", 2, optinline},
+    {"unreachable", 1, optunreachable},
+    {NULL, 0, NULL}
+};
+
+/*
+ * Optimize the compiled code between CODESTART and codeptr at the level
+ * selected by optlevel.  Call this after linksubs().
+ */
+void optimize()
+{
+    optpass_t *pass;
+    unsigned char iter;
+    unsigned char changed;
+    unsigned int before = codeptr - CODESTART;
+    unsigned int dropped;
+
+    if (optlevel && !irlift()) {
+        for (iter = 0; iter < OPTMAXITER; ++iter) {
+            changed = 0;
+            for (pass = optpasses; pass->name; ++pass) {
+                if (optlevel >= pass->level) {
+                    irlabels();
+                    changed |= pass->run();
+                }
             }
-            list(arg, arg2);    /* Two args */
-            break;
-        case TOK_LOAD:
-            if (readfile()) {
-                return 2;       /* Error */
+            if (!changed) {
+                break;
             }
-            /* Because readfile() trashes lnbuf ... */
-            return 0;
-            break;
-        case TOK_SAVE:
-            if (writefile()) {
-                return 2;       /* Error */
+        }
+#ifdef TIERED
+        if (!tiering)
+#endif
+        {
+            /* The last sub's progress dots end without a newline */
+            print("\n");
+            irinlreport();
+        }
+        dropped = irencode();
+#ifdef TIERED
+        if (!tiering)
+#endif
+        {
+            print("Optimized ");
+            printdec(before);
+            print(" -> ");
+            printdec(rtPC - RTPCSTART);
+            print(" bytes\n");
+            if (dropped) {
+                printdec(dropped);
+                print(" unused subs dropped\n");
             }
-            break;
-        default:
-            /* Should never get here */
-            EXIT(99);
         }
     }
-    return 0;
+    irfree();
 }
 
+#endif
+
+#ifdef LINKER
+
 /*
- * Expects filename in readbuf.
- * If writemode = 0 then it opens file for reading, otherwise for writing.
- * Returns 0 if OK, 1 if error.
+ * Build the relocation table: the address of every word in the compiled
+ * code which holds the address of code (the operands of JMPIMM,
+ * BRNCHIMM, JSRIMM and COSTART, and the entries in JMPTAB tables.)  Call
+ * this once the code is final.
  */
-#ifdef A2E
-#pragma code-name (push, "LC")
+void linkrelocs()
+{
+    unsigned char *p = CODESTART;
+    unsigned int n = 0;
+    unsigned int tabents;
+
+    free(relocs);
+    relocs = malloc(((codeptr - CODESTART) / 2 + 1) * sizeof(unsigned int));
+    nrelocs = 0;
+    if (!relocs) {
+        return;
+    }
+    while (p < codeptr) {
+        if (isjump(*p)) {
+            relocs[n++] = RTPCSTART + (p - CODESTART) + 1;
+        }
+        if (*p == VM_JMPTAB) {
+            tabents = p[1] | (p[2] << 8);
+            for (p += 3; tabents; --tabents, p += 2) {
+                relocs[n++] = RTPCSTART + (p - CODESTART);
+            }
+            continue;
+        }
+        if (*p == VM_PRMSG) {
+            p += strlen((char *) p + 1) + 2;
+        } else {
+            p += (irhasimm(*p) ? 3 : 1);
+        }
+    }
+    nrelocs = n;
+}
+
 #endif
-unsigned char openfile(unsigned char writemode)
+
+#ifdef OBJFORMAT
+
+/*
+ * Write the compiled code to fd as a bytecode object file.  The whole
+ * file is assembled in memory and written at once.
+ */
+void writeobject()
 {
-    char *readPtr = readbuf;
+    struct objhdr *hdr;
+    struct objsym *sym;
+    unsigned char *buf;
+    unsigned char *p;
+    unsigned int nsyms = 0;
+    unsigned int datasz = 0;
+    unsigned int len;
+    unsigned int i;
+    sub_t *s;
 
-    if (writemode) {
-        print("Writing ");
-    } else {
-        print("Reading ");
+#ifdef MODULES
+    if (modcomp) {
+        writemodule();
+        return;
     }
-    print(readPtr);
-    printchar(':');
-    while (*readPtr) {
-        ++readPtr;
+#endif
+#ifdef INITDATA
+    if (datahi > datalo) {
+        datasz = datahi - datalo;
     }
-#ifdef CBM
-    /* Commodore only, append ',s' for SEQ file */
-    *(readPtr++) = ',';
-    *(readPtr++) = 's';
 #endif
-    *readPtr = '\0';
-
-    readPtr = readbuf;
 
-#ifdef CBM
-    /* Commodore */
-    if (cbm_open(1, 8, (writemode ? CBM_WRITE : CBM_READ), readPtr)) {
+    for (s = subsbegin; s; s = s->next) {
+        if (s->addr) {
+            ++nsyms;
+        }
+    }
+    len = sizeof(struct objhdr) + (codeptr - CODESTART) + datasz +
+          2 * nrelocs + nsyms * sizeof(struct objsym);
+    buf = malloc(len);
+    if (!buf) {
         error(ERR_FILE);
-        return 1;
+        return;
     }
-#else
 
-#ifdef A2E
-    _filetype = 4;              /* Text file */
+    hdr = (struct objhdr *) buf;
+    memcpy(hdr->magic, OBJMAGIC, 4);
+    hdr->version = OBJVERSION;
+    hdr->entry = RTPCSTART;
+    hdr->codeaddr = RTPCSTART;
+    hdr->codesz = codeptr - CODESTART;
+    hdr->dataaddr = (datasz ? datalo : 0);
+    hdr->datasz = datasz;
+    hdr->stacktop = RTCALLSTACKTOP;
+    hdr->stacksz = RTCALLSTACKTOP - rtSP;
+    hdr->nrelocs = nrelocs;
+    hdr->nsyms = nsyms;
+
+    p = buf + sizeof(struct objhdr);
+    memcpy(p, CODESTART, hdr->codesz);
+    p += hdr->codesz;
+#ifdef INITDATA
+    memcpy(p, dataimg + datalo - RTCALLSTACKLIM, datasz);
+    p += datasz;
+#endif
+    for (i = 0; i < nrelocs; ++i) {
+        *p++ = relocs[i] & 0xff;
+        *p++ = (relocs[i] >> 8) & 0xff;
+    }
+    for (s = subsbegin; s; s = s->next) {
+        if (s->addr) {
+            sym = (struct objsym *) p;
+            memcpy(sym->name, s->name, OBJSYMCHARS);
+            sym->addr = s->addr;
+            p += sizeof(struct objsym);
+        }
+    }
+    hdr->checksum = objchecksum(buf + sizeof(struct objhdr),
+                                len - sizeof(struct objhdr));
+    fwrite(buf, 1, len, fd);
+#ifdef COMPCACHE
+    cacheput(buf, len);
 #endif
+    free(buf);
+}
 
-    /* POSIX */
-    fd = fopen(readPtr, (writemode ? "w" : "r"));
-    if (fd == NULL) {
-        error(ERR_FILE);
-        return 1;
-    }
 #endif
 
-    return 0;
+#ifdef MODULES
 
+/*
+ * Put 16 bit word w at p, little endian.  Returns p advanced past it.
+ */
+unsigned char *modputword(unsigned char *p, unsigned int w)
+{
+    *p++ = w & 0xff;
+    *p++ = (w >> 8) & 0xff;
+    return p;
 }
-#ifdef A2E
-#pragma code-name (pop)
-#endif
 
 /*
- * Load program from file.
- * Expects filename in readbuf.
- * Returns 0 if OK, 1 if error.
- * NOTE: Trashes lnbuf !!
+ * Write the compiled module to fd as a module object file.  Its subs are
+ * exported, and the calls to subs which linksubs() could not find are the
+ * imports.
  */
-#ifdef A2E
-#pragma code-name (push, "LC")
-#endif
-unsigned char readfile()
+void writemodule()
 {
-    unsigned char i;
-    unsigned char j;
-    unsigned int bytes;
-    unsigned char foundEOL;
-    unsigned char bytesInBuf = 0;
-    char *readPtr = readbuf;
-    int donereading = 0;
-    int count = 0;
+    struct modhdr *hdr;
+    struct objsym *sym;
+    unsigned char *buf;
+    unsigned char *p;
+    unsigned int nsyms = 0;
+    unsigned int nimports = 0;
+    unsigned int codesz = codeptr - CODESTART;
+    unsigned int len;
+    unsigned int i;
+    sub_t *s;
 
-    if (openfile(0)) {
-        return 1;
+    /* Drop any data relocations in code which was discarded later */
+    while (ndrelocs && (drelocs[ndrelocs - 1] >= RTPCSTART + codesz)) {
+        --ndrelocs;
+    }
+    for (s = subsbegin; s; s = s->next) {
+        if (linkfind(s->name) == s) {
+            ++nsyms;
+        }
+    }
+    for (s = callsbegin; s; s = s->next) {
+        if (!linkfind(s->name)) {
+            ++nimports;
+        }
+    }
+    len = sizeof(struct modhdr) + codesz + 2 * (nrelocs + ndrelocs) +
+          (nsyms + nimports) * sizeof(struct objsym);
+    buf = malloc(len);
+    if (!buf) {
+        error(ERR_FILE);
+        return;
     }
 
-    clearvars();
-    new();
+    hdr = (struct modhdr *) buf;
+    memcpy(hdr->magic, MODMAGIC, 4);
+    hdr->version = MODVERSION;
+    hdr->entry = RTPCSTART;
+    hdr->codesz = codesz;
+    hdr->datasz = moddatasz;
+    hdr->nrelocs = nrelocs;
+    hdr->ndrelocs = ndrelocs;
+    hdr->nsyms = nsyms;
+    hdr->nimports = nimports;
+
+    p = buf + sizeof(struct modhdr);
+    memcpy(p, CODESTART, codesz);
+    p += codesz;
+    for (i = 0; i < nrelocs; ++i) {
+        p = modputword(p, relocs[i]);
+    }
+    for (i = 0; i < ndrelocs; ++i) {
+        p = modputword(p, drelocs[i]);
+    }
+    for (s = subsbegin; s; s = s->next) {
+        if (linkfind(s->name) == s) {
+            sym = (struct objsym *) p;
+            memcpy(sym->name, s->name, OBJSYMCHARS);
+            sym->addr = s->addr;
+            p += sizeof(struct objsym);
+        }
+    }
+    for (s = callsbegin; s; s = s->next) {
+        if (!linkfind(s->name)) {
+            sym = (struct objsym *) p;
+            memcpy(sym->name, s->name, OBJSYMCHARS);
+            sym->addr = s->addr;
+            p += sizeof(struct objsym);
+        }
+    }
+    hdr->checksum = objchecksum(buf + sizeof(struct modhdr),
+                                len - sizeof(struct modhdr));
+    fwrite(buf, 1, len, fd);
+    free(buf);
+}
 
-    readPtr = readbuf;
-    do {
-        if (!donereading) {
-#ifdef DEBUG_READFILE
-            print("About to read ");
-            printdec(255 - bytesInBuf);
-            print(" bytes\n");
 #endif
 
-#ifdef CBM
-            /* Commodore */
-            bytes = cbm_read(1, readPtr, 255 - bytesInBuf);
-#else
-            /* POSIX */
-            bytes = fread(readPtr, 1, 255 - bytesInBuf, fd);
-
-#endif
-            if (bytes == -1U) {
-                error(ERR_FILE);
-#ifdef CBM
-                /* Commodore */
-                cbm_close(1);
-#else
-                /* POSIX */
-                fclose(fd);
-#endif
-                return 1;
-            }
-            if (!bytes) {
-                donereading = 1;
-            }
+#ifdef COMPCACHE
 
-            readPtr += bytes;
-            bytesInBuf += bytes;
+/*
+ * Compile cache.  Each entry is an object file, named by a 64 bit FNV-1a
+ * hash of the compiler build, the optimization level and the program text.
+ * The directory is $EBCACHE, or ~/.cache/eightball if that is not set.
+ * Setting EBCACHE to the empty string disables the cache.
+ */
+#define CACHEPATHLEN 256
+char cachepath[CACHEPATHLEN];
 
-#ifdef DEBUG_READFILE
-            print("Read ");
-            printdec(bytes);
-            print(" bytes\nBuf[");
-            for (i = 0; i < bytesInBuf; ++i) {
-                printchar(readbuf[i]);
-            }
-            print("]\n");
-#endif
+/*
+ * Hash the program and set cachepath to the name of its cache entry,
+ * creating the cache directory if need be.
+ * Returns 0 if OK, 1 if the cache is disabled or unusable.
+ */
+unsigned char cachekey()
+{
+    static const char build[] = "EightBall " VERSIONSTR " " __DATE__ " "
+        __TIME__;
+    struct lineofcode *l;
+    uint64_t h = 14695981039346656037ull;
+    const char *p;
+    char *dir = getenv("EBCACHE");
+    char *home;
+    int n;
+    int len;
+
+    for (p = build; *p; ++p) {
+        h = (h ^ (unsigned char) *p) * 1099511628211ull;
+    }
+    h = (h ^ optlevel) * 1099511628211ull;
+    for (l = program; l; l = l->next) {
+        for (p = l->line; *p; ++p) {
+            h = (h ^ (unsigned char) *p) * 1099511628211ull;
         }
+        h = (h ^ '\n') * 1099511628211ull;
+    }
 
-        foundEOL = 0;
-        for (i = 0; i < bytesInBuf; ++i) {
-            if (readbuf[i] == 10 || readbuf[i] == 13) {
-                strncpy(lnbuf, readbuf, i);
-                lnbuf[i] = 0;
-                for (j = i + 1; j < bytesInBuf; ++j) {
-                    readbuf[j - i - 1] = readbuf[j];
-                }
-                readPtr = readbuf + bytesInBuf - i - 1;
-                bytesInBuf -= (i + 1);
-                foundEOL = 1;
-                break;
-            }
+    if (dir) {
+        if (!*dir) {
+            return 1;
+        }
+        n = snprintf(cachepath, CACHEPATHLEN, "%s", dir);
+    } else {
+        home = getenv("HOME");
+        if (!home || !*home) {
+            return 1;
         }
+        n = snprintf(cachepath, CACHEPATHLEN, "%s/.cache", home);
+        if ((n > 0) && (n < CACHEPATHLEN)) {
+            mkdir(cachepath, 0755);
+        }
+        n = snprintf(cachepath, CACHEPATHLEN, "%s/.cache/eightball", home);
+    }
+    if ((n <= 0) || (n >= CACHEPATHLEN)) {
+        return 1;
+    }
+    mkdir(cachepath, 0755);
+    len = snprintf(cachepath + n, CACHEPATHLEN - n, "/%016llx.8bo",
+                   (unsigned long long) h);
+    return (len <= 0) || (len >= CACHEPATHLEN - n);
+}
 
-        if (foundEOL == 1) {
-            if (!count) {
-                insertfirstline(lnbuf);
-                findline(1);
-            } else {
-                appendline(lnbuf);
-            }
-            ++count;
-        } else {
-            if (bytesInBuf == 255) {
-                error(ERR_FILE);
-#ifdef CBM
-                /* Commodore */
-                cbm_close(1);
-#else
-                /* Apple II and POSIX */
-                fclose(fd);
+/*
+ * Look for the program in the compile cache.  On a hit, the cached object
+ * file is checked and written to filename.
+ * Returns 0 if the object file was written from the cache, 1 otherwise.
+ */
+unsigned char cacheget()
+{
+    struct objhdr hdr;
+    unsigned char *buf;
+    FILE *cf;
+    long len;
+    unsigned char ret = 1;
+
+    *cachepath = 0;
+#ifdef MODULES
+    if (modcomp) {
+        return 1;               /* Only programs are cached */
+    }
 #endif
-                return 1;
-            }
-            /* Handle last line with missing CRLF */
-            if (donereading == 1 && bytesInBuf) {
-                readbuf[bytesInBuf] = '\0';
-                appendline(readbuf);
-                ++count;
-                break;
+    if (!program || cachekey()) {
+        *cachepath = 0;
+        return 1;
+    }
+    cf = fopen(cachepath, "r");
+    if (!cf) {
+        return 1;
+    }
+    fseek(cf, 0, SEEK_END);
+    len = ftell(cf);
+    rewind(cf);
+    if ((len < (long) sizeof(struct objhdr)) || !(buf = malloc(len))) {
+        fclose(cf);
+        return 1;
+    }
+    if (fread(buf, 1, len, cf) == (size_t) len) {
+        memcpy(&hdr, buf, sizeof(struct objhdr));
+        if (!memcmp(hdr.magic, OBJMAGIC, 4) && (hdr.version == OBJVERSION) &&
+            (len == (long) (sizeof(struct objhdr) + hdr.codesz + hdr.datasz +
+                            2UL * hdr.nrelocs +
+                            (unsigned long) hdr.nsyms *
+                            sizeof(struct objsym))) &&
+            (objchecksum(buf + sizeof(struct objhdr),
+                         len - sizeof(struct objhdr)) == hdr.checksum)) {
+            strcpy(readbuf, filename);
+            printchar('\n');
+            if (!openfile(1)) {
+                print("(cached)\n");
+                fwrite(buf, 1, len, fd);
+                fclose(fd);
             }
+            ret = 0;
         }
+    }
+    free(buf);
+    fclose(cf);
+    return ret;
+}
 
-    } while (bytes || bytesInBuf);
+/*
+ * Store object file buf of len bytes in the compile cache, under the key
+ * set by cacheget().  It is written to a temporary file which is then
+ * renamed, so a cache entry is never seen half written.
+ */
+void cacheput(unsigned char *buf, unsigned int len)
+{
+    char tmp[CACHEPATHLEN + 16];
+    FILE *cf;
 
-#ifdef CBM
-    /* Commodore */
-    cbm_close(1);
-#else
-    /* Apple II and POSIX */
-    fclose(fd);
+    if (!*cachepath) {
+        return;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.%d", cachepath, (int) getpid());
+    cf = fopen(tmp, "w");
+    if (!cf) {
+        return;
+    }
+    if (fwrite(buf, 1, len, cf) != len) {
+        fclose(cf);
+        remove(tmp);
+        return;
+    }
+    if (fclose(cf) || rename(tmp, cachepath)) {
+        remove(tmp);
+    }
+}
+
+#endif
+
+#ifdef INCRCOMP
+
+/*
+ * Incremental compilation.  When the compiler reaches the endsub of a
+ * sub, the code compiled for it is kept, with the number of source lines
+ * from sub to endsub, the calls it makes and any data relocations.  The
+ * entry is keyed by a 64 bit FNV-1a hash of those lines, the sub
+ * statements of the program (which calls are compiled against), the
+ * globals and constants the sub can see, and the compiler settings.  When
+ * a later compile reaches a sub with the same key, its code is copied and
+ * relocated to where the sub now starts, and its lines are skipped.  The
+ * program is always linked and optimized as a whole.
+ */
+struct subfrag {
+    char name[SUBRNUMCHARS];
+    uint64_t key;
+    unsigned int nlines;        /* Source lines from sub to endsub      */
+    unsigned int base;          /* Address the code was compiled at     */
+    unsigned int len;           /* Bytes of code                        */
+    unsigned char *code;
+    unsigned int ncalls;
+    sub_t *calls;               /* Calls made, addr is offset in code   */
+    unsigned int ndrelocs;
+    unsigned int *drelocs;      /* Offsets of data addresses in code    */
+    unsigned char nodata;       /* 1 if compiling it cleared datasafe   */
+    struct subfrag *next;
+};
+
+struct subfrag *incrhash[LINKHASHSZ];   /* Kept code, hashed by sub name    */
+uint64_t incrsubs;              /* Hash of sub statements and settings   */
+uint64_t increnv;               /* incrsubs and globals, for current sub */
+struct lineofcode *incrline;    /* Sub statement being compiled, or NULL */
+sub_t *incrent;                 /* Its entry in the sub table            */
+int incrcounter;                /* Line number of incrline               */
+unsigned int incrpc;            /* Address its code starts at            */
+sub_t *incrcalls;               /* callsend when it started              */
+#ifdef MODULES
+unsigned int incrdrelocs;       /* ndrelocs when it started              */
+#endif
+#ifdef INITDATA
+unsigned char incrdatasafe;     /* datasafe when it started              */
 #endif
 
-    printdec(count);
-    print(" lines\n");
-    return 0;
+/*
+ * Add n bytes at p to FNV-1a hash h.  Returns the new hash.
+ */
+uint64_t incrhashbytes(uint64_t h, const void *p, unsigned int n)
+{
+    const unsigned char *b = p;
+
+    while (n--) {
+        h = (h ^ *b++) * 1099511628211ull;
+    }
+    return h;
 }
-#ifdef A2E
-#pragma code-name (pop)
-#endif
 
 /*
- * Save program to file.
- * Expects filename in readbuf.
- * Returns 0 if OK, 1 if error.
+ * Call this when compilation starts.  Hashes the sub statements in the
+ * program the same way docall() finds them, and the compiler settings.
  */
-#ifdef A2E
-#pragma code-name (push, "LC")
+void incrstart()
+{
+    struct lineofcode *l;
+    uint64_t h = 14695981039346656037ull;
+    char *p;
+
+    for (l = program; l; l = l->next) {
+        p = l->line;
+        while (*p == ' ') {
+            ++p;
+        }
+        if (!strncmp(p, "sub ", 4)) {
+            h = incrhashbytes(h, p, strlen(p) + 1);
+        }
+    }
+    h = incrhashbytes(h, &optlevel, sizeof(optlevel));
+#ifdef TIERED
+    h = incrhashbytes(h, &tiering, sizeof(tiering));
 #endif
-unsigned char writefile()
+#ifdef MODULES
+    h = incrhashbytes(h, &modcomp, sizeof(modcomp));
+#endif
+    incrsubs = h;
+    incrline = NULL;
+}
+
+/*
+ * Returns the key for the n lines of source starting at l.  The caller
+ * has checked there are that many.
+ */
+uint64_t incrkey(struct lineofcode *l, unsigned int n)
 {
-    unsigned int bytes;
-    unsigned int index;
+    uint64_t h = increnv;
 
-    if (openfile(1)) {
-        return 1;
+    for (; n; --n, l = l->next) {
+        h = incrhashbytes(h, l->line, strlen(l->line) + 1);
     }
+    return h;
+}
 
-    current = program;
-    while (current) {
-        index = 0;
+/*
+ * Find the kept code for sub name.  Returns NULL if there is none.
+ */
+struct subfrag *incrfind(char *name)
+{
+    struct subfrag *f = incrhash[linkhashidx(name)];
 
-#ifdef EXTMEM
-        copyfromaux(current->line, current->len);
-        for (index = 0; index < strlen(embuf); ++index) {
-#else
-        for (index = 0; index < strlen(current->line); ++index) {
-#endif
+    while (f && strncmp(f->name, name, SUBRNUMCHARS)) {
+        f = f->next;
+    }
+    return f;
+}
 
-#ifdef CBM
-            /* Commodore */
-            bytes = cbm_write(1, current->line + index, 1);
+/*
+ * Adjust the code addresses in the bytecode from p to end by delta, the
+ * same way linkrelocs() finds them.
+ */
+void increloc(unsigned char *p, unsigned char *end, int delta)
+{
+    unsigned int tabents;
+    unsigned int w;
 
-#elif defined(EXTMEM)
-            /* Apple II, using extended memory driver */
-            bytes = fwrite(embuf + index, 1, 1, fd);
-#else
-            /* POSIX and Apple II without extended memory */
-            bytes = fwrite(current->line + index, 1, 1, fd);
-#endif
-            if (!bytes) {
-                goto error;
+    while (p < end) {
+        if (isjump(*p)) {
+            w = (p[1] | (p[2] << 8)) + delta;
+            p[1] = w & 0xff;
+            p[2] = (w >> 8) & 0xff;
+        }
+        if (*p == VM_JMPTAB) {
+            tabents = p[1] | (p[2] << 8);
+            for (p += 3; tabents; --tabents, p += 2) {
+                w = (p[0] | (p[1] << 8)) + delta;
+                p[0] = w & 0xff;
+                p[1] = (w >> 8) & 0xff;
             }
+            continue;
         }
-#ifdef CBM
-        /* Commodore */
-        bytes += cbm_write(1, "\n", 1);
-#elif defined(A2E)
-        /* Apple II */
-        bytes += fwrite("\r", 1, 1, fd);
-#else
-        /* POSIX */
-        bytes += fwrite("\n", 1, 1, fd);
-#endif
-        if (!bytes) {
-            goto error;
+        if (*p == VM_PRMSG) {
+            p += strlen((char *) p + 1) + 2;
+        } else {
+            p += (irhasimm(*p) ? 3 : 1);
         }
-        current = current->next;
     }
+}
 
-#ifdef CBM
-    /* Commodore */
-    cbm_close(1);
-#else
-    /* POSIX */
-    fclose(fd);
+/*
+ * Called by dosubr() when compiling the sub statement at current, once
+ * subsend has been added to the sub table.  If the code kept for the sub
+ * is still good, it is emitted and current is left at its endsub.
+ * Returns 0 if the code was reused, 1 if the sub must be compiled.
+ */
+unsigned char incrsub()
+{
+    struct subfrag *f;
+    struct lineofcode *l;
+    unsigned int n;
+    unsigned int i;
+    sub_t *c;
+    var_t *v;
+    uint64_t h = incrsubs;
+
+    /* Globals and consts hold their address or value */
+    for (v = varsbegin; v; v = v->next) {
+        h = incrhashbytes(h, v->name, strnlen(v->name, VARNUMCHARS));
+        h = incrhashbytes(h, &(v->type), 1);
+        h = incrhashbytes(h, getptrtoscalarword(v),
+                          ((v->type & 0x10) ? 2 : 1) * sizeof(int));
+    }
+    increnv = h;
+
+    f = incrfind(subsend->name);
+    if (f && f->nlines) {
+        for (l = current, n = 1; l && (n < f->nlines); l = l->next, ++n);
+        if (l && (incrkey(current, f->nlines) == f->key)) {
+            memcpy(codeptr, f->code, f->len);
+            increloc(codeptr, codeptr + f->len, rtPC - f->base);
+            for (i = 0; i < f->ncalls; ++i) {
+                c = alloc2top(sizeof(sub_t));
+                memcpy(c->name, f->calls[i].name, SUBRNUMCHARS);
+                c->addr = rtPC + f->calls[i].addr;
+                c->next = NULL;
+                if (callsend) {
+                    callsend->next = c;
+                }
+                callsend = c;
+                if (!callsbegin) {
+                    callsbegin = c;
+                }
+            }
+#ifdef MODULES
+            for (i = 0; i < f->ndrelocs; ++i) {
+                moddreloc(rtPC + f->drelocs[i]);
+            }
 #endif
-    print("OK\n");
-    return 0;
+#ifdef INITDATA
+            if (f->nodata) {
+                datasafe = 0;
+            }
+#endif
+            codeptr += f->len;
+            rtPC += f->len;
+#ifdef MODULES
+            modretpc = rtPC;
+#endif
+            rtFP = rtSP;
+            for (n = 1; n < f->nlines; ++n) {
+                current = current->next;
+                ++counter;
+            }
+            txtPtr = current->line + strlen(current->line);
+#ifdef TIERED
+            if (!tiering)
+#endif
+            {
+                print(" unchanged");
+            }
+            return 0;
+        }
+    }
 
-  error:
-#ifdef CBM
-    /* Commodore */
-    cbm_close(1);
-#else
-    /* POSIX */
-    fclose(fd);
+    incrline = current;
+    incrent = subsend;
+    incrcounter = counter;
+    incrpc = rtPC;
+    incrcalls = callsend;
+#ifdef MODULES
+    incrdrelocs = ndrelocs;
+#endif
+#ifdef INITDATA
+    incrdatasafe = datasafe;
 #endif
-    error(ERR_FILE);
     return 1;
 }
-#ifdef A2E
-#pragma code-name (pop)
-#endif
-
 
-void run(unsigned char cont)
+/*
+ * Called by doendsubr() when compiling, with current at the endsub.  Keep
+ * the code for the sub in subsend, unless it was not started by incrsub()
+ * or the endsub is not at the start of the line.
+ */
+void incrsave()
 {
-    int status = 0;
-
-    calllevel = 0;
-    skipFlag = 0;
-    if (cont == 0) {
-        counter = 0;
-        clearvars();
-        returnSP = RETSTACKSZ - 1;
-        current = program;
+    struct subfrag *f;
+    struct lineofcode *l = incrline;
+    sub_t *c;
+    char *p = current->line;
+    unsigned int i;
+    unsigned int h;
+
+    if (!l || (incrent != subsend)) {
+        return;
     }
-    while (current && !status) {
-        if (compile) {
-            printchar('.');
+    incrline = NULL;
+    while (*p == ' ') {
+        ++p;
+    }
+    if (strncmp(p, "endsub", 6)) {
+        return;
+    }
+
+    f = incrfind(subsend->name);
+    if (f) {
+        free(f->code);
+        free(f->calls);
+        free(f->drelocs);
+    } else {
+        f = malloc(sizeof(struct subfrag));
+        if (!f) {
+            return;
         }
-#ifdef EXTMEM
-        copyfromaux(current->line, current->len);
-        txtPtr = embuf;
-#else
-        txtPtr = current->line;
+        strncpy(f->name, subsend->name, SUBRNUMCHARS);
+        h = linkhashidx(f->name);
+        f->next = incrhash[h];
+        incrhash[h] = f;
+    }
+    f->nlines = counter - incrcounter + 1;
+    f->key = incrkey(l, f->nlines);
+    f->base = incrpc;
+    f->len = rtPC - incrpc;
+    f->ncalls = 0;
+    for (c = (incrcalls ? incrcalls->next : callsbegin); c; c = c->next) {
+        ++(f->ncalls);
+    }
+    f->ndrelocs = 0;
+#ifdef MODULES
+    f->ndrelocs = ndrelocs - incrdrelocs;
+#endif
+    f->code = malloc(f->len);
+    f->calls = malloc(f->ncalls * sizeof(sub_t) + 1);
+    f->drelocs = malloc(f->ndrelocs * sizeof(unsigned int) + 1);
+    if (!f->code || !f->calls || !f->drelocs) {
+        f->nlines = 0;          /* Never matches */
+        return;
+    }
+    memcpy(f->code, CODESTART + incrpc - RTPCSTART, f->len);
+    c = (incrcalls ? incrcalls->next : callsbegin);
+    for (i = 0; c; c = c->next, ++i) {
+        memcpy(f->calls[i].name, c->name, SUBRNUMCHARS);
+        f->calls[i].addr = c->addr - incrpc;
+    }
+#ifdef MODULES
+    for (i = 0; i < f->ndrelocs; ++i) {
+        f->drelocs[i] = drelocs[incrdrelocs + i] - incrpc;
+    }
 #endif
-        status = parseline();
-        /* parseline() can set current to NULL when return is to
-         * immediate mode */
-        if (!current) {
-            break;
+    f->nodata = 0;
+#ifdef INITDATA
+    f->nodata = incrdatasafe && !datasafe;
+#endif
+}
+
+#endif
+
+#ifdef TIERED
+
+/*
+ * After the program has run on the embedded VM, convert the compiler's
+ * symbol table (which holds VM addresses) into interpreter variables
+ * holding the final values, so they can be examined in immediate mode.
+ */
+void tiersyncvars()
+{
+    var_t *v = varsbegin;
+    int *hdr;
+    unsigned char *body;
+    int i;
+
+    while (v) {
+        hdr = getptrtoscalarword(v);
+        if ((v->name[0] != '-') && !(v->type & 0x20)) {
+            if (v->type & 0x10) {
+                if ((v->type & 0x0f) == TYPE_LONG) {
+                    body = alloc1(hdr[1] * sizeof(int));
+                    for (i = 0; i < hdr[1]; ++i) {
+                        *((int *) body + i) =
+                            *(int *) &memory[hdr[0] + 4 * i];
+                    }
+                } else if ((v->type & 0x0f) == TYPE_WORD) {
+                    body = alloc1(hdr[1] * sizeof(int));
+                    for (i = 0; i < hdr[1]; ++i) {
+                        *((int *) body + i) =
+                            *(unsigned short *) &memory[hdr[0] + 2 * i];
+                    }
+                } else {
+                    body = alloc1(hdr[1]);
+                    memcpy(body, &memory[hdr[0]], hdr[1]);
+                }
+                hdr[0] = ADDR(body);
+            } else if ((v->type & 0x0f) == TYPE_LONG) {
+                *hdr = *(int *) &memory[*hdr];
+            } else if ((v->type & 0x0f) == TYPE_WORD) {
+                *hdr = *(unsigned short *) &memory[*hdr];
+            } else {
+                *getptrtoscalarbyte(v) = memory[*hdr];
+            }
         }
-        current = current->next;
-        ++counter;
-    }
-    switch (status) {
-    case 2:
-        print(" err at ");
-        printdec(counter);
-        printchar('\n');
-        returnSP = (RETSTACKSZ - 1);
-        skipFlag = 0;
-        compile = 0;
-        break;
-    case 3:
-        print("\nBrk at ");
-        printdec(counter);
-        printchar('\n');
-        returnSP = (RETSTACKSZ - 1);
-        skipFlag = 0;
-        compile = 0;
-        break;
+        v = v->next;
     }
 }
 
 /*
- * Perform linkage.
- * The subroutine definitions are in the list that starts with subsbegin.
- * The subroutine calls are in the list that starts with callsbegin.
+ * Tiered execution.  Compile the program into memory, with all output
+ * suppressed, and run it on the embedded VM.
+ * Returns 0 if the program was run, 1 if it could not be compiled (the
+ * caller should interpret it instead.)
  */
-#ifdef A2E
-#pragma code-name (push, "LC")
-#endif
-void linksubs()
+unsigned char tierrun()
 {
-    sub_t *call;
-    sub_t *sub;
-    call = callsbegin;
-    while (call) {
-        sub = subsbegin;
+    jmp_buf savedjumpbuf;
+    unsigned char status = 1;
 
-        while (strncmp(sub->name, call->name, SUBRNUMCHARS)) {
-            sub = sub->next;
-            if (!sub) {
-                error(ERR_LINK);
-                return;
+#ifdef PROFILER
+    if (profon) {
+        /* Profile the interpreted program */
+        return 1;
+    }
+#endif
+
+    /* In case compilation fails */
+    tierstate = TIER_BLOCKED;
+
+    /* Catch warm starts (eg: out of memory) during compilation */
+    memcpy(savedjumpbuf, jumpbuf, sizeof(jmp_buf));
+    tiering = 1;
+    if (!setjmp(jumpbuf)) {
+        compile = 1;
+        subsbegin = subsend = NULL;
+        callsbegin = callsend = NULL;
+        CLEARRTCALLSTACK();
+#ifdef INITDATA
+        initdata_clear();
+#endif
+#ifdef INCRCOMP
+        incrstart();
+#endif
+        run(0);
+        if (compile) {
+            emit(VM_END);
+            status = linksubs();
+#ifdef OPTIMIZER
+            if (!status) {
+                optimize();
             }
+#endif
         }
-        emit_fixup(call->addr, sub->addr);
-        call = call->next;
     }
+    compile = 0;
+    tiering = 0;
+    memcpy(jumpbuf, savedjumpbuf, sizeof(jmp_buf));
+
+    if (status) {
+        clearvars();
+        return 1;
+    }
+#ifdef INITDATA
+    if (datahi > datalo) {
+        status = vm_run(CODESTART, codeptr - CODESTART,
+                        dataimg + datalo - RTCALLSTACKLIM, datalo,
+                        datahi - datalo);
+    } else
+#endif
+        status = vm_run(CODESTART, codeptr - CODESTART, NULL, 0, 0);
+    if (status) {
+        /* VM error - interpret next time for a better diagnostic */
+        clearvars();
+        return 0;
+    }
+    tierstate = TIER_HOT;
+    tiersyncvars();
+    return 0;
 }
-#ifdef A2E
-#pragma code-name (pop)
+
 #endif
 
 #ifdef A2E
@@ -5369,6 +12013,8 @@ void list(unsigned int startline, unsigned int endline)
 #define clearexprstacks() \
     operandSP = STACKSZ - 1; \
     operatorSP = STACKSZ - 1; \
+    ctypeSP = 0; \
+    longctx = 0; \
     push_operator_stack(SENTINEL);
 
 
@@ -5377,10 +12023,11 @@ void list(unsigned int startline, unsigned int endline)
  */
 #ifdef __GNUC__
 int
+main(int argc, char *argv[])
 #else
 void
-#endif
 main()
+#endif
 {
 
 #ifdef EXTMEM
@@ -5445,6 +12092,19 @@ main()
     print("Free Software.\n");
     print("Licenced under GPL.\n\n");
 
+#ifdef OPTIMIZER
+    while (--argc > 0) {
+        ++argv;
+        if (((*argv)[0] == '-') && ((*argv)[1] == 'O') &&
+            ((*argv)[2] >= '0') && ((*argv)[2] <= '2') && !(*argv)[3]) {
+            optlevel = (*argv)[2] - '0';
+        } else {
+            print("Usage: eightball [-O0|-O1|-O2]\n");
+            return 1;
+        }
+    }
+#endif
+
     CLEARHEAP1();
 #ifdef CC65
     CLEARHEAP2TOP();
@@ -5454,6 +12114,10 @@ main()
 #endif
 #endif
 
+#ifdef EXPRCACHE
+    exprcache_flush();
+#endif
+
     showfreespace();
     print("\n\n");
 
@@ -5464,6 +12128,17 @@ main()
 
     for (;;) {
         clearexprstacks();
+#ifdef EXPRCACHE
+        /* Discard any recording interrupted by warm start */
+        exprcache_abort();
+#endif
+#ifdef CONTSTACK
+        /* Discard any statements left suspended */
+        contreset();
+#endif
+#ifdef COROUTINE
+        coreset();
+#endif
         if (editmode) {
 #ifdef CBM
             printchar(30);      /* Green */
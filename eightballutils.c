@@ -3,14 +3,11 @@
 /*                                                                        */
 /* The Eight Bit Algorithmic Language                                     */
 /* For Apple IIe/c/gs (64K), Commodore 64, VIC-20 +32K RAM expansion      */
-/* (also builds for Linux as 32 bit executable (gcc -m32) only)           */
+/* (also builds for Linux, 32 or 64 bit)                                  */
 /*                                                                        */
 /* Compiles with cc65 v2.15 for VIC-20, C64, Apple II                     */
 /* and gcc 7.3 for Linux                                                  */
 /*                                                                        */
-/* Note that this code assumes that sizeof(int) = sizeof(int*), which is  */
-/* true for 6502 (16 bits each) and i686 (32 bits each) - but not amd64   */
-/*                                                                        */
 /* cc65: Define symbol VIC20 to build for Commodore VIC-20 + 32K.         */
 /*       Define symbol C64 to build for Commodore 64.                     */
 /*       Define symbol A2E to build for Apple //e.                        */
@@ -42,6 +39,13 @@
 #include <unistd.h>
 #include <stdlib.h>
 
+#ifdef __GNUC__
+#include "eightballvm.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #ifdef A2E
 #include <apple2enh.h>
 #include <peekpoke.h>
@@ -88,6 +92,22 @@ void printdec(unsigned int val) {
 	}
 }
 
+/*
+ * Print a 32 bit integer value as an unsigned decimal
+ */
+void printdecl(unsigned long val) {
+
+	char buf[11];
+	unsigned char i = 10;
+
+	buf[10] = '\0';
+	do {
+		buf[--i] = (val % 10) + '0';
+		val = val / 10;
+	} while (val);
+	print(buf + i);
+}
+
 /*
  * Return character for hex digit 0 to 15
  */
@@ -196,3 +216,101 @@ unsigned char checkInterrupted(void)
     return 0;
 }
 
+#ifdef __GNUC__
+
+/*
+ * Checksum for bytecode object files (32 bit FNV-1a.)
+ */
+uint32_t objchecksum(unsigned char *p, unsigned long len)
+{
+    uint32_t h = 2166136261u;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Load bytecode object file name into 64K memory image mem.  The file is
+ * mapped and its header and checksum are checked before anything is
+ * copied.  If syms is not NULL, *syms is set to a malloc()ed copy of the
+ * symbol table (or NULL if there is none.)  For a raw code file the header
+ * is filled in as if it were an object file with just a code section.
+ * Returns OBJ_OK, OBJ_NOFILE or OBJ_BAD.
+ */
+unsigned char objload(char *name, unsigned char *mem, struct objhdr *hdr,
+                      struct objsym **syms)
+{
+    struct stat st;
+    unsigned char *map;
+    unsigned char *sect;
+    unsigned long len;
+    unsigned char ret = OBJ_BAD;
+    int fd;
+
+    if (syms) {
+        *syms = NULL;
+    }
+    fd = open(name, O_RDONLY);
+    if (fd == -1) {
+        return OBJ_NOFILE;
+    }
+    if (fstat(fd, &st) || (st.st_size == 0)) {
+        close(fd);
+        return OBJ_BAD;
+    }
+    len = st.st_size;
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return OBJ_NOFILE;
+    }
+
+    if ((len >= 4) && !memcmp(map, MODMAGIC, 4)) {
+        /* Module, which must be linked first */
+        munmap(map, len);
+        return OBJ_BAD;
+    }
+    if ((len < sizeof(struct objhdr)) || memcmp(map, OBJMAGIC, 4)) {
+        /* Raw code */
+        if (len <= 0x10000 - RTPCSTART) {
+            memset(hdr, 0, sizeof(struct objhdr));
+            hdr->entry = hdr->codeaddr = RTPCSTART;
+            hdr->codesz = len;
+            hdr->stacktop = RTCALLSTACKTOP;
+            memcpy(mem + RTPCSTART, map, len);
+            ret = OBJ_OK;
+        }
+        munmap(map, len);
+        return ret;
+    }
+
+    memcpy(hdr, map, sizeof(struct objhdr));
+    sect = map + sizeof(struct objhdr);
+    if ((hdr->version == OBJVERSION) &&
+        (len == sizeof(struct objhdr) + hdr->codesz + hdr->datasz +
+         2UL * hdr->nrelocs + (unsigned long) hdr->nsyms * sizeof(struct objsym)) &&
+        (objchecksum(sect, len - sizeof(struct objhdr)) == hdr->checksum) &&
+        ((unsigned long) hdr->codeaddr + hdr->codesz <= 0x10000) &&
+        ((unsigned long) hdr->dataaddr + hdr->datasz <= 0x10000) &&
+        (hdr->entry >= hdr->codeaddr) &&
+        (hdr->entry < hdr->codeaddr + hdr->codesz)) {
+        memcpy(mem + hdr->codeaddr, sect, hdr->codesz);
+        sect += hdr->codesz;
+        memcpy(mem + hdr->dataaddr, sect, hdr->datasz);
+        sect += hdr->datasz + 2UL * hdr->nrelocs;
+        if (syms && hdr->nsyms) {
+            *syms = malloc(hdr->nsyms * sizeof(struct objsym));
+            if (*syms) {
+                memcpy(*syms, sect, hdr->nsyms * sizeof(struct objsym));
+            }
+        }
+        ret = OBJ_OK;
+    }
+    munmap(map, len);
+    return ret;
+}
+
+#endif
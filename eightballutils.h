@@ -3,14 +3,11 @@
 /*                                                                        */
 /* The Eight Bit Algorithmic Language                                     */
 /* For Apple IIe/c/gs (64K), Commodore 64, VIC-20 +32K RAM expansion      */
-/* (also builds for Linux as 32 bit executable (gcc -m32) only)           */
+/* (also builds for Linux, 32 or 64 bit)                                  */
 /*                                                                        */
 /* Compiles with cc65 v2.15 for VIC-20, C64, Apple II                     */
 /* and gcc 7.3 for Linux                                                  */
 /*                                                                        */
-/* Note that this code assumes that sizeof(int) = sizeof(int*), which is  */
-/* true for 6502 (16 bits each) and i686 (32 bits each) - but not amd64   */
-/*                                                                        */
 /* cc65: Define symbol VIC20 to build for Commodore VIC-20 + 32K.         */
 /*       Define symbol C64 to build for Commodore 64.                     */
 /*       Define symbol A2E to build for Apple //e.                        */
@@ -45,6 +42,8 @@ void printchar(char c);
 
 void printdec(unsigned int val);
 
+void printdecl(unsigned long val);
+
 char hexval2char(unsigned char val);
 
 void printhex(unsigned int val);
@@ -3,14 +3,11 @@
 /*                                                                        */
 /* The Eight Bit Algorithmic Language                                     */
 /* For Apple IIe/c/gs (64K), Commodore 64, VIC-20 +32K RAM expansion      */
-/* (also builds for Linux as 32 bit executable (gcc -m32) only)           */
+/* (also builds for Linux, 32 or 64 bit)                                  */
 /*                                                                        */
 /* Compiles with cc65 v2.15 for VIC-20, C64, Apple II                     */
 /* and gcc 7.3 for Linux                                                  */
 /*                                                                        */
-/* Note that this code assumes that sizeof(int) = sizeof(int*), which is  */
-/* true for 6502 (16 bits each) and i686 (32 bits each) - but not amd64   */
-/*                                                                        */
 /* cc65: Define symbol VIC20 to build for Commodore VIC-20 + 32K.         */
 /*       Define symbol C64 to build for Commodore 64.                     */
 /*       Define symbol A2E to build for Apple //e.                        */
@@ -48,6 +45,51 @@
 #define DEBUGREGS
 */
 
+/* Define VMEMBED to build the VM core without main(), for linking into
+ * the EightBall interpreter (Linux only.)  Programs are run by calling
+ * vm_run() and VM_END returns to the caller rather than exiting.
+ */
+
+/* Define SCHEDULER to allow the standalone VM to run several bytecode
+ * programs as cooperative tasks (Linux only.)  Each task has its own
+ * memory image and registers, and runs for a quantum of instructions before
+ * the next task is scheduled.  See runtasks().
+ */
+#if defined(__GNUC__) && !defined(VMEMBED)
+#define SCHEDULER
+#endif
+
+/* Define NATIVES to include the standard native library, which VM_NATIVE
+ * calls for routines too slow to write in bytecode (Linux only.)
+ */
+#ifdef __GNUC__
+#define NATIVES
+#endif
+
+/* Define SIMD to run VM_VEC with SSE2 or AVX2 instructions, whichever
+ * is the best the CPU has (x86 Linux only.)  Otherwise, or if the CPU has
+ * neither, the elements are done one at a time.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD
+#endif
+
+/* Define FARMEM to give programs FARMEMSZ bytes of far memory outside the
+ * 64K address space, for far arrays (Linux only.)
+ */
+#ifdef __GNUC__
+#define FARMEM
+#endif
+
+/* Define SNAPSHOT to allow the state of the VM to be written to a file by
+ * VM_SNAP or by SIGUSR1, and to start a later run from the file rather
+ * than from the beginning of the program (Linux only.)  Requires SCHEDULER,
+ * which makes memory[] a pointer.
+ */
+#ifdef SCHEDULER
+#define SNAPSHOT
+#endif
+
 /* Define STACKCHECKS to enable paranoid stack checking */
 #ifdef __GNUC__
 #define STACKCHECKS
@@ -62,6 +104,30 @@
 #include <stdio.h>
 #include <string.h>
 
+#if defined(VMEMBED) || defined(SCHEDULER)
+#include <setjmp.h>
+#endif
+
+#ifdef SCHEDULER
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#ifdef NATIVES
+#include <time.h>
+#endif
+
+#ifdef SNAPSHOT
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef SIMD
+#include <immintrin.h>
+#endif
+
 #ifdef A2E
 #include <conio.h>
 #endif
@@ -86,6 +152,14 @@
 #define UINT16 unsigned short
 #endif
 
+#ifdef __GNUC__
+#define INT32  int
+#define UINT32 unsigned int
+#else
+#define INT32  long
+#define UINT32 unsigned long
+#endif
+
 #ifndef A2E
 
 unsigned char evalptr;          /* Points to the empty slot above top of eval stack */
@@ -130,7 +204,11 @@ extern UINT16 evalstack[EVALSTACKSZ];
  * Used for callstack.  Addressed by sp.
  *  - Callstack grows down from top of memory.
  */
-#ifdef __GNUC__
+#ifdef SCHEDULER
+/* Points to the memory image of the running task */
+unsigned char mainmemory[MEMORYSZ];
+unsigned char *memory = mainmemory;
+#elif defined(__GNUC__)
 unsigned char memory[MEMORYSZ];
 #else
 unsigned char *memory = 0;
@@ -145,11 +223,77 @@ unsigned char *memory = 0;
 #define MEM(x) (*(unsigned char*)x)
 #endif
 
+#ifdef FARMEM
+/*
+ * Far memory.  Addressed by 32 bit far addresses, which are held in longs.
+ * Allocated the first time it is used.
+ */
+unsigned char *farmem = 0;
+#endif
+
+#ifdef VMEMBED
+jmp_buf vmjmpbuf;               /* For returning from vm_run() */
+#endif
+
+#ifdef SCHEDULER
+
+#define QUANTUM      10000      /* Default instructions per time slice */
+#define MAXTASKS     32
+
+/* Task states.  Also used as longjmp() values to end a time slice. */
+#define TASK_READY   0
+#define TASK_BLOCKED 1          /* Waiting for keyboard input */
+#define TASK_DONE    2          /* Ran to VM_END */
+#define TASK_FAILED  3          /* Stopped with an error */
+
+struct task {
+    char *name;                 /* Bytecode file */
+    unsigned char *mem;         /* Memory image */
+#ifdef FARMEM
+    unsigned char *farmem;      /* Far memory, if the task has used it */
+#endif
+    UINT16 pc;
+    UINT16 sp;
+    UINT16 fp;
+    UINT16 coptr;
+    unsigned char evalptr;
+    UINT16 evalstack[EVALSTACKSZ];
+    unsigned char state;
+    unsigned char prio;         /* Time slices per turn */
+    unsigned long instrs;       /* Instructions executed */
+    double secs;                /* Wall time spent running */
+};
+
+struct task tasks[MAXTASKS];
+unsigned char ntasks;
+unsigned char multitask;        /* Set while runtasks() is in control */
+unsigned long quantum = QUANTUM;
+unsigned long budget;           /* Instructions left in this time slice */
+jmp_buf schedjmpbuf;            /* For returning to runtasks() */
+
+#endif
+
+/*
+ * Stop the VM after a fatal error.
+ * When embedded, return to caller of vm_run() rather than hanging.
+ */
+#ifdef VMEMBED
+#define HALT() longjmp(vmjmpbuf, 2)
+#elif defined(SCHEDULER)
+#define HALT() do { if (multitask) longjmp(schedjmpbuf, TASK_FAILED); while (1); } while (0)
+#else
+#define HALT() while (1)
+#endif
+
 #define XREG evalstack[evalptr - 1]     /* Only valid if evalptr >= 1 */
 #define YREG evalstack[evalptr - 2]     /* Only valid if evalptr >= 2 */
 #define ZREG evalstack[evalptr - 3]     /* Only valid if evalptr >= 3 */
 #define TREG evalstack[evalptr - 4]     /* Only valid if evalptr >= 4 */
 
+/* Longs take two eval stack entries, with the high word on top */
+#define LXREG (((UINT32) XREG << 16) | YREG)    /* Only valid if evalptr >= 2 */
+#define LYREG (((UINT32) ZREG << 16) | TREG)    /* Only valid if evalptr >= 4 */
+
 /*
  * Error checks are called through macros to make it easy to
  * disable them in production.  We should not need these checks
@@ -171,6 +315,12 @@ unsigned char *memory = 0;
 /* Check call stack is not going to overflow */
 #define CHECKSTACKOVERFLOW(bytes) checkstackoverflow(bytes)
 
+/* Check divisor is not zero (traps on Linux) */
+#define CHECKDIVZERO() checkdivzero()
+
+/* Check long divisor is not zero (traps on Linux) */
+#define CHECKDIVZEROL() checkdivzerol()
+
 #else
 
 /* For production use, do not do these checks */
@@ -178,6 +328,8 @@ unsigned char *memory = 0;
 #define CHECKOVERFLOW()
 #define CHECKSTACKUNDERFLOW(bytes)
 #define CHECKSTACKOVERFLOW(bytes)
+#define CHECKDIVZERO()
+#define CHECKDIVZEROL()
 #endif
 
 #ifdef STACKCHECKS
@@ -191,7 +343,7 @@ void checkunderflow(unsigned char level)
         print("Eval stack underflow\nPC=");
         printhex(pc);
         printchar('\n');
-        while (1);
+        HALT();
     }
 }
 
@@ -205,7 +357,7 @@ void checkoverflow()
         print("Eval stack overflow\nPC=");
         printhex(pc);
         printchar('\n');
-        while (1);
+        HALT();
     }
 }
 
@@ -219,7 +371,7 @@ void checkstackunderflow(unsigned char bytes)
         print("Call stack underflow\nPC=");
         printhex(pc);
         printchar('\n');
-        while (1);
+        HALT();
     }
 }
 
@@ -233,7 +385,33 @@ void checkstackoverflow()
         print("Call stack overflow\nPC=");
         printhex(pc);
         printchar('\n');
-        while (1);
+        HALT();
+    }
+}
+
+/*
+ * Check divisor in X is not zero.
+ */
+void checkdivzero()
+{
+    if (XREG == 0) {
+        print("Div by zero\nPC=");
+        printhex(pc);
+        printchar('\n');
+        HALT();
+    }
+}
+
+/*
+ * Check long divisor in LX is not zero.
+ */
+void checkdivzerol()
+{
+    if ((XREG == 0) && (YREG == 0)) {
+        print("Div by zero\nPC=");
+        printhex(pc);
+        printchar('\n');
+        HALT();
     }
 }
 #endif
@@ -248,7 +426,7 @@ void unsupported()
     print("\nPC=");
     printhex(pc);
     printchar('\n');
-    while (1);
+    HALT();
 }
 
 /*
@@ -260,7 +438,14 @@ void vm_end() {
         printdec(evalptr);
         printchar('\n');
     }
-#ifdef __GNUC__
+#ifdef VMEMBED
+    longjmp(vmjmpbuf, 1);
+#elif defined(__GNUC__)
+#ifdef SCHEDULER
+    if (multitask) {
+        longjmp(schedjmpbuf, TASK_DONE);
+    }
+#endif
     exit(0);
 #else
     for (tempword = 0; tempword < 25000; ++tempword);
@@ -733,6 +918,7 @@ void vm_mul() {
  */
 void vm_div() {
     CHECKUNDERFLOW(2);
+    CHECKDIVZERO();
     YREG = YREG / XREG;
     --evalptr;
     ++pc;
@@ -743,6 +929,7 @@ void vm_div() {
  */
 void vm_mod() {
     CHECKUNDERFLOW(2);
+    CHECKDIVZERO();
     YREG = YREG % XREG;
     --evalptr;
     ++pc;
@@ -1046,10 +1233,105 @@ void vm_prmsg() {
     ++pc;
 }
 
+#ifdef SCHEDULER
+
+/*
+ * Keyboard input.  KBDCH and KBDLN both take their input from inbuf,
+ * which is only filled by read() from fd 0 (stdio is never used for
+ * stdin.)  What is waiting can then be seen without blocking, so a task
+ * is only run once the whole of what it asked for has arrived.
+ */
+#define INBUFSZ 256
+
+unsigned char inbuf[INBUFSZ];
+unsigned int inlen;             /* Bytes waiting in inbuf */
+unsigned char ineof;            /* 1 once fd 0 is at end of file */
+
+/*
+ * Read whatever is waiting on fd 0 into inbuf.
+ * If wait is set, blocks until there is some.
+ */
+void inputfill(unsigned char wait)
+{
+    struct pollfd pfd;
+    ssize_t n;
+
+    pfd.fd = 0;
+    pfd.events = POLLIN;
+    while (!ineof && (inlen < INBUFSZ) &&
+           (poll(&pfd, 1, wait ? -1 : 0) == 1)) {
+        n = read(0, inbuf + inlen, INBUFSZ - inlen);
+        if (n <= 0) {
+            ineof = 1;
+        } else {
+            inlen += n;
+        }
+        wait = 0;
+    }
+}
+
+/*
+ * Returns 1 if there is a character of input waiting (or a whole line, if
+ * line is set), or input is at end of file.  0 otherwise.
+ */
+unsigned char inputready(unsigned char line)
+{
+    inputfill(0);
+    if (ineof || (inlen == INBUFSZ)) {
+        return 1;
+    }
+    return (line ? (memchr(inbuf, '\n', inlen) != NULL) : (inlen > 0));
+}
+
+/*
+ * Remove n bytes from the start of inbuf.
+ */
+void inputdrop(unsigned int n)
+{
+    inlen -= n;
+    memmove(inbuf, inbuf + n, inlen);
+}
+
+/*
+ * Read a line of input into str, which holds buflen bytes, the same as
+ * getln().  Blocks until there is a whole line.
+ */
+void inputline(char *str, unsigned char buflen)
+{
+    unsigned int n = 0;
+
+    while (!inputready(1)) {
+        inputfill(1);
+    }
+    while ((n < inlen) && (n + 1 < buflen) && (inbuf[n] != '\n')) {
+        str[n] = inbuf[n];
+        ++n;
+    }
+    if (buflen) {
+        str[n] = '\0';
+    }
+    if ((n < inlen) && (inbuf[n] == '\n')) {
+        ++n;
+    }
+    inputdrop(n);
+}
+
+/*
+ * A scheduled task which wants keyboard input when it has not all arrived
+ * is parked.  pc still points to the instruction, so it is retried when
+ * the task runs again.
+ */
+#define PARKFORINPUT(line) if (multitask && !inputready(line)) longjmp(schedjmpbuf, TASK_BLOCKED)
+
+#else
+#define PARKFORINPUT(line)
+#endif
+
 /*
  * Push character from keyboard onto eval stack
  */
 void vm_kbdch() {
+    PARKFORINPUT(0);
     CHECKUNDERFLOW(1);
     ++evalptr;
     /* Loop until we get a keypress */
@@ -1058,8 +1340,14 @@ void vm_kbdch() {
 #elif defined(CBM)
     while (!(*(char *) XREG = cbm_k_getin()));
 #else
-    /* TODO: Unimplemented in Linux */
+    /* TODO: Unimplemented in Linux, except for scheduled tasks */
     XREG = 0;
+#ifdef SCHEDULER
+    if (multitask && inlen) {
+        XREG = inbuf[0];
+        inputdrop(1);
+    }
+#endif
 #endif
     ++pc;
 }
@@ -1069,144 +1357,1441 @@ void vm_kbdch() {
  * Y. X contains the max number of bytes in buf. Drop X, Y
  */
 void vm_kbdln() {
+    PARKFORINPUT(1);
     CHECKUNDERFLOW(2);
+#ifdef SCHEDULER
+    inputline((char *) &MEM(YREG), XREG);
+#else
     getln((char *) &MEM(YREG), XREG);
+#endif
     evalptr -= 2;
     ++pc;
 }
 
-typedef void (*func)(void);
+/*
+ * Followed by 16 bit count N and a table of N 16 bit addresses.  If X<N
+ * jump to address X in the table, otherwise continue after the table.
+ * X is not dropped.
+ */
+void vm_jmptab() {
+    CHECKUNDERFLOW(1);
+    wordptr = (unsigned short *)&MEM(++pc);    /* Pointer to count */
+    if (XREG < *wordptr) {
+        wordptr = (unsigned short *)&MEM(pc + 2 + 2 * XREG);
+        pc = *wordptr;
+    } else {
+        pc += 2 + 2 * *wordptr;
+    }
+}
 
 /*
- * Must be in same order as enum bytecode.
+ * Coroutine object header word at offset off
  */
-func jumptbl[] = {
-    vm_end,
-    vm_ldimm,
-    vm_ldaword,
-    vm_ldawordimm,
-    vm_ldabyte,
-    vm_ldabyteimm,
-    vm_staword,
-    vm_stawordimm,
-    vm_stabyte,
-    vm_stabyteimm,
-    vm_ldrword,
-    vm_ldrwordimm,
-    vm_ldrbyte,
-    vm_ldrbyteimm,
-    vm_strword,
-    vm_strwordimm,
-    vm_strbyte,
-    vm_strbyteimm,
-    vm_swap,
-    vm_dup,
-    vm_dup2,
-    vm_drop,
-    vm_over,
-    vm_pick,
-    vm_popword,
-    vm_popbyte,
-    vm_pshword,
-    vm_pshbyte,
-    vm_discard,
-    vm_sptofp,
-    vm_fptosp,
-    vm_ator,
-    vm_rtoa,
-    vm_inc,
-    vm_dec,
-    vm_add,
-    vm_sub,
-    vm_mul,
-    vm_div,
-    vm_mod,
-    vm_neg,
-    vm_gt,
-    vm_gte,
-    vm_lt,
-    vm_lte,
-    vm_eql,
-    vm_neql,
-    vm_and,
-    vm_or,
-    vm_not,
-    vm_bitand,
-    vm_bitor,
-    vm_bitxor,
-    vm_bitnot,
-    vm_lsh,
-    vm_rsh,
-    vm_jmp,
-    vm_jmpimm,
-    vm_brnch,
-    vm_brnchimm,
-    vm_jsr,
-    vm_jsrimm,
-    vm_rts,
-    vm_prdec,
-    vm_prhex,
-    vm_prch,
-    vm_prstr,
-    vm_prmsg,
-    vm_kbdch,
-    vm_kbdln,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
-    unsupported,
+#define COWORD(obj, off) (*(unsigned short *)&MEM((obj) + (off)))
+
+UINT16 coptr;                   /* Running coroutine object, or 0 if none */
+
+/*
+ * Exchange PC, SP and FP with those saved in the header of coroutine
+ * object obj.
+ */
+void coswap(UINT16 obj)
+{
+    tempword = COWORD(obj, CO_PC);
+    COWORD(obj, CO_PC) = pc;
+    pc = tempword;
+    tempword = COWORD(obj, CO_SP);
+    COWORD(obj, CO_SP) = sp;
+    sp = tempword;
+    tempword = COWORD(obj, CO_FP);
+    COWORD(obj, CO_FP) = fp;
+    fp = tempword;
+}
+
+/*
+ * Leave the running coroutine, setting its status, and go back to
+ * whatever resumed it.  X is left for the resumer.
+ */
+void coleave(unsigned char status)
+{
+    UINT16 obj = coptr;
+
+    if (!obj) {
+        print("Not in coroutine\nPC=");
+        printhex(pc);
+        printchar('\n');
+        HALT();
+    }
+#ifdef STACKCHECKS
+    if (sp < obj + CO_HDRSZ) {
+        print("Coroutine stack overflow\nPC=");
+        printhex(pc);
+        printchar('\n');
+        HALT();
+    }
+    /* Anything else left on the eval stack belongs to the resumer */
+    if (evalptr != COWORD(obj, CO_EVAL) + 1) {
+        print("Bad yield\nPC=");
+        printhex(pc);
+        printchar('\n');
+        HALT();
+    }
+#endif
+    COWORD(obj, CO_STATUS) = status;
+    coswap(obj);
+    coptr = COWORD(obj, CO_PREV);
+}
+
+/*
+ * Y is addr of coroutine object, X is its size in bytes.  Save SP in
+ * the object and point SP at the top of it.  Drop X.
+ */
+void vm_conew() {
+    CHECKUNDERFLOW(2);
+    COWORD(YREG, CO_STATUS) = CO_DONE;
+    COWORD(YREG, CO_SP) = sp;
+    sp = YREG + XREG - 1;
+    --evalptr;
+    ++pc;
+}
+
+/*
+ * Followed by 16 bit addr of sub, then VM_CODONE.  X is addr of object.
+ * Push return addr of the VM_CODONE, suspend the coroutine ready to enter
+ * the sub and restore SP.  Drop X.
+ */
+void vm_costart() {
+    CHECKUNDERFLOW(1);
+    tempword = pc + 2;          /* RTS adds one */
+    byteptr = (unsigned char *) &tempword;
+    MEM(sp--) = *(byteptr + 1);
+    MEM(sp--) = *byteptr;
+    tempword = COWORD(XREG, CO_SP);
+    COWORD(XREG, CO_SP) = sp;
+    COWORD(XREG, CO_FP) = sp;
+    sp = tempword;
+    wordptr = (unsigned short *)&MEM(pc + 1);
+    COWORD(XREG, CO_PC) = *wordptr;
+    COWORD(XREG, CO_STATUS) = CO_SUSPENDED;
+    --evalptr;
+    pc += 4;
+}
+
+/*
+ * Sub run by coroutine returned.  Mark it finished and yield X.
+ */
+void vm_codone() {
+    CHECKUNDERFLOW(1);
+    coleave(CO_DONE);
+}
+
+/*
+ * Switch PC, SP and FP to coroutine at addr X.  Drop X.
+ */
+void vm_resume() {
+    CHECKUNDERFLOW(1);
+    tempword = XREG;
+    --evalptr;
+    if (COWORD(tempword, CO_STATUS) != CO_SUSPENDED) {
+        print("Can't resume coroutine\nPC=");
+        printhex(pc);
+        printchar('\n');
+        HALT();
+    }
+    COWORD(tempword, CO_STATUS) = CO_RUNNING;
+    COWORD(tempword, CO_PREV) = coptr;
+    COWORD(tempword, CO_EVAL) = evalptr;
+    coptr = tempword;
+    ++pc;
+    coswap(coptr);
+}
+
+/*
+ * Switch back to whatever resumed the running coroutine, which receives X.
+ */
+void vm_yield() {
+    CHECKUNDERFLOW(1);
+    ++pc;
+    coleave(CO_SUSPENDED);
+}
+
+#ifdef NATIVES
+
+/*
+ * Standard native library.  Each function is passed a pointer to its
+ * arguments on the eval stack, first argument first, and returns the
+ * result.  Array arguments are addresses in memory[].
+ */
+typedef UINT16(*native_t) (UINT16 * args);
+
+/*
+ * Halt unless the n bytes at addr lie within memory.
+ */
+void natcheck(UINT16 addr, unsigned long n)
+{
+    if ((unsigned long) addr + n > MEMORYSZ) {
+        print("Bad native arg\nPC=");
+        printhex(pc);
+        printchar('\n');
+        HALT();
+    }
+}
+
+int natcmp(const void *a, const void *b)
+{
+    return (int) *(UINT16 *) a - (int) *(UINT16 *) b;
+}
+
+/*
+ * sort(word a[], word n)
+ * Sort n words into ascending order.  Comparison is unsigned, like VM_LT.
+ */
+UINT16 nat_sort(UINT16 * args)
+{
+    natcheck(args[0], 2UL * args[1]);
+    qsort(&MEM(args[0]), args[1], 2, natcmp);
+    return 0;
+}
+
+/*
+ * memchr(byte a[], word n, word c)
+ * Index of the first byte equal to c in the n bytes of a, or -1.
+ */
+UINT16 nat_memchr(UINT16 * args)
+{
+    unsigned char *p;
+    natcheck(args[0], args[1]);
+    if (args[2] > 0xff) {
+        return 0xffff;
+    }
+    p = memchr(&MEM(args[0]), args[2], args[1]);
+    return (p ? p - &MEM(args[0]) : 0xffff);
+}
+
+/*
+ * cksum(byte a[], word n)
+ * CRC-16/CCITT of the n bytes of a (polynomial $1021, initial value $ffff.)
+ */
+UINT16 crctab[256];
+
+UINT16 nat_cksum(UINT16 * args)
+{
+    unsigned int i;
+    unsigned char j;
+    UINT16 crc;
+
+    if (!crctab[1]) {
+        for (i = 0; i < 256; ++i) {
+            crc = i << 8;
+            for (j = 0; j < 8; ++j) {
+                crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+            }
+            crctab[i] = crc;
+        }
+    }
+    natcheck(args[0], args[1]);
+    crc = 0xffff;
+    for (i = 0; i < args[1]; ++i) {
+        crc = (crc << 8) ^ crctab[((crc >> 8) ^ MEM(args[0] + i)) & 0xff];
+    }
+    return crc;
+}
+
+/*
+ * prfmt(byte fmt[], word v[])
+ * Print fmt, replacing %d (signed), %u, %x (like pr.hex), %c and %s
+ * (string at address) with successive words from v, and %% with %.  The output is buffered so
+ * the whole line costs a single write.  Returns the number of words used.
+ */
+UINT16 nat_prfmt(UINT16 * args)
+{
+    char buf[256];
+    unsigned int len = 0;
+    UINT16 f = args[0];
+    UINT16 v = args[1];
+    UINT16 val;
+    UINT16 s;
+    char c;
+
+    while ((c = MEM(f++))) {
+        if (len > sizeof(buf) - 8) {
+            buf[len] = '\0';
+            print(buf);
+            len = 0;
+        }
+        if ((c != '%') || !MEM(f)) {
+            buf[len++] = c;
+            continue;
+        }
+        c = MEM(f++);
+        if (c == '%') {
+            buf[len++] = c;
+            continue;
+        }
+        val = MEM(v) + (MEM((UINT16) (v + 1)) << 8);
+        v += 2;
+        switch (c) {
+        case 'd':
+            len += sprintf(buf + len, "%d", (short) val);
+            break;
+        case 'u':
+            len += sprintf(buf + len, "%u", val);
+            break;
+        case 'x':
+            len += sprintf(buf + len, "$%04x", val);
+            break;
+        case 'c':
+            buf[len++] = val;
+            break;
+        case 's':
+            s = val;
+            while (MEM(s)) {
+                buf[len++] = MEM(s++);
+                if (len == sizeof(buf) - 1) {
+                    buf[len] = '\0';
+                    print(buf);
+                    len = 0;
+                }
+            }
+            break;
+        default:
+            buf[len++] = '%';
+            buf[len++] = c;
+            v -= 2;
+        }
+    }
+    buf[len] = '\0';
+    print(buf);
+    return (v - args[1]) / 2;
+}
+
+/*
+ * clock()
+ * Milliseconds of wall time, modulo 65536.  For timing benchmarks.
+ */
+UINT16 nat_clock(UINT16 * args)
+{
+    struct timespec ts;
+    (void) args;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UINT16) (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Indexed by the NAT_ numbers in eightballvm.h.
+ */
+native_t natives[NUMNATIVES] = {
+    nat_sort,
+    nat_memchr,
+    nat_cksum,
+    nat_prfmt,
+    nat_clock
+};
+
+unsigned char natnargs[NUMNATIVES] = NATNARGS;
+
+/*
+ * Followed by 16 bit number N of a host function.  Call it, replacing its
+ * arguments on the eval stack with its result.
+ */
+void vm_native() {
+    unsigned char nargs;
+    wordptr = (unsigned short *)&MEM(pc + 1);
+    if (*wordptr >= NUMNATIVES) {
+        print("Bad native ");
+        printdec(*wordptr);
+        print("\nPC=");
+        printhex(pc);
+        printchar('\n');
+        HALT();
+    }
+    nargs = natnargs[*wordptr];
+    CHECKUNDERFLOW(nargs);
+    tempword = natives[*wordptr](&evalstack[evalptr - nargs]);
+    evalptr -= nargs;
+    ++evalptr;
+    CHECKOVERFLOW();
+    XREG = tempword;
+    pc += 3;
+}
+
+#endif
+
+/*
+ * 32 bit operations.
+ * A long takes two eval stack entries, LX being the long on top of the
+ * stack (high word in X) and LY the long below it.  Longs are stored in
+ * memory low word first.
+ */
+
+/*
+ * Drop LX and replace LY with l
+ */
+void setly(UINT32 l) {
+    evalptr -= 2;
+    YREG = (UINT16) l;
+    XREG = (UINT16) (l >> 16);
+}
+
+/*
+ * Drop LX and LY and push word w
+ */
+void setlw(UINT16 w) {
+    evalptr -= 3;
+    XREG = w;
+}
+
+/*
+ * Replace X with the long pointed to by X
+ */
+void vm_ldal() {
+    CHECKUNDERFLOW(1);
+    wordptr = (unsigned short *)&MEM(XREG);
+    XREG = *wordptr;
+    ++evalptr;
+    CHECKOVERFLOW();
+    XREG = *(wordptr + 1);
+    ++pc;
+}
+
+/*
+ * Imm mode - push long pointed to by addr after opcode
+ */
+void vm_ldalimm() {
+    evalptr += 2;
+    CHECKOVERFLOW();
+    wordptr = (unsigned short *)&MEM(++pc);     /* Pointer to operand */
+    wordptr = (unsigned short *)&MEM(*wordptr); /* Pointer to variable */
+    YREG = *wordptr;
+    XREG = *(wordptr + 1);
+    pc += 2;
+}
+
+/*
+ * Imm mode - push long pointed to by FP-relative addr after opcode
+ */
+void vm_ldrlimm() {
+    evalptr += 2;
+    CHECKOVERFLOW();
+    wordptr = (unsigned short *)&MEM(++pc);
+#ifdef __GNUC__
+    wordptr = (unsigned short *)&MEM((*wordptr + fp + 1) & 0xffff);
+#else
+    tempword = *wordptr + fp + 1;
+    wordptr = (unsigned short *)&MEM(tempword);
+#endif
+    YREG = *wordptr;
+    XREG = *(wordptr + 1);
+    pc += 2;
+}
+
+/*
+ * Store LX in addr pointed to by the word below it.  Drop LX and the addr
+ */
+void vm_stal() {
+    CHECKUNDERFLOW(3);
+    wordptr = (unsigned short *)&MEM(ZREG);
+    *wordptr = YREG;
+    *(wordptr + 1) = XREG;
+    evalptr -= 3;
+    ++pc;
+}
+
+/*
+ * Imm mode - store LX in addr after opcode.  Drop LX
+ */
+void vm_stalimm() {
+    CHECKUNDERFLOW(2);
+    wordptr = (unsigned short *)&MEM(++pc);     /* Pointer to operand */
+    wordptr = (unsigned short *)&MEM(*wordptr); /* Pointer to variable */
+    *wordptr = YREG;
+    *(wordptr + 1) = XREG;
+    evalptr -= 2;
+    pc += 2;
+}
+
+/*
+ * Imm mode - store LX in FP-relative addr after opcode.  Drop LX
+ */
+void vm_strlimm() {
+    CHECKUNDERFLOW(2);
+    wordptr = (unsigned short *)&MEM(++pc);
+#ifdef __GNUC__
+    wordptr = (unsigned short *)&MEM((*wordptr + fp + 1) & 0xffff);
+#else
+    tempword = *wordptr + fp + 1;
+    wordptr = (unsigned short *)&MEM(tempword);
+#endif
+    *wordptr = YREG;
+    *(wordptr + 1) = XREG;
+    evalptr -= 2;
+    pc += 2;
+}
+
+/*
+ * Zero extend the word below LX to a long
+ */
+void vm_wideny() {
+    CHECKUNDERFLOW(3);
+    ++evalptr;
+    CHECKOVERFLOW();
+    XREG = YREG;
+    YREG = ZREG;
+    ZREG = 0;
+    ++pc;
+}
+
+/*
+ * LX = LY+LX.  LY is dropped
+ */
+void vm_addl() {
+    CHECKUNDERFLOW(4);
+    setly(LYREG + LXREG);
+    ++pc;
+}
+
+/*
+ * LX = LY-LX.  LY is dropped
+ */
+void vm_subl() {
+    CHECKUNDERFLOW(4);
+    setly(LYREG - LXREG);
+    ++pc;
+}
+
+/*
+ * LX = LY*LX.  LY is dropped
+ */
+void vm_mull() {
+    CHECKUNDERFLOW(4);
+    setly(LYREG * LXREG);
+    ++pc;
+}
+
+/*
+ * LX = LY/LX (signed.)  LY is dropped
+ * Dividing the most negative long by -1 traps on Linux, so negate instead.
+ */
+void vm_divl() {
+    CHECKUNDERFLOW(4);
+    CHECKDIVZEROL();
+    if (LXREG == 0xffffffffUL) {
+        setly(-LYREG);
+    } else {
+        setly((INT32) LYREG / (INT32) LXREG);
+    }
+    ++pc;
+}
+
+/*
+ * LX = LY%LX (signed.)  LY is dropped
+ */
+void vm_modl() {
+    CHECKUNDERFLOW(4);
+    CHECKDIVZEROL();
+    if (LXREG == 0xffffffffUL) {
+        setly(0);
+    } else {
+        setly((INT32) LYREG % (INT32) LXREG);
+    }
+    ++pc;
+}
+
+/*
+ * LX = -LX
+ */
+void vm_negl() {
+    UINT32 l;
+    CHECKUNDERFLOW(2);
+    l = -LXREG;
+    YREG = (UINT16) l;
+    XREG = (UINT16) (l >> 16);
+    ++pc;
+}
+
+/*
+ * X = LY>LX (signed.)  LX and LY are dropped
+ */
+void vm_gtl() {
+    CHECKUNDERFLOW(4);
+    setlw((INT32) LYREG > (INT32) LXREG);
+    ++pc;
+}
+
+/*
+ * X = LY>=LX (signed.)  LX and LY are dropped
+ */
+void vm_gtel() {
+    CHECKUNDERFLOW(4);
+    setlw((INT32) LYREG >= (INT32) LXREG);
+    ++pc;
+}
+
+/*
+ * X = LY<LX (signed.)  LX and LY are dropped
+ */
+void vm_ltl() {
+    CHECKUNDERFLOW(4);
+    setlw((INT32) LYREG < (INT32) LXREG);
+    ++pc;
+}
+
+/*
+ * X = LY<=LX (signed.)  LX and LY are dropped
+ */
+void vm_ltel() {
+    CHECKUNDERFLOW(4);
+    setlw((INT32) LYREG <= (INT32) LXREG);
+    ++pc;
+}
+
+/*
+ * X = LY==LX.  LX and LY are dropped
+ */
+void vm_eqll() {
+    CHECKUNDERFLOW(4);
+    setlw(LYREG == LXREG);
+    ++pc;
+}
+
+/*
+ * X = LY!=LX.  LX and LY are dropped
+ */
+void vm_neqll() {
+    CHECKUNDERFLOW(4);
+    setlw(LYREG != LXREG);
+    ++pc;
+}
+
+/*
+ * X = LY&&LX.  LX and LY are dropped
+ */
+void vm_andl() {
+    CHECKUNDERFLOW(4);
+    setlw(LYREG && LXREG);
+    ++pc;
+}
+
+/*
+ * X = LY||LX.  LX and LY are dropped
+ */
+void vm_orl() {
+    CHECKUNDERFLOW(4);
+    setlw(LYREG || LXREG);
+    ++pc;
+}
+
+/*
+ * X = !LX.  LX is dropped
+ */
+void vm_notl() {
+    CHECKUNDERFLOW(2);
+    tempword = !LXREG;
+    --evalptr;
+    XREG = tempword;
+    ++pc;
+}
+
+/*
+ * LX = LY&LX.  LY is dropped
+ */
+void vm_bitandl() {
+    CHECKUNDERFLOW(4);
+    setly(LYREG & LXREG);
+    ++pc;
+}
+
+/*
+ * LX = LY|LX.  LY is dropped
+ */
+void vm_bitorl() {
+    CHECKUNDERFLOW(4);
+    setly(LYREG | LXREG);
+    ++pc;
+}
+
+/*
+ * LX = LY^LX.  LY is dropped
+ */
+void vm_bitxorl() {
+    CHECKUNDERFLOW(4);
+    setly(LYREG ^ LXREG);
+    ++pc;
+}
+
+/*
+ * LX = ~LX
+ */
+void vm_bitnotl() {
+    CHECKUNDERFLOW(2);
+    XREG = ~XREG;
+    YREG = ~YREG;
+    ++pc;
+}
+
+/*
+ * LX = LY<<LX.  LY is dropped
+ */
+void vm_lshl() {
+    CHECKUNDERFLOW(4);
+    setly((LXREG > 31) ? 0 : LYREG << (unsigned char) LXREG);
+    ++pc;
+}
+
+/*
+ * LX = LY>>LX (signed.)  LY is dropped
+ */
+void vm_rshl() {
+    CHECKUNDERFLOW(4);
+    setly((INT32) LYREG >> ((LXREG > 31) ? 31 : (unsigned char) LXREG));
+    ++pc;
+}
+
+/*
+ * Print LX as unsigned decimal.  Drop LX
+ */
+void vm_prdecl() {
+    CHECKUNDERFLOW(2);
+    printdecl(LXREG);
+    evalptr -= 2;
+    ++pc;
+}
+
+/*
+ * Vector operations.
+ * vecscalar() does elements i to n-1 of any VEC_ operation one at a time,
+ * continuing from the result r of the elements before i.  With SIMD, the
+ * elements which fill whole vector registers are done first by vecsimd().
+ */
+
+/* Number of arguments of each VEC_ operation */
+unsigned char vecnargs[] = { 4, 4, 4, 4, 4, 4, 2, 2, 2, 3, 3 };
+
+/* Element i of the array at p, which has elements of sz bytes */
+#define VECGET(p, i) ((sz == 1) ? (p)[i] : ((UINT16 *) (p))[i])
+
+UINT16 vecscalar(unsigned char op, unsigned char sz, unsigned char *d,
+                 unsigned char *a, unsigned char *b, UINT16 k, UINT16 i,
+                 UINT16 n, UINT16 r)
+{
+    UINT16 v;
+
+    for (; i < n; ++i) {
+        v = VECGET(a, i);
+        switch (op) {
+        case VEC_ADD:
+            v += VECGET(b, i);
+            break;
+        case VEC_SUB:
+            v -= VECGET(b, i);
+            break;
+        case VEC_AND:
+            v &= VECGET(b, i);
+            break;
+        case VEC_OR:
+            v |= VECGET(b, i);
+            break;
+        case VEC_XOR:
+            v ^= VECGET(b, i);
+            break;
+        case VEC_ADDS:
+            v += k;
+            break;
+        case VEC_SUM:
+            r += v;
+            continue;
+        case VEC_MIN:
+            if (v < r) {
+                r = v;
+            }
+            continue;
+        case VEC_MAX:
+            if (v > r) {
+                r = v;
+            }
+            continue;
+        case VEC_CNT:
+            if (v == k) {
+                ++r;
+            }
+            continue;
+        case VEC_FIND:
+            if (v == k) {
+                return i;
+            }
+            continue;
+        }
+        if (sz == 1) {
+            d[i] = v;
+        } else {
+            ((UINT16 *) d)[i] = v;
+        }
+    }
+    return r;
+}
+
+#ifdef SIMD
+
+/*
+ * SSE2 version of vecsimd().  Does the elements which fill whole 16 byte
+ * registers, updating r, and returns how many that was.  SSE2 has no
+ * unsigned word min/max, so words are offset by $8000 and compared signed.
+ */
+__attribute__ ((target("sse2")))
+UINT16 vecsse2(unsigned char op, unsigned char sz, unsigned char *d,
+               unsigned char *a, unsigned char *b, UINT16 k, UINT16 n,
+               UINT16 * r)
+{
+    unsigned long len = ((unsigned long) n * sz) & ~15UL;
+    unsigned long i;
+    unsigned long cnt = 0;
+    unsigned int m;
+    __m128i x, y, acc, kv;
+    __m128i bias = _mm_set1_epi16((short) 0x8000);
+    UINT16 lane[8];
+    unsigned char blane[16];
+    unsigned long long q[2];
+
+    kv = ((sz == 1) ? _mm_set1_epi8((char) k) : _mm_set1_epi16((short) k));
+
+    switch (op) {
+    case VEC_SUM:
+        acc = _mm_setzero_si128();
+        for (i = 0; i < len; i += 16) {
+            x = _mm_loadu_si128((__m128i *) (a + i));
+            if (sz == 1) {
+                /* Sums of each 8 bytes, in the two quadwords */
+                acc = _mm_add_epi64(acc, _mm_sad_epu8(x, _mm_setzero_si128()));
+            } else {
+                acc = _mm_add_epi16(acc, x);
+            }
+        }
+        if (sz == 1) {
+            _mm_storeu_si128((__m128i *) q, acc);
+            *r += (UINT16) (q[0] + q[1]);
+        } else {
+            _mm_storeu_si128((__m128i *) lane, acc);
+            for (i = 0; i < 8; ++i) {
+                *r += lane[i];
+            }
+        }
+        break;
+    case VEC_MIN:
+    case VEC_MAX:
+        if (sz == 1) {
+            acc = ((op == VEC_MIN) ? _mm_set1_epi8((char) 0xff) : _mm_setzero_si128());
+            for (i = 0; i < len; i += 16) {
+                x = _mm_loadu_si128((__m128i *) (a + i));
+                acc = ((op == VEC_MIN) ? _mm_min_epu8(acc, x) : _mm_max_epu8(acc, x));
+            }
+            _mm_storeu_si128((__m128i *) blane, acc);
+            for (i = 0; i < 16; ++i) {
+                if ((op == VEC_MIN) ? (blane[i] < *r) : (blane[i] > *r)) {
+                    *r = blane[i];
+                }
+            }
+        } else {
+            acc = ((op == VEC_MIN) ? _mm_set1_epi16(0x7fff) : bias);
+            for (i = 0; i < len; i += 16) {
+                x = _mm_xor_si128(_mm_loadu_si128((__m128i *) (a + i)), bias);
+                acc = ((op == VEC_MIN) ? _mm_min_epi16(acc, x) : _mm_max_epi16(acc, x));
+            }
+            _mm_storeu_si128((__m128i *) lane, _mm_xor_si128(acc, bias));
+            for (i = 0; i < 8; ++i) {
+                if ((op == VEC_MIN) ? (lane[i] < *r) : (lane[i] > *r)) {
+                    *r = lane[i];
+                }
+            }
+        }
+        break;
+    case VEC_CNT:
+    case VEC_FIND:
+        for (i = 0; i < len; i += 16) {
+            x = _mm_loadu_si128((__m128i *) (a + i));
+            x = ((sz == 1) ? _mm_cmpeq_epi8(x, kv) : _mm_cmpeq_epi16(x, kv));
+            /* Each byte which matched sets a bit */
+            m = _mm_movemask_epi8(x);
+            if (op == VEC_CNT) {
+                cnt += __builtin_popcount(m);
+            } else if (m) {
+                *r = (i + __builtin_ctz(m)) / sz;
+                return n;
+            }
+        }
+        *r += cnt / sz;
+        break;
+    default:
+        for (i = 0; i < len; i += 16) {
+            x = _mm_loadu_si128((__m128i *) (a + i));
+            y = ((op == VEC_ADDS) ? kv : _mm_loadu_si128((__m128i *) (b + i)));
+            switch (op) {
+            case VEC_ADD:
+            case VEC_ADDS:
+                x = ((sz == 1) ? _mm_add_epi8(x, y) : _mm_add_epi16(x, y));
+                break;
+            case VEC_SUB:
+                x = ((sz == 1) ? _mm_sub_epi8(x, y) : _mm_sub_epi16(x, y));
+                break;
+            case VEC_AND:
+                x = _mm_and_si128(x, y);
+                break;
+            case VEC_OR:
+                x = _mm_or_si128(x, y);
+                break;
+            case VEC_XOR:
+                x = _mm_xor_si128(x, y);
+                break;
+            }
+            _mm_storeu_si128((__m128i *) (d + i), x);
+        }
+    }
+    return len / sz;
+}
+
+/*
+ * AVX2 version of vecsimd(), with 32 byte registers.
+ */
+__attribute__ ((target("avx2")))
+UINT16 vecavx2(unsigned char op, unsigned char sz, unsigned char *d,
+               unsigned char *a, unsigned char *b, UINT16 k, UINT16 n,
+               UINT16 * r)
+{
+    unsigned long len = ((unsigned long) n * sz) & ~31UL;
+    unsigned long i;
+    unsigned long cnt = 0;
+    unsigned int m;
+    __m256i x, y, acc, kv;
+    UINT16 lane[16];
+    unsigned char blane[32];
+    unsigned long long q[4];
+
+    kv = ((sz == 1) ? _mm256_set1_epi8((char) k) : _mm256_set1_epi16((short) k));
+
+    switch (op) {
+    case VEC_SUM:
+        acc = _mm256_setzero_si256();
+        for (i = 0; i < len; i += 32) {
+            x = _mm256_loadu_si256((__m256i *) (a + i));
+            if (sz == 1) {
+                acc = _mm256_add_epi64(acc, _mm256_sad_epu8(x, _mm256_setzero_si256()));
+            } else {
+                acc = _mm256_add_epi16(acc, x);
+            }
+        }
+        if (sz == 1) {
+            _mm256_storeu_si256((__m256i *) q, acc);
+            *r += (UINT16) (q[0] + q[1] + q[2] + q[3]);
+        } else {
+            _mm256_storeu_si256((__m256i *) lane, acc);
+            for (i = 0; i < 16; ++i) {
+                *r += lane[i];
+            }
+        }
+        break;
+    case VEC_MIN:
+    case VEC_MAX:
+        if (sz == 1) {
+            acc = ((op == VEC_MIN) ? _mm256_set1_epi8((char) 0xff) : _mm256_setzero_si256());
+            for (i = 0; i < len; i += 32) {
+                x = _mm256_loadu_si256((__m256i *) (a + i));
+                acc = ((op == VEC_MIN) ? _mm256_min_epu8(acc, x) : _mm256_max_epu8(acc, x));
+            }
+            _mm256_storeu_si256((__m256i *) blane, acc);
+            for (i = 0; i < 32; ++i) {
+                if ((op == VEC_MIN) ? (blane[i] < *r) : (blane[i] > *r)) {
+                    *r = blane[i];
+                }
+            }
+        } else {
+            acc = ((op == VEC_MIN) ? _mm256_set1_epi16((short) 0xffff) : _mm256_setzero_si256());
+            for (i = 0; i < len; i += 32) {
+                x = _mm256_loadu_si256((__m256i *) (a + i));
+                acc = ((op == VEC_MIN) ? _mm256_min_epu16(acc, x) : _mm256_max_epu16(acc, x));
+            }
+            _mm256_storeu_si256((__m256i *) lane, acc);
+            for (i = 0; i < 16; ++i) {
+                if ((op == VEC_MIN) ? (lane[i] < *r) : (lane[i] > *r)) {
+                    *r = lane[i];
+                }
+            }
+        }
+        break;
+    case VEC_CNT:
+    case VEC_FIND:
+        for (i = 0; i < len; i += 32) {
+            x = _mm256_loadu_si256((__m256i *) (a + i));
+            x = ((sz == 1) ? _mm256_cmpeq_epi8(x, kv) : _mm256_cmpeq_epi16(x, kv));
+            m = (unsigned int) _mm256_movemask_epi8(x);
+            if (op == VEC_CNT) {
+                cnt += __builtin_popcount(m);
+            } else if (m) {
+                *r = (i + __builtin_ctz(m)) / sz;
+                return n;
+            }
+        }
+        *r += cnt / sz;
+        break;
+    default:
+        for (i = 0; i < len; i += 32) {
+            x = _mm256_loadu_si256((__m256i *) (a + i));
+            y = ((op == VEC_ADDS) ? kv : _mm256_loadu_si256((__m256i *) (b + i)));
+            switch (op) {
+            case VEC_ADD:
+            case VEC_ADDS:
+                x = ((sz == 1) ? _mm256_add_epi8(x, y) : _mm256_add_epi16(x, y));
+                break;
+            case VEC_SUB:
+                x = ((sz == 1) ? _mm256_sub_epi8(x, y) : _mm256_sub_epi16(x, y));
+                break;
+            case VEC_AND:
+                x = _mm256_and_si256(x, y);
+                break;
+            case VEC_OR:
+                x = _mm256_or_si256(x, y);
+                break;
+            case VEC_XOR:
+                x = _mm256_xor_si256(x, y);
+                break;
+            }
+            _mm256_storeu_si256((__m256i *) (d + i), x);
+        }
+    }
+    return len / sz;
+}
+
+UINT16(*vecsimd) (unsigned char op, unsigned char sz, unsigned char *d,
+                  unsigned char *a, unsigned char *b, UINT16 k, UINT16 n,
+                  UINT16 * r);
+unsigned char vecsimdset;
+
+/*
+ * Choose vecsimd() for this CPU, or leave it NULL if there is no SIMD.
+ */
+void vecselect()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        vecsimd = vecavx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        vecsimd = vecsse2;
+    }
+    vecsimdset = 1;
+}
+
+#endif
+
+/*
+ * Followed by 16 bit VEC_ operation.  The arguments are described in
+ * eightballvm.h.  Drop them and push the result, if there is one.
+ */
+void vm_vec() {
+    unsigned char op;
+    unsigned char sz;
+    unsigned char nargs;
+    UINT16 *args;
+    unsigned char *d = 0;
+    unsigned char *a;
+    unsigned char *b = 0;
+    UINT16 k = 0;
+    UINT16 n;
+    UINT16 i = 0;
+    UINT16 r;
+
+    wordptr = (unsigned short *)&MEM(pc + 1);
+    op = *wordptr & ~VEC_BYTE;
+    sz = ((*wordptr & VEC_BYTE) ? 1 : 2);
+    if (op >= VEC_NUMOPS) {
+        print("Bad vec ");
+        printdec(op);
+        print("\nPC=");
+        printhex(pc);
+        printchar('\n');
+        HALT();
+    }
+    nargs = vecnargs[op];
+    CHECKUNDERFLOW(nargs);
+    args = &evalstack[evalptr - nargs];
+    n = args[nargs - 1];
+
+    if (op <= VEC_ADDS) {
+        d = &MEM(args[0]);
+        a = &MEM(args[1]);
+        if (op == VEC_ADDS) {
+            k = args[2];
+        } else {
+            b = &MEM(args[2]);
+        }
+    } else {
+        a = &MEM(args[0]);
+        if (nargs == 3) {
+            k = args[1];
+            if ((sz == 1) && (k > 0xff)) {
+                /* No byte can match */
+                n = 0;
+            }
+        }
+    }
+
+#ifdef __GNUC__
+    /* The arrays come first */
+    for (i = 0; i < ((op < VEC_ADDS) ? 3 : ((op == VEC_ADDS) ? 2 : 1)); ++i) {
+        if ((unsigned long) args[i] + (unsigned long) n * sz > MEMORYSZ) {
+            print("Bad vec arg\nPC=");
+            printhex(pc);
+            printchar('\n');
+            HALT();
+        }
+    }
+    i = 0;
+#endif
+
+    r = (((op == VEC_MIN) || (op == VEC_FIND)) ? 0xffff : 0);
+    if (n) {
+#ifdef SIMD
+        if (!vecsimdset) {
+            vecselect();
+        }
+        if (vecsimd) {
+            i = vecsimd(op, sz, d, a, b, k, n, &r);
+        }
+#endif
+        r = vecscalar(op, sz, d, a, b, k, i, n, r);
+    } else if (op == VEC_MIN) {
+        r = 0;
+    }
+
+    evalptr -= nargs;
+    if (op >= VEC_SUM) {
+        ++evalptr;
+        CHECKOVERFLOW();
+        XREG = r;
+    }
+    pc += 3;
+}
+
+#ifdef FARMEM
+
+/*
+ * Far memory operations.
+ * Return a pointer to the sz bytes at far address addr, allocating far
+ * memory if this is the first access.  Halt if addr is out of range.
+ */
+unsigned char *farptr(UINT32 addr, unsigned char sz)
+{
+    if ((unsigned long) addr + sz > FARMEMSZ) {
+        print("Bad far addr\nPC=");
+        printhex(pc);
+        printchar('\n');
+        HALT();
+    }
+    if (!farmem) {
+        farmem = calloc(FARMEMSZ, 1);
+        if (!farmem) {
+            print("No far mem\nPC=");
+            printhex(pc);
+            printchar('\n');
+            HALT();
+        }
+    }
+    return farmem + addr;
+}
+
+/*
+ * Replace far address LX with the word stored there
+ */
+void vm_ldfw() {
+    unsigned char *p;
+    CHECKUNDERFLOW(2);
+    p = farptr(LXREG, 2);
+    --evalptr;
+    XREG = p[0] | (p[1] << 8);
+    ++pc;
+}
+
+/*
+ * Replace far address LX with the byte stored there
+ */
+void vm_ldfb() {
+    CHECKUNDERFLOW(2);
+    tempword = *farptr(LXREG, 1);
+    --evalptr;
+    XREG = tempword;
+    ++pc;
+}
+
+/*
+ * Store word X at the far address below it (high word in Y.)
+ * Drop X and the address.
+ */
+void vm_stfw() {
+    unsigned char *p;
+    CHECKUNDERFLOW(3);
+    p = farptr(((UINT32) YREG << 16) | ZREG, 2);
+    p[0] = XREG & 0xff;
+    p[1] = XREG >> 8;
+    evalptr -= 3;
+    ++pc;
+}
+
+/*
+ * Store byte X at the far address below it (high word in Y.)
+ * Drop X and the address.
+ */
+void vm_stfb() {
+    CHECKUNDERFLOW(3);
+    *farptr(((UINT32) YREG << 16) | ZREG, 1) = XREG & 0xff;
+    evalptr -= 3;
+    ++pc;
+}
+
+#endif
+
+#ifdef SNAPSHOT
+
+/*
+ * Snapshot file.  A snaphdr holding the registers is followed by the
+ * memory image at SNAPALIGN, and by the far memory image at 2 * SNAPALIGN
+ * if the program has used far memory.  The images are page aligned so
+ * that they can be mapped rather than read.  Pages which are all zero are
+ * not written, leaving holes in the file.  Snapshots are in host byte
+ * order and are only meant to be restored by the same VM.
+ */
+#define SNAPMAGIC   "8BS"       /* Includes the terminating zero      */
+#define SNAPVERSION 1
+#define SNAPALIGN   (64 * 1024UL)       /* Multiple of any page size  */
+#define SNAPPAGE    4096        /* Size of the holes                  */
+
+struct snaphdr {
+    char magic[4];              /* SNAPMAGIC                          */
+    uint16_t version;           /* SNAPVERSION                        */
+    uint16_t pc;
+    uint16_t sp;
+    uint16_t fp;
+    uint16_t coptr;
+    uint16_t evalptr;
+    uint16_t evalstack[EVALSTACKSZ];
+    uint32_t farsz;             /* FARMEMSZ if far memory follows     */
+};
+
+char *snapname = NULL;          /* File to write snapshots to (-s)    */
+
+/*
+ * Write the len bytes at p to fd at offset off, skipping pages which are
+ * all zero.  Returns 0 if okay, 1 on error.
+ */
+unsigned char snapimage(int fd, unsigned char *p, unsigned long len,
+                        unsigned long off)
+{
+    unsigned long i, j;
+
+    for (i = 0; i < len; i += SNAPPAGE) {
+        for (j = i; (j < i + SNAPPAGE) && !p[j]; ++j);
+        if ((j < i + SNAPPAGE) &&
+            (pwrite(fd, p + i, SNAPPAGE, off + i) != SNAPPAGE)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Write the state of the VM to snapname.
+ * Returns 0 if okay, 1 on error.
+ */
+unsigned char snapwrite()
+{
+    struct snaphdr hdr;
+    unsigned long end = 2 * SNAPALIGN;
+    unsigned char err;
+    int fd;
+
+    memset(&hdr, 0, sizeof(hdr));
+    strcpy(hdr.magic, SNAPMAGIC);
+    hdr.version = SNAPVERSION;
+    hdr.pc = pc;
+    hdr.sp = sp;
+    hdr.fp = fp;
+    hdr.coptr = coptr;
+    hdr.evalptr = evalptr;
+    memcpy(hdr.evalstack, evalstack, sizeof(hdr.evalstack));
+#ifdef FARMEM
+    if (farmem) {
+        hdr.farsz = FARMEMSZ;
+        end += FARMEMSZ;
+    }
+#endif
+
+    fd = open(snapname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return 1;
+    }
+    err = ((write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) ||
+           snapimage(fd, memory, MEMORYSZ, SNAPALIGN) ||
+#ifdef FARMEM
+           (farmem && snapimage(fd, farmem, FARMEMSZ, 2 * SNAPALIGN)) ||
+#endif
+           ftruncate(fd, end));
+    return (close(fd) || err);
+}
+
+#endif
+
+/*
+ * Write a snapshot, if one was asked for.  A run started from the
+ * snapshot continues with the next instruction.
+ */
+void vm_snap() {
+    ++pc;
+#ifdef SNAPSHOT
+    if (snapname && snapwrite()) {
+        print("Snapshot failed\n");
+    }
+#endif
+}
+
+typedef void (*func)(void);
+
+/*
+ * Must be in same order as enum bytecode.
+ */
+func jumptbl[] = {
+    vm_end,
+    vm_ldimm,
+    vm_ldaword,
+    vm_ldawordimm,
+    vm_ldabyte,
+    vm_ldabyteimm,
+    vm_staword,
+    vm_stawordimm,
+    vm_stabyte,
+    vm_stabyteimm,
+    vm_ldrword,
+    vm_ldrwordimm,
+    vm_ldrbyte,
+    vm_ldrbyteimm,
+    vm_strword,
+    vm_strwordimm,
+    vm_strbyte,
+    vm_strbyteimm,
+    vm_swap,
+    vm_dup,
+    vm_dup2,
+    vm_drop,
+    vm_over,
+    vm_pick,
+    vm_popword,
+    vm_popbyte,
+    vm_pshword,
+    vm_pshbyte,
+    vm_discard,
+    vm_sptofp,
+    vm_fptosp,
+    vm_ator,
+    vm_rtoa,
+    vm_inc,
+    vm_dec,
+    vm_add,
+    vm_sub,
+    vm_mul,
+    vm_div,
+    vm_mod,
+    vm_neg,
+    vm_gt,
+    vm_gte,
+    vm_lt,
+    vm_lte,
+    vm_eql,
+    vm_neql,
+    vm_and,
+    vm_or,
+    vm_not,
+    vm_bitand,
+    vm_bitor,
+    vm_bitxor,
+    vm_bitnot,
+    vm_lsh,
+    vm_rsh,
+    vm_jmp,
+    vm_jmpimm,
+    vm_brnch,
+    vm_brnchimm,
+    vm_jsr,
+    vm_jsrimm,
+    vm_rts,
+    vm_prdec,
+    vm_prhex,
+    vm_prch,
+    vm_prstr,
+    vm_prmsg,
+    vm_kbdch,
+    vm_kbdln,
+    vm_jmptab,
+    vm_conew,
+    vm_costart,
+    vm_codone,
+    vm_resume,
+    vm_yield,
+#ifdef NATIVES
+    vm_native,
+#else
+    unsupported,
+#endif
+    vm_ldal,
+    vm_ldalimm,
+    vm_ldrlimm,
+    vm_stal,
+    vm_stalimm,
+    vm_strlimm,
+    vm_wideny,
+    vm_addl,
+    vm_subl,
+    vm_mull,
+    vm_divl,
+    vm_modl,
+    vm_negl,
+    vm_gtl,
+    vm_gtel,
+    vm_ltl,
+    vm_ltel,
+    vm_eqll,
+    vm_neqll,
+    vm_andl,
+    vm_orl,
+    vm_notl,
+    vm_bitandl,
+    vm_bitorl,
+    vm_bitxorl,
+    vm_bitnotl,
+    vm_lshl,
+    vm_rshl,
+    vm_prdecl,
+    vm_vec,
+#ifdef FARMEM
+    vm_ldfw,
+    vm_ldfb,
+    vm_stfw,
+    vm_stfb,
+#else
+    unsupported,
+    unsupported,
+    unsupported,
+    unsupported,
+#endif
+    vm_snap,
+    unsupported,
+    unsupported,
+    unsupported,
+    unsupported,
+    unsupported,
+    unsupported,
+    unsupported,
+    unsupported,
+    unsupported,
+    unsupported,
+    unsupported,
+    unsupported,
+    unsupported,
+    unsupported,
     unsupported,
     unsupported,
     unsupported,
@@ -1343,17 +2928,14 @@ func jumptbl[] = {
 /*
  * Fetch, decode and execute a VM instruction.
  * Advance program counter and loop until VM_END.
+ * Starts at pc, with the registers as they are.
  */
-void execute()
+void dispatch()
 {
 #ifdef DEBUGREGS
     unsigned short i;
 #endif
 
-    evalptr = 0;
-    pc = RTPCSTART;
-    sp = fp = RTCALLSTACKTOP;
-
     while (1) {
 
     //print("--->PC "); printhex(pc); print(" eval stk: "); printhex(evalptr); print("\n");
@@ -1405,7 +2987,14 @@ void execute()
         (MEM(pc) == VM_STRBYTEIMM) ||
         (MEM(pc) == VM_JMPIMM) ||
         (MEM(pc) == VM_BRNCHIMM) ||
-        (MEM(pc) == VM_JSRIMM)) {
+        (MEM(pc) == VM_JSRIMM) ||
+        (MEM(pc) == VM_COSTART) ||
+        (MEM(pc) == VM_NATIVE) ||
+        (MEM(pc) == VM_LDALIMM) ||
+        (MEM(pc) == VM_LDRLIMM) ||
+        (MEM(pc) == VM_STALIMM) ||
+        (MEM(pc) == VM_STRLIMM) ||
+        (MEM(pc) == VM_VEC)) {
         printchar(' ');
         wordptr = (unsigned short *)&MEM(pc + 1);
         printhex(*wordptr);
@@ -1484,13 +3073,154 @@ void execute()
     }
 };
 
+/*
+ * Run the program from the beginning.
+ */
+void execute()
+{
+    evalptr = 0;
+    pc = RTPCSTART;
+    sp = fp = RTCALLSTACKTOP;
+    coptr = 0;
+    dispatch();
+}
+
+#ifdef SNAPSHOT
+
+func snaptbl[sizeof(jumptbl) / sizeof(func)];   /* Copy of jumptbl */
+
+/*
+ * Stands in for every instruction after SIGUSR1.  Puts jumptbl back and
+ * writes a snapshot.  The instruction at pc is executed next.
+ */
+void snaptrap() {
+    memcpy(jumptbl, snaptbl, sizeof(snaptbl));
+    if (snapwrite()) {
+        print("Snapshot failed\n");
+    }
+}
+
+/*
+ * SIGUSR1 handler.  Rather than checking for the signal before every
+ * instruction, the next instruction is made to write the snapshot.
+ */
+void snapsignal(int sig)
+{
+    unsigned int i;
+
+    (void) sig;
+    for (i = 0; i < sizeof(snaptbl) / sizeof(func); ++i) {
+        jumptbl[i] = snaptrap;
+    }
+}
+
+/*
+ * Write snapshots to file name on VM_SNAP or SIGUSR1.
+ */
+void snapenable(char *name)
+{
+    snapname = name;
+    memcpy(snaptbl, jumptbl, sizeof(snaptbl));
+    signal(SIGUSR1, snapsignal);
+}
+
+/*
+ * Restore the state of the VM from the snapshot in file name.  The memory
+ * images are mapped copy on write, so nothing is read until it is used.
+ * Returns 0 if okay, 1 on error.
+ */
+unsigned char snapload(char *name)
+{
+    struct snaphdr hdr;
+    unsigned char *p = MAP_FAILED;
+    int fd;
+
+    fd = open(name, O_RDONLY);
+    if (fd >= 0) {
+        if ((read(fd, &hdr, sizeof(hdr)) == sizeof(hdr)) &&
+            !strcmp(hdr.magic, SNAPMAGIC) &&
+            (hdr.version == SNAPVERSION) &&
+            (hdr.evalptr <= EVALSTACKSZ)) {
+            p = mmap(NULL, MEMORYSZ, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fd, SNAPALIGN);
+        }
+#ifdef FARMEM
+        if ((p != MAP_FAILED) && hdr.farsz) {
+            farmem = ((hdr.farsz == FARMEMSZ) ?
+                      mmap(NULL, FARMEMSZ, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE, fd, 2 * SNAPALIGN) : MAP_FAILED);
+            if (farmem == MAP_FAILED) {
+                farmem = NULL;
+                munmap(p, MEMORYSZ);
+                p = MAP_FAILED;
+            }
+        }
+#else
+        if ((p != MAP_FAILED) && hdr.farsz) {
+            munmap(p, MEMORYSZ);
+            p = MAP_FAILED;
+        }
+#endif
+        close(fd);
+    }
+    if (p == MAP_FAILED) {
+        print("Bad snapshot '");
+        print(name);
+        print("'\n");
+        return 1;
+    }
+    memory = p;
+    pc = hdr.pc;
+    sp = hdr.sp;
+    fp = hdr.fp;
+    coptr = hdr.coptr;
+    evalptr = hdr.evalptr;
+    memcpy(evalstack, hdr.evalstack, sizeof(hdr.evalstack));
+    return 0;
+}
+
+#endif
+
+#ifdef VMEMBED
+
+/*
+ * Copy len bytes of bytecode from code into memory[], and datalen bytes
+ * of initialized data from data to dataaddr, and run it.
+ * Returns 0 if the program ran to VM_END, 1 on error.
+ */
+unsigned char vm_run(unsigned char *code, unsigned int len,
+                     unsigned char *data, unsigned int dataaddr,
+                     unsigned int datalen)
+{
+    memcpy(&MEM(RTPCSTART), code, len);
+    if (datalen) {
+        memcpy(&MEM(dataaddr), data, datalen);
+    }
+    switch (setjmp(vmjmpbuf)) {
+    case 0:
+        execute();
+        /* Fall through - execute() only returns via longjmp() */
+    case 1:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+#else
+
 /*
  * Load bytecode into memory[].
  */
 void load()
 {
+#ifdef OBJFORMAT
+    struct objhdr hdr;
+    unsigned char status;
+#else
     FILE *fp;
     char ch;
+#endif
     char *p = (char*)&MEM(RTPCSTART);
 
     pc = RTPCSTART;
@@ -1508,6 +3238,16 @@ void load()
         print("Loading '");
         print(p);
         print("'\n");
+#ifdef OBJFORMAT
+        status = objload(p, memory, &hdr, NULL);
+    } while (status == OBJ_NOFILE);
+    if ((status != OBJ_OK) || (hdr.stacktop != RTCALLSTACKTOP) ||
+        (hdr.stacktop - hdr.stacksz < RTCALLSTACKLIM)) {
+        print("Bad bytecode file\n");
+        exit(1);
+    }
+    pc = hdr.entry;
+#else
         fp = fopen(p, "r");
     } while (!fp);
     while (!feof(fp)) {
@@ -1520,13 +3260,176 @@ void load()
     }
     fclose(fp);
     pc = RTPCSTART;
+#endif
 #ifdef A2E
     printchar(7);
 #endif
 }
 
+#ifdef SCHEDULER
+
+/*
+ * Load bytecode file name into a new task with its own memory image.
+ * Returns 0 if okay, 1 on error.
+ */
+unsigned char addtask(char *name, unsigned char prio)
+{
+    struct task *t = &tasks[ntasks];
+    struct objhdr hdr;
+
+    if (ntasks == MAXTASKS) {
+        print("Too many tasks\n");
+        return 1;
+    }
+    t->mem = calloc(MEMORYSZ, 1);
+    if (!t->mem) {
+        print("No memory for task\n");
+        return 1;
+    }
+    if ((objload(name, t->mem, &hdr, NULL) != OBJ_OK) ||
+        (hdr.stacktop != RTCALLSTACKTOP) ||
+        (hdr.stacktop - hdr.stacksz < RTCALLSTACKLIM)) {
+        print("Bad bytecode file '");
+        print(name);
+        print("'\n");
+        free(t->mem);
+        return 1;
+    }
+    t->name = name;
+#ifdef FARMEM
+    t->farmem = NULL;
+#endif
+    t->pc = hdr.entry;
+    t->sp = t->fp = RTCALLSTACKTOP;
+    t->coptr = 0;
+    t->evalptr = 0;
+    t->state = TASK_READY;
+    t->prio = (prio ? prio : 1);
+    t->instrs = 0;
+    t->secs = 0;
+    ++ntasks;
+    return 0;
+}
+
+/*
+ * Print instruction count and wall time for each task.
+ */
+void taskreport()
+{
+    static const char *states[] = { "ready", "blocked", "ended", "failed" };
+    struct task *t;
+    unsigned char i;
+
+    printf("\ntask      instrs      msec  state    file\n");
+    for (i = 0; i < ntasks; ++i) {
+        t = &tasks[i];
+        printf("%4d %11lu %9.1f  %-8s %s\n", i, t->instrs, t->secs * 1000,
+               states[t->state], t->name);
+    }
+}
+
+/*
+ * Run the loaded tasks until all of them have ended.
+ * Scheduling is round robin weighted by priority: each turn a task may
+ * execute prio * quantum instructions before the next ready task runs.
+ * A task which is parked waiting for keyboard input is made ready again
+ * when input arrives.  If every remaining task is parked, wait for input.
+ */
+void runtasks()
+{
+    struct task *t;
+    struct timespec start, end;
+    unsigned char cur = ntasks - 1;
+    unsigned char live = ntasks;
+    unsigned char i, status;
+    unsigned long slice;
+
+    multitask = 1;
+    while (live) {
+        for (i = 0; i < ntasks; ++i) {
+            cur = (cur + 1) % ntasks;
+            t = &tasks[cur];
+            if ((t->state == TASK_BLOCKED) &&
+                inputready(t->mem[t->pc] == VM_KBDLN)) {
+                t->state = TASK_READY;
+            }
+            if (t->state == TASK_READY) {
+                break;
+            }
+        }
+        if (i == ntasks) {
+            inputfill(1);
+            continue;
+        }
+
+        memory = t->mem;
+#ifdef FARMEM
+        farmem = t->farmem;
+#endif
+        pc = t->pc;
+        sp = t->sp;
+        fp = t->fp;
+        coptr = t->coptr;
+        evalptr = t->evalptr;
+        memcpy(evalstack, t->evalstack, evalptr * sizeof(UINT16));
+        slice = budget = quantum * t->prio;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        status = setjmp(schedjmpbuf);
+        if (status == TASK_READY) {
+            for (; budget; --budget) {
+                jumptbl[MEM(pc)]();
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        t->instrs += slice - budget;
+        t->secs += (end.tv_sec - start.tv_sec) +
+            (end.tv_nsec - start.tv_nsec) / 1e9;
+#ifdef FARMEM
+        t->farmem = farmem;
+#endif
+        t->pc = pc;
+        t->sp = sp;
+        t->fp = fp;
+        t->coptr = coptr;
+        t->evalptr = evalptr;
+        memcpy(t->evalstack, evalstack, evalptr * sizeof(UINT16));
+        t->state = status;
+        if (status >= TASK_DONE) {
+            free(t->mem);
+            t->mem = NULL;
+#ifdef FARMEM
+            free(t->farmem);
+            t->farmem = NULL;
+#endif
+            --live;
+        }
+    }
+    multitask = 0;
+    memory = mainmemory;
+#ifdef FARMEM
+    farmem = NULL;
+#endif
+    taskreport();
+}
+
+#endif
+
+#ifdef SCHEDULER
+int main(int argc, char *argv[])
+#else
 int main()
+#endif
 {
+#ifdef SCHEDULER
+    unsigned char prio = 1;
+    int i;
+#endif
+#ifdef SNAPSHOT
+    char *restore = NULL;
+#endif
+
     print("EightBallVM v" VERSIONSTR "\n");
 #ifdef STACKCHECKS
     print("[Stack Checks ON]\n");
@@ -1535,6 +3438,54 @@ int main()
     print("Free Software.\n");
     print("Licenced under GPL.\n\n");
 
+#ifdef SCHEDULER
+    /*
+     * eightballvm [-q quantum] [-p prio] file ... runs each file as a task.
+     * -p sets the priority of the files which follow it.
+     * eightballvm [-s snapfile] [-r snapfile] runs a single program, which
+     * writes snapshots to the file given with -s, starting from the
+     * snapshot given with -r rather than loading a bytecode file.
+     */
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-q") && (i + 1 < argc)) {
+            quantum = strtoul(argv[++i], NULL, 10);
+            if (!quantum) {
+                quantum = QUANTUM;
+            }
+        } else if (!strcmp(argv[i], "-p") && (i + 1 < argc)) {
+            prio = atoi(argv[++i]);
+#ifdef SNAPSHOT
+        } else if (!strcmp(argv[i], "-s") && (i + 1 < argc)) {
+            snapenable(argv[++i]);
+        } else if (!strcmp(argv[i], "-r") && (i + 1 < argc)) {
+            restore = argv[++i];
+#endif
+        } else if (addtask(argv[i], prio)) {
+            return 1;
+        }
+    }
+    if (ntasks) {
+#ifdef SNAPSHOT
+        if (snapname || restore) {
+            print("Snapshots are for a single program\n");
+            return 1;
+        }
+#endif
+        runtasks();
+        return 0;
+    }
+#endif
+
+#ifdef SNAPSHOT
+    if (restore) {
+        if (snapload(restore)) {
+            return 1;
+        }
+        dispatch();
+        return 0;
+    }
+#endif
+
     load();
 #ifdef __GNUC__
     print(" Done.\n\n");
@@ -1548,3 +3499,5 @@ int main()
     execute();
     return 0;
 }
+
+#endif
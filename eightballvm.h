@@ -3,14 +3,11 @@
 /*                                                                        */
 /* The Eight Bit Algorithmic Language                                     */
 /* For Apple IIe/c/gs (64K), Commodore 64, VIC-20 +32K RAM expansion      */
-/* (also builds for Linux as 32 bit executable (gcc -m32) only)           */
+/* (also builds for Linux, 32 or 64 bit)                                  */
 /*                                                                        */
 /* Compiles with cc65 v2.15 for VIC-20, C64, Apple II                     */
 /* and gcc 7.3 for Linux                                                  */
 /*                                                                        */
-/* Note that this code assumes that sizeof(int) = sizeof(int*), which is  */
-/* true for 6502 (16 bits each) and i686 (32 bits each) - but not amd64   */
-/*                                                                        */
 /* cc65: Define symbol VIC20 to build for Commodore VIC-20 + 32K.         */
 /*       Define symbol C64 to build for Commodore 64.                     */
 /*       Define symbol A2E to build for Apple //e.                        */
@@ -149,11 +146,128 @@ enum bytecode {
     VM_PRSTR,                   /* Print null terminated string pointed to by X.  Drop X        */
     VM_PRMSG,                   /* Print literal string at PC (null terminated)                 */
     VM_KBDCH,                   /* Push character from keyboard onto eval stack                 */
-    VM_KBDLN                    /* Obtain line from keyboard and write to memory pointed to by  */
+    VM_KBDLN,                   /* Obtain line from keyboard and write to memory pointed to by  */
                                 /* Y. X contains the max number of bytes in buf. Drop X, Y.     */
+    /**** Multiway branch ***********************************************************************/
+    VM_JMPTAB,                  /* Followed by 16 bit count N and a table of N 16 bit addresses.*/
+                                /* If X<N jump to address X in the table, otherwise continue    */
+                                /* after the table.  X is not dropped.                          */
+    /**** Coroutines ****************************************************************************/
+    VM_CONEW,                   /* Y is addr of coroutine object, X is its size in bytes.  Save */
+                                /* SP in the object and point SP at the top of it.  Drop X.     */
+    VM_COSTART,                 /* Followed by 16 bit addr of sub, then VM_CODONE.  X is addr   */
+                                /* of object.  Push return addr of the VM_CODONE, suspend the   */
+                                /* coroutine ready to enter the sub and restore SP.  Drop X.    */
+    VM_CODONE,                  /* Sub run by coroutine returned.  Mark it finished, yield X.   */
+    VM_RESUME,                  /* Switch PC, SP and FP to coroutine at addr X.  Drop X.        */
+    VM_YIELD,                   /* Switch back to whatever resumed the running coroutine, which */
+                                /* receives X.                                                  */
+    /**** Native functions **********************************************************************/
+    VM_NATIVE,                  /* Followed by 16 bit number N of a host function.  Call it,    */
+                                /* replacing its arguments on the eval stack with its result.   */
+    /**** 32 bit operations *********************************************************************/
+    /* A long takes two eval stack entries, high word on top.  In memory the low word is first. */
+    /* LX is the long on top of the stack and LY the long below it.                             */
+    VM_LDAL,                    /* Replace X with the long at address X                         */
+    VM_LDALIMM,                 /* Imm mode - push long at address following opcode             */
+    VM_LDRLIMM,                 /* Imm mode - push long at FP-relative address following opcode */
+    VM_STAL,                    /* Store LX at address below it.  Drop LX and the address.      */
+    VM_STALIMM,                 /* Imm mode - store LX at address following opcode.  Drop LX.   */
+    VM_STRLIMM,                 /* Imm mode - store LX at FP-relative address following opcode. */
+                                /* Drop LX.                                                     */
+    VM_WIDENY,                  /* Zero extend word below LX to a long.                         */
+    VM_ADDL,                    /* LX = LY+LX.  LY is dropped.                                  */
+    VM_SUBL,                    /* LX = LY-LX.  LY is dropped.                                  */
+    VM_MULL,                    /* LX = LY*LX.  LY is dropped.                                  */
+    VM_DIVL,                    /* LX = LY/LX (signed.)  LY is dropped.                         */
+    VM_MODL,                    /* LX = LY%LX (signed.)  LY is dropped.                         */
+    VM_NEGL,                    /* LX = -LX                                                     */
+    VM_GTL,                     /* X = LY>LX (signed.)  LX and LY are dropped.                  */
+    VM_GTEL,                    /* X = LY>=LX (signed.)  LX and LY are dropped.                 */
+    VM_LTL,                     /* X = LY<LX (signed.)  LX and LY are dropped.                  */
+    VM_LTEL,                    /* X = LY<=LX (signed.)  LX and LY are dropped.                 */
+    VM_EQLL,                    /* X = LY==LX.  LX and LY are dropped.                          */
+    VM_NEQLL,                   /* X = LY!=LX.  LX and LY are dropped.                          */
+    VM_ANDL,                    /* X = LY&&LX.  LX and LY are dropped.                          */
+    VM_ORL,                     /* X = LY||LX.  LX and LY are dropped.                          */
+    VM_NOTL,                    /* X = !LX.  LX is dropped.                                     */
+    VM_BITANDL,                 /* LX = LY&LX.  LY is dropped.                                  */
+    VM_BITORL,                  /* LX = LY|LX.  LY is dropped.                                  */
+    VM_BITXORL,                 /* LX = LY^LX.  LY is dropped.                                  */
+    VM_BITNOTL,                 /* LX = ~LX                                                     */
+    VM_LSHL,                    /* LX = LY<<LX.  LY is dropped.                                 */
+    VM_RSHL,                    /* LX = LY>>LX (signed.)  LY is dropped.                        */
+    VM_PRDECL,                  /* Print LX as unsigned decimal.  Drop LX.                      */
+    /**** Vector operations *********************************************************************/
+    VM_VEC,                     /* Followed by 16 bit VEC_ operation on whole arrays, which     */
+                                /* takes the arguments listed below, with the element count N   */
+                                /* in X.  Drop them and push the result, if there is one.       */
+    /**** Far memory ****************************************************************************/
+    /* Far memory is a separate store of FARMEMSZ bytes, addressed by longs (Linux only.)       */
+    VM_LDFW,                    /* Replace far address LX with the word stored there            */
+    VM_LDFB,                    /* Replace far address LX with the byte stored there            */
+    VM_STFW,                    /* Store word X at far address below it.  Drop X and address.   */
+    VM_STFB,                    /* Store byte X at far address below it.  Drop X and address.   */
+    /**** Snapshots *****************************************************************************/
+    VM_SNAP                     /* Write a snapshot of the VM, if one was asked for (Linux.)    */
     /********************************************************************************************/
 };
 
+/*
+ * Coroutine object header (byte offsets.)  The rest of the object is the
+ * call stack of the coroutine, growing down from the top.  While the
+ * coroutine is running, the header holds the registers of whatever
+ * resumed it, otherwise it holds the coroutine's own.
+ */
+#define CO_STATUS   0           /* Word: one of the values below          */
+#define CO_PC       2
+#define CO_SP       4
+#define CO_FP       6
+#define CO_PREV     8           /* Coroutine which was running, or 0      */
+#define CO_EVAL     10          /* Eval stack depth of whatever resumed it */
+#define CO_HDRSZ    12
+
+#define CO_DONE      0          /* Sub has returned                       */
+#define CO_SUSPENDED 1          /* Ready to be resumed                    */
+#define CO_RUNNING   2
+
+/*
+ * Standard native library called by VM_NATIVE (Linux VM only.)
+ * Arguments are given as the EightBall parameter list.
+ */
+#define NAT_SORT     0          /* sort(word a[], word n)               */
+#define NAT_MEMCHR   1          /* memchr(byte a[], word n, word c)     */
+#define NAT_CKSUM    2          /* cksum(byte a[], word n)              */
+#define NAT_PRFMT    3          /* prfmt(byte fmt[], word v[])          */
+#define NAT_CLOCK    4          /* clock()                              */
+#define NUMNATIVES   5
+
+/*
+ * Number of arguments each native takes, indexed by NAT_ number.  The
+ * compiler checks native sub declarations against this.
+ */
+#define NATNARGS     {2, 3, 2, 2, 0}
+
+/*
+ * Operations for VM_VEC.  Arguments are listed in order of pushing, so N is
+ * in X.  A, B and D are addresses of arrays of N elements, which are words,
+ * or bytes if VEC_BYTE is set.  Elements are compared unsigned.
+ */
+#define VEC_ADD      0          /* D, A, B, N:  D[i] = A[i] + B[i]      */
+#define VEC_SUB      1          /* D, A, B, N:  D[i] = A[i] - B[i]      */
+#define VEC_AND      2          /* D, A, B, N:  D[i] = A[i] & B[i]      */
+#define VEC_OR       3          /* D, A, B, N:  D[i] = A[i] | B[i]      */
+#define VEC_XOR      4          /* D, A, B, N:  D[i] = A[i] ^ B[i]      */
+#define VEC_ADDS     5          /* D, A, K, N:  D[i] = A[i] + K         */
+#define VEC_SUM      6          /* A, N:  push sum of A[i]              */
+#define VEC_MIN      7          /* A, N:  push smallest A[i], 0 if none */
+#define VEC_MAX      8          /* A, N:  push largest A[i], 0 if none  */
+#define VEC_CNT      9          /* A, K, N:  push count of A[i] == K    */
+#define VEC_FIND     10         /* A, K, N:  push first i where A[i]==K */
+                                /* or $ffff                             */
+#define VEC_NUMOPS   11
+#define VEC_BYTE     0x80       /* Byte elements                        */
+
 #ifdef A2E
 
 /*
@@ -194,3 +308,112 @@ enum bytecode {
 //#define RTPCSTART 0
 #define RTPCSTART 0x5000 // SO THINGS WORK ON APPLE II :)
 #endif
+
+#ifdef __GNUC__
+
+/*
+ * Embedded VM (eightballvm.c built with VMEMBED), which is linked into
+ * the Linux interpreter for tiered execution.
+ */
+unsigned char vm_run(unsigned char *code, unsigned int len,
+                     unsigned char *data, unsigned int dataaddr,
+                     unsigned int datalen);
+#ifndef SCHEDULER
+/* The scheduling VM points memory at the image of the running task */
+extern unsigned char memory[];
+#endif
+
+#endif
+
+#ifdef __GNUC__
+
+/*
+ * Bytecode object file (Linux.)  The file starts with an objhdr, which is
+ * followed by the sections in this order:
+ *   Code       codesz bytes, loaded at codeaddr.
+ *   Data       datasz bytes, loaded at dataaddr.
+ *   Relocation nrelocs 16 bit addresses of the words in the code section
+ *              which hold code addresses.
+ *   Symbols    nsyms objsym entries, one for each sub.
+ * The fields of objhdr and objsym are written as they are in memory, so
+ * they are in the byte order of the host, which must be the same for the
+ * compiler and the VM.  The code, data and relocation words are little
+ * endian, as in the memory of the VM.  checksum is objchecksum() of
+ * everything following the header.  A file which does not start with OBJMAGIC is raw
+ * code, as written by the 8 bit compilers, and is loaded at RTPCSTART.
+ */
+#include <stdint.h>
+
+/* Bytes of far memory, for far arrays */
+#define FARMEMSZ    (16UL * 1024 * 1024)
+
+#define OBJFORMAT
+#define OBJMAGIC    "8BO"       /* Includes the terminating zero      */
+#define OBJVERSION  1
+#define OBJSYMCHARS 8           /* Significant characters in sub name */
+
+struct objhdr {
+    char magic[4];              /* OBJMAGIC                           */
+    uint16_t version;           /* OBJVERSION                         */
+    uint16_t entry;             /* Address where execution starts     */
+    uint16_t codeaddr;          /* Load address of code section       */
+    uint16_t codesz;            /* Bytes in code section              */
+    uint16_t dataaddr;          /* Load address of data section       */
+    uint16_t datasz;            /* Bytes in data section              */
+    uint16_t stacktop;          /* RTCALLSTACKTOP code was built for  */
+    uint16_t stacksz;           /* Call stack bytes used by globals   */
+    uint16_t nrelocs;           /* Entries in relocation section      */
+    uint16_t nsyms;             /* Entries in symbol section          */
+    uint32_t checksum;          /* Checksum of sections               */
+};
+
+struct objsym {
+    char name[OBJSYMCHARS];     /* Not terminated if OBJSYMCHARS long */
+    uint16_t addr;              /* Entry point                        */
+};
+
+/*
+ * Module object file (Linux), written by the compiler's module statement
+ * and combined into a bytecode object file by the linker.  The file starts
+ * with a modhdr, which is followed by the sections in this order:
+ *   Code       codesz bytes, built to be loaded at RTPCSTART.
+ *   Relocation nrelocs 16 bit addresses of the words in the code section
+ *              which hold code addresses.
+ *   Data reloc ndrelocs 16 bit addresses of the words in the code section
+ *              which hold data addresses.
+ *   Symbols    nsyms objsym entries, one for each sub.
+ *   Imports    nimports objsym entries, one for each call to a sub which
+ *              the module does not define.  addr is the address of the
+ *              word which holds the address of the sub.
+ * As for bytecode object files, the fields of modhdr and objsym are in
+ * host byte order and the other words are little endian.
+ * The data section is datasz bytes of zeros, built to be loaded at
+ * MODDATAADDR.  entry is the module's initialization code, which is called
+ * with JSRIMM and returns with RTS.
+ */
+#define MODMAGIC    "8BM"       /* Includes the terminating zero      */
+#define MODVERSION  1
+#define MODDATAADDR 0x0100      /* Address data section is built for  */
+
+struct modhdr {
+    char magic[4];              /* MODMAGIC                           */
+    uint16_t version;           /* MODVERSION                         */
+    uint16_t entry;             /* Address of initialization code     */
+    uint16_t codesz;            /* Bytes in code section              */
+    uint16_t datasz;            /* Bytes in data section              */
+    uint16_t nrelocs;           /* Entries in relocation section      */
+    uint16_t ndrelocs;          /* Entries in data relocation section */
+    uint16_t nsyms;             /* Entries in symbol section          */
+    uint16_t nimports;          /* Entries in import section          */
+    uint32_t checksum;          /* Checksum of sections               */
+};
+
+#define OBJ_OK      0           /* Loaded                             */
+#define OBJ_NOFILE  1           /* Could not open file                */
+#define OBJ_BAD     2           /* Not a valid object file            */
+
+uint32_t objchecksum(unsigned char *p, unsigned long len);
+unsigned char objload(char *name, unsigned char *mem, struct objhdr *hdr,
+                      struct objsym **syms);
+
+#endif
@@ -0,0 +1,437 @@
+/**************************************************************************/
+/* EightBall Linker                                                       */
+/*                                                                        */
+/* The Eight Bit Algorithmic Language                                     */
+/* Linux only                                                             */
+/*                                                                        */
+/* Compiles with gcc 7.3 for Linux                                        */
+/*                                                                        */
+/* Copyright Bobbi Webber-Manners 2018                                    */
+/* Links EightBall modules into a bytecode object file                    */
+/*                                                                        */
+/* Formatted with indent -kr -nut                                         */
+/**************************************************************************/
+
+/**************************************************************************/
+/*  GNU PUBLIC LICENCE v3 OR LATER                                        */
+/*                                                                        */
+/*  This program is free software: you can redistribute it and/or modify  */
+/*  it under the terms of the GNU General Public License as published by  */
+/*  the Free Software Foundation, either version 3 of the License, or     */
+/*  (at your option) any later version.                                   */
+/*                                                                        */
+/*  This program is distributed in the hope that it will be useful,       */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*  GNU General Public License for more details.                          */
+/*                                                                        */
+/*  You should have received a copy of the GNU General Public License     */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/*                                                                        */
+/**************************************************************************/
+
+/*
+ * linker outfile module ...
+ *
+ * The program starts with a short piece of startup code which calls the
+ * initialization routine (top level code) of each module in the order they
+ * are given, and then ends.  So the module with the main program should be
+ * given last.  The code of the modules follows the startup code, and their
+ * data follows the code.  Calls to a sub in another module are resolved by
+ * name, and the code and data addresses in each module are relocated.
+ */
+
+#include "eightballvm.h"
+#include "eightballutils.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAXMODS     64          /* Maximum number of modules          */
+#define STARTSZ     4           /* Bytes of startup code per module   */
+
+/*
+ * Module being linked
+ */
+struct module {
+    char *name;                 /* File name                          */
+    struct modhdr hdr;          /* Header                             */
+    unsigned char *buf;         /* Whole file                         */
+    unsigned char *relocs;      /* Relocation section                 */
+    unsigned char *drelocs;     /* Data relocation section            */
+    struct objsym *syms;        /* Symbol section                     */
+    struct objsym *imports;     /* Import section                     */
+    unsigned int base;          /* Address of code in program         */
+    unsigned int database;      /* Address of data in program         */
+};
+
+struct module mods[MAXMODS];
+unsigned int nmods = 0;
+
+unsigned char image[0x10000];   /* Memory image of linked program     */
+
+/*
+ * Print error message about module m and sub name, which is not terminated
+ * if it is OBJSYMCHARS long.
+ */
+void linkerror(char *msg, struct module *m, char *name)
+{
+    char buf[OBJSYMCHARS + 1];
+
+    print(msg);
+    if (name) {
+        memcpy(buf, name, OBJSYMCHARS);
+        buf[OBJSYMCHARS] = 0;
+        print(" '");
+        print(buf);
+        print("'");
+    }
+    print(" in ");
+    print(m->name);
+    printchar('\n');
+}
+
+/*
+ * Get 16 bit little endian word at p.
+ */
+unsigned int getword(unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+/*
+ * Put 16 bit little endian word w at p.
+ */
+void putword(unsigned char *p, unsigned int w)
+{
+    p[0] = w & 0xff;
+    p[1] = (w >> 8) & 0xff;
+}
+
+/*
+ * Returns 1 if the word at address a is in the code of module m.
+ */
+unsigned char incode(struct module *m, unsigned int a)
+{
+    return (a >= RTPCSTART) &&
+        (a + 2 <= RTPCSTART + (unsigned int) m->hdr.codesz);
+}
+
+/*
+ * Read module object file name into m, checking its header and checksum.
+ * Returns 0 if okay, 1 on error.
+ */
+unsigned char readmodule(char *name, struct module *m)
+{
+    FILE *fp;
+    unsigned char *p;
+    long len;
+
+    m->name = name;
+    fp = fopen(name, "r");
+    if (!fp) {
+        print("Can't open ");
+        print(name);
+        printchar('\n');
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    rewind(fp);
+    m->buf = malloc(len + 1);
+    if (!m->buf || (fread(m->buf, 1, len, fp) != (size_t) len)) {
+        fclose(fp);
+        linkerror("Can't read module", m, NULL);
+        return 1;
+    }
+    fclose(fp);
+
+    memcpy(&m->hdr, m->buf, ((unsigned long) len < sizeof(struct modhdr)) ?
+           (unsigned long) len : sizeof(struct modhdr));
+    if (((unsigned long) len < sizeof(struct modhdr)) ||
+        memcmp(m->hdr.magic, MODMAGIC, 4) ||
+        (m->hdr.version != MODVERSION) ||
+        ((unsigned long) len != sizeof(struct modhdr) + m->hdr.codesz +
+         2UL * (m->hdr.nrelocs + m->hdr.ndrelocs) +
+         (unsigned long) (m->hdr.nsyms + m->hdr.nimports) *
+         sizeof(struct objsym)) ||
+        (objchecksum(m->buf + sizeof(struct modhdr),
+                     len - sizeof(struct modhdr)) != m->hdr.checksum) ||
+        (m->hdr.entry < RTPCSTART) ||
+        (m->hdr.entry >= RTPCSTART + m->hdr.codesz)) {
+        linkerror("Bad module", m, NULL);
+        return 1;
+    }
+
+    p = m->buf + sizeof(struct modhdr) + m->hdr.codesz;
+    m->relocs = p;
+    p += 2 * m->hdr.nrelocs;
+    m->drelocs = p;
+    p += 2 * m->hdr.ndrelocs;
+    m->syms = (struct objsym *) p;
+    m->imports = m->syms + m->hdr.nsyms;
+    return 0;
+}
+
+/*
+ * Find the module which exports sub name.  If sym is not NULL, *sym is set
+ * to its symbol table entry.
+ * Returns NULL if not found.
+ */
+struct module *findsym(char *name, struct objsym **sym)
+{
+    unsigned int i;
+    unsigned int j;
+
+    for (i = 0; i < nmods; ++i) {
+        for (j = 0; j < mods[i].hdr.nsyms; ++j) {
+            if (!strncmp(mods[i].syms[j].name, name, OBJSYMCHARS)) {
+                if (sym) {
+                    *sym = &mods[i].syms[j];
+                }
+                return &mods[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Work out where each module's code and data goes, copy the code into
+ * image[] and relocate it.  The code follows the startup code and the
+ * data is just below the call stack.
+ * Returns address after the end of the code, or 0 on error.
+ */
+unsigned long place()
+{
+    unsigned long addr = RTPCSTART + STARTSZ * nmods + 1;
+    unsigned long data = 0;
+    unsigned char *code;
+    unsigned int i;
+    unsigned int j;
+    unsigned int a;
+    struct module *m;
+
+    for (i = 0; i < nmods; ++i) {
+        mods[i].base = addr;
+        addr += mods[i].hdr.codesz;
+        data += mods[i].hdr.datasz;
+    }
+    if (addr + data > RTCALLSTACKLIM) {
+        print("Program too big\n");
+        return 0;
+    }
+    data = RTCALLSTACKLIM - data;
+    for (i = 0; i < nmods; ++i) {
+        mods[i].database = data;
+        data += mods[i].hdr.datasz;
+    }
+
+    for (i = 0; i < nmods; ++i) {
+        m = &mods[i];
+        code = m->buf + sizeof(struct modhdr);
+        memcpy(image + m->base, code, m->hdr.codesz);
+        for (j = 0; j < m->hdr.nrelocs; ++j) {
+            a = getword(m->relocs + 2 * j);
+            if (!incode(m, a)) {
+                linkerror("Bad relocation", m, NULL);
+                return 0;
+            }
+            a += m->base - RTPCSTART;
+            putword(image + a, getword(image + a) + m->base - RTPCSTART);
+        }
+        for (j = 0; j < m->hdr.ndrelocs; ++j) {
+            a = getword(m->drelocs + 2 * j);
+            if (!incode(m, a)) {
+                linkerror("Bad relocation", m, NULL);
+                return 0;
+            }
+            a += m->base - RTPCSTART;
+            putword(image + a,
+                    getword(image + a) + m->database - MODDATAADDR);
+        }
+    }
+    return addr;
+}
+
+/*
+ * Check that no sub is exported by two modules, and fill in the address
+ * of the sub in each call to another module.
+ * Returns 0 if okay, 1 on error.
+ */
+unsigned char resolve()
+{
+    struct objsym *sym;
+    struct module *m;
+    struct module *def;
+    unsigned int i;
+    unsigned int j;
+    unsigned int a;
+
+    for (i = 0; i < nmods; ++i) {
+        m = &mods[i];
+        for (j = 0; j < m->hdr.nsyms; ++j) {
+            if (findsym(m->syms[j].name, NULL) != m) {
+                linkerror("Duplicate sub", m, m->syms[j].name);
+                return 1;
+            }
+        }
+    }
+    for (i = 0; i < nmods; ++i) {
+        m = &mods[i];
+        for (j = 0; j < m->hdr.nimports; ++j) {
+            def = findsym(m->imports[j].name, &sym);
+            if (!def) {
+                linkerror("Undefined sub", m, m->imports[j].name);
+                return 1;
+            }
+            a = m->imports[j].addr;
+            if (!incode(m, a)) {
+                linkerror("Bad import", m, NULL);
+                return 1;
+            }
+            putword(image + a + m->base - RTPCSTART,
+                    sym->addr + def->base - RTPCSTART);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Write the linked program to bytecode object file name.
+ * end is the address after the end of the code.
+ * Returns 0 if okay, 1 on error.
+ */
+unsigned char writeprogram(char *name, unsigned long end)
+{
+    struct objhdr *hdr;
+    struct objsym *sym;
+    unsigned char *buf;
+    unsigned char *p;
+    unsigned int codesz = end - RTPCSTART;
+    unsigned int datasz = 0;
+    unsigned int nrelocs = nmods;
+    unsigned int nsyms = 0;
+    unsigned long len;
+    unsigned int i;
+    unsigned int j;
+    struct module *m;
+    FILE *fp;
+
+    for (i = 0; i < nmods; ++i) {
+        datasz += mods[i].hdr.datasz;
+        nrelocs += mods[i].hdr.nrelocs;
+        nsyms += mods[i].hdr.nsyms;
+    }
+    len = sizeof(struct objhdr) + codesz + datasz + 2UL * nrelocs +
+        (unsigned long) nsyms * sizeof(struct objsym);
+    buf = malloc(len);
+    if (!buf) {
+        print("No memory\n");
+        return 1;
+    }
+
+    hdr = (struct objhdr *) buf;
+    memcpy(hdr->magic, OBJMAGIC, 4);
+    hdr->version = OBJVERSION;
+    hdr->entry = RTPCSTART;
+    hdr->codeaddr = RTPCSTART;
+    hdr->codesz = codesz;
+    hdr->dataaddr = (datasz ? RTCALLSTACKLIM - datasz : 0);
+    hdr->datasz = datasz;
+    hdr->stacktop = RTCALLSTACKTOP;
+    hdr->stacksz = 0;           /* Globals are static data */
+    hdr->nrelocs = nrelocs;
+    hdr->nsyms = nsyms;
+
+    p = buf + sizeof(struct objhdr);
+    memcpy(p, image + RTPCSTART, codesz);
+    p += codesz;
+    memcpy(p, image + hdr->dataaddr, datasz);
+    p += datasz;
+    for (i = 0; i < nmods; ++i) {
+        putword(p, RTPCSTART + STARTSZ * i + 1);
+        p += 2;
+    }
+    for (i = 0; i < nmods; ++i) {
+        m = &mods[i];
+        for (j = 0; j < m->hdr.nrelocs; ++j) {
+            putword(p, getword(m->relocs + 2 * j) + m->base - RTPCSTART);
+            p += 2;
+        }
+    }
+    for (i = 0; i < nmods; ++i) {
+        m = &mods[i];
+        for (j = 0; j < m->hdr.nsyms; ++j) {
+            sym = (struct objsym *) p;
+            memcpy(sym->name, m->syms[j].name, OBJSYMCHARS);
+            sym->addr = m->syms[j].addr + m->base - RTPCSTART;
+            p += sizeof(struct objsym);
+        }
+    }
+    hdr->checksum = objchecksum(buf + sizeof(struct objhdr),
+                                len - sizeof(struct objhdr));
+
+    fp = fopen(name, "w");
+    if (!fp || (fwrite(buf, 1, len, fp) != len)) {
+        print("Can't write ");
+        print(name);
+        printchar('\n');
+        if (fp) {
+            fclose(fp);
+        }
+        free(buf);
+        return 1;
+    }
+    fclose(fp);
+    free(buf);
+
+    print("Linked ");
+    printdec(nmods);
+    print(" modules, code ");
+    printdec(codesz);
+    print(" bytes, data ");
+    printdec(datasz);
+    print(" bytes\n");
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long end;
+    unsigned char *p;
+    unsigned int i;
+
+    print("EightBall Linker v" VERSIONSTR "\n");
+    print("(c)Bobbi, 2018\n");
+    print("Free Software.\n");
+    print("Licenced under GPL.\n\n");
+
+    if ((argc < 3) || (argc - 2 > MAXMODS)) {
+        print("Usage: linker outfile module ...\n");
+        return 1;
+    }
+    for (i = 2; i < (unsigned int) argc; ++i) {
+        if (readmodule(argv[i], &mods[nmods++])) {
+            return 1;
+        }
+    }
+
+    end = place();
+    if (!end || resolve()) {
+        return 1;
+    }
+
+    /* Startup code: call the initialization routine of each module */
+    p = image + RTPCSTART;
+    for (i = 0; i < nmods; ++i) {
+        *p++ = VM_JSRIMM;
+        putword(p, mods[i].base + mods[i].hdr.entry - RTPCSTART);
+        p += 2;
+        *p++ = VM_DROP;
+    }
+    *p = VM_END;
+
+    return writeprogram(argv[1], end);
+}